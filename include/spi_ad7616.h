@@ -1,2 +1,113 @@
 #pragma once
 
+//
+// Public interface of the AD7616 driver, ad7616_driver.c.
+//
+// The driver is normally built as the shared library ad7616_driver.so and called
+// from Python through ad7616_api.py, which mirrors these declarations with ctypes.
+// Native programs such as trake_daemon.c include this header and link the driver
+// source directly.  See ad7616_driver.c for the documentation of each method.
+//
+
+//
+// This type is the handle returned by spi_initialize(), and
+// required by all subsequent calls.
+//
+typedef struct {
+    unsigned spi_cs_pin;
+    unsigned spi_sclk_pin;
+    unsigned spi_mosi_pin;
+    unsigned spi_miso_pin;
+    unsigned spi_errorcode;
+    unsigned spi_flags;
+} self_t;
+
+#define PRINT_DIAG_FLAG 0x1
+
+// The BUSY wait strategies for spi_setbusywait().
+#define BUSYWAIT_SPIN 0
+#define BUSYWAIT_DELAY 1
+#define BUSYWAIT_ALERT 2
+
+// The CRC check modes for spi_setcrc().
+#define CRC_OFF 0
+#define CRC_MARK 1                  // Keep a frame with a bad CRC, marked with a crc record.
+#define CRC_DROP 2                  // Leave a frame with a bad CRC out.
+#define CRC_RETRY 3                 // Convert again at once, and leave the frame out if that fails too.
+
+// The transports for spi_settransport().
+#define TRANSPORT_BITBANG 0
+#define TRANSPORT_SPIDEV 1          // Hardware SPI in 1-wire mode, through the kernel spidev driver.
+#define TRANSPORT_CAPTURE 2         // Bit-banged pins, with the readout clocked and sampled by pigpio DMA.
+
+// The conversion triggers for spi_settrigger().
+#define TRIGGER_SOFTWARE 0
+#define TRIGGER_HARDWARE 1
+
+// The values returned by spi_start().  Degraded starts combine the positive flags.
+#define START_OK 0
+#define START_NO_MLOCK 0x1          // Memory could not be locked, page faults may delay sampling.
+#define START_SCHED_RR 0x2          // SCHED_FIFO was refused, the thread runs SCHED_RR.
+#define START_SCHED_OTHER 0x4       // Real-time scheduling was refused, the thread runs at normal priority.
+#define START_NO_AFFINITY 0x8       // The thread could not be pinned to the sampler CPU.
+#define START_ERROR_RUNNING -1      // Acquisition is already running.
+#define START_ERROR_THREAD -2       // The acquisition thread could not be created.
+
+// The values returned by spi_waitstop().
+#define WAITSTOP_RUNNING 0
+#define WAITSTOP_POWERLOW 1
+#define WAITSTOP_OTHER 2
+
+// The AD7616 register addresses.
+#define REGISTER_CONFIGURATION 2
+#define REGISTER_CHANNELSEL 3
+#define REGISTER_RANGEA_0_3 4
+#define REGISTER_RANGEA_4_7 5
+#define REGISTER_RANGEB_0_3 6
+#define REGISTER_RANGEB_4_7 7
+#define REGISTER_SEQUENCER 0x20     // The first of the 32 sequencer stack registers.
+
+// The 2-bit input range codes packed four to a range register.
+#define RANGE_PLUS_MINUS_10V 0
+#define RANGE_PLUS_MINUS_2_5V 1
+#define RANGE_PLUS_MINUS_5V 2
+
+self_t spi_initialize();
+void spi_open(self_t self, unsigned bus, unsigned device);
+int spi_settransport(self_t self, unsigned transport, const char* device, unsigned speed_hz);
+void spi_terminate(self_t self);
+int read_powerlow();
+
+int spi_writeregister(self_t self, unsigned address, unsigned value);
+unsigned spi_readregister(self_t self, unsigned address);
+int spi_readregisters(self_t self, unsigned count, unsigned* addresses, unsigned* values);
+int spi_writeregisters(self_t self, unsigned count, unsigned* addresses, unsigned* values, unsigned* readback);
+int spi_verifyregisters(self_t self);
+int spi_readconversion(self_t self, unsigned count, unsigned* conversions);
+int spi_capture(self_t self, unsigned nframes, unsigned* conversions, unsigned long long* timestamps);
+unsigned spi_getsequencepairs();
+unsigned spi_convertpair(self_t self, unsigned channelA, unsigned channelB);
+void spi_definesequence(self_t self, unsigned count, unsigned* Achannels, unsigned* Bchannels);
+int spi_definechannels(self_t self, unsigned count, unsigned* Achannels, unsigned* Bchannels, unsigned mask, unsigned* repeats, const char* names);
+int spi_loadregisters(self_t self, unsigned count, unsigned* addresses, unsigned* values);
+
+void spi_setbusywait(self_t self, unsigned mode, unsigned timeout_us);
+int spi_setoversampling(self_t self, unsigned ratio);
+unsigned spi_getbusytimeouts();
+void spi_setcrc(self_t self, unsigned mode);
+unsigned spi_getcrcerrors();
+void spi_setsclksettle(self_t self, unsigned settle);
+int spi_scansclk(self_t self, unsigned frames);
+void spi_settrigger(self_t self, unsigned mode);
+void spi_setjournal(self_t self, unsigned enabled, unsigned flush_ms);
+void spi_setoverview(self_t self, unsigned enabled);
+void spi_setclockrecords(self_t self, unsigned period_ms, unsigned rtc);
+void spi_settelemetry(self_t self, const char* path, unsigned interval_ms);
+void spi_setshutdownbudget(self_t self, unsigned budget_ms);
+void spi_setaffinity(self_t self, int samplercpu, int writercpu);
+long long spi_getshutdownlatency();
+
+int spi_start(self_t self, unsigned period, unsigned averagecount, char* path, char* filename);
+void spi_stop(self_t self);
+int spi_waitstop(self_t self, unsigned timeout_ms);
+unsigned long long spi_getfirstsample();
@@ -0,0 +1,143 @@
+#pragma once
+
+//
+// Binary acquisition file format.
+//
+// A CSV acquisition file is convenient, but a multi-hour run is gigabytes of text that
+// has to be parsed in full before any of it can be used.  The binary format holds the
+// same information, column by column, so a reader can map the file into memory and use
+// a channel of a segment in place, without parsing or copying it.
+//
+// The file starts with a binaryheader_t, followed by the CSV header line, padded to a
+// multiple of 8 bytes.  Then come segments, each a binarysegment_t followed by its
+// payload.  A data segment holds up to segmentframes frames:
+//
+//     uint16_t channel0[count]         The samples of each channel, in turn.
+//     ...
+//     uint16_t channelN[count]
+//     padding to a multiple of 8 bytes
+//     varint firstsequence             The sequence number of the first frame.
+//     varint step                      The sequence numbers of the frames go up by step.
+//     varint time[1..count-1]          The time column, as zigzag differences of successive
+//                                      differences.  The first time is firsttime.
+//     varint aux[count]                The value in parentheses after the time.
+//     padding to a multiple of 8 bytes
+//
+// A varint is 7 bits per byte, least significant first, with the high bit set on every
+// byte but the last.  Frames are taken at a steady rate, so the time of a frame costs a
+// byte or two, and its sequence number nothing: a data segment is ended early at any
+// gap in the sequence, so the gaps are the boundaries between segments.
+//
+// Version 1 files, without sequence numbers, held the time and aux columns as
+// uint64_t[count] arrays before the samples.  They are still read, as if each frame's
+// sequence number were its frame number.
+//
+// A comment segment holds the bytes of one or more "#" lines of the CSV file, newlines
+// included, in the place they appeared among the frames.  A data segment is ended early
+// when a comment is written, so the order of frames and comments is kept exactly.
+// A trailer segment holds any bytes after the last newline of a CSV file, such as a line
+// cut short by a loss of power, so that converting back gives the same file.
+//
+// Segment headers carry the first and last time of their frames, which is a sparse
+// index for time-range queries, and a CRC-32 of the segment.  All values are little-endian.
+//
+#include <stdio.h>
+#include <stdint.h>
+
+#define BINARY_MAGIC 0x424b5254             // "TRKB" in little-endian byte order.
+#define BINARY_SEGMENT_MAGIC 0x534b5254     // "TRKS" in little-endian byte order.
+#define BINARY_VERSION 2
+#define BINARY_VERSION_COLUMNS 1            // Time and aux stored as plain columns, without sequence numbers.
+#define BINARY_EXTENSION ".trk"
+#define BINARY_SEGMENT_FRAMES 4096          // Default frames in a full data segment.
+#define BINARY_MAX_CHANNELS 64
+
+#define BINARY_FLAG_NOAUX 0x1               // The time column has no value in parentheses, as in early files.
+
+#define SEGMENT_DATA 1
+#define SEGMENT_COMMENT 2
+#define SEGMENT_TRAILER 3
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headersize;                    // sizeof(binaryheader_t).
+    uint16_t channels;
+    uint16_t flags;                         // BINARY_FLAG_ values.
+    uint32_t segmentframes;                 // Frames in a full data segment.
+    uint32_t textlength;                    // Length of the CSV header line that follows, without its newline.
+    uint32_t reserved[3];
+} binaryheader_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t type;                          // SEGMENT_DATA or SEGMENT_COMMENT.
+    uint16_t reserved;
+    uint32_t count;                         // Frames in a data segment, bytes of text in other segments.
+    uint32_t payloadlength;                 // Bytes of payload after this header, a multiple of 8.
+    uint64_t firsttime;                     // Time of the first frame, or 0 for a comment.
+    uint64_t lasttime;                      // Time of the last frame, or 0 for a comment.
+    uint32_t crc;                           // CRC-32 of this header, with crc as zero, and the payload.
+    uint32_t reserved2;
+} binarysegment_t;
+
+#define BINARY_PAD8(n) (((n) + 7) & ~(uint64_t)7)
+
+//
+// Returns: The length of the sample columns of a data segment of count frames.
+//
+static inline uint64_t binary_sampleslength(unsigned count, unsigned channels)
+{
+    return BINARY_PAD8((uint64_t)count * channels * sizeof(uint16_t));
+}
+
+//
+// Returns: The smallest payload a data segment of count frames can have in the given
+// file version, with every varint a single byte.
+//
+static inline uint64_t binary_datalength(unsigned count, unsigned channels, unsigned version)
+{
+    if (version == BINARY_VERSION_COLUMNS)
+        return BINARY_PAD8((uint64_t)count * (2 * sizeof(uint64_t) + channels * sizeof(uint16_t)));
+    return binary_sampleslength(count, channels) + BINARY_PAD8(2 + 2 * (uint64_t)count);
+}
+
+//
+// Returns: The samples of a data segment, channel by channel, segment->count values each.
+//
+static inline const uint16_t* binary_samples(const binarysegment_t* segment, unsigned version)
+{
+    if (version == BINARY_VERSION_COLUMNS)
+        return (const uint16_t*)((const uint64_t*)(segment + 1) + 2 * (size_t)segment->count);
+    return (const uint16_t*)(segment + 1);
+}
+
+// The record a CSV file has before its first frame and after any gap, giving the
+// sequence number of the next frame, and the step between the frames that follow.
+#define SEQUENCE_RECORD "# sequence,"
+
+//
+// A binary file being written.  Frames are collected in memory, column by column, until
+// a segment is full or a comment is written.
+//
+typedef struct {
+    FILE* file;
+    unsigned channels;
+    unsigned segmentframes;
+    unsigned count;                         // Frames collected for the current segment.
+    uint64_t firstsequence;                 // Sequence number of the first frame collected.
+    uint64_t sequencestep;                  // Step between the sequence numbers of the frames collected.
+    uint64_t* time;
+    uint64_t* aux;
+    uint16_t* data;                         // channels columns of segmentframes samples.
+} binarywriter_t;
+
+int binary_create(binarywriter_t* writer, const char* path, const char* header, unsigned channels, unsigned flags, unsigned segmentframes);
+int binary_appendframe(binarywriter_t* writer, uint64_t sequence, uint64_t time, uint64_t aux, const uint16_t* values);
+int binary_appendcomment(binarywriter_t* writer, const char* text, uint32_t length);
+int binary_appendtrailer(binarywriter_t* writer, const char* text, uint32_t length);
+int binary_close(binarywriter_t* writer);
+uint32_t binary_segmentcrc(const binarysegment_t* segment, const void* payload);
+int binary_decodeframes(const binarysegment_t* segment, unsigned version, unsigned channels,
+                        uint64_t* firstsequence, uint64_t* sequencestep, uint64_t* times, uint64_t* aux);
+int binary_parsesequence(const char* text, size_t length, uint64_t* number, uint64_t* step);
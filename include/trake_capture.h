@@ -0,0 +1,25 @@
+#pragma once
+
+//
+// Decoding of a conversion readout from sampled GPIO levels.
+//
+// With the capture transport, the driver does not clock the readout bit by bit.  It
+// plays CS and SCLK as a pigpio DMA wave, while pigpio's DMA sampler records the GPIO
+// level register every few microseconds.  capture_decode() then recovers the bits from
+// those snapshots in one pass.  It depends on nothing but the samples, so it can be run
+// on recorded level dumps as well as on a live capture.
+//
+#include <stdint.h>
+
+typedef struct {
+    uint32_t tick;                          // Microseconds, as pigpio's gpioTick().
+    uint32_t level;                         // The levels of GPIO 0-31, one bit each.
+} capture_sample_t;                         // The same layout as pigpio's gpioSample_t.
+
+typedef struct {
+    uint32_t cs;                            // The mask of the CS pin in the level.
+    uint32_t sclk;                          // The mask of the SCLK pin.
+    uint32_t miso;                          // The mask of the MISO pin, SDOA.
+} capture_pins_t;
+
+unsigned capture_decode(const capture_sample_t* samples, unsigned count, capture_pins_t pins, uint32_t* words, unsigned maxbits);
@@ -0,0 +1,61 @@
+#pragma once
+
+//
+// Crash-safe write-ahead journal for acquired data.
+//
+// Deployments normally end with a loss of power, so anything buffered in memory, and
+// anything half-written to a file, is lost or corrupt at the end of every deployment.
+// The journal lets the writer buffer aggressively anyway.  Data is written in fixed-size
+// blocks, each with a sequence number, a payload length and a CRC-32, into a file that
+// is preallocated with fallocate() so the file system never has to allocate on the
+// write path.  A block is never rewritten once it is written, so a power loss can only
+// damage the block being written at that instant.
+//
+// The payload bytes are opaque to the journal; the acquisition file is simply the
+// concatenation of the payloads of all blocks in sequence order.  journal_recover()
+// rebuilds that file from the longest run of good blocks at the start of a journal.
+//
+#include <stdint.h>
+#include <sys/types.h>
+
+#define JOURNAL_MAGIC 0x4a4b5254            // "TRKJ" in little-endian byte order.
+#define JOURNAL_VERSION 1
+#define JOURNAL_BLOCK_SIZE 4096             // Size of every block, including its header.
+#define JOURNAL_PREALLOCATE_BLOCKS 256      // Blocks to preallocate each time the file fills.
+#define JOURNAL_EXTENSION ".journal"        // Appended to the acquisition file path.
+
+//
+// The header at the start of every journal block.  The CRC-32 covers the header,
+// with the crc field taken as zero, followed by payloadlength bytes of payload.
+//
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headersize;
+    uint64_t sequence;
+    uint32_t payloadlength;
+    uint32_t crc;
+    uint64_t reserved;
+} journalblock_t;
+
+#define JOURNAL_PAYLOAD_SIZE (JOURNAL_BLOCK_SIZE - sizeof(journalblock_t))
+
+//
+// The writer's state for an open journal.
+//
+typedef struct {
+    int fd;                                 // -1 when the journal is not open.
+    uint64_t sequence;                      // Sequence number of the block being filled.
+    off_t allocated;                        // Bytes preallocated in the file so far.
+    uint32_t length;                        // Bytes of payload in the block being filled.
+    unsigned char block[JOURNAL_BLOCK_SIZE];
+} journal_t;
+
+int journal_open(journal_t* journal, const char* path);
+int journal_append(journal_t* journal, const void* data, uint32_t length);
+int journal_flush(journal_t* journal, int sync);
+int journal_close(journal_t* journal);
+
+long long journal_recover(const char* journalpath, const char* outputpath, uint64_t* blocks);
+
+uint32_t journal_crc32(uint32_t crc, const void* data, uint32_t length);
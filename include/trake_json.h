@@ -0,0 +1,42 @@
+#pragma once
+
+//
+// A small JSON parser for the t-rake configuration and run files.
+//
+// These files are a few hundred bytes, written by people or by deploy tools, and read
+// once per run, so the parser favours being small and strict over being fast.  The
+// whole document is parsed into a tree of json_t nodes that is released with one call
+// to json_free().  Object members and array items are kept as a linked list in file
+// order, and lookups are linear.
+//
+
+typedef enum {
+    JSON_NULL,
+    JSON_FALSE,
+    JSON_TRUE,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+} jsontype_t;
+
+typedef struct json_s {
+    jsontype_t type;
+    char* key;                  // Member name when this node is in an object, else NULL.
+    char* string;               // Decoded UTF-8 value of a JSON_STRING, else NULL.
+    double number;              // Value of a JSON_NUMBER.
+    struct json_s* child;       // First member or item of a JSON_OBJECT or JSON_ARRAY.
+    struct json_s* next;        // Next member or item in the same parent.
+} json_t;
+
+json_t* json_parse(const char* text);
+json_t* json_parsefile(const char* path);
+void json_free(json_t* node);
+
+json_t* json_get(const json_t* object, const char* key);
+unsigned json_length(const json_t* array);
+json_t* json_item(const json_t* array, unsigned index);
+
+double json_getnumber(const json_t* object, const char* key, double fallback);
+const char* json_getstring(const json_t* object, const char* key, const char* fallback);
+int json_getbool(const json_t* object, const char* key, int fallback);
@@ -0,0 +1,74 @@
+#pragma once
+
+//
+// Multi-resolution overview of an acquisition file.
+//
+// To plot a week-long deployment, nobody needs every sample, only the minimum, maximum
+// and mean of each channel over each second, minute or hour.  The overview holds these
+// summaries in a small sidecar file next to the acquisition file, <file>OVERVIEW_EXTENSION.
+// It is built incrementally as frames arrive: each time a frame's time passes the end of
+// a bucket, the summary of that bucket is appended to the file, so a bucket is never
+// rewritten and the sidecar can be read while acquisition is running.
+//
+// The file starts with an overviewheader_t, followed by records for all levels, in the
+// order their buckets were completed.  Each record is an overviewrecord_t followed by an
+// overviewvalue_t for each channel.  Buckets with no frames have no record.  Times are
+// in the units of the acquisition file's time column, microseconds, and buckets of each
+// level are aligned to multiples of its width.  All values are little-endian.
+//
+#include <stdint.h>
+
+#define OVERVIEW_MAGIC 0x4f4b5254           // "TRKO" in little-endian byte order.
+#define OVERVIEW_VERSION 1
+#define OVERVIEW_EXTENSION ".ovr"           // Appended to the acquisition file path.
+#define OVERVIEW_LEVELS 3
+#define OVERVIEW_MAX_CHANNELS 64
+
+// The bucket widths of the levels, in time column units: 1 second, 1 minute and 1 hour.
+#define OVERVIEW_WIDTHS { 1000000ULL, 60000000ULL, 3600000000ULL }
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headersize;                    // sizeof(overviewheader_t).
+    uint16_t channels;
+    uint16_t levels;
+    uint32_t reserved;
+    uint64_t width[OVERVIEW_LEVELS];        // Bucket width of each level.
+} overviewheader_t;
+
+typedef struct {
+    uint16_t level;
+    uint16_t channels;                      // The same as in the header.
+    uint32_t count;                         // Frames summarized.
+    uint64_t start;                         // Time at the start of the bucket.
+} overviewrecord_t;
+
+typedef struct {
+    uint16_t min;
+    uint16_t max;
+    float mean;
+} overviewvalue_t;
+
+#define OVERVIEW_RECORD_SIZE(channels) (sizeof(overviewrecord_t) + (channels) * sizeof(overviewvalue_t))
+#define OVERVIEW_MAX_OUTPUT (OVERVIEW_LEVELS * OVERVIEW_RECORD_SIZE(OVERVIEW_MAX_CHANNELS))
+
+//
+// The bucket being summarized for each level.
+//
+typedef struct {
+    uint64_t bucket;                        // Bucket number, the start time divided by the width.
+    uint32_t count;                         // Frames in the bucket so far, 0 if none.
+    uint16_t min[OVERVIEW_MAX_CHANNELS];
+    uint16_t max[OVERVIEW_MAX_CHANNELS];
+    uint64_t sum[OVERVIEW_MAX_CHANNELS];
+} overviewbucket_t;
+
+typedef struct {
+    unsigned channels;
+    overviewbucket_t level[OVERVIEW_LEVELS];
+} overview_t;
+
+unsigned overview_begin(overview_t* overview, unsigned channels, void* output);
+unsigned overview_add(overview_t* overview, uint64_t time, const uint16_t* values, void* output);
+unsigned overview_finish(overview_t* overview, void* output);
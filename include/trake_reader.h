@@ -0,0 +1,92 @@
+#pragma once
+
+//
+// Memory-mapped random-access reader for acquisition files.
+//
+// Opens either the binary format of trake_binary.h or a CSV data file, maps it into
+// memory, and builds a sparse index of segments, each with its first frame number and
+// its first and last time.  Time-range queries search the index and then only one
+// segment.  Reads decode the segments they cover in parallel, one thread per segment
+// at a time.  For binary files, the sample columns of a segment can also be used in
+// place, without any copy.
+//
+// A CSV file is split into segments of READER_CSV_SEGMENT_FRAMES data lines.  Finding
+// the segments takes one pass over the file, so the index is saved next to it, as
+// <file>READER_INDEX_EXTENSION, and reused while the file's size and modification time
+// are unchanged.  A partial last line, left by a loss of power, is ignored.
+//
+// Every frame has a sequence number, counting the sample periods since acquisition
+// started, so dropped frames show as gaps in the sequence, unlike jitter in the time
+// column.  Binary files hold them in their data segments, and CSV files in sequence
+// records.  Files without them number their frames 0, 1, 2 and so on.
+//
+// If the file has an overview sidecar (see trake_overview.h), it is loaded too, and
+// reader_overviewlevel() picks the level with the right resolution for a time range.
+//
+// This library is built as trake_reader.so and called from Python through trake_reader_api.py.
+//
+#include <stdint.h>
+
+#define READER_FORMAT_BINARY 1
+#define READER_FORMAT_CSV 2
+
+#define READER_VERIFY 0x1                   // Check the CRC of every binary segment that is read.
+#define READER_NOINDEXFILE 0x2              // Neither read nor write the CSV index file.
+
+#define READER_CSV_SEGMENT_FRAMES 4096
+#define READER_INDEX_MAGIC 0x494b5254       // "TRKI" in little-endian byte order.
+#define READER_INDEX_VERSION 2
+#define READER_INDEX_EXTENSION ".idx"
+
+//
+// One entry of the sparse index.
+//
+typedef struct {
+    uint64_t firstframe;                    // Frame number of the first frame in the segment.
+    uint64_t firsttime;                     // Time column of the first frame.
+    uint64_t lasttime;                      // Time column of the last frame.
+    uint64_t offset;                        // File offset of the segment payload, or of its first CSV line.
+    uint64_t length;                        // Bytes of payload, or of CSV lines.
+    uint32_t frames;                        // Frames in the segment.
+    uint32_t reserved;
+    uint64_t firstsequence;                 // Sequence number of the first frame.
+    uint64_t sequencestep;                  // Step between sequence numbers, up to the next sequence record.
+} readersegment_t;
+
+//
+// A "#" comment line or lines, and where they appear among the frames.
+//
+typedef struct {
+    uint64_t frame;                         // Number of frames before the comment.
+    uint64_t offset;                        // File offset of the comment text.
+    uint64_t length;                        // Bytes of text, including newlines.
+} readercomment_t;
+
+typedef struct reader_s reader_t;
+
+reader_t* reader_open(const char* path, unsigned flags);
+void reader_close(reader_t* reader);
+
+int reader_format(const reader_t* reader);
+unsigned reader_channels(const reader_t* reader);
+unsigned reader_flags(const reader_t* reader);
+uint64_t reader_frames(const reader_t* reader);
+const char* reader_header(const reader_t* reader);
+unsigned reader_segments(const reader_t* reader);
+int reader_segmentinfo(const reader_t* reader, unsigned segment, readersegment_t* info);
+unsigned reader_comments(const reader_t* reader);
+const char* reader_comment(const reader_t* reader, unsigned comment, uint64_t* length, uint64_t* frame);
+
+const uint64_t* reader_timeslice(const reader_t* reader, unsigned segment);
+const uint64_t* reader_auxslice(const reader_t* reader, unsigned segment);
+const uint16_t* reader_channelslice(const reader_t* reader, unsigned segment, unsigned channel);
+
+uint64_t reader_findtime(const reader_t* reader, uint64_t time);
+long long reader_read(const reader_t* reader, uint64_t first, uint64_t count, uint64_t* times, uint64_t* aux, uint16_t* data, unsigned threads);
+long long reader_readsequences(const reader_t* reader, uint64_t first, uint64_t count, uint64_t* sequences);
+
+unsigned reader_overviewlevels(const reader_t* reader);
+uint64_t reader_overviewwidth(const reader_t* reader, unsigned level);
+int reader_overviewlevel(const reader_t* reader, uint64_t start, uint64_t end, uint64_t maxpoints);
+long long reader_overview(const reader_t* reader, unsigned level, uint64_t start, uint64_t end, uint64_t maxcount,
+                          uint64_t* times, uint32_t* counts, uint16_t* min, uint16_t* max, float* mean);
@@ -0,0 +1,44 @@
+#pragma once
+
+//
+// Hardware SPI transport to the AD7616 through the Linux spidev driver.
+//
+// The bit-banged interface spends the acquisition thread's CPU on every SCLK edge.
+// With the chip in 1-wire mode, where the A and B results of each pair come out one
+// after the other on SDOA, the conversion results are ordinary SPI data, so the SPI
+// controller, with the kernel's DMA, can clock them instead.  spidev only allows
+// 8-bit words on the Pi, but that is no limit: a 32-bit result pair is read as four
+// bytes, most significant first, and a whole sequence is one transfer, one ioctl.
+// Register command bursts are batched the same way.
+//
+// The chip still needs a CONVST pulse and a BUSY wait between sequences, so one
+// sequence is the most a single SPI_IOC_MESSAGE can read.
+//
+// The device "sim" is a simulated spidev for testing the driver without hardware.
+// It answers like an AD7616 in 1-wire mode: register commands update a register file,
+// and read commands are answered in the next frame.  Sequence reads return, for each
+// A and B channel of the sequencer stack, or of the channel register, the channel
+// number in the top 4 bits and a conversion count below, with the CRC.  The self-test
+// channel converts to 0xaaaa on the A side and 0x5555 on the B side.
+//
+#include <stdint.h>
+
+#define SPIDEV_SIMULATED "sim"
+#define SPIDEV_DEFAULT_HZ 10000000          // SCLK rate when none is given.
+#define SPIDEV_MAX_TRANSFER 4096            // Bytes in one transfer, the spidev default buffer size.
+
+typedef struct {
+    int fd;                                 // spidev file descriptor, -1 if closed or simulated.
+    int simulated;                          // Set for the SPIDEV_SIMULATED device.
+    uint32_t speed_hz;
+
+    // State of the simulated chip.
+    uint16_t registers[64];
+    uint16_t response;                      // Clocked out during the next frame.
+    uint32_t conversions;                   // Sequences read so far.
+} spidev_t;
+
+int spidev_open(spidev_t* spidev, const char* device, uint32_t speed_hz);
+int spidev_transfer(spidev_t* spidev, const uint16_t* send, uint16_t* receive, unsigned count);
+int spidev_readsequence(spidev_t* spidev, unsigned count, unsigned* conversions, unsigned* crc);
+void spidev_close(spidev_t* spidev);
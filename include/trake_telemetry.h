@@ -0,0 +1,128 @@
+#pragma once
+
+//
+// Live telemetry of a running acquisition over a local Unix domain socket.
+//
+// Checking on a deployed rake should not mean tailing the data file, which costs disk
+// reads and only works while every line is written straight through.  Instead, the
+// driver publishes a decimated view of the frames, with statistics, and its health
+// counters on a SOCK_SEQPACKET socket, so any number of local clients, such as
+// trake_monitor.py, can watch without touching the file.
+//
+// Publishing can never stall acquisition.  The acquisition thread only summarizes
+// frames into a small ring, dropping a summary if the ring is full, and the writer
+// thread sends with MSG_DONTWAIT, dropping a message for any client whose socket
+// buffer is full rather than waiting for it.  Dropped messages are counted and reported
+// in the health messages.
+//
+// Each message is one packet, starting with a telemetryheader_t that gives its type:
+// - TELEMETRY_HELLO, sent once to each client when it connects: a telemetryhello_t,
+//   followed by the acquisition file path, without a terminating zero.
+// - TELEMETRY_FRAME, sent every interval of the time column: a telemetryframe_t for
+//   the last sample line of the interval, followed by a telemetryvalue_t for each of
+//   the channels given in the hello, with its last sample and its minimum, maximum and
+//   mean over the interval.
+// - TELEMETRY_HEALTH, sent every TELEMETRY_HEALTH_ms: a telemetryhealth_t.
+// Times are in the units of the acquisition file's time column, microseconds.  All
+// values are little-endian.  Clients should ignore message types they do not know.
+//
+#include <stdint.h>
+
+#define TELEMETRY_MAGIC 0x544b5254          // "TRKT" in little-endian byte order.
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_MAX_CHANNELS 64
+#define TELEMETRY_MAX_CLIENTS 8
+#define TELEMETRY_HEALTH_ms 1000            // Time between health messages.
+
+#define TELEMETRY_HELLO 1
+#define TELEMETRY_FRAME 2
+#define TELEMETRY_HEALTH 3
+
+// Flags in the health message.
+#define TELEMETRY_VOLTAGE_LOW 0x1           // The supply voltage is low.
+#define TELEMETRY_JOURNAL 0x2               // Data is written through the journal.
+
+typedef struct {
+    uint16_t type;
+    uint16_t length;                        // Of the whole message, including this header.
+} telemetryheader_t;
+
+typedef struct {
+    telemetryheader_t header;
+    uint32_t magic;
+    uint16_t version;
+    uint16_t channels;
+    uint32_t period_us;                     // Sample period.
+    uint32_t averagecount;                  // Frames averaged into each sample line.
+    uint32_t interval_us;                   // Time between frame messages.
+    uint32_t start;                         // Start status, as returned by spi_start().
+} telemetryhello_t;
+
+typedef struct {
+    telemetryheader_t header;
+    uint32_t count;                         // Sample lines summarized.
+    uint64_t sequence;                      // Sequence number of the last line.
+    uint64_t time;                          // Time column of the last line.
+} telemetryframe_t;
+
+typedef struct {
+    uint16_t last;
+    uint16_t min;
+    uint16_t max;
+    uint16_t reserved;
+    float mean;
+} telemetryvalue_t;
+
+typedef struct {
+    telemetryheader_t header;
+    uint32_t flags;
+    uint64_t uptime_ns;                     // Since acquisition started.
+    uint64_t lines;                         // Sample lines written.
+    uint64_t dropped;                       // Sample lines dropped because the writer fell behind.
+    uint64_t missed;                        // Frames missed, from the sequence records.
+    uint64_t busytimeouts;                  // Conversions that timed out waiting on BUSY.
+    uint32_t ringused;                      // Bytes waiting for the writer thread.
+    uint32_t ringpeak;                      // Most bytes ever waiting for the writer thread.
+    uint64_t telemetrydropped;              // Telemetry messages dropped, for all clients.
+    uint32_t clients;                       // Clients connected.
+    uint32_t crcerrors;                     // Readouts whose CRC did not match, 0 unless checked.
+} telemetryhealth_t;
+
+#define TELEMETRY_FRAME_SIZE(channels) (sizeof(telemetryframe_t) + (channels) * sizeof(telemetryvalue_t))
+#define TELEMETRY_MAX_FRAME TELEMETRY_FRAME_SIZE(TELEMETRY_MAX_CHANNELS)
+
+//
+// The summary of the interval being filled, kept by the acquisition thread.
+//
+typedef struct {
+    unsigned channels;
+    uint64_t interval;                      // Width of an interval, in time column units.
+    uint64_t bucket;                        // Interval number, the start time divided by the width.
+    uint32_t count;                         // Lines in the interval so far, 0 if none.
+    uint64_t sequence;
+    uint64_t time;
+    uint16_t last[TELEMETRY_MAX_CHANNELS];
+    uint16_t min[TELEMETRY_MAX_CHANNELS];
+    uint16_t max[TELEMETRY_MAX_CHANNELS];
+    uint64_t sum[TELEMETRY_MAX_CHANNELS];
+} telemetry_t;
+
+//
+// The listening socket and the connected clients, kept by the writer thread.
+//
+typedef struct {
+    int fd;                                 // Listening socket, -1 if closed.
+    int clients[TELEMETRY_MAX_CLIENTS];     // Connected sockets, -1 for free slots.
+    uint64_t dropped;                       // Messages not sent because a client was behind.
+    char hello[sizeof(telemetryhello_t) + 1024];
+    unsigned hellolength;
+} telemetryserver_t;
+
+void telemetry_begin(telemetry_t* telemetry, unsigned channels, uint64_t interval);
+unsigned telemetry_add(telemetry_t* telemetry, uint64_t sequence, uint64_t time, const uint16_t* values, void* output);
+
+int telemetry_open(telemetryserver_t* server, const char* path, const telemetryhello_t* hello, const char* datafile);
+void telemetry_accept(telemetryserver_t* server);
+void telemetry_publish(telemetryserver_t* server, const void* message, unsigned length);
+unsigned telemetry_clients(const telemetryserver_t* server);
+void telemetry_close(telemetryserver_t* server, const char* path);
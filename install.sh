@@ -2,6 +2,7 @@
 
 apt install -y python3-smbus
 apt install -y python3-watchdog
+apt install -y python3-numpy
 mkdir /trake
 mkdir /trake/configuration
 mkdir /trake/data
@@ -13,6 +14,12 @@ chmod 744 /usr/local/bin/start-trake-onboot.sh
 (crontab -l ; echo "@reboot /usr/local/bin/start-trake-onboot.sh") 2>&1 | grep -v "no crontab" | sort | uniq | crontab -
 cd src
 python3 ./set_rtc_datetime.py >> /home/trake/trake.log
-gcc -Wall -pthread -fpic -shared -o ad7616_driver.so ad7616_driver.c -lpigpio -lrt
+gcc -O2 -Wall -pthread -fpic -shared -I../include -o ad7616_driver.so ad7616_driver.c trake_journal.c trake_overview.c trake_telemetry.c trake_spidev.c trake_capture.c -lpigpio -lrt
+apt install -y python3-dev
+gcc -O2 -Wall -pthread -fpic -shared $(python3-config --includes) -I../include -o _ad7616.so ad7616_module.c ad7616_driver.c trake_journal.c trake_overview.c trake_telemetry.c trake_spidev.c trake_capture.c -lpigpio -lrt
+gcc -O2 -Wall -pthread -fpic -shared -I../include -o trake_reader.so trake_reader.c trake_binary.c trake_journal.c trake_overview.c
+gcc -Wall -I../include -o trake_recover trake_recover.c trake_journal.c
+gcc -O2 -Wall -pthread -I../include -o trake_convert trake_convert.c trake_binary.c trake_journal.c trake_overview.c
+gcc -Wall -pthread -I../include -o trake_daemon trake_daemon.c trake_json.c ad7616_driver.c trake_journal.c trake_overview.c trake_telemetry.c trake_spidev.c trake_capture.c -lpigpio -lrt
 cd ..
 
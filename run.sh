@@ -2,5 +2,9 @@
 
 cd /home/trake/github/t-rake/src
 echo "Test Deploying Temperature Rake data acquisition" >> /home/trake/trake.log
-python3 deploy.py driver
+if [ -x ./trake_daemon ]; then
+  ./trake_daemon driver >> /home/trake/trake.log
+else
+  python3 deploy.py driver
+fi
 echo "Test Temperature Rake data acquisition complete" >> /home/trake/trake.log
@@ -1,4 +1,5 @@
 import pathlib
+import numpy
 from enum import Enum
 from ctypes import *
 
@@ -10,6 +11,9 @@ from ctypes import *
           same directory as the shim Python file itself.  See instructions to generate
           ad7616_driver.so in the comments of the ad7616_driver.c file.
 
+    When the native extension module _ad7616.so, built from ad7616_module.c, is
+    importable, the shim calls the driver through it instead of through ctypes.
+
     For API details, see the file docs/PythonAPI.md, also available on github at 
     https://github.com/RoboticOceanographicSurfaceSampler/t-rake/blob/main/docs/PythonAPI.md
 """
@@ -57,6 +61,43 @@ class AD7616:
         PLUS_MINUS_2_5V = 1
         PLUS_MINUS_5V = 2
 
+    class Trigger(Enum):
+        """ How conversions are started while data acquisition is running.
+            SOFTWARE pulses CONVST from the acquisition thread, HARDWARE drives
+            CONVST from a pigpio DMA waveform for a jitter-free sample instant.
+        """
+        SOFTWARE = 0
+        HARDWARE = 1
+
+    class Transport(Enum):
+        """ How the driver talks to the chip.  BITBANG clocks every bit through GPIO,
+            SPIDEV puts the chip in 1-wire mode and reads it with the SPI controller,
+            and CAPTURE clocks the bit-banged readout with a DMA wave and decodes the
+            sampled GPIO levels.
+        """
+        BITBANG = 0
+        SPIDEV = 1
+        CAPTURE = 2
+
+    class Crc(Enum):
+        """ What the acquisition thread does with a frame whose CRC does not match.
+            OFF does not check, MARK keeps the frame and marks it in the data file,
+            DROP leaves it out, and RETRY converts again at once, then drops.
+        """
+        OFF = 0
+        MARK = 1
+        DROP = 2
+        RETRY = 3
+
+    class BusyWait(Enum):
+        """ How the driver waits for the BUSY pin to drop after starting a conversion.
+            SPIN polls the pin without sleeping, DELAY waits a calibrated fixed delay,
+            and ALERT blocks on a pigpio edge alert.
+        """
+        SPIN = 0
+        DELAY = 1
+        ALERT = 2
+
     def __init__(self, bus=1, device=0, print_diagnostic=False):
         """ Constructor for an AD7616 object.
         """
@@ -73,12 +114,27 @@ class AD7616:
             The __enter__ method functions to connect to the hardware, using scarce resources
             in a way that can be automatically disposed when they are no longer needed.
         """
-        libname = pathlib.Path().absolute() / "ad7616_driver.so"
-        self.driver = CDLL(libname)
+        try:
+            # The native extension module, if it was built, takes the same calls with less overhead.
+            import _ad7616
+            self.driver = _ad7616
+            self.handle = SPIDEF.from_buffer_copy(self.driver.spi_initialize())
+        except ImportError:
+            libname = pathlib.Path().absolute() / "ad7616_driver.so"
+            self.driver = CDLL(libname)
 
-        self.driver.spi_initialize.restype = SPIDEF
+            self.driver.spi_initialize.restype = SPIDEF
+            self.driver.spi_settransport.argtypes = [SPIDEF, c_uint32, c_char_p, c_uint32]
+            self.driver.spi_settelemetry.argtypes = [SPIDEF, c_char_p, c_uint32]
+            self.driver.spi_start.argtypes = [SPIDEF, c_uint32, c_uint32, c_char_p, c_char_p]
+            self.driver.spi_getshutdownlatency.restype = c_longlong
+            self.driver.spi_getfirstsample.restype = c_ulonglong
+            self.driver.spi_definechannels.argtypes = [SPIDEF, c_uint32, POINTER(c_uint32), POINTER(c_uint32), c_uint32, POINTER(c_uint32), c_char_p]
+            self.driver.spi_capture.argtypes = [SPIDEF, c_uint32,
+                                                numpy.ctypeslib.ndpointer(numpy.uint32, flags='C_CONTIGUOUS'),
+                                                numpy.ctypeslib.ndpointer(numpy.uint64, flags='C_CONTIGUOUS')]
 
-        self.handle = self.driver.spi_initialize()
+            self.handle = self.driver.spi_initialize()
         if (self.print_diagnostic):
             self.handle.spi_flags |= 1
         self.driver.spi_open(self.handle, self.bus, self.device)
@@ -95,39 +151,74 @@ class AD7616:
         """
         self.driver.spi_terminate(self.handle)
 
+    def SetTransport(self, transport, device='/dev/spidev1.0', speed_hz=0):
+        """ Select how the driver talks to the chip, as a value of the Transport Enum, e.g.
+            Transport.SPIDEV.value, with the spidev device and SCLK rate, 0 for 10 MHz.
+            The device 'sim' is a simulated chip.  The chip is reset, so call this before
+            writing any register.  Returns True on success; on failure the driver stays
+            bit-banged.
+        """
+        return self.driver.spi_settransport(self.handle, transport, bytes(device, "ASCII") if device else None, speed_hz) == 0
+
     def WriteRegister(self, address, value):
         """ Write the specified value to the specified AD7616 register address.
             The address should be specified as a value of the Register Enum, e.g.
             Register.CONFIGURATION.value
+            Nothing is written if the register is known to hold the value already.
         """
         self.driver.spi_writeregister(self.handle, address, value)
 
+    def WriteRegisters(self, registers, verify=True):
+        """ Write a list of (address, value) pairs to AD7616 registers in a single transaction,
+            using only one conversion.  The addresses should be specified as values of the
+            Register Enum, e.g. Register.CONFIGURATION.value
+            When verify is True, the registers are read back in the same transaction, and a list
+            of the addresses that did not verify is returned.  The list is empty on success.
+            When verify is False, registers known to hold their value already are not written.
+        """
+        registers_array = c_uint32 * len(registers)
+        registeraddresses = registers_array(*[address for address, _ in registers])
+        registervalues = registers_array(*[value for _, value in registers])
+        registerreadback = registers_array() if verify else None
+
+        self.driver.spi_writeregisters(self.handle, len(registers), registeraddresses, registervalues, registerreadback)
+
+        failed = []
+        if verify:
+            for i, (address, value) in enumerate(registers):
+                if registerreadback[i] != (value & 0x1ff):
+                    failed.append(address)
+
+        return failed
+
     def ReadRegister(self, address):
         """ Read the value of an AD7616 register address and return it.
             The address should be specified as a value of the Register Enum, e.g.
             Register.CONFIGURATION.value
+            The driver keeps a shadow of the registers, so the chip is only read if the
+            register is not known.  Use VerifyRegisters() to check the chip itself.
         """
         registerValue = self.driver.spi_readregister(self.handle, address)
         return registerValue
 
+    def VerifyRegisters(self):
+        """ Read every general-purpose and sequencer stack register back from the chip in one
+            transaction, and compare them with the driver's shadow of the registers.  Returns
+            the number of registers that did not hold the expected value, 0 on success, or -1
+            if the conversion timed out.
+        """
+        return self.driver.spi_verifyregisters(self.handle)
+
     def ReadRegisters(self, addresses):
         """ Read the values of a list of AD7616 register addresses and return them as a list.
             The addresses should be specified as values of the Register Enum, e.g.
             Register.CONFIGURATION.value
         """
-        registerss_array = c_uint32 * len(addresses)
-        sequenceaddresses = registerss_array()
-        sequencevalues = registerss_array()
-        for i in range(len(addresses)):
-            sequenceaddresses[i] = addresses[i]
-            
-        self.driver.spi_readregisters(self.handle, len(addresses), sequenceaddresses, sequencevalues)
-
-        values = []
-        for value in sequencevalues:
-            values.append(value)
-
-        return values
+        registers_array = c_uint32 * len(addresses)
+        registeraddresses = registers_array(*addresses)
+        registervalues = registers_array()
+        self.driver.spi_readregisters(self.handle, len(addresses), registeraddresses, registervalues)
+        return list(registervalues)
 
     def ConvertPair(self, AChannel, BChannel):
         """ The AD7616 chip always converts a pair of channels, one A-side and one B-side.
@@ -144,14 +235,35 @@ class AD7616:
     def DefineSequence(self, AChannels, BChannels):
         self.sequenceLength = len(AChannels)
         channels_array = c_uint32 * self.sequenceLength
-        AchannelArray = channels_array()
-        BchannelArray = channels_array()
-        for i in range(len(AChannels)):
-            AchannelArray[i] = AChannels[i]
-            BchannelArray[i] = BChannels[i]
+        AchannelArray = channels_array(*AChannels)
+        BchannelArray = channels_array(*BChannels)
 
         self.driver.spi_definesequence(self.handle, self.sequenceLength, AchannelArray, BchannelArray)
 
+    def DefineChannels(self, AChannels, BChannels, mask, names=None, repeats=None):
+        """ Convert and store only the columns of a channel map selected by mask, where bit i
+            is AChannels[i] and bit len(AChannels) + i is BChannels[i], as the columns of the
+            whole map would be numbered.  The chip is programmed with the shortest sequence
+            that converts them, and the data file gets only those columns, named by the list
+            names, or ChannelN for the column N of the whole map.  At most 16 pairs.
+            The list repeats gives, for each selected column in order, the number of times
+            to convert it in each sample period, spread evenly through the sequence, and
+            written as that many columns, name.0 onwards, with a "# columns" record giving
+            their streams and times.  Each side may have up to 32 conversions in all.
+            Returns the number of columns, or -1 if the mask or repeats are not valid.
+        """
+        count = len(AChannels)
+        channels_array = c_uint32 * count
+        namestring = None
+        if names:
+            namestring = bytes(','.join(names), "ASCII")
+        repeatarray = None
+        if repeats:
+            repeatarray = (c_uint32 * bin(mask).count('1'))(*repeats)
+        columns = self.driver.spi_definechannels(self.handle, count, channels_array(*AChannels), channels_array(*BChannels), mask, repeatarray, namestring)
+        self.sequenceLength = self.driver.spi_getsequencepairs()
+        return columns
+
     def ReadConversions(self):
         conversions_array = c_uint32 * self.sequenceLength
         conversionvalues = conversions_array()
@@ -159,19 +271,170 @@ class AD7616:
         for conversionvalue in conversionvalues: print(f"{conversionvalue} ", end=" ")
         print()
 
-        conversions = []
-        # First, append all the A side conversions.
-        for conversion in conversionvalues:
-            conversions.append(((conversion >> 16) & 0xffff))
-        # Second, append all the B side conversions.
-        for conversion in conversionvalues:
-            conversions.append(conversion & 0xffff)
+        # First all the A side conversions, then all the B side conversions.
+        return [(conversion >> 16) & 0xffff for conversion in conversionvalues] + [conversion & 0xffff for conversion in conversionvalues]
+
+    def Capture(self, frames):
+        """ Convert and read frames sequences back to back, as fast as the transport allows,
+            for calibration snapshots such as the offset and noise of each channel.  Returns
+            a numpy uint16 array with a row per sequence, holding first all the A side
+            conversions, then all the B side conversions, as ReadConversions() does, and the
+            achieved rate in sequences per second.  Fewer rows are returned if a conversion
+            timed out.  Not available while data acquisition is running.
+        """
+        pairs = self.driver.spi_getsequencepairs()
+        conversions = numpy.zeros((frames, pairs), dtype=numpy.uint32)
+        timestamps = numpy.zeros(frames, dtype=numpy.uint64)
+        captured = self.driver.spi_capture(self.handle, frames, conversions, timestamps)
+        if captured < 0:
+            raise RuntimeError("Cannot capture while data acquisition is running")
+
+        conversions = conversions[:captured]
+        samples = numpy.hstack(((conversions >> 16).astype(numpy.uint16), (conversions & 0xffff).astype(numpy.uint16)))
+        rate = 0.0
+        if captured > 1:
+            rate = (captured - 1) * 1e9 / float(timestamps[captured - 1] - timestamps[0])
+        return samples, rate
+
+    def SetBusyWait(self, busywait, timeout_us=100000):
+        """ Select how the driver waits for each conversion to complete, as a value of the
+            BusyWait Enum, e.g. BusyWait.SPIN.value
+            Conversions that take longer than timeout_us microseconds are abandoned and counted.
+        """
+        self.driver.spi_setbusywait(self.handle, busywait, timeout_us)
+
+    def SetOversampling(self, ratio):
+        """ Set the on-chip oversampling ratio, a power of two from 1 (off) to 128.  The chip
+            averages ratio conversions of each channel, which lowers the noise but lengthens
+            every conversion by the same factor, so it must still fit in the period given to
+            Start().  The rest of the configuration register is kept.  Returns True on success.
+        """
+        return self.driver.spi_setoversampling(self.handle, ratio) == 0
+
+    def BusyTimeouts(self):
+        """ Return the number of conversions that timed out waiting for the BUSY pin.
+        """
+        return self.driver.spi_getbusytimeouts()
+
+    def SetCrc(self, crc):
+        """ Select whether the CRC the chip appends to each sequence is checked, and what
+            is done with a frame that fails, as a value of the Crc Enum, e.g. Crc.MARK.value
+        """
+        self.driver.spi_setcrc(self.handle, crc)
+
+    def CrcErrors(self):
+        """ Return the number of readouts whose CRC did not match.
+        """
+        return self.driver.spi_getcrcerrors()
+
+    def SetSclkSettle(self, settle):
+        """ Set how many extra reads of MISO follow each SCLK falling edge before a bit is
+            taken, 0 for the fastest readout.
+        """
+        self.driver.spi_setsclksettle(self.handle, settle)
+
+    def ScanSclk(self, frames=1000):
+        """ Find and select the fastest SCLK timing that reads frames conversions of the
+            self-test channel without a bit error at it and every slower timing.  Returns
+            the settle chosen, or -1 if none was reliable.  Not allowed while acquiring.
+        """
+        return self.driver.spi_scansclk(self.handle, frames)
+
+    def SetJournal(self, enabled, flush_ms=1000):
+        """ Select whether Start() writes through a crash-safe write-ahead journal, and how often,
+            in milliseconds, buffered data is forced to disk.
+            Must be called before Start() to have any effect.
+        """
+        self.driver.spi_setjournal(self.handle, 1 if enabled else 0, flush_ms)
+
+    def SetOverview(self, enabled):
+        """ Select whether Start() writes an overview of the data file next to it, with the
+            minimum, maximum and mean of each channel over every second, minute and hour.
+            The overview is written by default.
+            Must be called before Start() to have any effect.
+        """
+        self.driver.spi_setoverview(self.handle, 1 if enabled else 0)
+
+    def SetClockRecords(self, period_ms, rtc=True):
+        """ Select how often, in milliseconds, Start() writes clock records into the data file,
+            pairing its time column with the system clocks, and with the edges of the RTC's
+            seconds if rtc is True.  0 writes none.  The default is every 10 seconds, with the RTC.
+            Must be called before Start() to have any effect.
+        """
+        self.driver.spi_setclockrecords(self.handle, period_ms, 1 if rtc else 0)
+
+    def SetTelemetry(self, path, interval_ms=100):
+        """ Publish live telemetry on a Unix domain socket at path while acquiring: the last
+            sample and the minimum, maximum and mean of each channel every interval_ms, and
+            the driver's health counters every second.  None or '' publishes nothing, which
+            is the default.  Must be called before Start() to have any effect.
+        """
+        self.driver.spi_settelemetry(self.handle, bytes(path, "ASCII") if path else None, interval_ms)
+
+    def SetTrigger(self, trigger):
+        """ Select how conversions are started by Start(), as a value of the Trigger Enum, e.g.
+            Trigger.HARDWARE.value
+            Must be called before Start() to have any effect.
+        """
+        self.driver.spi_settrigger(self.handle, trigger)
+
+    def SetShutdownBudget(self, budget_ms):
+        """ Set the time, in milliseconds, allowed from detecting low voltage to having all
+            acquired data on disk.  Shutdowns that take longer are reported.
+        """
+        self.driver.spi_setshutdownbudget(self.handle, budget_ms)
+
+    class StartStatus(Enum):
+        """ The values returned by Start().  OK means acquisition is running with everything
+            asked for.  The positive values are flags, combined when acquisition is running
+            degraded.  The negative values mean acquisition is not running.
+        """
+        OK = 0
+        NO_MLOCK = 0x1
+        SCHED_RR = 0x2
+        SCHED_OTHER = 0x4
+        NO_AFFINITY = 0x8
+        ERROR_RUNNING = -1
+        ERROR_THREAD = -2
+
+    class Stopped(Enum):
+        """ The values returned by WaitForStop().
+        """
+        RUNNING = 0
+        POWER_LOW = 1
+        OTHER = 2
+
+    def WaitForStop(self, timeout_ms):
+        """ Wait up to timeout_ms milliseconds for data acquisition to stop by itself, which it
+            does as soon as it detects low voltage.  Returns a value of the Stopped Enum.
+            Stop() must still be called afterwards.
+        """
+        return self.driver.spi_waitstop(self.handle, timeout_ms)
+
+    def ShutdownLatency(self):
+        """ Return the time in microseconds the last low-voltage shutdown took, from detecting
+            low voltage to having all data on disk, or -1 if there has been none.
+        """
+        return self.driver.spi_getshutdownlatency()
+
+    def SetAffinity(self, samplercpu=-1, writercpu=-1):
+        """ Pin the acquisition (sampler) thread and the writer thread to the given CPUs,
+            or -1 to let a thread migrate between CPUs.
+            Must be called before Start() to have any effect.
+        """
+        self.driver.spi_setaffinity(self.handle, samplercpu, writercpu)
 
-        return conversions
+    def FirstSampleTime(self):
+        """ Return the time the first frame was acquired after Start(), in nanoseconds since
+            boot, or 0 if no frame has been acquired yet.
+        """
+        return self.driver.spi_getfirstsample()
 
     def Start(self, period, averagecount, path, filename):
-        self.driver.spi_start.argtypes = [SPIDEF, c_uint32, c_uint32, c_char_p, c_char_p]
-        self.driver.spi_start(self.handle, period, averagecount, c_char_p(bytes(path, "ASCII")), c_char_p(bytes(filename, "ASCII")))
+        """ Start background data acquisition.  Returns a value of the StartStatus Enum,
+            or a combination of its positive flags if acquisition is running degraded.
+        """
+        return self.driver.spi_start(self.handle, period, averagecount, bytes(path, "ASCII"), bytes(filename, "ASCII"))
 
     def Stop(self):
         self.driver.spi_stop(self.handle)
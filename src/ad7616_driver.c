@@ -15,7 +15,10 @@
 //    this is standard SPI, it requires using the SPI interface with
 //    a 32-bit word length.  Unfortunately, due to limitations in either
 //    the Raspberry Pi SPI hardware or the driver software, only 8-bit
-//    word lengths are allowed.
+//    word lengths are allowed.  spi_settransport() now offers this mode anyway,
+//    reading each 32-bit pair as four bytes through spidev, see trake_spidev.h.
+//    It also offers a bit-banged readout clocked by DMA instead of the CPU, see
+//    trake_capture.h.
 //
 // After best attempts to get either of the above modes to work with SPI
 // hardware, it was determined that the best approach is to bit-bang four
@@ -29,8 +32,9 @@
 // To build on a Raspberry Pi, use this command in a terminal prompt after changing
 // to the directory with this file in it:
 //
-//gcc -Wall -pthread -fpic -shared -o ad7616_driver.so ad7616_driver.c -lpigpio -lrt
+//gcc -O2 -Wall -pthread -fpic -shared -I../include -o ad7616_driver.so ad7616_driver.c trake_journal.c trake_overview.c trake_telemetry.c trake_spidev.c trake_capture.c -lpigpio -lrt
 //
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -39,11 +43,21 @@
 #include <string.h>
 #include <pthread.h>
 #include <sched.h>
+#include <semaphore.h>
 #include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
 
 
 #include <pigpio.h>
 
+#include "spi_ad7616.h"
+#include "trake_journal.h"
+#include "trake_overview.h"
+#include "trake_telemetry.h"
+#include "trake_spidev.h"
+#include "trake_capture.h"
+
 #define RESETPin 23         // Broadcom pin 23 (Pi pin 16)
 
 #define ADC_BUSY_Pin 24     // Broadcom pin 24 (Pi pin 18)
@@ -65,20 +79,10 @@
 
 #define POWER_LOW_Pin 27     // Broadcom pin 27 (Pi pin 13)
 
-//
-// This type is the handle returned by spi_initialize(), and
-// required by all subsequent calls.
-//
-typedef struct {
-    unsigned spi_cs_pin;
-    unsigned spi_sclk_pin;
-    unsigned spi_mosi_pin;
-    unsigned spi_miso_pin;
-    unsigned spi_errorcode;
-    unsigned spi_flags;
-} self_t;
-
-#define PRINT_DIAG_FLAG 0x1
+#define RTC_ENABLE_Pin 26   // Broadcom pin 26 (Pi pin 37), 1 enables the RTC I2C bus.
+#define RTC_I2C_BUS 1
+#define RTC_ADDRESS 0x68    // DS3231 real-time clock.
+#define RTC_SECONDS 0x00    // First of the seconds, minutes, hours, day of week, day, month and year registers.
 
 #define PRINT_DIAG(x) (x).spi_flags & PRINT_DIAG_FLAG
 
@@ -89,6 +93,130 @@ static self_t spidefault = {0, 0, 0, 0, 0};
 static int acquiring = 0;                   // Set when DoDataAcquisition enters, cleared when it leaves.
 static int voltage_low = 0;                 // Set to nonzero when low voltage condition is true.
 static int debug = 0;                       // Set to true to allow console logging.
+static unsigned SequenceSize = 0;           // Set by spi_definesequence(), the number of A and B channels converted.
+static unsigned Transport = TRANSPORT_BITBANG;  // Set by spi_settransport().
+static spidev_t Spidev = { .fd = -1 };      // Open while Transport is TRANSPORT_SPIDEV.
+
+//
+// State shared between the pigpio alert thread and the threads waiting on a
+// BUSY falling edge, either for hardware-timed conversions or BUSYWAIT_ALERT.
+//
+static sem_t BusySemaphore;                 // Posted once for each BUSY falling edge.
+static volatile uint32_t BusyTick = 0;      // pigpio tick of the most recent BUSY falling edge.
+static volatile unsigned BusyEdges = 0;     // Count of BUSY falling edges seen.
+
+//
+// pigpio alert callback for the BUSY pin.  A falling edge means a conversion
+// has completed and its results are ready to clock out.
+//
+static void BusyAlert(int gpio, int level, uint32_t tick)
+{
+    if (level == 0)
+    {
+        BusyTick = tick;
+        BusyEdges++;
+        sem_post(&BusySemaphore);
+    }
+}
+
+//
+// State for the capture transport.  The readout is a one-shot pigpio wave that frames
+// CS and clocks SCLK from DMA, while pigpio's DMA sampler records the GPIO levels.
+// pigpio hands the samples to CaptureSamplesReady() every millisecond, which keeps those
+// of the readout, and the levels are then decoded by capture_decode().  Each SCLK phase
+// spans two sample periods, so no bit falls between samples.
+//
+#define CAPTURE_SAMPLE_us 5                         // pigpio's sample period, its default unless gpioCfgClock() changes it.
+#define CAPTURE_HALF_us (2 * CAPTURE_SAMPLE_us)     // Length of each SCLK phase.
+#define CAPTURE_MAX_BITS (32 * 32 + 16)             // 32 result pairs and the CRC word.
+#define CAPTURE_MAX_SAMPLES (8 * CAPTURE_MAX_BITS)
+#define CAPTURE_MARGIN_ms 20                        // Allowance for pigpio's millisecond sample delivery.
+
+static int CaptureWave = -1;                        // pigpio wave of the readout, -1 if none.
+static unsigned CaptureWaveBits = 0;                // SCLK cycles in CaptureWave.
+static capture_pins_t CapturePins;                  // Pin masks, set by spi_settransport().
+static capture_sample_t CaptureSamples[CAPTURE_MAX_SAMPLES];    // Levels of the readout in progress.
+static volatile unsigned CaptureCount = 0;          // Samples in CaptureSamples.
+static volatile int CaptureArmed = 0;               // Set while a readout is waiting for its samples.
+static volatile uint32_t CaptureStartTick = 0;      // pigpio tick before the readout wave was sent.
+static int CaptureSeenLow = 0;                      // Set once CS was seen low in the readout.
+static sem_t CaptureSemaphore;                      // Posted when CS has gone high again.
+
+//
+// pigpio samples callback, called from pigpio's thread with the levels sampled since the
+// last call.  While a readout is armed, it keeps the samples from the start of the wave
+// until CS goes high again.
+//
+static void CaptureSamplesReady(const gpioSample_t* samples, int numSamples)
+{
+    if (!CaptureArmed)
+        return;
+
+    for (int i = 0; i < numSamples; i++)
+    {
+        if ((int32_t)(samples[i].tick - CaptureStartTick) < 0)
+            continue;
+        if (CaptureCount < CAPTURE_MAX_SAMPLES)
+        {
+            CaptureSamples[CaptureCount].tick = samples[i].tick;
+            CaptureSamples[CaptureCount].level = samples[i].level;
+            CaptureCount++;
+        }
+        if ((samples[i].level & CapturePins.cs) == 0)
+            CaptureSeenLow = 1;
+        else if (CaptureSeenLow)
+        {
+            CaptureArmed = 0;
+            sem_post(&CaptureSemaphore);
+            return;
+        }
+    }
+}
+
+//
+// Shadow of the chip's registers.  Reading a register back costs a conversion and two
+// 16-bit frames, and every setup step used to read the configuration register before
+// changing a bit in it.  So the driver keeps a copy of every register it has written or
+// read, indexed by address, and reads and read-modify-writes use the copy.  Writes of a
+// value the register already holds are skipped.  The chip is only read back when a
+// register is not known yet, or on an explicit spi_verifyregisters().
+//
+// The hardware reset in spi_initialize() returns the general-purpose registers to their
+// data sheet defaults (AD7616 Rev. 0, register summary): configuration and channel 0x000,
+// and input ranges 0x0ff, +-10V for every channel.  The sequencer stack registers are
+// not relied on until they are written or read back.
+//
+#define REGISTER_RESET_RANGE 0x0ff
+
+static unsigned RegisterShadow[64];                     // Last value known to be in each register.
+static unsigned long long RegisterKnown = 0;            // Bit n is set when RegisterShadow[n] is known.
+
+static void ShadowReset()
+{
+    RegisterKnown = 0;
+    for (unsigned address = REGISTER_CONFIGURATION; address <= REGISTER_RANGEB_4_7; address++)
+    {
+        RegisterShadow[address] = address >= REGISTER_RANGEA_0_3 ? REGISTER_RESET_RANGE : 0;
+        RegisterKnown |= 1ULL << address;
+    }
+}
+
+static void ShadowStore(unsigned address, unsigned value)
+{
+    RegisterShadow[address & 0x3f] = value & 0x1ff;
+    RegisterKnown |= 1ULL << (address & 0x3f);
+}
+
+static int ShadowKnown(unsigned address)
+{
+    return (RegisterKnown >> (address & 0x3f)) & 1;
+}
+
+static int ShadowMatches(unsigned address, unsigned value)
+{
+    return ShadowKnown(address) && RegisterShadow[address & 0x3f] == (value & 0x1ff);
+}
+
 //
 // A call to spi_nitialize() is required before any other call.
 // Initialize memory and the GPIO library, and condition the chip for operation.
@@ -105,6 +233,8 @@ self_t spi_initialize()
         spidef.spi_errorcode = errorcode;
         return spidef;
     }
+    sem_init(&BusySemaphore, 0, 0);
+    sem_init(&CaptureSemaphore, 0, 0);
 
     // Default to bus 1, device 0
     spidef.spi_cs_pin = SPI1_CS0_Pin;
@@ -117,12 +247,13 @@ self_t spi_initialize()
     gpioSetMode(POWER_LOW_Pin, PI_INPUT);
     gpioSetPullUpDown(POWER_LOW_Pin, PI_PUD_UP);
 
-    gpioWrite(ADC_SER1W_Pin, 0);        // 0 for 1-wire, 1 for 2-wire (doesn't seem to work, always 2-wire)
+    gpioWrite(ADC_SER1W_Pin, 0);        // 0 for 2-wire, 1 for 1-wire, which spi_settransport() selects for spidev.
     usleep(100);
     gpioWrite(RESETPin, 0);
     usleep(100);
     gpioWrite(RESETPin, 1);
     usleep(100);
+    ShadowReset();
 
     return spidef;
 }
@@ -134,8 +265,10 @@ self_t spi_initialize()
 //
 static void spi_idle(self_t* self)
 {
-    // Set defaults for output pins
+    // Set defaults for output pins.  The SPI controller owns them under spidev.
     gpioWrite(ADC_CONVST_Pin, 0);
+    if (Transport == TRANSPORT_SPIDEV)
+        return;
     gpioWrite(self->spi_cs_pin, 1);
     gpioWrite(self->spi_sclk_pin, 1);
     gpioWrite(self->spi_mosi_pin, 0);
@@ -183,13 +316,254 @@ void spi_open(self_t self, unsigned bus, unsigned device)
     spi_idle(&self);
 }
 
+//
+// Select how the driver talks to the chip.  TRANSPORT_BITBANG, the default, clocks
+// every bit in software through GPIO.  TRANSPORT_SPIDEV puts the chip in 1-wire mode,
+// with SER1W high, so the A and B results of each pair come out one after the other
+// on SDOA as ordinary SPI data, and hands the SPI pins back to the SPI controller.
+// Each sequence readout, with its CRC, is then one spidev message, and each register
+// burst another, so the acquisition thread no longer spends the readout toggling pins.
+// TRANSPORT_CAPTURE keeps the bit-banged wiring, but clocks each readout with a pigpio
+// DMA wave and decodes it from the GPIO levels pigpio samples, so the thread sleeps
+// through it.  Registers are still written bit-banged.  CONVST and BUSY stay on GPIO
+// with every transport.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_open(), which chose the bus.
+// transport: TRANSPORT_BITBANG, TRANSPORT_SPIDEV or TRANSPORT_CAPTURE.
+// device: For TRANSPORT_SPIDEV, the spidev device on that bus and chip select, such as
+//         "/dev/spidev1.0", or "sim" for a simulated chip that needs no hardware.
+// speed_hz: For TRANSPORT_SPIDEV, the SCLK rate, or 0 for 10 MHz.
+//
+// NOTE: The chip is reset to latch SER1W, so call this after spi_open() and before
+//       configuring any register.  It cannot be called while acquiring.
+//
+// Returns: 0 on success, or -1 if the device could not be opened, or pigpio refused
+//          the samples callback, when the driver stays with the bit-banged transport.
+//
+int spi_settransport(self_t self, unsigned transport, const char* device, unsigned speed_hz)
+{
+    if (acquiring)
+    {
+        printf("spi_settransport cannot change the transport while acquiring\n");
+        return -1;
+    }
+
+    spidev_close(&Spidev);
+    gpioSetGetSamplesFunc(NULL, 0);
+    if (CaptureWave >= 0)
+        gpioWaveDelete(CaptureWave);
+    CaptureWave = -1;
+    Transport = TRANSPORT_BITBANG;
+    int status = 0;
+    if (transport == TRANSPORT_SPIDEV)
+    {
+        if (spidev_open(&Spidev, device, speed_hz) == 0)
+            Transport = TRANSPORT_SPIDEV;
+        else
+        {
+            printf("spi_settransport could not open %s: %s\n", device, strerror(errno));
+            status = -1;
+        }
+    }
+    else if (transport == TRANSPORT_CAPTURE)
+    {
+        CapturePins.cs = 1 << self.spi_cs_pin;
+        CapturePins.sclk = 1 << self.spi_sclk_pin;
+        CapturePins.miso = 1 << self.spi_miso_pin;
+        if (gpioSetGetSamplesFunc(CaptureSamplesReady, CapturePins.cs | CapturePins.sclk | CapturePins.miso) == 0)
+            Transport = TRANSPORT_CAPTURE;
+        else
+            status = -1;
+    }
+
+    if (!Spidev.simulated)
+    {
+        // SPI0 is ALT0 on its pins, SPI1 ALT4.  The kernel drives CS as a GPIO output.
+        unsigned mode = PI_OUTPUT;
+        if (Transport == TRANSPORT_SPIDEV)
+            mode = (self.spi_sclk_pin == SPI0_SCLK_Pin) ? PI_ALT0 : PI_ALT4;
+        gpioSetMode(self.spi_sclk_pin, mode);
+        gpioSetMode(self.spi_mosi_pin, mode);
+        gpioSetMode(self.spi_miso_pin, (Transport == TRANSPORT_SPIDEV) ? mode : PI_INPUT);
+
+        gpioWrite(ADC_SER1W_Pin, (Transport == TRANSPORT_SPIDEV) ? 1 : 0);
+        usleep(100);
+        gpioWrite(RESETPin, 0);
+        usleep(100);
+        gpioWrite(RESETPin, 1);
+        usleep(100);
+    }
+    ShadowReset();
+    spi_idle(&self);
+
+    if (PRINT_DIAG(self))
+        printf("Transport %s\n", (Transport == TRANSPORT_SPIDEV) ? device : (Transport == TRANSPORT_CAPTURE) ? "DMA capture" : "bit-banged");
+    return status;
+}
+
 //
 // When done using the AD7616 chip, call this method.  This will close everything
 // and release the GPIO pins owned by the GPIO library.
 //
 void spi_terminate(self_t self)
 {
+    gpioSetAlertFunc(ADC_BUSY_Pin, NULL);
+    spidev_close(&Spidev);
+    gpioSetGetSamplesFunc(NULL, 0);
     gpioTerminate();
+    sem_destroy(&BusySemaphore);
+    sem_destroy(&CaptureSemaphore);
+}
+
+//
+// Strategies for waiting on the BUSY pin after starting a conversion.
+// BUSYWAIT_SPIN:  Poll the BUSY pin in a tight loop, without sleeping.  Lowest
+//                 latency, but uses the CPU for the whole conversion.
+// BUSYWAIT_DELAY: Busy-wait a fixed delay calibrated against the data sheet
+//                 conversion time and a measured conversion, then confirm BUSY
+//                 is low, spinning for the rest if it is not.
+// BUSYWAIT_ALERT: Block on a pigpio alert for the BUSY falling edge.  Costs no
+//                 CPU while waiting, but adds the pigpio sampling latency.
+// Every strategy gives up after the timeout, rather than hang if the ADC wedges.
+// The mode values are defined in spi_ad7616.h.
+//
+
+#define ADC_TCONV_ns 520            // Maximum conversion time for a channel pair (t CONV, AD7616 Rev. 0 Table 2).
+#define ADC_TACQ_ns 480             // Acquisition time for a channel pair (t ACQ, AD7616 Rev. 0 Table 2).
+#define CONFIGURATION_OS_SHIFT 2    // OS[2:0], the oversampling ratio as a power of two, in the configuration register.
+#define CONFIGURATION_OS_MASK (0x7 << CONFIGURATION_OS_SHIFT)
+#define CONFIGURATION_CRCEN 0x01    // Append a CRC word to the conversion results.
+#define CONFIGURATION_SEQEN 0x20    // Take the channels from the sequencer stack.
+#define CONFIGURATION_BURSTEN 0x40  // Convert the whole sequence on one CONVST.
+
+static unsigned BusyWaitMode = BUSYWAIT_SPIN;
+static unsigned TriggerMode = TRIGGER_SOFTWARE;  // Set by spi_settrigger().
+static unsigned BusyTimeout_us = 100000;    // Set by spi_setbusywait().
+static unsigned Oversampling = 1;           // The oversampling ratio of the run, set by spi_start().
+static unsigned long long Conversion_ns;    // The estimated conversion time of the run, set by spi_start().
+static unsigned BusyDelay_us = 1;           // Calibrated delay for BUSYWAIT_DELAY.
+static unsigned BusyTimeouts = 0;           // Count of conversions that timed out waiting on BUSY.
+
+//
+// Internal method that spins on the BUSY pin until it drops or the timeout expires.
+//
+// Returns: 0 when BUSY dropped, -1 on timeout.
+//
+static int spi_spinbusy(struct timespec* tpStart)
+{
+    for (unsigned polls = 1; gpioRead(ADC_BUSY_Pin) != 0; polls++)
+    {
+        // Only check the clock occasionally, to keep the loop tight.
+        if ((polls & 0x3f) == 0)
+        {
+            struct timespec tpNow;
+            clock_gettime(CLOCK_MONOTONIC_RAW, &tpNow);
+            long elapsed_us = ((tpNow.tv_sec-tpStart->tv_sec)*(1000*1000*1000) + (tpNow.tv_nsec-tpStart->tv_nsec)) / 1000;
+            if (elapsed_us > BusyTimeout_us)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+//
+// Internal method that starts a conversion with a pulse on CONVST, and waits
+// for the conversion to complete using the configured BUSY wait strategy.
+//
+// Returns: 0 when the conversion completed, -1 if it timed out.
+//
+static int spi_convert(self_t* self)
+{
+    int result = 0;
+    struct timespec tpStart;
+
+    if (BusyWaitMode == BUSYWAIT_ALERT)
+    {
+        // Discard any stale edges, so we only wake for this conversion.
+        while (sem_trywait(&BusySemaphore) == 0)
+            ;
+    }
+
+    gpioWrite(ADC_CONVST_Pin, 1);
+    gpioWrite(ADC_CONVST_Pin, 0);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tpStart);
+
+    switch (BusyWaitMode)
+    {
+    case BUSYWAIT_DELAY:
+        gpioDelay(BusyDelay_us);
+        result = spi_spinbusy(&tpStart);
+        break;
+
+    case BUSYWAIT_ALERT:
+    {
+        struct timespec tpTimeout;
+        clock_gettime(CLOCK_REALTIME, &tpTimeout);
+        unsigned long long timeout_ns = (unsigned long long)tpTimeout.tv_nsec + (unsigned long long)BusyTimeout_us * 1000;
+        tpTimeout.tv_sec += timeout_ns / (1000 * 1000 * 1000);
+        tpTimeout.tv_nsec = timeout_ns % (1000 * 1000 * 1000);
+        if (sem_timedwait(&BusySemaphore, &tpTimeout) != 0 && gpioRead(ADC_BUSY_Pin) != 0)
+            result = -1;
+        break;
+    }
+
+    default:
+        result = spi_spinbusy(&tpStart);
+        break;
+    }
+
+    if (result != 0)
+    {
+        BusyTimeouts++;
+        if (PRINT_DIAG(*self) || debug)
+            printf("Timed out after %d us waiting for BUSY to drop\n", BusyTimeout_us);
+    }
+
+    return result;
+}
+
+//
+// Internal method that estimates the time of one burst conversion of the sequence.
+// The data sheet gives the burst conversion time for N channel pairs as
+// (t CONV + 25 ns) + (N - 1)(t ACQ + t CONV), and oversampling repeats each
+// conversion OSR times.
+//
+// Parameters:
+// configuration: The configuration register, which holds the oversampling ratio.
+//
+// Returns: The estimated conversion time, in nanoseconds.
+//
+static unsigned long long ConversionEstimate_ns(unsigned configuration)
+{
+    unsigned pairs = (SequenceSize > 0) ? SequenceSize / 2 : 1;
+    unsigned oversampling = 1 << ((configuration & CONFIGURATION_OS_MASK) >> CONFIGURATION_OS_SHIFT);
+    return (unsigned long long)oversampling * ((ADC_TCONV_ns + 25) + (pairs - 1) * (ADC_TACQ_ns + ADC_TCONV_ns));
+}
+
+//
+// Internal method that calibrates the BUSYWAIT_DELAY delay.  A conversion is measured,
+// and the longer of that and the data sheet estimate is used.
+//
+static void spi_calibratebusywait(self_t* self, unsigned configuration)
+{
+    unsigned long long estimate_ns = ConversionEstimate_ns(configuration);
+
+    struct timespec tpStart;
+    gpioWrite(ADC_CONVST_Pin, 1);
+    gpioWrite(ADC_CONVST_Pin, 0);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tpStart);
+    spi_spinbusy(&tpStart);
+    struct timespec tpEnd;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tpEnd);
+    unsigned long long measured_ns = (tpEnd.tv_sec-tpStart.tv_sec)*(1000*1000*1000) + (tpEnd.tv_nsec-tpStart.tv_nsec);
+
+    unsigned long long delay_ns = (measured_ns > estimate_ns) ? measured_ns : estimate_ns;
+    BusyDelay_us = (unsigned)((delay_ns + 999) / 1000);
+
+    if (PRINT_DIAG(*self))
+        printf("BUSY delay calibrated to %d us (data sheet %llu ns, measured %llu ns)\n", BusyDelay_us, estimate_ns, measured_ns);
 }
 
 //
@@ -212,6 +586,111 @@ int read_powerlow()
     return voltage_low;
 }
 
+//
+// State for the bit-banged serial clock, and for checking the CRC the chip appends
+// to the conversion results.
+//
+#define SCLK_SETTLE_MAX 16
+#define CRC16_POLYNOMIAL 0x8005     // x^16 + x^15 + x^2 + 1, the AD7616 data sheet CRC.
+
+static unsigned SclkSettle = 0;             // Extra MISO reads after each SCLK falling edge, set by spi_setsclksettle().
+static unsigned CrcMode = CRC_OFF;          // Set by spi_setcrc().
+static unsigned CrcErrors = 0;              // Count of readouts whose CRC did not match.
+static unsigned CrcExpected = 0;            // CRC computed over the last readout.
+static unsigned CrcRead = 0;                // CRC word clocked out after the last readout.
+
+//
+// Internal method that samples MISO after SCLK has fallen, SclkSettle reads late.
+// Each read of the GPIO level register takes a fixed bus access, so this is a
+// delay that scales with the Pi rather than with the compiler.
+//
+static inline int spi_readmiso(self_t* self)
+{
+    for (unsigned settle = SclkSettle; settle > 0; settle--)
+        gpioRead(self->spi_miso_pin);
+    return gpioRead(self->spi_miso_pin);
+}
+
+//
+// Internal method that adds one 16-bit result to a CRC, most significant bit first.
+//
+static unsigned Crc16(unsigned crc, unsigned word)
+{
+    crc ^= word & 0xffff;
+    for (unsigned bit = 0; bit < 16; bit++)
+        crc = (crc & 0x8000) ? (crc << 1) ^ CRC16_POLYNOMIAL : crc << 1;
+    return crc & 0xffff;
+}
+
+//
+// Internal method that clocks one 16-bit command frame out on MOSI while clocking
+// the 16-bit response in on MISO.  The caller is responsible for asserting CS.
+//
+static unsigned spi_transferframe(self_t* self, unsigned senddata)
+{
+    unsigned result = 0;
+    unsigned bitmask = 1 << 15;
+
+    for (unsigned _ = 0; _ < 16; _++)
+    {
+        unsigned bit_setting = (senddata & bitmask) != 0 ? 1 : 0;
+        gpioWrite(self->spi_mosi_pin, bit_setting);
+        gpioWrite(self->spi_sclk_pin, 0);
+        if (spi_readmiso(self) != 0)
+            result |= bitmask;
+        gpioWrite(self->spi_sclk_pin, 1);
+
+        bitmask = bitmask >> 1;
+    }
+
+    return result;
+}
+
+//
+// Internal method that sends count 16-bit command frames in one CS-framed burst, and
+// receives the frame clocked in during each, over the selected transport.
+//
+// Parameters:
+// send: The frames to send.
+// receive: Receives the frames clocked in, or NULL.
+//
+// Returns: 0 on success, -1 if the spidev transfer failed.
+//
+#define FRAMES_MAX 160             // Enough for spi_writeregisters() with readback.
+static int spi_transferframes(self_t* self, unsigned count, const unsigned* send, unsigned* receive)
+{
+    if (Transport == TRANSPORT_SPIDEV)
+    {
+        uint16_t sendframes[FRAMES_MAX];
+        uint16_t receiveframes[FRAMES_MAX];
+        if (count > FRAMES_MAX)
+            return -1;
+        for (unsigned i = 0; i < count; i++)
+            sendframes[i] = send[i];
+        if (spidev_transfer(&Spidev, sendframes, receiveframes, count) != 0)
+        {
+            if (PRINT_DIAG(*self) || debug)
+                printf("spidev transfer of %d frames failed: %s\n", count, strerror(errno));
+            return -1;
+        }
+        if (receive != NULL)
+            for (unsigned i = 0; i < count; i++)
+                receive[i] = receiveframes[i];
+        return 0;
+    }
+
+    gpioWrite(self->spi_cs_pin, 0);
+    for (unsigned i = 0; i < count; i++)
+    {
+        unsigned result = spi_transferframe(self, send[i]);
+        if (receive != NULL)
+            receive[i] = result;
+    }
+    gpioWrite(self->spi_cs_pin, 1);
+    gpioWrite(self->spi_mosi_pin, 0);
+    return 0;
+}
+
 //
 // Write a single value to a single register.  The first step after
 // initializing and opening this driver will be to configure the AD7616
@@ -224,43 +703,33 @@ int read_powerlow()
 //          the AD7616 chip.
 // value:   The 9-bit value to write to the register.
 //
-// Returns: Nothing.
+// NOTE: Nothing is written if the register is known to hold the value already.
+//
+// Returns: 0 on success, -1 if the conversion timed out and nothing was written.
 //
-void spi_writeregister(self_t self, unsigned address, unsigned value)
+int spi_writeregister(self_t self, unsigned address, unsigned value)
 {
+    if (ShadowMatches(address, value))
+    {
+        if (PRINT_DIAG(self))
+            printf("Register %d already holds %03x, write skipped\n", address, value & 0x1ff);
+        return 0;
+    }
+
     // Always start with a conversion.
     if (PRINT_DIAG(self))
         printf("Starting Write to register %d (%d) with a conversion\n", address, value);
-    gpioWrite(ADC_CONVST_Pin, 1);
-    gpioWrite(ADC_CONVST_Pin, 0);
-    while (gpioRead(ADC_BUSY_Pin) != 0)
-        usleep(1);
+    if (spi_convert(&self) != 0)
+        return -1;
 
     // Instrument for elapsed time.
     struct timespec tpStart;
     clock_gettime(CLOCK_MONOTONIC_RAW, &tpStart);
     clock_t start = clock();
 
-    gpioWrite(self.spi_mosi_pin, 1);
-    gpioWrite(self.spi_cs_pin, 0);
-
-    unsigned result = 0;
-    unsigned bitmask = 1 << 15;
     unsigned senddata = ((address & 0x3f) | 0x40) << 9 | (value & 0x1ff);
-
-    gpioWrite(self.spi_cs_pin, 0);
-    for (unsigned _ = 0; _ < 16; _++)
-    {
-        unsigned bit_setting = (senddata & bitmask) != 0 ? 1 : 0;
-        gpioWrite(self.spi_mosi_pin, bit_setting);
-        gpioWrite(self.spi_sclk_pin, 0);
-        if (gpioRead(self.spi_miso_pin) != 0)
-            result |= bitmask;
-        gpioWrite(self.spi_sclk_pin, 1);
-
-        bitmask = bitmask >> 1;
-    }
-    gpioWrite(self.spi_cs_pin, 1);
+    if (spi_transferframes(&self, 1, &senddata, NULL) != 0)
+        return -1;
 
     // Instrument for elapsed time.
     struct timespec tpEnd;
@@ -271,54 +740,50 @@ void spi_writeregister(self_t self, unsigned address, unsigned value)
 
     if (PRINT_DIAG(self))
         printf("Register write used %lf ms CPU, done in %lu us\n\n", elapsed * 1000.0 / (double)CLOCKS_PER_SEC, tpElapsed);
+
+    ShadowStore(address, value);
+    return 0;
 }
 
 //
-// Read the value from a single register.  This is not frequently
-// needed, other than to confirm previously-written values.
+// Read the value from a single register.  The value is taken from the driver's shadow
+// of the registers if it is known, so use spi_verifyregisters() to confirm previously
+// written values in the chip itself.
 //
 // Parameters:
 // self: A copy of the opaque handle that was provided by spi_initialize().
 // address: A valid register address (2-7 and 32-64) for a register within
 //          the AD7616 chip.
 //
-// Returns: The 9-bit value read from the register.
+// Returns: The 9-bit value of the register.
 //
 unsigned spi_readregister(self_t self, unsigned address)
 {
-    unsigned result = 0;
-    unsigned bitmask = 1 << 15;
-    unsigned senddata = (address & 0x3f) << 9;
-
-    gpioWrite(self.spi_cs_pin, 0);
-    for (unsigned __ = 0; __ < 2; __++)
+    if (ShadowKnown(address))
     {
-        result = 0;
-        bitmask = 1 << 15;
-        for (unsigned _ = 0; _ < 16; _++)
-        {
-            unsigned bit_setting = (senddata & bitmask) != 0 ? 1 : 0;
-            gpioWrite(self.spi_mosi_pin, bit_setting);
-            gpioWrite(self.spi_sclk_pin, 0);
-            if (gpioRead(self.spi_miso_pin) != 0)
-                result |= bitmask;
-            gpioWrite(self.spi_sclk_pin, 1);
-
-            bitmask = bitmask >> 1;
-        }
+        if (PRINT_DIAG(self))
+            printf("Read register %d: %03x (shadow)\n", address, RegisterShadow[address & 0x3f]);
+        return RegisterShadow[address & 0x3f];
     }
-    gpioWrite(self.spi_cs_pin, 1);
+
+    // The response to the read command is clocked out during the following frame.
+    unsigned senddata[2] = { (address & 0x3f) << 9, (address & 0x3f) << 9 };
+    unsigned received[2] = { 0, 0 };
+    spi_transferframes(&self, 2, senddata, received);
+    unsigned result = received[1];
 
     spi_idle(&self);
 
     if (PRINT_DIAG(self))
         printf("Read register %d: %04x\n", address, result);
-    return result;
+    ShadowStore(address, result);
+    return result & 0x1ff;
 }
 
 //
-// Read the values from multiple registers.  This is not frequently
-// needed, other than to confirm previously-written values.
+// Read the values from multiple registers.  Like spi_readregister(), the values are
+// taken from the shadow of the registers, and the chip is only read, after a conversion,
+// if any of them is not known.
 //
 // Parameters:
 // self: A copy of the opaque handle that was provided by spi_initialize().
@@ -332,20 +797,25 @@ unsigned spi_readregister(self_t self, unsigned address)
 //       by the caller.  It is the caller's responsibility to ensure they are at
 //       least as large as indicated by count.
 //
-// Returns: Nothing.
+// Returns: 0 on success, -1 if the conversion timed out and nothing was read.
 //
-void spi_readregisters(self_t self, unsigned count, unsigned* addresses, unsigned* values)
+int spi_readregisters(self_t self, unsigned count, unsigned* addresses, unsigned* values)
 {
+    unsigned known = 0;
+    while (known < count && ShadowKnown(addresses[known]))
+        known++;
+    if (known == count)
+    {
+        for (unsigned i = 0; i < count; i++)
+            values[i] = RegisterShadow[addresses[i] & 0x3f];
+        return 0;
+    }
+
     // Always start with a conversion.
     if (PRINT_DIAG(self))
         printf("Starting Read from %d registers\n", count);
-    gpioWrite(ADC_CONVST_Pin, 1);
-    gpioWrite(ADC_CONVST_Pin, 0);
-    while (gpioRead(ADC_BUSY_Pin) != 0)
-        usleep(1);
-
-    gpioWrite(self.spi_mosi_pin, 1);
-    gpioWrite(self.spi_cs_pin, 0);
+    if (spi_convert(&self) != 0)
+        return -1;
 
     unsigned* registeraddress = addresses;
     unsigned* registervalue = values;
@@ -356,70 +826,424 @@ void spi_readregisters(self_t self, unsigned count, unsigned* addresses, unsigne
         registervalue++;
     }
 
+    return 0;
 }
 
 //
-// Tell the AD7616 A/D chip to perform a conversion operation, which may be a single
-// A side and B side pair of values, or many A and B pairs, depending on whether 
-// spi_definesequence has previously been called.
-// It is up to the caller to ensure that the number of conversions read back,
-// as controlled by the count parameter, is a match for the number of conversions
-// the AD7616 chip is configured to perform in a single operation.
-//
-// Parameters:
-// self: A copy of the opaque handle that was provided by spi_initialize().
-// count: The size of the conversions array in unsigned short integers.
-//        This will read and return count number of values from the chip.
-//        If count is larger than the chip is configured to convert, most likely
-//        all excess values will be copies of the last conversion, but there
-//        are no guarantees, as this is undefined.
-// conversions: A pointer to an array of unsigned short integers to return the
-//            conversion values in.  Note that each value in the returned array
-//            will be a 32-bit value containing an A side value and a B side value.
-//
-// NOTE: The memory for the conversions array is allocated by and owned
-//       by the caller.  It is the caller's responsibility to ensure it is at
-//       least as large as indicated by count.
-//
-// Returns: Nothing.
+// Internal methods that read count registers in a burst.  spi_queuereads() appends the
+// read commands to the frames to send.  The response to each read command is clocked
+// out during the following frame, so the last read command is sent twice to collect
+// its own response, and count + 1 frames are appended.  Once the burst has been sent,
+// spi_takereads() takes the values from the frames received for those commands, and
+// stores them in the shadow.
 //
-void spi_readconversion(self_t self, unsigned count, unsigned* conversions)
+static unsigned spi_queuereads(unsigned count, const unsigned* addresses, unsigned* send)
 {
-    // Always start with a conversion.
-    gpioWrite(ADC_CONVST_Pin, 1);
-    gpioWrite(ADC_CONVST_Pin, 0);
-    while (gpioRead(ADC_BUSY_Pin) != 0)
-        usleep(1);
+    send[0] = (addresses[0] & 0x3f) << 9;
+    for (unsigned i = 0; i < count; i++)
+        send[i + 1] = (addresses[i + 1 < count ? i + 1 : i] & 0x3f) << 9;
+    return count + 1;
+}
 
-    // Instrument for elapsed time.
-    struct timespec tpStart;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &tpStart);
-    clock_t start = clock();
+static void spi_takereads(unsigned count, const unsigned* addresses, const unsigned* received, unsigned* values)
+{
+    for (unsigned i = 0; i < count; i++)
+    {
+        values[i] = received[i + 1] & 0x1ff;
+        ShadowStore(addresses[i], values[i]);
+    }
+}
+
+//
+// Write multiple values to multiple registers in a single transaction.  Unlike
+// calling spi_writeregister() once per register, this starts only one conversion,
+// and then clocks all of the write commands in one CS-framed burst.  Optionally,
+// the same burst continues with a read command for each written register, so the
+// written values can be verified without another conversion.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// count: The size of the addresses and values arrays in unsigned integers, 64 max.
+// addresses: A pointer to an array of valid register addresses (2-7 and 32-63)
+//            for registers within the AD7616 chip.
+// values:    A pointer to an array of 9-bit values to write to the registers.
+// readback:  A pointer to an array to return the values read back from the
+//            registers, or NULL to skip verification.  Without verification, registers
+//            known to hold their value already are left out, and if none is left, no
+//            conversion is started.
+//
+// NOTE: The memory for the addresses, values and readback arrays is allocated by
+//       and owned by the caller.  It is the caller's responsibility to ensure they
+//       are at least as large as indicated by count.
+//
+// Returns: The number of registers whose read back value did not match the value
+//          written, or 0 when readback is NULL.  -1 if count is too large, or if the
+//          conversion timed out or the spidev transfer failed.
+//
+#define RegisterAddressCount 64
+int spi_writeregisters(self_t self, unsigned count, unsigned* addresses, unsigned* values, unsigned* readback)
+{
+    if (count > RegisterAddressCount)
+    {
+        printf("spi_writeregisters cannot write %d registers, %d max\n", count, RegisterAddressCount);
+        return -1;
+    }
+    // Unless they are to be verified, only write the registers that change.
+    unsigned changedaddresses[RegisterAddressCount];
+    unsigned changedvalues[RegisterAddressCount];
+    if (readback == NULL)
+    {
+        unsigned changed = 0;
+        for (unsigned i = 0; i < count; i++)
+        {
+            if (!ShadowMatches(addresses[i], values[i]))
+            {
+                changedaddresses[changed] = addresses[i];
+                changedvalues[changed] = values[i];
+                changed++;
+            }
+        }
+        if (PRINT_DIAG(self) && changed < count)
+            printf("%d of %d registers already hold their values, writes skipped\n", count - changed, count);
+        count = changed;
+        addresses = changedaddresses;
+        values = changedvalues;
+    }
+    if (count == 0)
+        return 0;
+
+    // Always start with a conversion, but only one for the whole batch.
+    if (PRINT_DIAG(self))
+        printf("Starting Write to %d registers with a conversion\n", count);
+    if (spi_convert(&self) != 0)
+        return -1;
+
+    // Instrument for elapsed time.
+    struct timespec tpStart;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tpStart);
+
+    unsigned send[FRAMES_MAX];
+    unsigned received[FRAMES_MAX];
+    unsigned frames = 0;
+    for (unsigned i = 0; i < count; i++)
+        send[frames++] = ((addresses[i] & 0x3f) | 0x40) << 9 | (values[i] & 0x1ff);
+    if (readback != NULL)
+        frames += spi_queuereads(count, addresses, &send[frames]);
+    if (spi_transferframes(&self, frames, send, received) != 0)
+    {
+        spi_idle(&self);
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++)
+        ShadowStore(addresses[i], values[i]);
+
+    int mismatches = 0;
+    if (readback != NULL)
+    {
+        spi_takereads(count, addresses, &received[count], readback);
+        for (unsigned i = 0; i < count; i++)
+        {
+            if (readback[i] != (values[i] & 0x1ff))
+            {
+                mismatches++;
+                if (PRINT_DIAG(self))
+                    printf("Register %d verify failed, wrote %03x, read %03x\n", addresses[i], values[i] & 0x1ff, readback[i]);
+            }
+        }
+    }
+
+    spi_idle(&self);
+
+    if (PRINT_DIAG(self))
+    {
+        // Instrument for elapsed time.
+        struct timespec tpEnd;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &tpEnd);
+        long tpElapsed = ((tpEnd.tv_sec-tpStart.tv_sec)*(1000*1000*1000) + (tpEnd.tv_nsec-tpStart.tv_nsec)) / 1000 ;
+
+        printf("%d register writes done in %lu us, %d verify failures\n\n", count, tpElapsed, mismatches);
+    }
+
+    return mismatches;
+}
+
+//
+// Read every general-purpose and sequencer stack register back from the chip, after
+// one conversion and in one CS-framed burst, and compare each with the value the
+// driver's shadow holds for it.  This is the only time registers the driver already
+// knows are read from the chip, so call it after configuring, to confirm the chip
+// holds the configuration.  Afterwards, the shadow holds what was read.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+//
+// Returns: The number of known registers that did not hold the value the driver
+//          expected, 0 on success, or -1 if the conversion timed out or the spidev
+//          transfer failed, and nothing was read.
+//
+int spi_verifyregisters(self_t self)
+{
+    unsigned addresses[6 + 32];
+    unsigned expected[6 + 32];
+    unsigned known[6 + 32];
+    unsigned values[6 + 32];
+    unsigned count = 0;
+    for (unsigned address = REGISTER_CONFIGURATION; address <= REGISTER_RANGEB_4_7; address++)
+        addresses[count++] = address;
+    for (unsigned i = 0; i < 32; i++)
+        addresses[count++] = REGISTER_SEQUENCER + i;
+    for (unsigned i = 0; i < count; i++)
+    {
+        known[i] = ShadowKnown(addresses[i]);
+        expected[i] = RegisterShadow[addresses[i]];
+    }
+
+    if (spi_convert(&self) != 0)
+        return -1;
+
+    unsigned send[6 + 32 + 1];
+    unsigned received[6 + 32 + 1];
+    unsigned frames = spi_queuereads(count, addresses, send);
+    int status = spi_transferframes(&self, frames, send, received);
+    spi_idle(&self);
+    if (status != 0)
+        return -1;
+    spi_takereads(count, addresses, received, values);
+
+    int mismatches = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (known[i] && values[i] != expected[i])
+        {
+            mismatches++;
+            if (PRINT_DIAG(self))
+                printf("Register %d verify failed, expected %03x, read %03x\n", addresses[i], expected[i], values[i]);
+        }
+    }
+    if (PRINT_DIAG(self))
+        printf("%d registers read back, %d verify failures\n", count, mismatches);
+    return mismatches;
+}
+
+//
+// Internal method that builds the readout wave for bits SCLK cycles, unless it is built
+// already.  CS falls, SCLK falls and rises once per bit, and CS rises, each a phase apart.
+//
+// Returns: 0 on success, or the pigpio error.
+//
+static int BuildCaptureWave(self_t* self, unsigned bits)
+{
+    if (CaptureWave >= 0 && CaptureWaveBits == bits)
+        return 0;
+    if (CaptureWave >= 0)
+        gpioWaveDelete(CaptureWave);
+    CaptureWave = -1;
+
+    static gpioPulse_t pulses[2 * CAPTURE_MAX_BITS + 2];
+    unsigned count = 0;
+    pulses[count++] = (gpioPulse_t){ 0, 1 << self->spi_cs_pin, CAPTURE_HALF_us };
+    for (unsigned bit = 0; bit < bits; bit++)
+    {
+        pulses[count++] = (gpioPulse_t){ 0, 1 << self->spi_sclk_pin, CAPTURE_HALF_us };
+        pulses[count++] = (gpioPulse_t){ 1 << self->spi_sclk_pin, 0, CAPTURE_HALF_us };
+    }
+    pulses[count++] = (gpioPulse_t){ 1 << self->spi_cs_pin, 0, CAPTURE_HALF_us };
+
+    gpioWaveAddNew();
+    int result = gpioWaveAddGeneric(count, pulses);
+    if (result < 0)
+        return result;
+    result = gpioWaveCreate();
+    if (result < 0)
+        return result;
+    CaptureWave = result;
+    CaptureWaveBits = bits;
+    return 0;
+}
+
+//
+// Internal method that reads the conversion results, and the CRC word if crc is set,
+// with the capture transport.  The acquisition thread sleeps while DMA clocks the bits.
+//
+// Returns: 0 on success, or -1 if the wave could not be sent, or the samples did not
+//          arrive or did not hold every bit.
+//
+static int spi_capturereadout(self_t* self, unsigned count, unsigned* conversions, unsigned* crc)
+{
+    unsigned bits = count * 32 + (crc != NULL ? 16 : 0);
+    if (bits > CAPTURE_MAX_BITS || BuildCaptureWave(self, bits) != 0)
+        return -1;
+
+    CaptureCount = 0;
+    CaptureSeenLow = 0;
+    while (sem_trywait(&CaptureSemaphore) == 0)
+        ;
+    CaptureStartTick = gpioTick();
+    CaptureArmed = 1;
+    if (gpioWaveTxSend(CaptureWave, PI_WAVE_MODE_ONE_SHOT) < 0)
+    {
+        CaptureArmed = 0;
+        return -1;
+    }
 
-    gpioWrite(self.spi_mosi_pin, 1);
-    gpioWrite(self.spi_cs_pin, 0);
+    struct timespec tpTimeout;
+    clock_gettime(CLOCK_REALTIME, &tpTimeout);
+    unsigned long long timeout_ns = (unsigned long long)tpTimeout.tv_nsec +
+        ((unsigned long long)(2 * bits + 2) * CAPTURE_HALF_us + CAPTURE_MARGIN_ms * 1000) * 1000;
+    tpTimeout.tv_sec += timeout_ns / (1000 * 1000 * 1000);
+    tpTimeout.tv_nsec = timeout_ns % (1000 * 1000 * 1000);
+    int arrived = (sem_timedwait(&CaptureSemaphore, &tpTimeout) == 0);
+    CaptureArmed = 0;
+    if (!arrived)
+        return -1;
+
+    uint32_t words[(CAPTURE_MAX_BITS + 31) / 32];
+    if (capture_decode(CaptureSamples, CaptureCount, CapturePins, words, bits) != bits)
+        return -1;
+    for (unsigned i = 0; i < count; i++)
+        conversions[i] = words[i];
+    if (crc != NULL)
+        *crc = words[count] >> 16;
+    return 0;
+}
 
-    unsigned* conversion = conversions;
-    for (unsigned _ = 0; _ < count; _++)
+//
+// Internal method that clocks the conversion results out of the chip once BUSY
+// has dropped, over the selected transport.  It does not touch CONVST, so it may be
+// used while a hardware timer owns that pin.  The CS, SCLK and MOSI pins are returned
+// to idle state.  The hardware timer's wave leaves no room for the capture wave, so
+// with TRIGGER_HARDWARE the capture transport reads bit-banged.
+//
+// Parameters:
+// crc: Nonzero to clock out the CRC word that follows the results when CRCEN is
+//      set, and check it against the A and B results, in the order read.
+//
+// Returns: 0 on success, or -1 if the CRC did not match.
+//
+static int spi_readout(self_t* self, unsigned count, unsigned* conversions, int crc)
+{
+    unsigned received = 0;
+    if (Transport == TRANSPORT_SPIDEV || (Transport == TRANSPORT_CAPTURE && TriggerMode == TRIGGER_SOFTWARE))
+    {
+        // The whole sequence, with its CRC, is one SPI message or one wave.  If it fails,
+        // the frame is zeros, and counts as a CRC error when the CRC is checked.
+        int failed = (Transport == TRANSPORT_SPIDEV)
+            ? spidev_readsequence(&Spidev, count, conversions, crc ? &received : NULL)
+            : spi_capturereadout(self, count, conversions, crc ? &received : NULL);
+        if (failed)
+        {
+            if (PRINT_DIAG(*self) || debug)
+                printf("%s read of %d conversions failed\n", (Transport == TRANSPORT_SPIDEV) ? "spidev" : "Capture", count);
+            memset(conversions, 0, count * sizeof(*conversions));
+            if (crc)
+            {
+                CrcErrors++;
+                return -1;
+            }
+        }
+    }
+    else
     {
-        unsigned result = 0;
-        unsigned bitmask = 1 << 31;
+        gpioWrite(self->spi_mosi_pin, 1);
+        gpioWrite(self->spi_cs_pin, 0);
+
+        unsigned* conversion = conversions;
+        for (unsigned _ = 0; _ < count; _++)
+        {
+            unsigned result = 0;
+            unsigned bitmask = 1 << 31;
+
+            gpioWrite(self->spi_mosi_pin, 0);
+            for (unsigned __ = 0; __ < 32; __++)
+            {
+                gpioWrite(self->spi_sclk_pin, 0);
+                if (spi_readmiso(self) != 0)
+                    result |= bitmask;
+                gpioWrite(self->spi_sclk_pin, 1);
+
+                bitmask = bitmask >> 1;
+            }
 
-        gpioWrite(self.spi_mosi_pin, 0);
-        for (unsigned __ = 0; __ < 32; __++)
+            *conversion = result;
+            conversion++;
+        }
+
+        if (crc)
         {
-            gpioWrite(self.spi_sclk_pin, 0);
-            if (gpioRead(self.spi_miso_pin) != 0)
-                result |= bitmask;
-            gpioWrite(self.spi_sclk_pin, 1);
+            for (unsigned bitmask = 1 << 15; bitmask != 0; bitmask >>= 1)
+            {
+                gpioWrite(self->spi_sclk_pin, 0);
+                if (spi_readmiso(self) != 0)
+                    received |= bitmask;
+                gpioWrite(self->spi_sclk_pin, 1);
+            }
+        }
+
+        gpioWrite(self->spi_cs_pin, 1);
+        gpioWrite(self->spi_sclk_pin, 1);
+        gpioWrite(self->spi_mosi_pin, 0);
+    }
 
-            bitmask = bitmask >> 1;
+    int status = 0;
+    if (crc)
+    {
+        unsigned expected = 0;
+        for (unsigned i = 0; i < count; i++)
+            expected = Crc16(Crc16(expected, conversions[i] >> 16), conversions[i]);
+        CrcExpected = expected;
+        CrcRead = received;
+        if (received != expected)
+        {
+            CrcErrors++;
+            status = -1;
         }
+    }
+    return status;
+}
 
-        *conversion = result;
-        conversion++;
+//
+// Tell the AD7616 A/D chip to perform a conversion operation, which may be a single
+// A side and B side pair of values, or many A and B pairs, depending on whether 
+// spi_definesequence has previously been called.
+// It is up to the caller to ensure that the number of conversions read back,
+// as controlled by the count parameter, is a match for the number of conversions
+// the AD7616 chip is configured to perform in a single operation.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// count: The size of the conversions array in unsigned short integers.
+//        This will read and return count number of values from the chip.
+//        If count is larger than the chip is configured to convert, most likely
+//        all excess values will be copies of the last conversion, but there
+//        are no guarantees, as this is undefined.
+// conversions: A pointer to an array of unsigned short integers to return the
+//            conversion values in.  Note that each value in the returned array
+//            will be a 32-bit value containing an A side value and a B side value.
+//
+// NOTE: The memory for the conversions array is allocated by and owned
+//       by the caller.  It is the caller's responsibility to ensure it is at
+//       least as large as indicated by count.
+//
+// Returns: 0 on success, -1 if the conversion timed out and nothing was read, or
+//          -2 if CRC checking is on and the CRC did not match.  The conversions are
+//          returned even then.
+//
+int spi_readconversion(self_t self, unsigned count, unsigned* conversions)
+{
+    // Always start with a conversion.
+    if (spi_convert(&self) != 0)
+    {
+        spi_idle(&self);
+        return -1;
     }
 
+    // Instrument for elapsed time.
+    struct timespec tpStart;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tpStart);
+    clock_t start = clock();
+
+    int status = spi_readout(&self, count, conversions, CrcMode != CRC_OFF) == 0 ? 0 : -2;
+
     spi_idle(&self);
 
     if (PRINT_DIAG(self))
@@ -432,7 +1256,259 @@ void spi_readconversion(self_t self, unsigned count, unsigned* conversions)
         long tpElapsed = ((tpEnd.tv_sec-tpStart.tv_sec)*(1000*1000*1000) + (tpEnd.tv_nsec-tpStart.tv_nsec)) / 1000 ;
 
         printf("%d conversions used %lf ms CPU, done in %lu us\n\n", count, elapsed * 1000.0 / (double)CLOCKS_PER_SEC, tpElapsed);
+        if (status != 0)
+            printf("Conversion CRC %04x, expected %04x\n", CrcRead, CrcExpected);
+    }
+
+    return status;
+}
+
+//
+// Select the strategy used to wait for BUSY to drop after each conversion is started.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// mode: BUSYWAIT_SPIN, BUSYWAIT_DELAY or BUSYWAIT_ALERT.
+// timeout_us: The longest time to wait for BUSY to drop, in microseconds.
+//             Conversions that take longer are reported and abandoned.
+//
+// NOTE: With BUSYWAIT_DELAY, the delay is calibrated against the current sequence
+//       and oversampling ratio, so call this after spi_definesequence() and after
+//       configuring oversampling.  It is calibrated again by spi_start().
+//
+// Returns: Nothing.
+//
+void spi_setbusywait(self_t self, unsigned mode, unsigned timeout_us)
+{
+    BusyWaitMode = (mode <= BUSYWAIT_ALERT) ? mode : BUSYWAIT_SPIN;
+    if (timeout_us > 0)
+        BusyTimeout_us = timeout_us;
+
+    gpioSetAlertFunc(ADC_BUSY_Pin, (BusyWaitMode == BUSYWAIT_ALERT) ? BusyAlert : NULL);
+    if (BusyWaitMode == BUSYWAIT_DELAY)
+        spi_calibratebusywait(&self, spi_readregister(self, 2));
+
+    if (PRINT_DIAG(self))
+        printf("BUSY wait strategy %d, timeout %d us\n", BusyWaitMode, BusyTimeout_us);
+}
+
+//
+// Set the on-chip oversampling ratio.  The chip averages ratio conversions of each
+// channel before BUSY drops, which lowers the noise without costing the acquisition
+// thread any readout time, but lengthens every conversion by the same factor.  The
+// software average of spi_start() then averages the oversampled results.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// ratio: The oversampling ratio, a power of two from 1 (off) to 128.
+//
+// NOTE: The rest of the configuration register is kept.  With BUSYWAIT_DELAY, the
+//       delay is calibrated again for the new ratio.
+//
+// Returns: 0 on success, or -1 if the ratio is not valid or the write failed.
+//
+int spi_setoversampling(self_t self, unsigned ratio)
+{
+    unsigned bits = 0;
+    while (bits < 7 && (1u << bits) < ratio)
+        bits++;
+    if ((1u << bits) != ratio)
+    {
+        printf("Oversampling ratio %d is not a power of two from 1 to 128\n", ratio);
+        return -1;
+    }
+
+    unsigned configuration = spi_readregister(self, REGISTER_CONFIGURATION);
+    configuration = (configuration & ~CONFIGURATION_OS_MASK) | (bits << CONFIGURATION_OS_SHIFT);
+    if (spi_writeregister(self, REGISTER_CONFIGURATION, configuration) != 0)
+        return -1;
+
+    if (BusyWaitMode == BUSYWAIT_DELAY)
+        spi_calibratebusywait(&self, configuration);
+
+    if (PRINT_DIAG(self))
+        printf("Oversampling ratio %d, a conversion of the sequence takes about %llu us\n", ratio, (ConversionEstimate_ns(configuration) + 999) / 1000);
+    return 0;
+}
+
+//
+// Returns: The number of conversions that timed out waiting for BUSY to drop
+//          since spi_initialize().
+//
+unsigned spi_getbusytimeouts()
+{
+    return BusyTimeouts;
+}
+
+//
+// Select whether the CRC word the chip appends to each sequence is read and checked,
+// and what the acquisition thread does with a frame whose CRC does not match.  A bad
+// CRC means bits were misread, typically because SCLK is too fast for the wiring.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// mode: CRC_OFF, CRC_MARK to keep the frame and mark it with a crc record in the data
+//       file, CRC_DROP to leave it out, or CRC_RETRY to convert again at once, and
+//       leave the frame out if that fails too.  With hardware-timed conversions,
+//       CRC_RETRY drops.
+//
+// NOTE: Checking costs 16 SCLK cycles per frame.  CRCEN is set in the configuration
+//       register if it is not already; spi_definesequence() always sets it.
+//
+// Returns: Nothing.
+//
+void spi_setcrc(self_t self, unsigned mode)
+{
+    CrcMode = (mode <= CRC_RETRY) ? mode : CRC_MARK;
+    if (CrcMode != CRC_OFF)
+        spi_writeregister(self, REGISTER_CONFIGURATION, spi_readregister(self, REGISTER_CONFIGURATION) | CONFIGURATION_CRCEN);
+
+    if (PRINT_DIAG(self))
+        printf("CRC check mode %d\n", CrcMode);
+}
+
+//
+// Returns: The number of readouts whose CRC did not match since spi_initialize().
+//
+unsigned spi_getcrcerrors()
+{
+    return CrcErrors;
+}
+
+//
+// Set how long the driver waits after each SCLK falling edge before it samples MISO.
+// 0, the default, samples as soon as possible, for the fastest readout.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// settle: The number of extra reads of MISO, each one GPIO bus access, up to
+//         SCLK_SETTLE_MAX.  spi_scansclk() finds the least that reads reliably.
+//
+// NOTE: This only affects the bit-banged transport.
+//
+// Returns: Nothing.
+//
+void spi_setsclksettle(self_t self, unsigned settle)
+{
+    SclkSettle = (settle <= SCLK_SETTLE_MAX) ? settle : SCLK_SETTLE_MAX;
+    if (PRINT_DIAG(self))
+        printf("SCLK settle %d\n", SclkSettle);
+}
+
+//
+// Find the fastest SCLK timing that reads without errors.  The chip is switched to
+// its self-test channel, which converts to a fixed pattern on both sides, and frames
+// of that pattern are read, with the CRC, at every settle from 0 to SCLK_SETTLE_MAX.
+// The least settle from which every slower one also read all frames correctly is
+// chosen, so a marginal setting that passed by chance is not.  The configuration and
+// channel registers are restored afterwards.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// frames: The number of frames read at each settle, 1000 for a good error rate bound.
+//
+// NOTE: This cannot run while acquiring.  On-chip oversampling is turned off for the
+//       scan, so it takes about frames * 17 * 10 us.
+//
+// Returns: The settle chosen, which is now in effect, or -1 if no settle read the
+//          pattern reliably, or a conversion timed out, when the settle is unchanged.
+//
+#define SELFTEST_CHANNEL 0xb
+#define SELFTEST_PATTERN 0xaaaa5555     // The self-test channel converts to 0xaaaa on the A side and 0x5555 on the B side.
+
+int spi_scansclk(self_t self, unsigned frames)
+{
+    if (acquiring)
+    {
+        printf("spi_scansclk cannot scan SCLK timing while acquiring\n");
+        return -1;
+    }
+    if (Transport != TRANSPORT_BITBANG)
+    {
+        printf("spi_scansclk only scans the bit-banged SCLK\n");
+        return -1;
+    }
+
+    unsigned configuration = spi_readregister(self, REGISTER_CONFIGURATION);
+    unsigned channel = spi_readregister(self, REGISTER_CHANNELSEL);
+    unsigned addresses[] = { REGISTER_CONFIGURATION, REGISTER_CHANNELSEL };
+    unsigned values[] = { (configuration & ~(CONFIGURATION_BURSTEN | CONFIGURATION_SEQEN | CONFIGURATION_OS_MASK)) | CONFIGURATION_CRCEN,
+                          SELFTEST_CHANNEL << 4 | SELFTEST_CHANNEL };
+    if (spi_writeregisters(self, 2, addresses, values, NULL) != 0)
+        return -1;
+
+    unsigned previous = SclkSettle;
+    unsigned crcerrors = CrcErrors;
+    unsigned errors[SCLK_SETTLE_MAX + 1];
+    int timedout = 0;
+    for (unsigned settle = 0; settle <= SCLK_SETTLE_MAX && !timedout; settle++)
+    {
+        SclkSettle = settle;
+        errors[settle] = 0;
+        for (unsigned frame = 0; frame < frames && !timedout; frame++)
+        {
+            unsigned conversion = 0;
+            if (spi_convert(&self) != 0)
+                timedout = 1;
+            else if (spi_readout(&self, 1, &conversion, 1) != 0 || conversion != SELFTEST_PATTERN)
+                errors[settle]++;
+            spi_idle(&self);
+        }
+        if (PRINT_DIAG(self) && !timedout)
+            printf("SCLK settle %d: %d of %d self-test frames failed\n", settle, errors[settle], frames);
+    }
+    CrcErrors = crcerrors;
+
+    int chosen = -1;
+    for (int settle = SCLK_SETTLE_MAX; settle >= 0 && !timedout && errors[settle] == 0; settle--)
+        chosen = settle;
+    SclkSettle = (chosen >= 0) ? chosen : previous;
+
+    values[0] = configuration;
+    values[1] = channel;
+    spi_writeregisters(self, 2, addresses, values, NULL);
+
+    if (chosen < 0)
+        printf("SCLK timing scan found no reliable setting, keeping settle %d\n", SclkSettle);
+    else if (PRINT_DIAG(self))
+        printf("SCLK timing scan chose settle %d\n", chosen);
+    return chosen;
+}
+
+//
+// The columns of each line of the data file.  By default every A and B sample of the
+// sequence is written, all A channels first, as ChannelN.  spi_definechannels() selects
+// fewer, with names, and may write a channel converted several times per sequence in
+// several columns.  Each column's source is the pair it comes from, times two, plus 1
+// for the B side.
+//
+#define COLUMNS_MAX 64
+#define COLUMN_NAME_LENGTH 32
+#define SEQUENCE_RECORD_LENGTH 96   // "# sequence,number=%llu,step=%u,missed=%llu\n" at its longest.
+#define SAMPLE_LINE_LENGTH (SEQUENCE_RECORD_LENGTH + 42 + COLUMNS_MAX * 6 + 2)  // With the time, "%llu(%llu)", and a ",%d" per column.
+
+static unsigned ColumnCount = 0;            // Columns in each line, SequenceSize unless selected with spi_definechannels().
+static unsigned char ColumnSources[COLUMNS_MAX];
+static unsigned char ColumnStreams[COLUMNS_MAX];    // The channel each column samples, counted in column order.
+static unsigned ColumnsRepeat = 0;          // Set when a channel is written in several columns.
+static char ColumnHeader[COLUMNS_MAX * (COLUMN_NAME_LENGTH + 1) + 1];   // The column names, each preceded by a comma.
+
+//
+// Internal method that selects every sample of the sequence as a column.
+//
+static void SelectAllColumns()
+{
+    unsigned pairs = SequenceSize / 2;
+    ColumnCount = SequenceSize;
+    ColumnsRepeat = 0;
+    int headerLength = 0;
+    for (unsigned i = 0; i < ColumnCount; i++)
+    {
+        ColumnSources[i] = (i < pairs) ? i * 2 : (i - pairs) * 2 + 1;
+        ColumnStreams[i] = i;
+        headerLength += snprintf(ColumnHeader + headerLength, sizeof(ColumnHeader) - headerLength, ",Channel%d", i);
     }
+    ColumnHeader[headerLength] = '\0';
 }
 
 //
@@ -458,135 +1534,1746 @@ void spi_readconversion(self_t self, unsigned count, unsigned* conversions)
 //            combined pairwise with the A side channels in the Achannels array,
 //            so the chip will know how to convert both the A side and B side.
 //
-// NOTE: The memory for the Achannels and Bchannels arrays is allocated by and owned
-//       by the caller.  It is the caller's responsibility to ensure they are at
-//       least as large as indicated by count.
+// NOTE: The memory for the Achannels and Bchannels arrays is allocated by and owned
+//       by the caller.  It is the caller's responsibility to ensure they are at
+//       least as large as indicated by count.
+//
+// Returns: Nothing.
+//
+void spi_definesequence(self_t self, unsigned count, unsigned* Achannels, unsigned* Bchannels)
+{
+    if (count > 32)
+    {
+        printf("spi_definesequence cannot define a sequence with %d elements, 32 max\n", count);
+        return;
+    }
+
+    // The configuration register comes from the shadow, so the sequencer stack and the
+    // configuration register with BURSTEN and SEQEN set go out in one batch, and only
+    // the registers that change are written.
+    unsigned configuration = spi_readregister(self, REGISTER_CONFIGURATION);
+
+    unsigned addresses[RegisterAddressCount];
+    unsigned values[RegisterAddressCount];
+    unsigned sequencer = REGISTER_SEQUENCER;
+
+    for (unsigned i = 0; i < count; i++, sequencer++, Achannels++, Bchannels++)
+    {
+        unsigned ssren = 0;
+        if (i + 1 == count)
+            ssren = 0x100;
+
+        unsigned AChannel = (*Achannels & 0xf);
+        unsigned BChannel = (*Bchannels & 0xf);
+        unsigned channeldata = BChannel << 4 | AChannel | ssren;
+        addresses[i] = sequencer;
+        values[i] = channeldata;
+    }
+
+    SequenceSize = count * 2;
+    SelectAllColumns();
+
+    addresses[count] = REGISTER_CONFIGURATION;
+    values[count] = configuration | CONFIGURATION_BURSTEN | CONFIGURATION_SEQEN | CONFIGURATION_CRCEN;
+    if (spi_writeregisters(self, count + 1, addresses, values, NULL) != 0)
+        printf("spi_definesequence timed out writing the sequencer stack\n");
+}
+
+//
+// Internal method that lays out one side of the sequencer stack, spreading the repeats of
+// each entry as evenly as possible over the slots, as a smooth weighted round robin.  The
+// weights add up to slots, and an entry of weight k gets k slots about slots / k apart.
+//
+// Parameters:
+// entries: The number of entries.
+// weights: The number of slots of each entry.
+// slots: The number of slots, the sum of the weights.
+// layout: Receives the entry of each slot.
+//
+static void SpreadSlots(unsigned entries, const unsigned* weights, unsigned slots, unsigned* layout)
+{
+    int credit[COLUMNS_MAX] = { 0 };
+    for (unsigned slot = 0; slot < slots; slot++)
+    {
+        unsigned chosen = 0;
+        for (unsigned entry = 0; entry < entries; entry++)
+        {
+            credit[entry] += weights[entry];
+            if (credit[entry] > credit[chosen])
+                chosen = entry;
+        }
+        credit[chosen] -= slots;
+        layout[slot] = chosen;
+    }
+}
+
+//
+// Convert and store only some of the channels of a channel map, some of them several times
+// in each sample period.  The map is given as to spi_definesequence(), and mask selects its
+// columns as they would be written for the whole map: bit i, for i below count, is the A
+// side channel Achannels[i], and bit count + i is the B side channel Bchannels[i].  The
+// chip is programmed with the shortest sequence that converts each selected channel as
+// many times as asked, pairing the A side slots with the B side slots, so only those pairs
+// are clocked out, and only the selected columns are written, A side first, with the given
+// names in the header line.
+//
+// A channel converted k times is spread evenly through the sequence, and written as k
+// columns, named with .0 to .k-1 after its name, in the order converted.  A "# columns"
+// record at the start of the file then gives the stream each column belongs to, and the
+// time of its conversion after the time of the line, so a reader can put each channel's
+// samples back into one stream with correct times.
+//
+// For example, with the board's 8-pair map, a rake with thermistors on columns 2, 6, 10
+// and 14 is converted as 2 pairs instead of 8, and written as 4 columns instead of 16.
+// Converting the two at the interface, columns 10 and 14, 4 times each takes 4 pairs.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// count: The number of pairs in the map, up to 16.
+// Achannels: The A side channels of the map.
+// Bchannels: The B side channels of the map.
+// mask: The columns to convert and store.
+// repeats: The number of times to convert each selected column in each sample period, in
+//          order, or NULL to convert each once.  Each side may have up to 32 in all.
+// names: The names of the selected columns, in order, separated by commas, or NULL or
+//        an empty string to name them ChannelN, where N is the column in the whole map.
+//        Columns past the last name are named that way too.  Names are cut to fit
+//        COLUMN_NAME_LENGTH - 1 characters with their repeat suffix.
+//
+// NOTE: When the A and B sides have different numbers of slots, the shorter side fills
+//       them with its last channel, or the map's first if none, and those samples are
+//       read but not written.
+//
+// Returns: The number of columns written, or -1 if count, mask or repeats is not valid.
+//
+int spi_definechannels(self_t self, unsigned count, unsigned* Achannels, unsigned* Bchannels, unsigned mask, unsigned* repeats, const char* names)
+{
+    if (count == 0 || count > 16 || (count < 16 && (mask >> (2 * count)) != 0) || mask == 0)
+    {
+        printf("spi_definechannels cannot select columns %x of a %d pair map\n", mask, count);
+        return -1;
+    }
+
+    // The selected columns of each side, with their channels and repeats.  The last entry
+    // of each side stands for the slots it leaves over, which are not written.
+    unsigned channels[2][17], columns[2][17], weights[2][17];
+    unsigned entries[2] = { 0, 0 }, slots[2] = { 0, 0 };
+    unsigned selected = 0;
+    for (unsigned column = 0; column < 2 * count; column++)
+    {
+        if (!(mask & (1u << column)))
+            continue;
+        unsigned side = (column < count) ? 0 : 1;
+        unsigned repeat = (repeats != NULL && repeats[selected] > 0) ? repeats[selected] : 1;
+        channels[side][entries[side]] = side ? Bchannels[column - count] : Achannels[column];
+        columns[side][entries[side]] = column;
+        weights[side][entries[side]] = repeat;
+        entries[side]++;
+        slots[side] += repeat;
+        selected++;
+    }
+    unsigned pairs = (slots[0] > slots[1]) ? slots[0] : slots[1];
+    if (pairs > 32)
+    {
+        printf("spi_definechannels cannot convert %d slots in the 32 pair sequencer\n", pairs);
+        return -1;
+    }
+
+    // Lay out both sides, and program the chip.
+    unsigned layout[2][32];
+    unsigned sequence[2][32];
+    for (unsigned side = 0; side < 2; side++)
+    {
+        unsigned filler = (entries[side] > 0) ? channels[side][entries[side] - 1] : (side ? Bchannels[0] : Achannels[0]);
+        channels[side][entries[side]] = filler;
+        weights[side][entries[side]] = pairs - slots[side];
+        SpreadSlots(entries[side] + 1, weights[side], pairs, layout[side]);
+        for (unsigned slot = 0; slot < pairs; slot++)
+            sequence[side][slot] = channels[side][layout[side][slot]];
+    }
+    spi_definesequence(self, pairs, sequence[0], sequence[1]);
+
+    // Name the selected columns in order, ChannelN where no name is given.
+    char entrynames[2][16][COLUMN_NAME_LENGTH];
+    const char* name = (names != NULL && names[0] != '\0') ? names : NULL;
+    for (unsigned side = 0; side < 2; side++)
+    {
+        for (unsigned entry = 0; entry < entries[side]; entry++)
+        {
+            if (name == NULL || *name == '\0')
+                snprintf(entrynames[side][entry], COLUMN_NAME_LENGTH, "Channel%d", columns[side][entry]);
+            else
+            {
+                size_t length = strcspn(name, ",\n");
+                snprintf(entrynames[side][entry], COLUMN_NAME_LENGTH, "%.*s", (int)length, name);
+                name += length;
+                if (*name == ',')
+                    name++;
+            }
+        }
+    }
+
+    // Write each selected channel's slots in the order converted, A side first.
+    ColumnCount = 0;
+    ColumnsRepeat = 0;
+    int headerLength = 0;
+    unsigned stream = 0;
+    for (unsigned side = 0; side < 2; side++)
+    {
+        for (unsigned entry = 0; entry < entries[side]; entry++, stream++)
+        {
+            unsigned occurrence = 0;
+            for (unsigned slot = 0; slot < pairs; slot++)
+            {
+                if (layout[side][slot] != entry)
+                    continue;
+                ColumnSources[ColumnCount] = slot * 2 + side;
+                ColumnStreams[ColumnCount] = stream;
+                ColumnCount++;
+                if (weights[side][entry] == 1)
+                    headerLength += snprintf(ColumnHeader + headerLength, sizeof(ColumnHeader) - headerLength, ",%s", entrynames[side][entry]);
+                else
+                {
+                    int suffix = snprintf(NULL, 0, ".%d", occurrence);
+                    headerLength += snprintf(ColumnHeader + headerLength, sizeof(ColumnHeader) - headerLength, ",%.*s.%d",
+                                             COLUMN_NAME_LENGTH - 1 - suffix, entrynames[side][entry], occurrence);
+                    ColumnsRepeat = 1;
+                }
+                occurrence++;
+            }
+        }
+    }
+    ColumnHeader[headerLength] = '\0';
+
+    if (PRINT_DIAG(self))
+        printf("Selected %d columns in %d pairs:%s\n", ColumnCount, pairs, ColumnHeader);
+    return ColumnCount;
+}
+
+//
+// Restore a complete register image in a single verified transaction, in place of
+// setting the input ranges, calling spi_definesequence() and setting the configuration
+// register one step at a time.  This lets a program that boots straight into acquisition
+// replay the image it read back, with spi_readregisters(), after the last run was
+// configured, and start sampling sooner.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// count: The number of registers in the image, up to RegisterAddressCount.
+// addresses: The register addresses.  Registers are written in this order, so the
+//            sequencer stack registers should come before the configuration register.
+// values: The 9-bit value for each register.
+//
+// NOTE: The sequence size used by spi_start() is taken from the sequencer stack
+//       registers in the image, up to the first with SSREN set.
+//
+// Returns: The number of registers that did not verify, 0 on success, or -1 if the
+//          conversion timed out and nothing was written.
+//
+int spi_loadregisters(self_t self, unsigned count, unsigned* addresses, unsigned* values)
+{
+    if (count > RegisterAddressCount)
+        return -1;
+
+    unsigned readback[RegisterAddressCount];
+    int failed = spi_writeregisters(self, count, addresses, values, readback);
+    if (failed != 0)
+        return failed;
+
+    unsigned pairs = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (addresses[i] >= REGISTER_SEQUENCER && addresses[i] < REGISTER_SEQUENCER + 32)
+        {
+            pairs = addresses[i] - REGISTER_SEQUENCER + 1;
+            if (values[i] & 0x100)
+                break;
+        }
+    }
+    SequenceSize = pairs * 2;
+    SelectAllColumns();
+    return 0;
+}
+
+//
+// Perform a conversion on a single A side and B side channel pair.
+//
+// Warning: This method can only be used before any calls to spi_definesequence().
+//          After calling spi_definesequence() at least once, the AD7616 chip will
+//          be configured to take its channel from the sequencer stack registers,
+//          rather than those provided in this call.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// channelA: The A side channel to convert.  The A side channel will be
+//            combined with the B side channel, so the chip will know how to 
+//            convert both the A side and B side.
+// channelB: The B side channel to convert.  The B side channel will be
+//            combined with the A side channel, so the chip will know how to 
+//            convert both the A side and B side.
+//
+// NOTE: The returned value will be a 32-bit value containing an A side value and a B side value.
+//
+// Returns: The converted A side and B side channels, with A side in the high word.
+//
+unsigned spi_convertpair(self_t self, unsigned channelA, unsigned channelB)
+{
+    unsigned channeldata = (channelB & 0xf) << 4 | (channelA & 0xf);
+    spi_writeregister(self, REGISTER_CHANNELSEL, channeldata);
+
+    unsigned conversion = 0;
+    spi_readconversion(self, 1, &conversion);
+
+    return conversion;
+}
+
+//
+// Select how conversions are started while the background data acquisition thread
+// is running.  By default (TRIGGER_SOFTWARE), the thread pulses CONVST itself on
+// each tick of its own clock, so the sample instant jitters with scheduler wakeups.
+// With TRIGGER_HARDWARE, a repeating pigpio waveform drives CONVST from the DMA
+// hardware timer, and the thread only reacts to the BUSY falling edge to read the
+// conversion out.  Each frame is then stamped with the pigpio tick of that edge.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// mode: TRIGGER_SOFTWARE or TRIGGER_HARDWARE.
+//
+// NOTE: This must be called before spi_start() to have any effect.
+//
+// Returns: Nothing.
+//
+#define CONVST_PULSE_us 2       // Width of the hardware-timed CONVST pulse.
+
+void spi_settrigger(self_t self, unsigned mode)
+{
+    TriggerMode = (mode == TRIGGER_HARDWARE) ? TRIGGER_HARDWARE : TRIGGER_SOFTWARE;
+    if (PRINT_DIAG(self))
+        printf("Conversion trigger set to %s\n", TriggerMode == TRIGGER_HARDWARE ? "hardware" : "software");
+}
+
+//
+// Build and start a repeating waveform that pulses CONVST once per period.
+//
+// Returns: The pigpio wave id, or a negative pigpio error code.
+//
+static int StartConversionWave(unsigned long long period_us)
+{
+    gpioPulse_t pulse[2];
+
+    pulse[0].gpioOn = 1 << ADC_CONVST_Pin;
+    pulse[0].gpioOff = 0;
+    pulse[0].usDelay = CONVST_PULSE_us;
+
+    pulse[1].gpioOn = 0;
+    pulse[1].gpioOff = 1 << ADC_CONVST_Pin;
+    pulse[1].usDelay = period_us - CONVST_PULSE_us;
+
+    gpioWaveClear();
+    CaptureWave = -1;
+    int result = gpioWaveAddGeneric(2, pulse);
+    if (result < 0)
+        return result;
+
+    int wave_id = gpioWaveCreate();
+    if (wave_id < 0)
+        return wave_id;
+
+    result = gpioWaveTxSend(wave_id, PI_WAVE_MODE_REPEAT);
+    if (result < 0)
+    {
+        gpioWaveDelete(wave_id);
+        return result;
+    }
+
+    return wave_id;
+}
+
+//
+// The worker thread that does the background data acquisition and file capture.
+//
+// In this version, both function are performed in one thread.  The file capture
+// adds to the overall time spent in this thread, impacting the fastest data capture rate.
+// If we need a faster data capture rate, we should consider splitting the data
+// capture into its own thread.
+//
+// To get info on how long the conversion is taking, uncommnet the line below following DIAGNOSTIC.
+//
+// Parameters:
+// vargp: Per POSIX, an opaque pointer to the arguments for the thread.
+//
+// Returns: An opaque pointer to the returned value.  Currently NULL.
+//
+#define FilePathLength 1000
+static char TimeColumnName[FilePathLength];             // Column header for time stamp column.
+static char AcquisitionFilePath[FilePathLength];        // Full path to filename.
+static unsigned long long AcquisitionPeriod_ms = 10;    // Set by Start().
+static unsigned AverageCount = 1;                       // Set by Start().
+static int quit = 0;                                    // Cleared by Start(), set by Stop().  The thread stops when set.
+
+static unsigned averageBuffer[COLUMNS_MAX];             // Running sums of each channel over AverageCount frames.
+static unsigned averageIndex = 1;                       // Frames left before the averaged sample line is written.
+static unsigned long long FirstSample_ns = 0;           // CLOCK_BOOTTIME of the first frame since Start(), 0 until then.
+static unsigned long long LastSequence = 0;             // Sequence number of the last sample line written.
+static int SequenceWritten = 0;                         // Set once a sequence record has been written.
+
+static unsigned JournalEnabled = 0;                     // Set by spi_setjournal().
+static unsigned JournalFlush_ms = 1000;                 // Set by spi_setjournal().
+static journal_t Journal = { .fd = -1 };                // Open while a journaled acquisition is running.
+static unsigned long long JournalFlushed_ns = 0;        // Time of the last journal flush.
+
+static unsigned OverviewEnabled = 1;                    // Set by spi_setoverview().
+static overview_t Overview;                             // Summaries of the buckets being filled.
+static char OverviewPath[FilePathLength + sizeof(OVERVIEW_EXTENSION)];
+static int OverviewActive = 0;                          // Set while the overview sidecar is being written.
+static char OverviewRecords[OVERVIEW_MAX_OUTPUT];      // Finished records; static, the thread's stack is small.
+
+static unsigned ClockPeriod_ms = 10000;                 // Set by spi_setclockrecords(), 0 for no clock records.
+static unsigned RtcEnabled = 1;                         // Set by spi_setclockrecords().
+static unsigned long long NextClock_ns = 0;             // CLOCK_MONOTONIC_RAW when the next clock record is due.
+static unsigned long long ClockOrigin_ns = 0;           // CLOCK_MONOTONIC_RAW at time column 0, as last recorded.
+static int ClockRecorded = 0;                           // Set once a clock record has been written.
+static int RtcHandle = -1;                              // pigpio I2C handle of the RTC, open while acquiring.
+static unsigned long long RtcNext_ns = 0;               // CLOCK_MONOTONIC_RAW when the next RTC edge may be timed.
+static unsigned long long RtcEdge_ns = 0;               // CLOCK_MONOTONIC_RAW of the last RTC edge timed, 0 if none.
+
+static char TelemetryPath[FilePathLength] = "";         // Set by spi_settelemetry(), empty for no telemetry.
+static unsigned TelemetryInterval_ms = 100;             // Set by spi_settelemetry().
+static telemetry_t Telemetry;                           // Summary of the interval being filled.
+static telemetryserver_t TelemetryServer = { .fd = -1 };
+static int TelemetryActive = 0;                         // Set while the telemetry socket is open.
+static char TelemetryFrame[TELEMETRY_MAX_FRAME];        // Frame message; static, the thread's stack is small.
+static unsigned long long TelemetryStart_ns = 0;        // CLOCK_MONOTONIC_RAW when the telemetry socket was opened.
+static unsigned long long LinesWritten = 0;             // Sample lines handed to the writer, updated atomically.
+static unsigned long long FramesMissed = 0;             // Frames missed, from the sequence records, updated atomically.
+
+//
+// Select whether the background data acquisition thread writes through a crash-safe
+// write-ahead journal.  Without the journal, the writer thread opens, appends and closes
+// the file every WRITER_PERIOD_ms, which leaves little at risk.  With the
+// journal, sample lines are buffered into checksummed, sequence-numbered blocks in
+// "<file>.journal", which are written as they fill, and forced to disk every flush_ms.
+// On a clean Stop(), the acquisition file is rebuilt from the journal and the journal
+// is removed.  After a power loss, the trake_recover tool does the same, recovering
+// everything up to the last good block.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// enabled: Nonzero to write through the journal.
+// flush_ms: The longest time buffered data may wait before it is forced to disk.
+//
+// NOTE: This must be called before spi_start() to have any effect.
+//
+// Returns: Nothing.
+//
+void spi_setjournal(self_t self, unsigned enabled, unsigned flush_ms)
+{
+    JournalEnabled = enabled;
+    if (flush_ms > 0)
+        JournalFlush_ms = flush_ms;
+    if (PRINT_DIAG(self))
+        printf("Journal %s, flushed every %d ms\n", JournalEnabled ? "enabled" : "disabled", JournalFlush_ms);
+}
+
+//
+// Select whether the background data acquisition thread writes an overview of the
+// acquisition file next to it, in "<file>.ovr", with the minimum, maximum and mean of
+// each channel over every second, minute and hour.  Plotting tools and the reader
+// library use it to show a whole deployment without reading every sample.  The overview
+// is on by default.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// enabled: Nonzero to write the overview.
+//
+// NOTE: This must be called before spi_start() to have any effect.
+//
+// Returns: Nothing.
+//
+void spi_setoverview(self_t self, unsigned enabled)
+{
+    OverviewEnabled = enabled;
+    if (PRINT_DIAG(self))
+        printf("Overview %s\n", OverviewEnabled ? "enabled" : "disabled");
+}
+
+//
+// Select how often the background data acquisition thread writes clock records into
+// the acquisition file.  The time column is only relative, so each record pairs a point
+// of the time column with CLOCK_MONOTONIC_RAW and CLOCK_REALTIME, read back to back, and
+// the writer thread adds records timing the edges of the RTC's seconds, read over I2C.
+// Afterwards, the samples of each file can be placed on UTC, and the files of several
+// rakes aligned, to well under a millisecond.  See the data file format document.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// period_ms: The time between clock records, or 0 for none.  The default is 10 seconds.
+// rtc: Nonzero to also time the edges of the RTC's seconds, which is the default.
+//
+// NOTE: This must be called before spi_start() to have any effect.
+//
+// Returns: Nothing.
+//
+void spi_setclockrecords(self_t self, unsigned period_ms, unsigned rtc)
+{
+    ClockPeriod_ms = period_ms;
+    RtcEnabled = rtc;
+    if (PRINT_DIAG(self))
+        printf("Clock records every %d ms, RTC %s\n", ClockPeriod_ms, RtcEnabled ? "enabled" : "disabled");
+}
+
+//
+// Publish live telemetry of the acquisition on a local Unix domain socket: every
+// interval_ms, the last sample line with the minimum, maximum and mean of each channel
+// over the interval, and every second the health counters of the acquisition and
+// writer threads.  trake_monitor.py shows them.  Sending never blocks; a client that
+// does not keep up misses messages.  See trake_telemetry.h for the protocol.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// path: The path of the socket, or NULL or an empty string for no telemetry, which is
+//       the default.
+// interval_ms: The time between frame messages.  The default is 100 ms.
+//
+// NOTE: This must be called before spi_start() to have any effect.  Telemetry is sent
+// by the writer thread, so there is none if it cannot be started.
+//
+// Returns: Nothing.
+//
+void spi_settelemetry(self_t self, const char* path, unsigned interval_ms)
+{
+    snprintf(TelemetryPath, sizeof(TelemetryPath), "%s", path != NULL ? path : "");
+    if (interval_ms > 0)
+        TelemetryInterval_ms = interval_ms;
+    if (PRINT_DIAG(self))
+        printf("Telemetry %s%s, every %d ms\n", TelemetryPath[0] != '\0' ? "on " : "disabled", TelemetryPath, TelemetryInterval_ms);
+}
+
+//
+// Internal method used by the writer thread, or by the acquisition thread when there
+// is no writer thread, to append data to the acquisition file, either directly or
+// through the journal.
+//
+static void StoreAcquisitionData(const char* data, unsigned length)
+{
+    if (Journal.fd >= 0)
+    {
+        if (journal_append(&Journal, data, length) != 0 && debug)
+            printf("Journal write failed: %m\n");
+        return;
+    }
+
+    // Open the previous file and append to it.  Always close the file to flush to disk.
+    FILE* acquisitionFile = fopen(AcquisitionFilePath, "a");
+    if (acquisitionFile != NULL)
+    {
+        fwrite(data, 1, length, acquisitionFile);
+        fclose(acquisitionFile);
+    }
+}
+
+//
+// Internal method used by the writer thread, or by the acquisition thread when there
+// is no writer thread, to append overview records to the overview sidecar file.
+//
+static void StoreOverviewData(const char* data, unsigned length)
+{
+    FILE* overviewFile = fopen(OverviewPath, "a");
+    if (overviewFile != NULL)
+    {
+        fwrite(data, 1, length, overviewFile);
+        fclose(overviewFile);
+    }
+}
+
+//
+// Internal method to force journaled data to disk once every JournalFlush_ms.
+//
+static void FlushJournal(unsigned long long now_ns)
+{
+    if (Journal.fd >= 0 && now_ns - JournalFlushed_ns >= JournalFlush_ms * (unsigned long long)(1000*1000))
+    {
+        if (journal_flush(&Journal, 1) != 0 && debug)
+            printf("Journal flush failed: %m\n");
+        JournalFlushed_ns = now_ns;
+    }
+}
+
+//
+// The writer thread.  Formatting a sample line is cheap, but opening and closing the
+// acquisition file, writing journal blocks, and above all forcing them to disk can
+// stall for milliseconds on an SD card.  So the acquisition thread only copies each
+// line into WriteBuffer, and a writer thread at normal priority, optionally on its own
+// CPU, stores and flushes it.  The acquisition thread never waits for the writer; if
+// the ring is ever full, the line is dropped and counted.  Overview records, about one a
+// second, go through a smaller ring of their own to the overview file, and telemetry
+// frame messages through a ring of fixed slots to the telemetry clients.
+//
+#define WRITE_BUFFER_SIZE (1024 * 1024)                 // Must be a power of two.
+#define OVERVIEW_BUFFER_SIZE (64 * 1024)                // Must be a power of two.
+#define WRITER_PERIOD_ms 50                             // Longest time a line waits in WriteBuffer.
+#define WRITER_STACK_SIZE (256 * 1024)
+#define TELEMETRY_SLOTS 32                              // Must be a power of two.
+
+static char WriteBuffer[WRITE_BUFFER_SIZE];             // Ring of data waiting for the writer thread.
+static unsigned WriteHead = 0;                          // Total bytes added by the acquisition thread.
+static unsigned WriteTail = 0;                          // Total bytes stored by the writer thread.
+static unsigned WriteDropped = 0;                       // Lines dropped because WriteBuffer was full.
+static char OverviewBuffer[OVERVIEW_BUFFER_SIZE];       // Ring of overview records waiting for the writer thread.
+static unsigned OverviewHead = 0;                       // Total bytes added by the acquisition thread.
+static unsigned OverviewTail = 0;                       // Total bytes stored by the writer thread.
+static unsigned WritePeak = 0;                          // Most bytes ever waiting in WriteBuffer.
+static char TelemetrySlots[TELEMETRY_SLOTS][TELEMETRY_MAX_FRAME];   // Frame messages waiting for the writer thread.
+static unsigned TelemetryLengths[TELEMETRY_SLOTS];
+static unsigned TelemetryHead = 0;                      // Total messages added by the acquisition thread.
+static unsigned TelemetryTail = 0;                      // Total messages sent by the writer thread.
+static unsigned TelemetryDropped = 0;                   // Messages dropped because the slots were full.
+static int WriterQuit = 0;                              // Set to make the writer thread drain WriteBuffer and stop.
+static pthread_mutex_t WriteMutex;
+static pthread_cond_t WriteCondition = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_id = 0;
+
+static int SamplerCpu = -1;                             // Set by spi_setaffinity(), -1 to let the thread migrate.
+static int WriterCpu = -1;                              // Set by spi_setaffinity(), -1 to let the thread migrate.
+
+//
+// Internal method to copy data into a ring of size bytes at the given total byte count.
+//
+static void CopyToRing(char* ring, unsigned size, unsigned head, const char* data, unsigned length)
+{
+    unsigned offset = head & (size - 1);
+    unsigned first = (length < size - offset) ? length : size - offset;
+    memcpy(ring + offset, data, first);
+    memcpy(ring, data + first, length - first);
+}
+
+//
+// Internal method to store the data in a ring from total byte count tail up to head.
+//
+static void StoreFromRing(const char* ring, unsigned size, unsigned tail, unsigned head, void (*store)(const char*, unsigned))
+{
+    unsigned length = head - tail;
+    if (length > 0)
+    {
+        unsigned offset = tail & (size - 1);
+        unsigned first = (length < size - offset) ? length : size - offset;
+        store(ring + offset, first);
+        if (length > first)
+            store(ring, length - first);
+    }
+}
+
+//
+// Internal method used by the acquisition thread to append data to the acquisition
+// file.  The data is handed to the writer thread if it is running.
+//
+// Returns: 0 on success, -1 if the data was dropped because the writer fell behind.
+//
+static int WriteAcquisitionData(const char* data, unsigned length)
+{
+    if (writer_id == 0)
+    {
+        StoreAcquisitionData(data, length);
+        return 0;
+    }
+
+    int result = 0;
+    pthread_mutex_lock(&WriteMutex);
+    unsigned used = WriteHead - WriteTail;
+    if (WRITE_BUFFER_SIZE - used < length)
+    {
+        WriteDropped++;
+        result = -1;
+    }
+    else
+    {
+        CopyToRing(WriteBuffer, WRITE_BUFFER_SIZE, WriteHead, data, length);
+        WriteHead += length;
+        if (used + length > WritePeak)
+            WritePeak = used + length;
+
+        // Only wake the writer early if the ring is filling up; it wakes by itself every WRITER_PERIOD_ms.
+        if (used + length > WRITE_BUFFER_SIZE / 2)
+            pthread_cond_signal(&WriteCondition);
+    }
+    pthread_mutex_unlock(&WriteMutex);
+    return result;
+}
+
+//
+// Internal method used by the acquisition thread to append overview records to the
+// overview file.  The records are handed to the writer thread if it is running.
+//
+static void WriteOverviewData(const char* data, unsigned length)
+{
+    if (writer_id == 0)
+    {
+        StoreOverviewData(data, length);
+        return;
+    }
+
+    pthread_mutex_lock(&WriteMutex);
+    if (OVERVIEW_BUFFER_SIZE - (OverviewHead - OverviewTail) >= length)
+    {
+        CopyToRing(OverviewBuffer, OVERVIEW_BUFFER_SIZE, OverviewHead, data, length);
+        OverviewHead += length;
+    }
+    pthread_mutex_unlock(&WriteMutex);
+}
+
+//
+// Internal method used by the acquisition thread to hand a telemetry frame message to
+// the writer thread, which is always running while telemetry is active.  The message is
+// dropped if the writer has fallen behind.
+//
+static void WriteTelemetryData(const char* data, unsigned length)
+{
+    pthread_mutex_lock(&WriteMutex);
+    if (TelemetryHead - TelemetryTail < TELEMETRY_SLOTS)
+    {
+        unsigned slot = TelemetryHead & (TELEMETRY_SLOTS - 1);
+        memcpy(TelemetrySlots[slot], data, length);
+        TelemetryLengths[slot] = length;
+        TelemetryHead++;
+    }
+    else
+        TelemetryDropped++;
+    pthread_mutex_unlock(&WriteMutex);
+}
+
+//
+// Internal method used by the acquisition thread to force journaled data to disk
+// once every JournalFlush_ms, when there is no writer thread to do it.
+//
+static void FlushAcquisitionData(unsigned long long now_ns)
+{
+    if (writer_id == 0)
+        FlushJournal(now_ns);
+}
+
+//
+// Clock records.  The acquisition thread writes a "# clock" record when acquisition
+// starts, every ClockPeriod_ms, and when it stops, pairing a point of the time column
+// with CLOCK_MONOTONIC_RAW and CLOCK_REALTIME.  Reading the clocks takes well under a
+// microsecond, but timing an edge of the RTC's seconds means polling it over I2C for
+// up to a few hundred milliseconds, so that is left to the writer thread, which writes
+// "# rtc" records pairing the edge with CLOCK_MONOTONIC_RAW.
+//
+#define NS_PER_SECOND (1000ULL * 1000 * 1000)
+#define RTC_POLL_LEAD_ns (100ULL * 1000 * 1000)         // Polling starts this long before the predicted edge.
+#define RTC_POLL_MIN_ns (5ULL * 1000 * 1000)            // Any closer to the edge, wait for the next one.
+#define RTC_POLL_LIMIT_ns (250ULL * 1000 * 1000)        // Longest the writer thread polls the RTC at once.
+
+static unsigned long long ReadClock_ns(clockid_t clock)
+{
+    struct timespec tp;
+    clock_gettime(clock, &tp);
+    return (unsigned long long)tp.tv_sec * (unsigned long long)(1000*1000*1000) + (unsigned long long)tp.tv_nsec;
+}
+
+//
+// Internal method used by the acquisition thread to decide whether a clock record is
+// due, and if so when the next one is.
+//
+static int ClockRecordDue(unsigned long long now_ns)
+{
+    if (ClockPeriod_ms == 0 || SequenceSize == 0 || now_ns < NextClock_ns)
+        return 0;
+    NextClock_ns = now_ns + ClockPeriod_ms * (unsigned long long)(1000*1000);
+    return 1;
+}
+
+//
+// Internal method used by the acquisition thread to write a clock record.
+//
+// Parameters:
+// origin_ns: The CLOCK_MONOTONIC_RAW time of time column 0.
+//
+static void RecordClock(unsigned long long origin_ns)
+{
+    unsigned long long before_ns = ReadClock_ns(CLOCK_MONOTONIC_RAW);
+    unsigned long long realtime_ns = ReadClock_ns(CLOCK_REALTIME);
+    unsigned long long after_ns = ReadClock_ns(CLOCK_MONOTONIC_RAW);
+    unsigned long long monotonic_ns = before_ns + (after_ns - before_ns) / 2;
+
+    char record[160];
+    int recordLength = snprintf(record, sizeof(record), "# clock,time_ns=%lld,monotonic_raw_ns=%llu,realtime_ns=%llu,uncertainty_ns=%llu\n",
+        (long long)(monotonic_ns - origin_ns), monotonic_ns, realtime_ns, (after_ns - before_ns + 1) / 2);
+    WriteAcquisitionData(record, recordLength);
+    ClockOrigin_ns = origin_ns;
+    ClockRecorded = 1;
+}
+
+//
+// Internal method used by the acquisition thread to open the RTC for the writer thread,
+// if RTC clock records are wanted.
+//
+static void OpenRtc()
+{
+    RtcHandle = -1;
+    RtcNext_ns = 0;
+    RtcEdge_ns = 0;
+    if (!RtcEnabled || ClockPeriod_ms == 0 || SequenceSize == 0)
+        return;
+
+    gpioSetMode(RTC_ENABLE_Pin, PI_OUTPUT);
+    gpioWrite(RTC_ENABLE_Pin, 1);
+    RtcHandle = i2cOpen(RTC_I2C_BUS, RTC_ADDRESS, 0);
+    if (RtcHandle < 0)
+    {
+        printf("Opening the RTC failed with error %d, clock records are written without it\n", RtcHandle);
+        gpioWrite(RTC_ENABLE_Pin, 0);
+        RtcHandle = -1;
+    }
+}
+
+static void CloseRtc()
+{
+    if (RtcHandle < 0)
+        return;
+    i2cClose(RtcHandle);
+    gpioWrite(RTC_ENABLE_Pin, 0);
+    RtcHandle = -1;
+}
+
+static unsigned BcdDecode(unsigned value)
+{
+    return ((value >> 4) & 0xf) * 10 + (value & 0xf);
+}
+
+//
+// Internal method used by the writer thread to time the next edge of the RTC's seconds,
+// when one is due, and append an RTC record for it to the acquisition file.
+//
+static void TimeRtcEdge()
+{
+    if (RtcHandle < 0)
+        return;
+    unsigned long long now_ns = ReadClock_ns(CLOCK_MONOTONIC_RAW);
+    if (now_ns < RtcNext_ns)
+        return;
+
+    // Once an edge has been timed, the next one is a whole number of seconds later, give
+    // or take the drift between the clocks, so only poll from shortly before it.
+    if (RtcEdge_ns != 0)
+    {
+        unsigned long long predicted_ns = RtcEdge_ns + ((now_ns - RtcEdge_ns) / NS_PER_SECOND + 1) * NS_PER_SECOND;
+        if (predicted_ns - now_ns < RTC_POLL_MIN_ns)
+        {
+            RtcNext_ns = predicted_ns + NS_PER_SECOND - RTC_POLL_LEAD_ns;
+            return;
+        }
+        if (predicted_ns - now_ns > RTC_POLL_LEAD_ns)
+        {
+            RtcNext_ns = predicted_ns - RTC_POLL_LEAD_ns;
+            return;
+        }
+    }
+
+    // Poll the seconds register until it changes.  The edge came after the start of the
+    // last read that returned the old value, and before the end of the first read that
+    // returned the new one.
+    unsigned long long lastStart_ns = now_ns;
+    unsigned long long readEnd_ns = now_ns;
+    int first = i2cReadByteData(RtcHandle, RTC_SECONDS);
+    int seconds = first;
+    while (first >= 0 && readEnd_ns - now_ns < RTC_POLL_LIMIT_ns)
+    {
+        unsigned long long readStart_ns = ReadClock_ns(CLOCK_MONOTONIC_RAW);
+        seconds = i2cReadByteData(RtcHandle, RTC_SECONDS);
+        readEnd_ns = ReadClock_ns(CLOCK_MONOTONIC_RAW);
+        if (seconds < 0 || seconds != first)
+            break;
+        lastStart_ns = readStart_ns;
+    }
+
+    if (first < 0 || seconds < 0)
+    {
+        printf("Reading the RTC failed with error %d, clock records are written without it\n", first < 0 ? first : seconds);
+        CloseRtc();
+        return;
+    }
+    if (seconds == first)
+    {
+        // No edge this time, perhaps because the clocks drifted apart; look for one afresh.
+        RtcEdge_ns = 0;
+        RtcNext_ns = readEnd_ns;
+        return;
+    }
+    RtcEdge_ns = lastStart_ns + (readEnd_ns - lastStart_ns) / 2;
+    RtcNext_ns = RtcEdge_ns + ClockPeriod_ms * (unsigned long long)(1000*1000) - RTC_POLL_LEAD_ns;
+
+    // The registers will not change for nearly a second, so read the time the edge began.
+    unsigned char registers[7];
+    if (i2cReadI2CBlockData(RtcHandle, RTC_SECONDS, (char*)registers, sizeof(registers)) != sizeof(registers) || registers[0] != seconds)
+        return;
+
+    char record[160];
+    int recordLength = snprintf(record, sizeof(record), "# rtc,monotonic_raw_ns=%llu,uncertainty_ns=%llu,utc=%04u-%02u-%02uT%02u:%02u:%02uZ\n",
+        RtcEdge_ns, (readEnd_ns - lastStart_ns + 1) / 2,
+        2000 + BcdDecode(registers[6]) + ((registers[5] & 0x80) ? 100 : 0), BcdDecode(registers[5] & 0x1f), BcdDecode(registers[4]),
+        BcdDecode(registers[2] & 0x3f), BcdDecode(registers[1]), BcdDecode(registers[0]));
+    StoreAcquisitionData(record, recordLength);
+}
+
+//
+// Internal method used by the writer thread to send the health counters to the
+// telemetry clients.  The counters kept under WriteMutex are passed in.
+//
+static void PublishHealth(unsigned long long now_ns, const telemetryhealth_t* counters)
+{
+    telemetryhealth_t health = *counters;
+    health.header.type = TELEMETRY_HEALTH;
+    health.header.length = sizeof(health);
+    health.flags = (voltage_low ? TELEMETRY_VOLTAGE_LOW : 0) | (Journal.fd >= 0 ? TELEMETRY_JOURNAL : 0);
+    health.uptime_ns = now_ns - TelemetryStart_ns;
+    health.lines = __atomic_load_n(&LinesWritten, __ATOMIC_RELAXED);
+    health.missed = __atomic_load_n(&FramesMissed, __ATOMIC_RELAXED);
+    health.busytimeouts = BusyTimeouts;
+    health.crcerrors = CrcErrors;
+    health.telemetrydropped += TelemetryServer.dropped;
+    health.clients = telemetry_clients(&TelemetryServer);
+    telemetry_publish(&TelemetryServer, &health, sizeof(health));
+}
+
+static void* DoWriteData(void* vargp)
+{
+    unsigned long long health_ns = 0;                   // When the last health message was sent.
+    pthread_mutex_lock(&WriteMutex);
+    for (;;)
+    {
+        if (WriteHead == WriteTail && OverviewHead == OverviewTail && !WriterQuit)
+        {
+            struct timespec tpTimeout;
+            clock_gettime(CLOCK_REALTIME, &tpTimeout);
+            tpTimeout.tv_nsec += WRITER_PERIOD_ms * 1000 * 1000;
+            tpTimeout.tv_sec += tpTimeout.tv_nsec / (1000 * 1000 * 1000);
+            tpTimeout.tv_nsec %= 1000 * 1000 * 1000;
+            pthread_cond_timedwait(&WriteCondition, &WriteMutex, &tpTimeout);
+        }
+
+        unsigned head = WriteHead;
+        unsigned tail = WriteTail;
+        unsigned overviewHead = OverviewHead;
+        unsigned telemetryHead = TelemetryHead;
+        telemetryhealth_t counters = { .dropped = WriteDropped, .ringused = head - tail, .ringpeak = WritePeak,
+                                       .telemetrydropped = TelemetryDropped };
+        int quitting = WriterQuit;
+        pthread_mutex_unlock(&WriteMutex);
+
+        // The acquisition thread only adds beyond head, so these parts of the rings can be stored unlocked.
+        StoreFromRing(WriteBuffer, WRITE_BUFFER_SIZE, tail, head, StoreAcquisitionData);
+        StoreFromRing(OverviewBuffer, OVERVIEW_BUFFER_SIZE, OverviewTail, overviewHead, StoreOverviewData);
+
+        struct timespec tpNow;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &tpNow);
+        unsigned long long now_ns = (unsigned long long)tpNow.tv_sec * (unsigned long long)(1000*1000*1000) + (unsigned long long)tpNow.tv_nsec;
+        FlushJournal(now_ns);
+
+        // Telemetry goes out after the data is stored, and can only be dropped, never delay it.
+        if (TelemetryActive)
+        {
+            telemetry_accept(&TelemetryServer);
+            for (unsigned message = TelemetryTail; message != telemetryHead; message++)
+            {
+                unsigned slot = message & (TELEMETRY_SLOTS - 1);
+                telemetry_publish(&TelemetryServer, TelemetrySlots[slot], TelemetryLengths[slot]);
+            }
+            if (now_ns - health_ns >= TELEMETRY_HEALTH_ms * (unsigned long long)(1000*1000))
+            {
+                PublishHealth(now_ns, &counters);
+                health_ns = now_ns;
+            }
+        }
+        if (!quitting)
+            TimeRtcEdge();
+
+        pthread_mutex_lock(&WriteMutex);
+        WriteTail = head;
+        OverviewTail = overviewHead;
+        TelemetryTail = telemetryHead;
+        if (quitting && WriteHead == WriteTail && OverviewHead == OverviewTail)
+            break;
+    }
+    pthread_mutex_unlock(&WriteMutex);
+    return NULL;
+}
+
+//
+// Internal method used by the acquisition thread to start the writer thread, at normal
+// priority, so that it never competes with the acquisition thread.  If it cannot be
+// started, the acquisition thread writes the data itself, as before.
+//
+static void StartWriterThread()
+{
+    // Priority inheritance, so the writer never holds up the acquisition thread while
+    // holding the mutex at normal priority.
+    pthread_mutexattr_t mutexattr;
+    pthread_mutexattr_init(&mutexattr);
+    pthread_mutexattr_setprotocol(&mutexattr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&WriteMutex, &mutexattr);
+    pthread_mutexattr_destroy(&mutexattr);
+
+    WriteHead = 0;
+    WriteTail = 0;
+    WriteDropped = 0;
+    WritePeak = 0;
+    OverviewHead = 0;
+    OverviewTail = 0;
+    TelemetryHead = 0;
+    TelemetryTail = 0;
+    TelemetryDropped = 0;
+    WriterQuit = 0;
+
+    // With mlockall(MCL_FUTURE) in effect the whole stack is locked, so keep it small.
+    pthread_attr_t attr;
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WRITER_STACK_SIZE);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    pthread_attr_setschedparam(&attr, &param);
+    if (WriterCpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(WriterCpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+
+    int ret = pthread_create(&writer_id, &attr, DoWriteData, NULL);
+    if (ret != 0)
+    {
+        printf("Starting the writer thread failed (%s), writing from the acquisition thread\n", strerror(ret));
+        writer_id = 0;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+//
+// Internal method used by the acquisition thread to make the writer thread store
+// everything still in WriteBuffer, and wait for it to stop.
+//
+static void StopWriterThread()
+{
+    if (writer_id == 0)
+        return;
+
+    pthread_mutex_lock(&WriteMutex);
+    WriterQuit = 1;
+    pthread_cond_signal(&WriteCondition);
+    pthread_mutex_unlock(&WriteMutex);
+    pthread_join(writer_id, NULL);
+    writer_id = 0;
+    pthread_mutex_destroy(&WriteMutex);
+
+    if (WriteDropped != 0)
+        printf("The writer thread fell behind, %u sample lines were dropped\n", WriteDropped);
+}
+
+//
+// Pin the acquisition (sampler) thread and the writer thread to chosen CPUs.  By default
+// both may migrate between CPUs, and share them with everything else on the system.
+// For the least jitter, reserve a CPU for the sampler with isolcpus= and nohz_full= on
+// the kernel command line, pin the sampler to it, and pin the writer to another CPU.
+// spi_start() reports the scheduling setup it used, including which CPUs the kernel
+// has isolated.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// samplercpu: The CPU for the acquisition thread, or -1 to let it migrate.
+// writercpu: The CPU for the writer thread, or -1 to let it migrate.
+//
+// NOTE: This must be called before spi_start() to have any effect.
+//
+// Returns: Nothing.
+//
+void spi_setaffinity(self_t self, int samplercpu, int writercpu)
+{
+    SamplerCpu = samplercpu;
+    WriterCpu = writercpu;
+    if (PRINT_DIAG(self))
+        printf("Affinity set to sampler CPU %d, writer CPU %d\n", SamplerCpu, WriterCpu);
+}
+
+//
+// Internal method to read a CPU list such as "2-3" from sysfs into list, which is
+// left empty if the file does not exist or lists no CPUs.
+//
+static void ReadCpuList(const char* path, char* list, int length)
+{
+    list[0] = '\0';
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return;
+    if (fgets(list, length, file) == NULL)
+        list[0] = '\0';
+    fclose(file);
+    list[strcspn(list, "\n")] = '\0';
+}
+
+//
+// Returns: Nonzero if cpu is in a CPU list such as "1,3-5".
+//
+static int CpuListContains(const char* list, int cpu)
+{
+    while (*list != '\0')
+    {
+        char* end;
+        long first = strtol(list, &end, 10);
+        if (end == list)
+            return 0;
+        long last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        if (cpu >= first && cpu <= last)
+            return 1;
+        list = (*end == ',') ? end + 1 : end;
+    }
+    return 0;
+}
+
+//
+// The scheduling setup of the current acquisition, as key=value pairs.
+//
+static char SchedulingReport[256];
+static int StartStatus = START_OK;                      // Returned by spi_start(), recorded in the data file.
+
+//
+// Internal method used by spi_start() to drop an affinity to a CPU that does not exist.
+//
+static void CheckAffinity()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (SamplerCpu >= cpus)
+    {
+        printf("Sampler CPU %d does not exist, not pinning the acquisition thread\n", SamplerCpu);
+        SamplerCpu = -1;
+    }
+    if (WriterCpu >= cpus)
+    {
+        printf("Writer CPU %d does not exist, not pinning the writer thread\n", WriterCpu);
+        WriterCpu = -1;
+    }
+}
+
+//
+// Internal method used by the acquisition thread to describe, and check, the scheduling
+// setup it actually got, which may be less than was asked for.
+//
+static void ReportScheduling()
+{
+    char isolated[64];
+    char nohzfull[64];
+    ReadCpuList("/sys/devices/system/cpu/isolated", isolated, sizeof(isolated));
+    ReadCpuList("/sys/devices/system/cpu/nohz_full", nohzfull, sizeof(nohzfull));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int policy = SCHED_OTHER;
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_getschedparam(pthread_self(), &policy, &param);
+
+    // Report the CPU only if the thread is really pinned to exactly one.
+    int samplercpu = -1;
+    cpu_set_t affinity;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(affinity), &affinity) == 0 && CPU_COUNT(&affinity) == 1)
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &affinity))
+                samplercpu = cpu;
+
+    snprintf(SchedulingReport, sizeof(SchedulingReport), "policy=%s,priority=%d,mlock=%d,samplercpu=%d,writercpu=%d,cpus=%ld,isolcpus=%s,nohz_full=%s,status=%d",
+             policy == SCHED_FIFO ? "SCHED_FIFO" : policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER", param.sched_priority,
+             (StartStatus & START_NO_MLOCK) ? 0 : 1, samplercpu, WriterCpu, cpus,
+             isolated[0] ? isolated : "none", nohzfull[0] ? nohzfull : "none", StartStatus);
+    printf("Acquisition scheduling: %s\n", SchedulingReport);
+
+    if (samplercpu >= 0 && !CpuListContains(isolated, samplercpu))
+        printf("Sampler CPU %d is not isolated with isolcpus=, other tasks and interrupts may share it\n", samplercpu);
+    if (samplercpu >= 0 && !CpuListContains(nohzfull, samplercpu))
+        printf("Sampler CPU %d is not in nohz_full=, so the scheduler tick still interrupts it\n", samplercpu);
+    if (samplercpu >= 0 && samplercpu == WriterCpu)
+        printf("Sampler and writer threads share CPU %d\n", samplercpu);
+}
+
+//
+// Internal method used when the acquisition thread stops, to close the journal and
+// rebuild the acquisition file from it.  The journal is kept if that fails.
+//
+static void CloseAcquisitionData()
+{
+    if (Journal.fd < 0)
+        return;
+
+    char journalPath[FilePathLength + sizeof(JOURNAL_EXTENSION)];
+    snprintf(journalPath, sizeof(journalPath), "%s%s", AcquisitionFilePath, JOURNAL_EXTENSION);
+
+    if (journal_close(&Journal) != 0)
+        printf("Closing journal %s failed: %m\n", journalPath);
+
+    uint64_t blocks = 0;
+    long long written = journal_recover(journalPath, AcquisitionFilePath, &blocks);
+    if (written < 0)
+        printf("Rebuilding %s from its journal failed, journal kept\n", AcquisitionFilePath);
+    else
+    {
+        if (debug)
+            printf("Rebuilt %s, %lld bytes from %llu journal blocks\n", AcquisitionFilePath, written, (unsigned long long)blocks);
+        unlink(journalPath);
+    }
+}
+
+//
+// Internal method used by the acquisition thread to accumulate one frame of
+// conversions into the running average, and append the sample line to the file
+// when AverageCount frames have been accumulated.
+//
+// Parameters:
+// conversions: The SequenceSize/2 packed A and B side conversions of the frame.
+// time_us: The time stamp for the frame, in microseconds since the start.
+// aux_us: The diagnostic value written in parentheses after the time stamp.
+//
+static void RecordFrame(unsigned* conversions, unsigned long long sequence, unsigned long long time_us, unsigned long long aux_us)
+{
+    if (FirstSample_ns == 0)
+    {
+        struct timespec tpBoot;
+        clock_gettime(CLOCK_BOOTTIME, &tpBoot);
+        FirstSample_ns = (unsigned long long)tpBoot.tv_sec * (unsigned long long)(1000*1000*1000) + (unsigned long long)tpBoot.tv_nsec;
+    }
+
+    // Break out the A and B channels of the selected columns into individual 16-bit samples,
+    // with all A channels first.
+    for (unsigned i = 0; i < ColumnCount; i++)
+    {
+        // A conversions are high-order, B are low-order.  See page 33 of 50 in AD7616 (Rev. 0)
+        unsigned conversion = conversions[ColumnSources[i] / 2];
+        unsigned sample = (ColumnSources[i] & 1) ? conversion & 0xffff : (conversion >> 16) & 0xffff;
+        averageBuffer[i] += (sample + 0x8000) & 0xffff;
+    }
+
+    --averageIndex;
+    if (averageIndex == 0)
+    {
+        // Append this sample line to the file, after a sequence record if it is the first,
+        // or if frames were missed or lines dropped since the last line written.
+        uint16_t samples[COLUMNS_MAX];
+        static char samplebuffer[SAMPLE_LINE_LENGTH];   // Static, the thread's stack is small.
+        char* formatBuffer = samplebuffer;
+        size_t remaining = sizeof(samplebuffer);
+        int formatCount = 0;
+        if (!SequenceWritten || sequence != LastSequence + AverageCount)
+        {
+            unsigned long long expected = SequenceWritten ? LastSequence + AverageCount : AverageCount - 1;
+            unsigned long long missed = sequence > expected ? sequence - expected : 0;
+            formatCount = snprintf(formatBuffer, remaining, "# sequence,number=%llu,step=%u,missed=%llu\n", sequence, AverageCount, missed);
+            if (formatCount > 0 && (size_t)formatCount < remaining)
+            {
+                formatBuffer += formatCount;
+                remaining -= formatCount;
+            }
+            __atomic_add_fetch(&FramesMissed, missed, __ATOMIC_RELAXED);
+        }
+        formatCount = snprintf(formatBuffer, remaining, "%llu(%llu)", time_us, aux_us);
+        if (formatCount >= 0 && (size_t)formatCount < remaining)
+        {
+            formatBuffer += formatCount;
+            remaining -= formatCount;
+            for (unsigned i = 0; i < ColumnCount; i++)
+            {
+                samples[i] = averageBuffer[i] / AverageCount;
+                formatCount = snprintf(formatBuffer, remaining, ",%d", samples[i]);
+                if (formatCount < 0 || (size_t)formatCount >= remaining)
+                    i = ColumnCount;
+                else
+                {
+                    formatBuffer += formatCount;
+                    remaining -= formatCount;
+                }
+            }
+            formatCount = snprintf(formatBuffer, remaining, "\n");
+            if (formatCount > 0 && (size_t)formatCount < remaining)
+                formatBuffer += formatCount;
+
+            if (WriteAcquisitionData(samplebuffer, formatBuffer - samplebuffer) == 0)
+            {
+                LastSequence = sequence;
+                SequenceWritten = 1;
+                __atomic_add_fetch(&LinesWritten, 1, __ATOMIC_RELAXED);
+            }
+
+            if (OverviewActive)
+            {
+                unsigned recordsLength = overview_add(&Overview, time_us, samples, OverviewRecords);
+                if (recordsLength > 0)
+                    WriteOverviewData(OverviewRecords, recordsLength);
+            }
+            if (TelemetryActive)
+            {
+                unsigned frameLength = telemetry_add(&Telemetry, sequence, time_us, samples, TelemetryFrame);
+                if (frameLength > 0)
+                    WriteTelemetryData(TelemetryFrame, frameLength);
+            }
+        }
+
+        averageIndex = AverageCount;
+
+        for (unsigned ii = 0; ii < 64; ii++)
+            averageBuffer[ii] = 0;
+    }
+}
+
+//
+// Internal method used by the acquisition thread to mark a frame whose CRC did not
+// match with a crc record, which is written ahead of the line the frame is, or would
+// have been, averaged into.
+//
+// Parameters:
+// sequence: The sequence number of the frame.
+// action: "mark" if the frame was kept, "drop" if it was left out, or "retry" if it
+//         was converted again successfully.
+//
+static void RecordCrcError(unsigned long long sequence, const char* action)
+{
+    char record[96];
+    int recordLength = snprintf(record, sizeof(record), "# crc,number=%llu,expected=%04x,read=%04x,action=%s\n",
+                                sequence, CrcExpected, CrcRead, action);
+    WriteAcquisitionData(record, recordLength);
+    if (debug)
+        printf("Frame %llu CRC %04x, expected %04x, %s\n", sequence, CrcRead, CrcExpected, action);
+}
+
+//
+// State for the low-voltage shutdown path.  A falling edge on POWER_LOW_Pin makes the
+// acquisition thread stop sampling at once, write a shutdown record, and force all
+// buffered data to disk, rather than waiting for a supervisor to notice and call Stop().
+//
+#define POWER_LOW_GLITCH_us 1000                        // POWER_LOW_Pin must be steady this long to raise an alert.
+
+static unsigned ShutdownBudget_ms = 500;                // Set by spi_setshutdownbudget().
+static volatile int PowerLowShutdown = 0;               // Set when the thread must stop for low voltage.
+static volatile uint32_t PowerLowTick = 0;              // pigpio tick when low voltage was detected.
+static long long ShutdownLatency_us = -1;               // Detection to data on disk, -1 if no shutdown happened.
+static unsigned long long AcquisitionStart_ns = 0;      // CLOCK_MONOTONIC_RAW when the thread started.
+
+static pthread_mutex_t StopMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t StopCondition = PTHREAD_COND_INITIALIZER;
+static int AcquisitionStopped = 0;                      // Set under StopMutex when the thread has finished.
+
+//
+// Internal method used by the acquisition thread to begin a low-voltage shutdown.
+//
+static void BeginPowerLowShutdown(uint32_t tick)
+{
+    if (!PowerLowShutdown)
+    {
+        PowerLowTick = tick;
+        voltage_low = 1;
+        PowerLowShutdown = 1;
+
+        // Wake a hardware-timed acquisition thread waiting on BUSY.
+        sem_post(&BusySemaphore);
+    }
+}
+
+//
+// pigpio alert callback for the POWER_LOW pin.  A falling edge means the supply is failing.
+//
+static void PowerLowAlert(int gpio, int level, uint32_t tick)
+{
+    if (level == 0)
+        BeginPowerLowShutdown(tick);
+}
+
+//
+// Internal method used by the acquisition thread to capture the low-voltage state.
+// This also catches a supply that was already low when acquisition started, which
+// produces no edge.
+//
+static void SampleVoltageLow()
+{
+    if (gpioRead(POWER_LOW_Pin) != 0)
+        voltage_low = 0;        // Pin in high state, not in low-voltage condition.
+    else
+        BeginPowerLowShutdown(gpioTick());
+}
+
 //
-// Returns: Nothing.
+// Internal method used by the acquisition thread after it stops sampling for low voltage.
+// A shutdown record is appended, and everything buffered is forced to disk.  Rebuilding
+// the data file from a journal takes time proportional to the file size, so it is left
+// for trake_recover at the next boot, keeping the shutdown time bounded by the journal
+// flush interval rather than the length of the deployment.
 //
-static unsigned SequenceSize = 0;
-void spi_definesequence(self_t self, unsigned count, unsigned* Achannels, unsigned* Bchannels)
+static void ShutdownAcquisitionData()
 {
-    if (count > 32)
-    {
-        printf("spi_definesequence cannot define a sequence with %d elements, 32 max\n", count);
-        return;
-    }
+    struct timespec tpNow;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tpNow);
+    unsigned long long now_ns = (unsigned long long)tpNow.tv_sec * (unsigned long long)(1000*1000*1000) + (unsigned long long)tpNow.tv_nsec;
 
-    unsigned sequencer = 0x20;
+    char record[128];
+    int recordLength = snprintf(record, sizeof(record), "# shutdown,reason=powerlow,elapsed_us=%llu,budget_ms=%d\n",
+                                (now_ns - AcquisitionStart_ns) / 1000, ShutdownBudget_ms);
+    WriteAcquisitionData(record, recordLength);
 
-    for (unsigned i = 0; i < count; i++, sequencer++, Achannels++, Bchannels++)
+    if (Journal.fd >= 0)
     {
-        unsigned ssren = 0;
-        if (i + 1 == count)
-            ssren = 0x100;
-
-        unsigned AChannel = (*Achannels & 0xf);
-        unsigned BChannel = (*Bchannels & 0xf);
-        unsigned channeldata = BChannel << 4 | AChannel | ssren;
-        spi_writeregister(self, sequencer, channeldata);
+        if (journal_close(&Journal) != 0)
+            printf("Closing journal for %s failed: %m\n", AcquisitionFilePath);
+    }
+    else
+    {
+        int fd = open(AcquisitionFilePath, O_WRONLY);
+        if (fd >= 0)
+        {
+            fdatasync(fd);
+            close(fd);
+        }
     }
 
-    SequenceSize = count * 2;
-
-    // Read the configuration register, set BURSTEN and SEQEN, write it back.
-    unsigned configuration = spi_readregister(self, 2);
-    configuration |= (0x40 | 0x20 | 0x1);     // BURSTEN with SEQEN.
-    spi_writeregister(self, 2, configuration);
+    ShutdownLatency_us = (uint32_t)(gpioTick() - PowerLowTick);
+    if (ShutdownLatency_us > ShutdownBudget_ms * 1000LL)
+        printf("Low-voltage shutdown took %lld us, over the %d ms budget\n", ShutdownLatency_us, ShutdownBudget_ms);
+    else if (debug)
+        printf("Low-voltage shutdown took %lld us\n", ShutdownLatency_us);
 }
 
 //
-// Perform a conversion on a single A side and B side channel pair.
-//
-// Warning: This method can only be used before any calls to spi_definesequence().
-//          After calling spi_definesequence() at least once, the AD7616 chip will
-//          be configured to take its channel from the sequencer stack registers,
-//          rather than those provided in this call.
+// Set the time allowed from detecting low voltage to having all acquired data on disk.
+// Shutdowns that take longer are reported.  The time is bounded mainly by the journal
+// flush interval set with spi_setjournal(), so keep that well inside this budget.
 //
 // Parameters:
 // self: A copy of the opaque handle that was provided by spi_initialize().
-// channelA: The A side channel to convert.  The A side channel will be
-//            combined with the B side channel, so the chip will know how to 
-//            convert both the A side and B side.
-// channelB: The B side channel to convert.  The B side channel will be
-//            combined with the A side channel, so the chip will know how to 
-//            convert both the A side and B side.
+// budget_ms: The shutdown time budget in milliseconds.
 //
-// NOTE: The returned value will be a 32-bit value containing an A side value and a B side value.
+// Returns: Nothing.
 //
-// Returns: The converted A side and B side channels, with A side in the high word.
+void spi_setshutdownbudget(self_t self, unsigned budget_ms)
+{
+    ShutdownBudget_ms = budget_ms;
+}
+
 //
-unsigned spi_convertpair(self_t self, unsigned channelA, unsigned channelB)
+// Returns: The time in microseconds the last low-voltage shutdown took, from detecting
+//          low voltage to having all data on disk, or -1 if there has been none.
+//
+long long spi_getshutdownlatency()
 {
-    unsigned channeldata = (channelB & 0xf) << 4 | (channelA & 0xf);
-    spi_writeregister(self, 3, channeldata);
+    return ShutdownLatency_us;
+}
 
-    unsigned conversion;
-    spi_readconversion(self, 1, &conversion);
+//
+// Internal method used by the acquisition thread when conversions are hardware timed.
+// Each BUSY falling edge wakes the thread to read the conversion out, and the frame
+// is stamped with the pigpio tick of that edge, extended to 64 bits.  The value in
+// parentheses is the latency from the edge to the start of the readout.
+//
+// Returns: Nonzero if hardware timing could not be started, so the caller should
+//          fall back to software timing.
+//
+static int DoHardwareTimedAcquisition()
+{
+    unsigned long long period_us = AcquisitionPeriod_ms * 1000;
 
-    return conversion;
+    while (sem_trywait(&BusySemaphore) == 0)
+        ;
+    BusyEdges = 0;
+    gpioSetAlertFunc(ADC_BUSY_Pin, BusyAlert);
+
+    int wave_id = StartConversionWave(period_us);
+    if (wave_id < 0)
+    {
+        printf("Hardware-timed conversion start failed with error %d, using software timing\n", wave_id);
+        gpioSetAlertFunc(ADC_BUSY_Pin, (BusyWaitMode == BUSYWAIT_ALERT) ? BusyAlert : NULL);
+        return 1;
+    }
+
+    int firstFrame = 1;
+    unsigned firstEdges = 0;
+    uint32_t lastTick = 0;
+    unsigned long long tick_us = 0;
+    unsigned long long starttick_us = 0;
+    unsigned lastEdges = 0;
+    unsigned overruns = 0;
+
+    do
+    {
+        // Wait for the next BUSY falling edge, but never forever, so Stop() is
+        // honored even if the waveform or the chip stops producing edges.
+        struct timespec tpTimeout;
+        clock_gettime(CLOCK_REALTIME, &tpTimeout);
+        unsigned long long timeout_ns = (unsigned long long)tpTimeout.tv_nsec + 2 * period_us * 1000 + 100 * 1000 * 1000;
+        tpTimeout.tv_sec += timeout_ns / (1000 * 1000 * 1000);
+        tpTimeout.tv_nsec = timeout_ns % (1000 * 1000 * 1000);
+
+        if (sem_timedwait(&BusySemaphore, &tpTimeout) == 0 && !PowerLowShutdown)
+        {
+            // If we fell behind, the chip only holds the latest conversion, so skip to it.
+            while (sem_trywait(&BusySemaphore) == 0)
+                ;
+            uint32_t tick = BusyTick;
+            unsigned edges = BusyEdges;
+            if (!firstFrame && edges - lastEdges > 1)
+            {
+                overruns += edges - lastEdges - 1;
+                if (debug)
+                    printf("Missed %d hardware-timed conversions\n", edges - lastEdges - 1);
+            }
+            lastEdges = edges;
+
+            if (SequenceSize > 0)
+            {
+                unsigned conversions[64];
+                uint32_t readoutTick = gpioTick();
+                int crcfailed = spi_readout(&spidef, SequenceSize/2, conversions, CrcMode != CRC_OFF);
+
+                if (firstFrame)
+                {
+                    tick_us = starttick_us = tick;
+                    firstEdges = edges;
+                }
+                else
+                    tick_us += (uint32_t)(tick - lastTick);
+
+                // Every BUSY edge is a frame, so missed edges are gaps in the sequence.  The
+                // next conversion is already under way, so a bad CRC cannot be retried.
+                if (crcfailed)
+                    RecordCrcError(edges - firstEdges, CrcMode == CRC_MARK ? "mark" : "drop");
+                if (!crcfailed || CrcMode == CRC_MARK)
+                    RecordFrame(conversions, edges - firstEdges, tick_us - starttick_us, (uint32_t)(readoutTick - tick));
+            }
+            lastTick = tick;
+            firstFrame = 0;
+        }
+        else if (!PowerLowShutdown)
+        {
+            BusyTimeouts++;
+            if (debug)
+                printf("No BUSY falling edge within timeout\n");
+        }
+
+        SampleVoltageLow();
+
+        struct timespec tpNow;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &tpNow);
+        unsigned long long now_ns = (unsigned long long)tpNow.tv_sec * (unsigned long long)(1000*1000*1000) + (unsigned long long)tpNow.tv_nsec;
+        FlushAcquisitionData(now_ns);
+
+        // The time column counts pigpio ticks, so find where its origin falls on CLOCK_MONOTONIC_RAW.
+        if (!firstFrame && ClockRecordDue(now_ns))
+        {
+            unsigned long long before_ns = ReadClock_ns(CLOCK_MONOTONIC_RAW);
+            uint32_t nowTick = gpioTick();
+            unsigned long long after_ns = ReadClock_ns(CLOCK_MONOTONIC_RAW);
+            unsigned long long elapsed_us = tick_us - starttick_us + (uint32_t)(nowTick - lastTick);
+            RecordClock(before_ns + (after_ns - before_ns) / 2 - elapsed_us * 1000);
+        }
+    } while (!quit && !PowerLowShutdown);
+
+    gpioWaveTxStop();
+    gpioWaveDelete(wave_id);
+    gpioSetAlertFunc(ADC_BUSY_Pin, (BusyWaitMode == BUSYWAIT_ALERT) ? BusyAlert : NULL);
+    gpioWrite(ADC_CONVST_Pin, 0);
+
+    if (debug)
+        printf("Hardware-timed acquisition stopped after %d BUSY edges, %d missed\n", BusyEdges, overruns);
+    return 0;
 }
 
 //
-// The worker thread that does the background data acquisition and file capture.
+// Internal method used by the acquisition thread, before the writer thread is started,
+// to open the telemetry socket if one was chosen.  Acquisition goes on without it if
+// it cannot be opened.
 //
-// In this version, both function are performed in one thread.  The file capture
-// adds to the overall time spent in this thread, impacting the fastest data capture rate.
-// If we need a faster data capture rate, we should consider splitting the data
-// capture into its own thread.
+static void OpenTelemetry(unsigned long long starttime_ns)
+{
+    TelemetryActive = 0;
+    LinesWritten = 0;
+    FramesMissed = 0;
+    if (TelemetryPath[0] == '\0' || SequenceSize == 0)
+        return;
+
+    telemetryhello_t hello = {};
+    hello.magic = TELEMETRY_MAGIC;
+    hello.version = TELEMETRY_VERSION;
+    hello.channels = ColumnCount;
+    hello.period_us = AcquisitionPeriod_ms * 1000;
+    hello.averagecount = AverageCount > 0 ? AverageCount : 1;
+    hello.interval_us = TelemetryInterval_ms * 1000;
+    hello.start = StartStatus;
+    if (telemetry_open(&TelemetryServer, TelemetryPath, &hello, AcquisitionFilePath) != 0)
+    {
+        printf("Opening telemetry socket %s failed, acquiring without it: %m\n", TelemetryPath);
+        return;
+    }
+    telemetry_begin(&Telemetry, ColumnCount, TelemetryInterval_ms * 1000ULL);
+    TelemetryStart_ns = starttime_ns;
+    TelemetryActive = 1;
+}
+
 //
-// To get info on how long the conversion is taking, uncommnet the line below following DIAGNOSTIC.
+// Internal method used by the acquisition thread, after the writer thread has stopped,
+// to disconnect the telemetry clients and remove the socket.
 //
-// Parameters:
-// vargp: Per POSIX, an opaque pointer to the arguments for the thread.
+static void CloseTelemetry()
+{
+    if (TelemetryActive)
+        telemetry_close(&TelemetryServer, TelemetryPath);
+    TelemetryActive = 0;
+}
+
 //
-// Returns: An opaque pointer to the returned value.  Currently NULL.
+// Internal method used by the acquisition thread when it stops, for any reason, to
+// close out the data file and signal anyone waiting in spi_waitstop().
 //
-#define FilePathLength 1000
-static char TimeColumnName[FilePathLength];             // Column header for time stamp column.
-static char AcquisitionFilePath[FilePathLength];        // Full path to filename.
-static unsigned long long AcquisitionPeriod_ms = 10;    // Set by Start().
-static unsigned AverageCount = 1;                       // Set by Start().
-static int quit = 0;                                    // Cleared by Start(), set by Stop().  The thread stops when set.
+// Returns: The value returned by the thread.  Currently NULL.
+//
+static void* FinishDataAcquisition()
+{
+    gpioSetAlertFunc(POWER_LOW_Pin, NULL);
+
+    // Summarize the buckets still being filled, so the overview covers the whole file.
+    if (OverviewActive)
+    {
+        unsigned recordsLength = overview_finish(&Overview, OverviewRecords);
+        if (recordsLength > 0)
+            WriteOverviewData(OverviewRecords, recordsLength);
+        OverviewActive = 0;
+    }
+    if (ClockRecorded)
+        RecordClock(ClockOrigin_ns);
+    StopWriterThread();
+    CloseRtc();
+    CloseTelemetry();
+
+    if (PowerLowShutdown)
+        ShutdownAcquisitionData();
+    else
+        CloseAcquisitionData();
+
+    // Signal the acquisition thread is stopped.
+    acquiring = 0;
+    pthread_mutex_lock(&StopMutex);
+    AcquisitionStopped = 1;
+    pthread_cond_broadcast(&StopCondition);
+    pthread_mutex_unlock(&StopMutex);
+    return NULL;
+}
 
 void* DoDataAcquisition(void* vargp)
 {
     // Signal the acquisition thread is running.
     acquiring = 1;
 
-    FILE* acquisitionFile = NULL;
     unsigned long long AcquisitionPeriod_ns = AcquisitionPeriod_ms * (unsigned long long)(1000*1000);
 
     // Checkpoint the start time in nanoseconds.
     struct timespec tpStart;
     clock_gettime(CLOCK_MONOTONIC_RAW, &tpStart);
     unsigned long long starttime_ns = (unsigned long long)tpStart.tv_sec * (unsigned long long)(1000*1000*1000) + (unsigned long long)tpStart.tv_nsec;
+    AcquisitionStart_ns = starttime_ns;
+
+    // React to the supply failing as soon as pigpio sees the edge.
+    PowerLowShutdown = 0;
+    gpioGlitchFilter(POWER_LOW_Pin, POWER_LOW_GLITCH_us);
+    gpioSetAlertFunc(POWER_LOW_Pin, PowerLowAlert);
 
     if (SequenceSize > 0)
     {
-        // Create a new file and write the CSV header.  Always close the file to flush to disk.
-        acquisitionFile = fopen(AcquisitionFilePath, "w");
-        fprintf(acquisitionFile, TimeColumnName);
-        for (unsigned i = 0; i < SequenceSize; i++)
+        // Create a new file, or a journal to rebuild it from, and write the CSV header.
+        if (JournalEnabled)
         {
-            fprintf(acquisitionFile, ",Channel%d", i);
+            char journalPath[FilePathLength + sizeof(JOURNAL_EXTENSION)];
+            snprintf(journalPath, sizeof(journalPath), "%s%s", AcquisitionFilePath, JOURNAL_EXTENSION);
+            if (journal_open(&Journal, journalPath) != 0)
+                printf("Opening journal %s failed, writing without it: %m\n", journalPath);
+            JournalFlushed_ns = starttime_ns;
+        }
+        if (Journal.fd < 0)
+        {
+            FILE* acquisitionFile = fopen(AcquisitionFilePath, "w");
+            if (acquisitionFile != NULL)
+                fclose(acquisitionFile);
+        }
+
+        char headerbuffer[FilePathLength + sizeof(ColumnHeader) + 1];
+        int headerLength = snprintf(headerbuffer, sizeof(headerbuffer), "%s%s\n", TimeColumnName, ColumnHeader);
+        WriteAcquisitionData(headerbuffer, headerLength);
+
+        // Create the overview file, starting with its header.
+        OverviewActive = 0;
+        if (OverviewEnabled)
+        {
+            char overviewHeader[sizeof(overviewheader_t)];
+            unsigned overviewHeaderLength = overview_begin(&Overview, ColumnCount, overviewHeader);
+            snprintf(OverviewPath, sizeof(OverviewPath), "%s%s", AcquisitionFilePath, OVERVIEW_EXTENSION);
+            FILE* overviewFile = fopen(OverviewPath, "w");
+            if (overviewFile != NULL)
+            {
+                OverviewActive = fwrite(overviewHeader, 1, overviewHeaderLength, overviewFile) == overviewHeaderLength;
+                fclose(overviewFile);
+            }
+            if (!OverviewActive)
+                printf("Creating overview %s failed, acquiring without it\n", OverviewPath);
+        }
+    }
+
+    // Record how this run is really scheduled, so a run degraded to non-real-time timing can be recognized.
+    ReportScheduling();
+    if (SequenceSize > 0)
+    {
+        char record[sizeof(SchedulingReport) + 16];
+        int recordLength = snprintf(record, sizeof(record), "# scheduling,%s\n", SchedulingReport);
+        WriteAcquisitionData(record, recordLength);
+
+        static const char* BusyWaitNames[] = { "spin", "delay", "alert" };
+        static const char* CrcModeNames[] = { "off", "mark", "drop", "retry" };
+        static const char* TransportNames[] = { "bitbang", "spidev", "capture" };
+        recordLength = snprintf(record, sizeof(record), "# conversion,oversampling=%d,pairs=%d,estimate_us=%llu,busywait=%s,busytimeout_us=%d,crc=%s,sclksettle=%d,transport=%s,spihz=%u\n",
+                                Oversampling, SequenceSize / 2, (Conversion_ns + 999) / 1000, BusyWaitNames[BusyWaitMode], BusyTimeout_us,
+                                CrcModeNames[CrcMode], SclkSettle, TransportNames[Transport],
+                                (Transport == TRANSPORT_SPIDEV) ? Spidev.speed_hz : 0);
+        WriteAcquisitionData(record, recordLength);
+
+        // When a channel is written in several columns, give the stream of each column and
+        // when it was converted after the time of the line.
+        if (ColumnsRepeat)
+        {
+            char columns[32 + COLUMNS_MAX * 16];
+            int columnsLength = snprintf(columns, sizeof(columns), "# columns,stream=");
+            for (unsigned column = 0; column < ColumnCount; column++)
+                columnsLength += snprintf(columns + columnsLength, sizeof(columns) - columnsLength, "%s%d", column ? "/" : "", ColumnStreams[column]);
+            columnsLength += snprintf(columns + columnsLength, sizeof(columns) - columnsLength, ",offset_ns=");
+            for (unsigned column = 0; column < ColumnCount; column++)
+                columnsLength += snprintf(columns + columnsLength, sizeof(columns) - columnsLength, "%s%u", column ? "/" : "",
+                                          Oversampling * (ColumnSources[column] / 2) * (ADC_TACQ_ns + ADC_TCONV_ns));
+            columnsLength += snprintf(columns + columnsLength, sizeof(columns) - columnsLength, "\n");
+            WriteAcquisitionData(columns, columnsLength);
         }
-        fprintf(acquisitionFile, "\n");
-        fclose(acquisitionFile);
     }
-    acquisitionFile = NULL;
+
+    NextClock_ns = 0;
+    ClockRecorded = 0;
+    OpenRtc();
+    OpenTelemetry(starttime_ns);
+    StartWriterThread();
+    if (writer_id == 0)
+        CloseTelemetry();
 
     if (AverageCount == 0)
         AverageCount = 1;
 
+    for (unsigned ii = 0; ii < 64; ii++)
+        averageBuffer[ii] = 0;
+    averageIndex = AverageCount;
+    SequenceWritten = 0;
+
+    if (TriggerMode == TRIGGER_HARDWARE && DoHardwareTimedAcquisition() == 0)
+        return FinishDataAcquisition();
+
     unsigned long long nextticktime_ns = starttime_ns;
     unsigned long long now_ns = starttime_ns + AcquisitionPeriod_ns;
     unsigned long long timeleftinperiod_ns = nextticktime_ns - now_ns;
-    char samplebuffer[250];
-    unsigned averageBuffer[64];
-    for (unsigned ii = 0; ii < 64; ii++)
-        averageBuffer[ii] = 0;
-    unsigned averageIndex = AverageCount;
 
     do
     {
@@ -599,61 +3286,30 @@ void* DoDataAcquisition(void* vargp)
 
             // We convert SequenceSize/2 samples, since A and B channels are packed into a single 32-bit value.
             unsigned conversions[64];
-            spi_readconversion(spidef, SequenceSize/2, conversions);
-
-            // Break out A and B channels into individual 16-bit samples, with all A channels first.
-            for (unsigned i = 0; i < SequenceSize / 2; i++)
-            {
-                // A conversions are high-order, B are low-order.  See page 33 of 50 in AD7616 (Rev. 0)
-                unsigned AConv = (conversions[i] >> 16) & 0xffff;
-                unsigned BConv = conversions[i] & 0xffff;
-                AConv = (AConv + 0x8000) & 0xffff;
-                BConv = (BConv + 0x8000) & 0xffff;
-                averageBuffer[i] += AConv;
-                averageBuffer[i + (SequenceSize / 2)] += BConv;
-            }
-
-            --averageIndex;
-            if (averageIndex == 0)
+            // The sequence number counts periods, so periods skipped or failed are gaps.
+            unsigned long long sequence = (nextticktime_ns - starttime_ns) / AcquisitionPeriod_ns;
+            int status = spi_readconversion(spidef, SequenceSize/2, conversions);
+            if (status == -2 && CrcMode == CRC_RETRY)
             {
-                // Open the previous file and append this sample line to it.  Always close the file to flush to disk.
-                char* formatBuffer = samplebuffer;
-                int formatCount = sprintf(formatBuffer, "%llu(%llu)", ((convert_ns-starttime_ns) / 1000), (timeleftinperiod_ns / 1000));
-                if (formatCount >= 0)
-                {
-                    formatBuffer += formatCount;
-                    for (unsigned i = 0; i < SequenceSize; i++)
-                    {
-                        formatCount = sprintf(formatBuffer, ",%d", averageBuffer[i] / AverageCount);
-                        if (formatCount < 0)
-                            i = SequenceSize;
-                        else
-                            formatBuffer += formatCount;
-                    }
-                    formatCount = sprintf(formatBuffer, "\n");
-
-                    acquisitionFile = fopen(AcquisitionFilePath, "a");
-                    fprintf(acquisitionFile, samplebuffer);
-                    fclose(acquisitionFile);
-                    acquisitionFile = NULL;
-                }
-
-                averageIndex = AverageCount;
-
-                for (unsigned ii = 0; ii < 64; ii++)
-                    averageBuffer[ii] = 0;
+                status = spi_readconversion(spidef, SequenceSize/2, conversions);
+                RecordCrcError(sequence, status == 0 ? "retry" : "drop");
             }
+            else if (status == -2)
+                RecordCrcError(sequence, CrcMode == CRC_MARK ? "mark" : "drop");
+            if (status == 0 || (status == -2 && CrcMode == CRC_MARK))
+                RecordFrame(conversions, sequence, (convert_ns-starttime_ns) / 1000, timeleftinperiod_ns / 1000);
         }
 
         // Capture the low-voltage state.
-        if (gpioRead(POWER_LOW_Pin) != 0)
-            voltage_low = 0;        // Pin in high state, not in low-voltage condition.
-        else
-            voltage_low = 1;        // Otherwise in low-voltage condition.
+        SampleVoltageLow();
 
         struct timespec tpNow;
         clock_gettime(CLOCK_MONOTONIC_RAW, &tpNow);
         now_ns = (unsigned long long)tpNow.tv_sec * (unsigned long long)(1000*1000*1000) + (unsigned long long)tpNow.tv_nsec;
+        FlushAcquisitionData(now_ns);
+        if (ClockRecordDue(now_ns))
+            RecordClock(starttime_ns);
+
         nextticktime_ns = nextticktime_ns + AcquisitionPeriod_ns;
         while (nextticktime_ns < now_ns) {
             nextticktime_ns = nextticktime_ns + AcquisitionPeriod_ns;
@@ -665,11 +3321,53 @@ void* DoDataAcquisition(void* vargp)
         // DIAGNOSTIC - Uncomment this line to get info on how much time is spent converting.
         // printf("Conversion time was %llu ns, sleeping %llu ns\n", (AcquisitiontPeriod_ns - timeleftinperiod_ns), timeleftinperiod_ns);
         usleep(timeleftinperiod_ns / 1000);
-    } while (!quit);
+    } while (!quit && !PowerLowShutdown);
 
-    // Signal the acquisition thread is stopped.
-    acquiring = 0;
-    return NULL;    
+    return FinishDataAcquisition();
+}
+
+//
+// Internal method used by spi_start() to create the acquisition thread with the given
+// scheduling, pinned to SamplerCpu if one was chosen.
+//
+// Returns: 0 on success, or the error from the first pthread call that failed.
+//
+#define ACQUISITION_PRIORITY 80
+#define ACQUISITION_STACK_SIZE (PTHREAD_STACK_MIN + 64 * 1024)  // printf() and the host's static TLS, large in Python, share it.
+
+static pthread_t thread_id;
+
+static int CreateAcquisitionThread(int policy, int priority)
+{
+    pthread_attr_t attr;
+    int ret = pthread_attr_init(&attr);
+    if (ret != 0)
+        return ret;
+
+    struct sched_param param = { .sched_priority = priority };
+    ret = pthread_attr_setstacksize(&attr, ACQUISITION_STACK_SIZE);
+    if (ret == 0)
+        ret = pthread_attr_setschedpolicy(&attr, policy);
+    if (ret == 0)
+        ret = pthread_attr_setschedparam(&attr, &param);
+    if (ret == 0)
+        ret = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    if (ret == 0 && SamplerCpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(SamplerCpu, &cpus);
+        if (pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus) != 0)
+        {
+            printf("pthread setaffinity failed, the acquisition thread may migrate\n");
+            StartStatus |= START_NO_AFFINITY;
+        }
+    }
+    if (ret == 0)
+        ret = pthread_create(&thread_id, &attr, DoDataAcquisition, NULL);
+
+    pthread_attr_destroy(&attr);
+    return ret;
 }
 
 //
@@ -687,103 +3385,85 @@ void* DoDataAcquisition(void* vargp)
 // NOTE: Is is allowed to call this method repeatedly, as only the first call
 //       will have any effect.
 //
-// Returns: Nothing.
+// Returns: START_OK if the thread runs with everything asked for, a positive combination
+//          of START_NO_MLOCK, START_SCHED_RR, START_SCHED_OTHER and START_NO_AFFINITY if it
+//          runs degraded, or a negative START_ERROR_ code if it is not running.
 //
-static pthread_t thread_id;
-void spi_start(self_t self, unsigned period, unsigned averagecount, char* path, char* filename)
+int spi_start(self_t self, unsigned period, unsigned averagecount, char* path, char* filename)
 {
     if (thread_id != 0)
     {
         printf("Thread already running, not starting\n");
-        return;
+        return START_ERROR_RUNNING;
     }
 
     if (PRINT_DIAG(self))
         printf("Starting thread using path '%s' and filename '%s'\n", path, filename);
-    int error = 1;
-    strncpy(AcquisitionFilePath, path, FilePathLength);
-    int remaining = FilePathLength - strlen(AcquisitionFilePath) - 1;
-    if (remaining > 0)
-    {
-        strncat(AcquisitionFilePath, "/", 2);
-        remaining -= 1;
-        if (remaining > strlen(filename))
-        {
-            strncat(AcquisitionFilePath, filename, strlen(filename));
-            error = 0;
-        }
-    }
-    if (error)
-    {
-        strncpy(AcquisitionFilePath, "./trake.csv", FilePathLength);
-    }
+    int pathLength = snprintf(AcquisitionFilePath, sizeof(AcquisitionFilePath), "%s/%s", path, filename);
+    if (pathLength < 0 || pathLength >= (int)sizeof(AcquisitionFilePath))
+        snprintf(AcquisitionFilePath, sizeof(AcquisitionFilePath), "%s", "./trake.csv");
     if (PRINT_DIAG(self))
         printf("Starting thread with period %d, average %d, saving data to %s\n", period, averagecount, AcquisitionFilePath);
 
-    strncpy(TimeColumnName, filename, FilePathLength);
-    strncat(TimeColumnName, " + ms", 6);
+    snprintf(TimeColumnName, sizeof(TimeColumnName), "%s + ms", filename);
 
     AcquisitionPeriod_ms = period;
     AverageCount = averagecount;
+    FirstSample_ns = 0;
     debug = PRINT_DIAG(self);
 
-
-    struct sched_param param;
-    pthread_attr_t attr;
-    int ret;
-
-    /* Lock memory */
-    if(mlockall(MCL_CURRENT|MCL_FUTURE) == -1) {
-        if (PRINT_DIAG(self))
-            printf("mlockall failed: %m\n");
-        exit(-2);
+    // The sequence and oversampling ratio are final now, so calibrate the BUSY delay against them.
+    unsigned configuration = spi_readregister(self, REGISTER_CONFIGURATION);
+    if (BusyWaitMode == BUSYWAIT_DELAY)
+        spi_calibratebusywait(&self, configuration);
+
+    // A conversion must fit in the period, and a slow oversampled one must not be taken
+    // for a missing BUSY.
+    Conversion_ns = ConversionEstimate_ns(configuration);
+    Oversampling = 1 << ((configuration & CONFIGURATION_OS_MASK) >> CONFIGURATION_OS_SHIFT);
+    if (Conversion_ns >= (unsigned long long)period * 1000000)
+        printf("WARNING: a conversion at oversampling ratio %d takes about %llu us, not less than the %d ms period, so samples will be missed\n",
+               Oversampling, (Conversion_ns + 999) / 1000, period);
+    if ((unsigned long long)BusyTimeout_us * 1000 < 2 * Conversion_ns)
+    {
+        BusyTimeout_us = (unsigned)(2 * Conversion_ns / 1000 + 1);
+        printf("BUSY timeout raised to %d us for oversampling ratio %d\n", BusyTimeout_us, Oversampling);
     }
 
-    /* Initialize pthread attributes (default values) */
-    ret = pthread_attr_init(&attr);
-    if (ret) {
-        if (PRINT_DIAG(self))
-            printf("init pthread attributes failed\n");
-        goto out;
-    }
 
-    /* Set a specific stack size  */
-    ret = pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN);
-    if (ret) {
-        if (PRINT_DIAG(self))
-            printf("pthread setstacksize failed\n");
-        goto out;
+    // Lock memory, so page faults cannot delay sampling.  Carry on without it if not allowed.
+    StartStatus = START_OK;
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+    {
+        printf("mlockall failed, page faults may delay sampling: %m\n");
+        StartStatus |= START_NO_MLOCK;
     }
 
-    /* Set scheduler policy and priority of pthread */
-    ret = pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
-    if (ret) {
-        if (PRINT_DIAG(self))
-            printf("pthread setschedpolicy failed\n");
-        goto out;
+    // Take the best scheduling the system allows: SCHED_FIFO, then SCHED_RR, then normal priority.
+    CheckAffinity();
+    quit = 0;
+    AcquisitionStopped = 0;
+    int ret = CreateAcquisitionThread(SCHED_FIFO, ACQUISITION_PRIORITY);
+    if (ret != 0)
+    {
+        printf("SCHED_FIFO refused (%s), trying SCHED_RR\n", strerror(ret));
+        StartStatus |= START_SCHED_RR;
+        ret = CreateAcquisitionThread(SCHED_RR, ACQUISITION_PRIORITY);
     }
-
-    param.sched_priority = 80;
-    ret = pthread_attr_setschedparam(&attr, &param);
-    if (ret) {
-        if (PRINT_DIAG(self))
-            printf("pthread setschedparam failed\n");
-        goto out;
+    if (ret != 0)
+    {
+        printf("WARNING: real-time scheduling refused (%s), sampling at normal priority will not be real-time\n", strerror(ret));
+        StartStatus = (StartStatus & ~START_SCHED_RR) | START_SCHED_OTHER;
+        ret = CreateAcquisitionThread(SCHED_OTHER, 0);
     }
-
-    /* Use scheduling parameters of attr */
-    ret = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
-    if (ret) {
-        if (PRINT_DIAG(self))
-            printf("pthread setinheritsched failed\n");
-        goto out;
+    if (ret != 0)
+    {
+        printf("Creating the acquisition thread failed (%s)\n", strerror(ret));
+        thread_id = 0;
+        return START_ERROR_THREAD;
     }
 
-    /* Create a pthread with specified attributes */
-    quit = 0;
-    pthread_create(&thread_id, &attr, DoDataAcquisition, NULL);
- 
-out:
+    return StartStatus;
 }
 
 //
@@ -814,3 +3494,123 @@ void spi_stop(self_t self)
 
     thread_id = 0;
 }
+
+//
+// Returns: The time the first frame was acquired after spi_start(), in nanoseconds
+//          since boot (CLOCK_BOOTTIME), or 0 if no frame has been acquired yet.
+//          Comparing this to the time a program started measures how long it
+//          takes from power on to the first sample.
+//
+unsigned long long spi_getfirstsample()
+{
+    return FirstSample_ns;
+}
+
+//
+// Wait for the background data acquisition thread to stop by itself, which it does
+// when it detects low voltage.  This lets a supervisor react to a low-voltage shutdown
+// at once, instead of polling read_powerlow().
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// timeout_ms: The longest time to wait, in milliseconds.
+//
+// NOTE: spi_stop() must still be called afterwards to release the thread.
+//
+// Returns: WAITSTOP_RUNNING if the thread is still running after timeout_ms,
+//          WAITSTOP_POWERLOW if it stopped for low voltage, or WAITSTOP_OTHER if it
+//          stopped for any other reason or was never started.
+//
+int spi_waitstop(self_t self, unsigned timeout_ms)
+{
+    struct timespec tpTimeout;
+    clock_gettime(CLOCK_REALTIME, &tpTimeout);
+    unsigned long long timeout_ns = (unsigned long long)tpTimeout.tv_nsec + (unsigned long long)timeout_ms * 1000 * 1000;
+    tpTimeout.tv_sec += timeout_ns / (1000 * 1000 * 1000);
+    tpTimeout.tv_nsec = timeout_ns % (1000 * 1000 * 1000);
+
+    pthread_mutex_lock(&StopMutex);
+    while (thread_id != 0 && !AcquisitionStopped)
+    {
+        if (pthread_cond_timedwait(&StopCondition, &StopMutex, &tpTimeout) != 0)
+            break;
+    }
+    int stopped = (thread_id == 0 || AcquisitionStopped);
+    pthread_mutex_unlock(&StopMutex);
+
+    if (!stopped)
+        return WAITSTOP_RUNNING;
+    return PowerLowShutdown ? WAITSTOP_POWERLOW : WAITSTOP_OTHER;
+}
+
+//
+// Returns: The number of A and B result pairs in one sequence, as defined by
+//          spi_definesequence() or spi_loadregisters(), or 1 with no sequence.
+//
+unsigned spi_getsequencepairs()
+{
+    return (SequenceSize > 0) ? SequenceSize / 2 : 1;
+}
+
+//
+// Convert and read nframes sequences back to back, as fast as the transport allows,
+// into a caller-provided array.  This is for calibration snapshots, such as the offset
+// and noise of each channel, which need many frames at once but no data file.
+//
+// Parameters:
+// self: A copy of the opaque handle that was provided by spi_initialize().
+// nframes: The number of sequences to convert.
+// conversions: Receives the A and B result pairs of every sequence, one after the other,
+//              with the A side in the high word, as spi_readconversion() returns them.
+//              A sequence is the pairs defined by spi_definesequence(), or one pair.
+// timestamps: Receives the time each conversion was started, in nanoseconds of
+//             CLOCK_MONOTONIC_RAW, or NULL.
+//
+// NOTE: The memory for the conversions and timestamps arrays is allocated by and owned
+//       by the caller.  It is the caller's responsibility to ensure they hold nframes
+//       sequences and nframes times.  Frames whose CRC does not match are kept and
+//       counted by spi_getcrcerrors().
+//
+// Returns: The number of sequences read, which is less than nframes if a conversion
+//          timed out, or -1 if data acquisition is running.
+//
+int spi_capture(self_t self, unsigned nframes, unsigned* conversions, unsigned long long* timestamps)
+{
+    if (thread_id != 0)
+    {
+        printf("Thread running, not capturing\n");
+        return -1;
+    }
+
+    unsigned pairs = spi_getsequencepairs();
+    int crc = (CrcMode != CRC_OFF);
+
+    struct timespec tpStart;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tpStart);
+
+    unsigned frame;
+    for (frame = 0; frame < nframes; frame++, conversions += pairs)
+    {
+        if (timestamps != NULL)
+        {
+            struct timespec tpConvert;
+            clock_gettime(CLOCK_MONOTONIC_RAW, &tpConvert);
+            timestamps[frame] = (unsigned long long)tpConvert.tv_sec * 1000 * 1000 * 1000 + tpConvert.tv_nsec;
+        }
+        if (spi_convert(&self) != 0)
+            break;
+        spi_readout(&self, pairs, conversions, crc);
+    }
+
+    spi_idle(&self);
+
+    if (PRINT_DIAG(self))
+    {
+        struct timespec tpEnd;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &tpEnd);
+        long tpElapsed = ((tpEnd.tv_sec-tpStart.tv_sec)*(1000*1000*1000) + (tpEnd.tv_nsec-tpStart.tv_nsec)) / 1000;
+        printf("Captured %d of %d sequences in %lu us\n", frame, nframes, tpElapsed);
+    }
+
+    return frame;
+}
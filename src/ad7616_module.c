@@ -0,0 +1,492 @@
+//
+// Native Python extension module for the AD7616 driver, _ad7616.
+//
+// ad7616_api.py can drive ad7616_driver.so through ctypes, but every ctypes call
+// marshals its arguments through libffi, and arrays have to be built element by element.
+// This module links the driver itself, and exposes each driver method under the same name
+// and with the same arguments as the ctypes library, so ad7616_api.py uses whichever it
+// finds, with no other difference:
+// - The handle is the SPIDEF ctypes structure, read through the buffer protocol.
+// - Arrays are any buffer of 32-bit unsigned values, such as a ctypes array, an array.array('I')
+//   or a numpy uint32 array, read and written in place.
+// - Strings are bytes or str, or None for a NULL pointer.
+// - spi_initialize() returns the handle as bytes, for SPIDEF.from_buffer_copy().
+// Every driver call releases the GIL, so other Python threads run while the driver
+// waits on a conversion, a register burst, or the acquisition thread.
+//
+// To build on a Raspberry Pi, use this command in a terminal prompt after changing
+// to the directory with this file in it:
+//
+//gcc -O2 -Wall -pthread -fpic -shared $(python3-config --includes) -I../include -o _ad7616.so ad7616_module.c ad7616_driver.c trake_journal.c trake_overview.c trake_telemetry.c trake_spidev.c trake_capture.c -lpigpio -lrt
+//
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string.h>
+
+#include "spi_ad7616.h"
+
+#define STRING_LENGTH 1000          // The longest path the driver takes, as FilePathLength.
+#define NONE (Py_INCREF(Py_None), Py_None)
+
+//
+// Internal method that copies the handle out of a SPIDEF structure, or anything else
+// holding a self_t.
+//
+// Returns: 0 on success, or -1 with a Python exception set.
+//
+static int GetHandle(PyObject* object, self_t* self)
+{
+    Py_buffer view;
+    if (PyObject_GetBuffer(object, &view, PyBUF_SIMPLE) != 0)
+        return -1;
+    int status = 0;
+    if (view.len != sizeof(*self))
+    {
+        PyErr_Format(PyExc_TypeError, "handle must be a SPIDEF of %d bytes, not %zd", (int)sizeof(*self), view.len);
+        status = -1;
+    }
+    else
+        memcpy(self, view.buf, sizeof(*self));
+    PyBuffer_Release(&view);
+    return status;
+}
+
+//
+// Internal method that gets a buffer of at least count values of size bytes, or NULL for
+// None when optional is set.  The caller releases the view if it was filled.
+//
+// Returns: 0 on success, or -1 with a Python exception set.
+//
+static int GetBuffer(PyObject* object, Py_buffer* view, size_t count, size_t size, int writable, int optional, void** values)
+{
+    view->obj = NULL;
+    *values = NULL;
+    if (object == Py_None && optional)
+        return 0;
+    if (PyObject_GetBuffer(object, view, writable ? PyBUF_WRITABLE : PyBUF_SIMPLE) != 0)
+        return -1;
+    if ((size_t)view->len < count * size)
+    {
+        PyErr_Format(PyExc_ValueError, "array holds %zd bytes, %zu values of %zu bytes are needed", view->len, count, size);
+        PyBuffer_Release(view);
+        return -1;
+    }
+    *values = view->buf;
+    return 0;
+}
+
+//
+// Internal method that gets a buffer of at least count 32-bit values, as GetBuffer().
+//
+static int GetArray(PyObject* object, Py_buffer* view, unsigned count, int writable, int optional, unsigned** values)
+{
+    return GetBuffer(object, view, count, sizeof(unsigned), writable, optional, (void**)values);
+}
+
+static void ReleaseArray(Py_buffer* view)
+{
+    if (view->obj != NULL)
+        PyBuffer_Release(view);
+}
+
+//
+// Internal method that copies a bytes or str argument, or None, into a C string.
+//
+// Returns: The string, NULL for None, or NULL with a Python exception set.
+//
+static const char* GetString(PyObject* object, char* string)
+{
+    if (object == Py_None)
+        return NULL;
+    const char* text;
+    Py_ssize_t length;
+    if (PyBytes_Check(object))
+    {
+        text = PyBytes_AS_STRING(object);
+        length = PyBytes_GET_SIZE(object);
+    }
+    else if ((text = PyUnicode_AsUTF8AndSize(object, &length)) == NULL)
+        return NULL;
+    if (length >= STRING_LENGTH)
+    {
+        PyErr_Format(PyExc_ValueError, "string of %zd characters is too long", length);
+        return NULL;
+    }
+    memcpy(string, text, length);
+    string[length] = '\0';
+    return string;
+}
+
+//
+// Wrappers for the driver methods that take the handle and unsigned arguments.
+//
+#define HANDLE_METHOD(name, format, call, result)                           \
+    static PyObject* py_##name(PyObject* module, PyObject* args)            \
+    {                                                                       \
+        PyObject* handle;                                                   \
+        self_t self;                                                        \
+        unsigned a = 0, b = 0, c = 0;                                       \
+        (void)a; (void)b; (void)c;                                          \
+        if (!PyArg_ParseTuple(args, "O" format, &handle, &a, &b, &c) ||     \
+            GetHandle(handle, &self) != 0)                                  \
+            return NULL;                                                    \
+        Py_BEGIN_ALLOW_THREADS                                              \
+        call;                                                               \
+        Py_END_ALLOW_THREADS                                                \
+        return result;                                                      \
+    }
+
+HANDLE_METHOD(spi_open, "II", spi_open(self, a, b), NONE)
+HANDLE_METHOD(spi_terminate, "", spi_terminate(self), NONE)
+HANDLE_METHOD(spi_stop, "", spi_stop(self), NONE)
+HANDLE_METHOD(spi_setbusywait, "II", spi_setbusywait(self, a, b), NONE)
+HANDLE_METHOD(spi_setcrc, "I", spi_setcrc(self, a), NONE)
+HANDLE_METHOD(spi_setsclksettle, "I", spi_setsclksettle(self, a), NONE)
+HANDLE_METHOD(spi_settrigger, "I", spi_settrigger(self, a), NONE)
+HANDLE_METHOD(spi_setjournal, "II", spi_setjournal(self, a, b), NONE)
+HANDLE_METHOD(spi_setoverview, "I", spi_setoverview(self, a), NONE)
+HANDLE_METHOD(spi_setclockrecords, "II", spi_setclockrecords(self, a, b), NONE)
+HANDLE_METHOD(spi_setshutdownbudget, "I", spi_setshutdownbudget(self, a), NONE)
+HANDLE_METHOD(spi_setaffinity, "ii", spi_setaffinity(self, (int)a, (int)b), NONE)
+
+HANDLE_METHOD(spi_writeregister, "II", c = (unsigned)spi_writeregister(self, a, b), PyLong_FromLong((int)c))
+HANDLE_METHOD(spi_readregister, "I", c = spi_readregister(self, a), PyLong_FromUnsignedLong(c))
+HANDLE_METHOD(spi_verifyregisters, "", c = (unsigned)spi_verifyregisters(self), PyLong_FromLong((int)c))
+HANDLE_METHOD(spi_convertpair, "II", c = spi_convertpair(self, a, b), PyLong_FromUnsignedLong(c))
+HANDLE_METHOD(spi_setoversampling, "I", c = (unsigned)spi_setoversampling(self, a), PyLong_FromLong((int)c))
+HANDLE_METHOD(spi_scansclk, "I", c = (unsigned)spi_scansclk(self, a), PyLong_FromLong((int)c))
+HANDLE_METHOD(spi_waitstop, "I", c = (unsigned)spi_waitstop(self, a), PyLong_FromLong((int)c))
+
+//
+// Wrappers for the driver methods that take no handle.
+//
+static PyObject* py_spi_initialize(PyObject* module, PyObject* args)
+{
+    self_t self;
+    Py_BEGIN_ALLOW_THREADS
+    self = spi_initialize();
+    Py_END_ALLOW_THREADS
+    return PyBytes_FromStringAndSize((const char*)&self, sizeof(self));
+}
+
+static PyObject* py_read_powerlow(PyObject* module, PyObject* args)
+{
+    return PyLong_FromLong(read_powerlow());
+}
+
+static PyObject* py_spi_getbusytimeouts(PyObject* module, PyObject* args)
+{
+    return PyLong_FromUnsignedLong(spi_getbusytimeouts());
+}
+
+static PyObject* py_spi_getcrcerrors(PyObject* module, PyObject* args)
+{
+    return PyLong_FromUnsignedLong(spi_getcrcerrors());
+}
+
+static PyObject* py_spi_getshutdownlatency(PyObject* module, PyObject* args)
+{
+    return PyLong_FromLongLong(spi_getshutdownlatency());
+}
+
+static PyObject* py_spi_getsequencepairs(PyObject* module, PyObject* args)
+{
+    return PyLong_FromUnsignedLong(spi_getsequencepairs());
+}
+
+static PyObject* py_spi_getfirstsample(PyObject* module, PyObject* args)
+{
+    return PyLong_FromUnsignedLongLong(spi_getfirstsample());
+}
+
+//
+// Wrappers for the driver methods that take arrays, which are used in place.
+//
+static PyObject* py_spi_readregisters(PyObject* module, PyObject* args)
+{
+    PyObject *handle, *addressesobject, *valuesobject;
+    self_t self;
+    unsigned count;
+    if (!PyArg_ParseTuple(args, "OIOO", &handle, &count, &addressesobject, &valuesobject) || GetHandle(handle, &self) != 0)
+        return NULL;
+    Py_buffer addressesview, valuesview;
+    unsigned *addresses, *values;
+    if (GetArray(addressesobject, &addressesview, count, 0, 0, &addresses) != 0)
+        return NULL;
+    if (GetArray(valuesobject, &valuesview, count, 1, 0, &values) != 0)
+    {
+        ReleaseArray(&addressesview);
+        return NULL;
+    }
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = spi_readregisters(self, count, addresses, values);
+    Py_END_ALLOW_THREADS
+    ReleaseArray(&addressesview);
+    ReleaseArray(&valuesview);
+    return PyLong_FromLong(status);
+}
+
+//
+// spi_writeregisters() and spi_loadregisters() share this, readback being None for the latter.
+//
+static PyObject* WriteRegisters(PyObject* args, int load)
+{
+    PyObject *handle, *addressesobject, *valuesobject, *readbackobject = Py_None;
+    self_t self;
+    unsigned count;
+    if (!PyArg_ParseTuple(args, load ? "OIOO" : "OIOOO", &handle, &count, &addressesobject, &valuesobject, &readbackobject) ||
+        GetHandle(handle, &self) != 0)
+        return NULL;
+    Py_buffer addressesview, valuesview, readbackview;
+    unsigned *addresses, *values, *readback;
+    if (GetArray(addressesobject, &addressesview, count, 0, 0, &addresses) != 0)
+        return NULL;
+    if (GetArray(valuesobject, &valuesview, count, 0, 0, &values) != 0)
+    {
+        ReleaseArray(&addressesview);
+        return NULL;
+    }
+    if (GetArray(readbackobject, &readbackview, count, 1, 1, &readback) != 0)
+    {
+        ReleaseArray(&addressesview);
+        ReleaseArray(&valuesview);
+        return NULL;
+    }
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = load ? spi_loadregisters(self, count, addresses, values) : spi_writeregisters(self, count, addresses, values, readback);
+    Py_END_ALLOW_THREADS
+    ReleaseArray(&addressesview);
+    ReleaseArray(&valuesview);
+    ReleaseArray(&readbackview);
+    return PyLong_FromLong(status);
+}
+
+static PyObject* py_spi_writeregisters(PyObject* module, PyObject* args)
+{
+    return WriteRegisters(args, 0);
+}
+
+static PyObject* py_spi_loadregisters(PyObject* module, PyObject* args)
+{
+    return WriteRegisters(args, 1);
+}
+
+static PyObject* py_spi_readconversion(PyObject* module, PyObject* args)
+{
+    PyObject *handle, *conversionsobject;
+    self_t self;
+    unsigned count;
+    if (!PyArg_ParseTuple(args, "OIO", &handle, &count, &conversionsobject) || GetHandle(handle, &self) != 0)
+        return NULL;
+    Py_buffer conversionsview;
+    unsigned* conversions;
+    if (GetArray(conversionsobject, &conversionsview, count, 1, 0, &conversions) != 0)
+        return NULL;
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = spi_readconversion(self, count, conversions);
+    Py_END_ALLOW_THREADS
+    ReleaseArray(&conversionsview);
+    return PyLong_FromLong(status);
+}
+
+static PyObject* py_spi_capture(PyObject* module, PyObject* args)
+{
+    PyObject *handle, *conversionsobject, *timestampsobject;
+    self_t self;
+    unsigned nframes;
+    if (!PyArg_ParseTuple(args, "OIOO", &handle, &nframes, &conversionsobject, &timestampsobject) || GetHandle(handle, &self) != 0)
+        return NULL;
+    Py_buffer conversionsview, timestampsview;
+    unsigned* conversions;
+    unsigned long long* timestamps;
+    if (GetArray(conversionsobject, &conversionsview, nframes * spi_getsequencepairs(), 1, 0, &conversions) != 0)
+        return NULL;
+    if (GetBuffer(timestampsobject, &timestampsview, nframes, sizeof(*timestamps), 1, 1, (void**)&timestamps) != 0)
+    {
+        ReleaseArray(&conversionsview);
+        return NULL;
+    }
+    int frames;
+    Py_BEGIN_ALLOW_THREADS
+    frames = spi_capture(self, nframes, conversions, timestamps);
+    Py_END_ALLOW_THREADS
+    ReleaseArray(&conversionsview);
+    ReleaseArray(&timestampsview);
+    return PyLong_FromLong(frames);
+}
+
+static PyObject* py_spi_definesequence(PyObject* module, PyObject* args)
+{
+    PyObject *handle, *Aobject, *Bobject;
+    self_t self;
+    unsigned count;
+    if (!PyArg_ParseTuple(args, "OIOO", &handle, &count, &Aobject, &Bobject) || GetHandle(handle, &self) != 0)
+        return NULL;
+    Py_buffer Aview, Bview;
+    unsigned *Achannels, *Bchannels;
+    if (GetArray(Aobject, &Aview, count, 0, 0, &Achannels) != 0)
+        return NULL;
+    if (GetArray(Bobject, &Bview, count, 0, 0, &Bchannels) != 0)
+    {
+        ReleaseArray(&Aview);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    spi_definesequence(self, count, Achannels, Bchannels);
+    Py_END_ALLOW_THREADS
+    ReleaseArray(&Aview);
+    ReleaseArray(&Bview);
+    Py_RETURN_NONE;
+}
+
+static PyObject* py_spi_definechannels(PyObject* module, PyObject* args)
+{
+    PyObject *handle, *Aobject, *Bobject, *repeatsobject, *namesobject;
+    self_t self;
+    unsigned count, mask;
+    if (!PyArg_ParseTuple(args, "OIOOIOO", &handle, &count, &Aobject, &Bobject, &mask, &repeatsobject, &namesobject) || GetHandle(handle, &self) != 0)
+        return NULL;
+    char namesstring[STRING_LENGTH];
+    const char* names = GetString(namesobject, namesstring);
+    if (names == NULL && PyErr_Occurred())
+        return NULL;
+    Py_buffer Aview, Bview;
+    unsigned *Achannels, *Bchannels;
+    if (GetArray(Aobject, &Aview, count, 0, 0, &Achannels) != 0)
+        return NULL;
+    if (GetArray(Bobject, &Bview, count, 0, 0, &Bchannels) != 0)
+    {
+        ReleaseArray(&Aview);
+        return NULL;
+    }
+    Py_buffer repeatsview;
+    unsigned* repeats;
+    if (GetArray(repeatsobject, &repeatsview, __builtin_popcount(mask), 0, 1, &repeats) != 0)
+    {
+        ReleaseArray(&Aview);
+        ReleaseArray(&Bview);
+        return NULL;
+    }
+    int columns;
+    Py_BEGIN_ALLOW_THREADS
+    columns = spi_definechannels(self, count, Achannels, Bchannels, mask, repeats, names);
+    Py_END_ALLOW_THREADS
+    ReleaseArray(&Aview);
+    ReleaseArray(&Bview);
+    ReleaseArray(&repeatsview);
+    return PyLong_FromLong(columns);
+}
+
+//
+// Wrappers for the driver methods that take strings.
+//
+static PyObject* py_spi_settransport(PyObject* module, PyObject* args)
+{
+    PyObject *handle, *deviceobject;
+    self_t self;
+    unsigned transport, speed_hz;
+    char device[STRING_LENGTH];
+    if (!PyArg_ParseTuple(args, "OIOI", &handle, &transport, &deviceobject, &speed_hz) || GetHandle(handle, &self) != 0)
+        return NULL;
+    const char* devicestring = GetString(deviceobject, device);
+    if (devicestring == NULL && PyErr_Occurred())
+        return NULL;
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = spi_settransport(self, transport, devicestring, speed_hz);
+    Py_END_ALLOW_THREADS
+    return PyLong_FromLong(status);
+}
+
+static PyObject* py_spi_settelemetry(PyObject* module, PyObject* args)
+{
+    PyObject *handle, *pathobject;
+    self_t self;
+    unsigned interval_ms;
+    char path[STRING_LENGTH];
+    if (!PyArg_ParseTuple(args, "OOI", &handle, &pathobject, &interval_ms) || GetHandle(handle, &self) != 0)
+        return NULL;
+    const char* pathstring = GetString(pathobject, path);
+    if (pathstring == NULL && PyErr_Occurred())
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    spi_settelemetry(self, pathstring, interval_ms);
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyObject* py_spi_start(PyObject* module, PyObject* args)
+{
+    PyObject *handle, *pathobject, *filenameobject;
+    self_t self;
+    unsigned period, averagecount;
+    char path[STRING_LENGTH];
+    char filename[STRING_LENGTH];
+    if (!PyArg_ParseTuple(args, "OIIOO", &handle, &period, &averagecount, &pathobject, &filenameobject) || GetHandle(handle, &self) != 0)
+        return NULL;
+    if (GetString(pathobject, path) == NULL || GetString(filenameobject, filename) == NULL)
+    {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError, "path and filename are required");
+        return NULL;
+    }
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = spi_start(self, period, averagecount, path, filename);
+    Py_END_ALLOW_THREADS
+    return PyLong_FromLong(status);
+}
+
+#define METHOD(name) { #name, py_##name, METH_VARARGS, NULL }
+
+static PyMethodDef Methods[] = {
+    METHOD(spi_initialize),
+    METHOD(spi_open),
+    METHOD(spi_settransport),
+    METHOD(spi_terminate),
+    METHOD(read_powerlow),
+    METHOD(spi_writeregister),
+    METHOD(spi_readregister),
+    METHOD(spi_readregisters),
+    METHOD(spi_writeregisters),
+    METHOD(spi_verifyregisters),
+    METHOD(spi_readconversion),
+    METHOD(spi_capture),
+    METHOD(spi_getsequencepairs),
+    METHOD(spi_convertpair),
+    METHOD(spi_definesequence),
+    METHOD(spi_definechannels),
+    METHOD(spi_loadregisters),
+    METHOD(spi_setbusywait),
+    METHOD(spi_setoversampling),
+    METHOD(spi_getbusytimeouts),
+    METHOD(spi_setcrc),
+    METHOD(spi_getcrcerrors),
+    METHOD(spi_setsclksettle),
+    METHOD(spi_scansclk),
+    METHOD(spi_settrigger),
+    METHOD(spi_setjournal),
+    METHOD(spi_setoverview),
+    METHOD(spi_setclockrecords),
+    METHOD(spi_settelemetry),
+    METHOD(spi_setshutdownbudget),
+    METHOD(spi_setaffinity),
+    METHOD(spi_getshutdownlatency),
+    METHOD(spi_start),
+    METHOD(spi_stop),
+    METHOD(spi_waitstop),
+    METHOD(spi_getfirstsample),
+    { NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef Module = {
+    PyModuleDef_HEAD_INIT, "_ad7616", "Native interface to the AD7616 driver, see ad7616_api.py.", -1, Methods
+};
+
+PyMODINIT_FUNC PyInit__ad7616(void)
+{
+    return PyModule_Create(&Module);
+}
@@ -1,16 +1,11 @@
-import os
-import json
 import time
 
-configurationpath = '/trake/configuration'
+from trake_client import TrakeClient
 
-deployFile = configurationpath + '/' + '__runfile__.deploy'
+client = TrakeClient()
 
 time.sleep(5)
-if os.path.exists(deployFile):
-    os.remove(deployFile)
+client.Undeploy()
 
 time.sleep(5)
-runfileContent = '{"configurationName": "defaultconfig"}'
-with open(deployFile, 'w') as file:
-    file.write(runfileContent)
+client.Deploy('defaultconfig')
@@ -68,6 +68,12 @@ class DeployHandler(FileSystemEventHandler):
             print('File modified event: ' + event.src_path)
         self.handleNewOrModified(event.src_path)
 
+    def on_moved(self, event):
+        # trake_client.py writes the run file under another name and renames it into place.
+        if self.debug:
+            print('File moved event: ' + event.dest_path)
+        self.handleNewOrModified(event.dest_path)
+
     def on_deleted(self, event):
         self.handleDeleted(event.src_path)
 
@@ -140,6 +146,11 @@ class Watcher:
         self.observer.start()
         if self.debug:
             print("\nWatcher Running in {}/\n".format(self.directory))
+        # Configure the low-voltage pin once, rather than on every pass of the loop,
+        # so a failing supply is seen within one 100 ms pass.
+        GPIO.setmode(GPIO.BCM)
+        GPIO.setup(POWER_LOW_Pin, GPIO.IN)
+
         #try:
         while not self.handler.runstate.is_voltage_low():
             time.sleep(0.1)
@@ -150,16 +161,14 @@ class Watcher:
                 self.handler.runstate.Reset()
 
             # Capture the low-voltage state.
-            GPIO.setmode(GPIO.BCM)
-            GPIO.setup(POWER_LOW_Pin, GPIO.IN)
             if not GPIO.input(POWER_LOW_Pin):
                 if self.debug:
                     print('GPIO detected low voltage')
                 self.handler.runstate.voltageLow = True
-            GPIO.cleanup()
 
         #except:
         #    pass
+        GPIO.cleanup()
         self.observer.stop()
         self.observer.join()
         if self.debug:
@@ -11,6 +11,12 @@ class TemperatureRake:
     configuration = self.runstate.get_configuration()
 
     with AD7616(print_diagnostic=self.debugdriver) as chip:
+      # The hardware SPI transport resets the chip, so it is selected before any register is written.
+      if 'spidev' in configuration:
+        chip.SetTransport(AD7616.Transport.SPIDEV.value, configuration['spidev'], configuration.get('spidevhz', 0))
+      elif configuration.get('capture', False):
+        chip.SetTransport(AD7616.Transport.CAPTURE.value, None)
+
       self.SetConversionScaleForAllChannels(chip)
 
       # Define a conversion sequence.  This will apply from this point on.
@@ -36,14 +42,51 @@ class TemperatureRake:
       if 'datafolder' in configuration:
         datafolder = configuration['datafolder']
 
-      chip.Start(sampleperiodms, averagecount, datafolder, datafile)
+      if configuration.get('sclksettle') == 'scan':
+        chip.ScanSclk()
+      else:
+        chip.SetSclkSettle(configuration.get('sclksettle', 0))
+
+      chip.SetCrc(AD7616.Crc[configuration.get('crc', 'off').upper()].value)
+
+      if 'busywait' in configuration:
+        chip.SetBusyWait(AD7616.BusyWait[configuration['busywait'].upper()].value, configuration.get('busytimeoutus', 100000))
+
+      if configuration.get('journal', False):
+        chip.SetJournal(True, configuration.get('journalflushms', 1000))
+
+      if 'overview' in configuration:
+        chip.SetOverview(configuration['overview'])
+
+      if 'clockrecordms' in configuration or 'rtc' in configuration:
+        chip.SetClockRecords(configuration.get('clockrecordms', 10000), configuration.get('rtc', True))
+
+      chip.SetTelemetry(configuration.get('telemetry', '/trake/telemetry.sock'), configuration.get('telemetryms', 100))
+
+      if configuration.get('trigger', 'software') == 'hardware':
+        chip.SetTrigger(AD7616.Trigger.HARDWARE.value)
+
+      if 'shutdownbudgetms' in configuration:
+        chip.SetShutdownBudget(configuration['shutdownbudgetms'])
+
+      if 'samplercpu' in configuration or 'writercpu' in configuration:
+        chip.SetAffinity(configuration.get('samplercpu', -1), configuration.get('writercpu', -1))
+
+      status = chip.Start(sampleperiodms, averagecount, datafolder, datafile)
+      if status < 0:
+        print('Data acquisition failed to start: ' + AD7616.StartStatus(status).name)
+        return
+      if status != AD7616.StartStatus.OK.value:
+        degraded = [flag.name for flag in AD7616.StartStatus if flag.value > 0 and status & flag.value]
+        print('Data acquisition started degraded: ' + ', '.join(degraded))
 
       try:
         power_low = 0
 
         while power_low == 0 and self.runstate.is_running():
-          time.sleep(10)
-          power_low = chip.ReadPowerLow()
+          # The driver stops by itself, and saves its data, as soon as it sees low voltage.
+          stopped = chip.WaitForStop(10000)
+          power_low = chip.ReadPowerLow() or stopped == AD7616.Stopped.POWER_LOW.value
 
           if power_low != 0:
             if self.debug:
@@ -56,16 +99,30 @@ class TemperatureRake:
         print('Data acquisition stopping: is_running=' + str(self.runstate.is_running()) + ' voltage_low=' + str(self.runstate.is_voltage_low()))
       chip.Stop()
 
+      shutdownlatency = chip.ShutdownLatency()
+      if shutdownlatency >= 0:
+        print('Low-voltage shutdown saved data in ' + str(shutdownlatency) + ' us')
+
+      busytimeouts = chip.BusyTimeouts()
+      if busytimeouts != 0:
+        print('Data acquisition had ' + str(busytimeouts) + ' conversions time out waiting for BUSY')
+
+      crcerrors = chip.CrcErrors()
+      if crcerrors != 0:
+        print('Data acquisition had ' + str(crcerrors) + ' readouts fail their CRC')
+
 
   def SetConversionScaleForAllChannels(self, chip):
     # Write an input range of +-2.5V to all channels.
     if self.debug:
       print('Setting +-2.5V range for all channels')
     range = AD7616.Range.PLUS_MINUS_2_5V.value << 6 | AD7616.Range.PLUS_MINUS_2_5V.value << 4 | AD7616.Range.PLUS_MINUS_2_5V.value << 2 | AD7616.Range.PLUS_MINUS_2_5V.value
-    chip.WriteRegister(AD7616.Register.RANGEA_0_3.value, range)   # Input range for A-side channels 0-3.
-    chip.WriteRegister(AD7616.Register.RANGEA_4_7.value, range)   # Input range for A-side channels 4-7.
-    chip.WriteRegister(AD7616.Register.RANGEB_0_3.value, range)   # Input range for B-side channels 0-3.
-    chip.WriteRegister(AD7616.Register.RANGEB_4_7.value, range)   # Input range for B-side channels 4-7.
+    # Verified with the rest of the configuration, in DefineConversionSequence().
+    chip.WriteRegisters([(AD7616.Register.RANGEA_0_3.value, range),    # Input range for A-side channels 0-3.
+                         (AD7616.Register.RANGEA_4_7.value, range),    # Input range for A-side channels 4-7.
+                         (AD7616.Register.RANGEB_0_3.value, range),    # Input range for B-side channels 0-3.
+                         (AD7616.Register.RANGEB_4_7.value, range)],   # Input range for B-side channels 4-7.
+                        verify=False)
 
   def DefineConversionSequence(self, chip):
     # Normal acquisition mode is started by defining the channels to be read
@@ -95,9 +152,37 @@ class TemperatureRake:
       if 'Bchannels' in configuration['channelmap']:
         Bchannels = configuration['channelmap']['Bchannels']
 
-    chip.DefineSequence(Achannels, Bchannels)
-
-    configRegister = chip.ReadRegister(AD7616.Register.CONFIGURATION.value)
-    configRegister |= 0x1c
-    chip.WriteRegister(AD7616.Register.CONFIGURATION.value, configRegister)
+    # Only the columns selected by 'channelmask', a number or a string such as "0x4444", with
+    # bit i for column i of the whole map, A channels first, are converted and stored, named
+    # by 'channelnames', e.g. {"2": "T4", "6": "T3", "10": "T1", "14": "T2"} for a rake with
+    # one thermistor per board.  With names but no mask, the named columns are selected.
+    # 'channelrepeat' converts some columns several times per sample period, e.g.
+    # {"10": 4, "14": 4} for the two thermistors at the interface, with no mask all of them.
+    names = configuration.get('channelnames', {})
+    repeat = configuration.get('channelrepeat', {})
+    mask = configuration.get('channelmask')
+    if isinstance(mask, str):
+      mask = int(mask, 0)
+    if mask is None and names:
+      mask = sum(1 << int(column) for column in names)
+    if mask is None and repeat:
+      mask = (1 << (2 * len(Achannels))) - 1
+
+    if mask is None:
+      chip.DefineSequence(Achannels, Bchannels)
+    else:
+      columns = [column for column in range(2 * len(Achannels)) if mask & (1 << column)]
+      if chip.DefineChannels(Achannels, Bchannels, mask, [names.get(str(column), 'Channel%d' % column) for column in columns],
+                             [int(repeat.get(str(column), 1)) for column in columns]) < 0:
+        print('Channel mask ' + hex(mask) + ' or repeats do not fit the channel map, using all of it')
+        chip.DefineSequence(Achannels, Bchannels)
+
+    # On-chip oversampling, on top of the software average of Start().
+    if not chip.SetOversampling(configuration.get('oversampling', 128)):
+      chip.SetOversampling(128)
+
+    # Confirm the chip holds the whole configuration, in one transaction.
+    failed = chip.VerifyRegisters()
+    if failed != 0 and self.debug:
+      print(str(failed) + ' registers failed to verify')
 
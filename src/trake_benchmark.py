@@ -0,0 +1,116 @@
+import os
+import time
+import resource
+import argparse
+import numpy
+from ad7616_api import AD7616
+from trake_reader_api import TrakeFile
+
+""" Oversampling benchmark.
+
+    The noise of a channel can be lowered by the chip's on-chip oversampling, which
+    averages in hardware but lengthens every conversion, and by the software average of
+    Start(), which costs the acquisition thread a readout per sample.  This tool acquires
+    for a few seconds at every combination of oversampling ratio and average count, and
+    reports the noise floor, the line rate achieved, the frames missed and the CPU time
+    used, so the cheapest setting that meets a resolution target can be chosen.  With
+    --target-lsb, it recommends one.
+
+    The noise is estimated from the differences of successive lines, which removes the
+    slowly changing temperature, so the inputs should be connected and steady, or shorted.
+
+    It must not run while trake_daemon or temperature_rake.py is acquiring.
+
+    Usage: sudo python3 trake_benchmark.py [-p period_ms] [-s seconds] [--target-lsb noise]
+"""
+
+LSB_uV = 5e6 / 65536    # One code of the +-2.5V input range, in microvolts.
+
+
+def Acquire(chip, ratio, averagecount, period, seconds, folder):
+  """ Acquire for seconds at one setting, and measure it.  Returns a dictionary of results,
+      or None if the setting is not valid.
+  """
+  if not chip.SetOversampling(ratio):
+    return None
+  filename = 'benchmark_os%d_avg%d.csv' % (ratio, averagecount)
+  path = os.path.join(folder, filename)
+
+  busytimeouts = chip.BusyTimeouts()
+  usage = resource.getrusage(resource.RUSAGE_SELF)
+  wall = time.monotonic()
+  if chip.Start(period, averagecount, folder, filename) < 0:
+    return None
+  time.sleep(seconds)
+  chip.Stop()
+  wall = time.monotonic() - wall
+  after = resource.getrusage(resource.RUSAGE_SELF)
+  cpu = (after.ru_utime - usage.ru_utime) + (after.ru_stime - usage.ru_stime)
+
+  with TrakeFile(path, indexfile=False) as data:
+    times, aux, samples = data.Read()
+    sequences = data.Sequences()
+  os.remove(path)
+  for extension in ('.idx', '.ovr'):
+    if os.path.exists(path + extension):
+      os.remove(path + extension)
+
+  lines = len(times)
+  missed = 0
+  if lines > 1:
+    missed = int(numpy.maximum(numpy.diff(sequences.astype(numpy.int64)) - averagecount, 0).sum())
+  noise = float('nan')
+  if lines > 2:
+    # Samples are stored offset binary, 0x8000 at 0 V, so a shorted input does not wrap.
+    # The difference of two lines has twice the variance of one, and no signal that
+    # changes slowly.
+    codes = samples.astype(numpy.float64)
+    noise = float(numpy.median(numpy.diff(codes, axis=1).std(axis=1)) / numpy.sqrt(2))
+  rate = (lines - 1) * 1e6 / float(times[-1] - times[0]) if lines > 1 and times[-1] > times[0] else 0.0
+  return {'oversampling': ratio, 'averagecount': averagecount, 'lines': lines, 'rate': rate,
+          'target': 1000.0 / (period * averagecount), 'missed': missed, 'noise': noise,
+          'cpu': 100.0 * cpu / wall, 'busytimeouts': chip.BusyTimeouts() - busytimeouts}
+
+
+def Benchmark(ratios, averages, period, seconds, folder, target):
+  results = []
+  with AD7616() as chip:
+    range = AD7616.Range.PLUS_MINUS_2_5V.value << 6 | AD7616.Range.PLUS_MINUS_2_5V.value << 4 | AD7616.Range.PLUS_MINUS_2_5V.value << 2 | AD7616.Range.PLUS_MINUS_2_5V.value
+    chip.WriteRegisters([(AD7616.Register.RANGEA_0_3.value, range), (AD7616.Register.RANGEA_4_7.value, range),
+                         (AD7616.Register.RANGEB_0_3.value, range), (AD7616.Register.RANGEB_4_7.value, range)], verify=False)
+    chip.DefineSequence([0, 1, 2, 3, 4, 5, 6, 7], [0, 1, 2, 3, 4, 5, 6, 7])
+
+    print('%5s %5s %8s %10s %10s %8s %10s %10s %6s' % ('OS', 'Avg', 'Lines', 'Rate/s', 'Target/s', 'Missed', 'Noise LSB', 'Noise uV', 'CPU%'))
+    for ratio in ratios:
+      for averagecount in averages:
+        result = Acquire(chip, ratio, averagecount, period, seconds, folder)
+        if result is None:
+          print('%5d %5d  failed' % (ratio, averagecount))
+          continue
+        results.append(result)
+        print('%5d %5d %8d %10.1f %10.1f %8d %10.2f %10.1f %6.1f' % (ratio, averagecount, result['lines'], result['rate'], result['target'],
+                                                                     result['missed'], result['noise'], result['noise'] * LSB_uV, result['cpu']))
+
+  if target is not None:
+    # The cheapest setting that meets the target, and keeps up with its own line rate.
+    meets = [result for result in results if result['noise'] <= target and result['missed'] == 0]
+    if len(meets) == 0:
+      print('No setting reached %.2f LSB without missing frames' % target)
+    else:
+      best = min(meets, key=lambda result: (result['cpu'], -result['rate']))
+      print('Cheapest setting for %.2f LSB: "oversampling": %d, "averagecount": %d, %.1f lines/s, %.1f%% CPU'
+            % (target, best['oversampling'], best['averagecount'], best['rate'], best['cpu']))
+  return results
+
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser(description='Sweep oversampling ratio and average count, and measure noise, rate and CPU load.')
+  parser.add_argument('-r', '--ratios', default='1,2,4,8,16,32,64,128', help='oversampling ratios, comma separated')
+  parser.add_argument('-a', '--averages', default='1,2,5,10,20', help='software average counts, comma separated')
+  parser.add_argument('-p', '--period', type=int, default=1, help='sample period in ms')
+  parser.add_argument('-s', '--seconds', type=float, default=5, help='acquisition time of each setting')
+  parser.add_argument('-f', '--folder', default='/tmp', help='folder for the temporary data files')
+  parser.add_argument('--target-lsb', type=float, default=None, help='noise target, in codes, to recommend a setting for')
+  arguments = parser.parse_args()
+  Benchmark([int(ratio) for ratio in arguments.ratios.split(',')], [int(count) for count in arguments.averages.split(',')],
+            arguments.period, arguments.seconds, arguments.folder, arguments.target_lsb)
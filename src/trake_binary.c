@@ -0,0 +1,390 @@
+//
+// Binary acquisition file writer, and the decoding shared by its readers.  See
+// trake_binary.h for the layout.
+//
+// This file is compiled into the trake_reader.so library and the tools that
+// produce binary files.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trake_binary.h"
+#include "trake_journal.h"
+
+//
+// Returns: The CRC-32 of a segment header, with its crc field taken as zero, and its payload.
+//
+uint32_t binary_segmentcrc(const binarysegment_t* segment, const void* payload)
+{
+    binarysegment_t header = *segment;
+    header.crc = 0;
+
+    uint32_t crc = journal_crc32(0, &header, sizeof(header));
+    return journal_crc32(crc, payload, segment->payloadlength);
+}
+
+//
+// Internal methods to write and read varints, and to map signed differences to the
+// small unsigned values that make short varints.
+//
+static inline unsigned char* binary_putvarint(unsigned char* p, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = (unsigned char)value | 0x80;
+        value >>= 7;
+    }
+    *p++ = (unsigned char)value;
+    return p;
+}
+
+static inline const unsigned char* binary_getvarint(const unsigned char* p, const unsigned char* end, uint64_t* value)
+{
+    uint64_t result = 0;
+    for (unsigned shift = 0; p < end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *p++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            *value = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static inline uint64_t binary_zigzag(uint64_t difference)
+{
+    return (difference << 1) ^ (uint64_t)((int64_t)difference >> 63);
+}
+
+static inline uint64_t binary_unzigzag(uint64_t value)
+{
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
+//
+// Internal method to write a segment header and payload, padding the payload to a multiple of 8 bytes.
+//
+static int binary_writesegment(binarywriter_t* writer, binarysegment_t* segment, const void* payload)
+{
+    segment->magic = BINARY_SEGMENT_MAGIC;
+    segment->crc = binary_segmentcrc(segment, payload);
+    if (fwrite(segment, sizeof(*segment), 1, writer->file) != 1 ||
+        fwrite(payload, 1, segment->payloadlength, writer->file) != segment->payloadlength)
+        return -1;
+    return 0;
+}
+
+//
+// Internal method to write the frames collected so far as one data segment.
+//
+static int binary_flushdata(binarywriter_t* writer)
+{
+    unsigned count = writer->count;
+    if (count == 0)
+        return 0;
+
+    binarysegment_t segment = {};
+    segment.type = SEGMENT_DATA;
+    segment.count = count;
+    segment.firsttime = writer->time[0];
+    segment.lasttime = writer->time[count - 1];
+
+    // Lay the sample columns out back to back, as they will be in the file, then the varints.
+    uint64_t sampleslength = binary_sampleslength(count, writer->channels);
+    unsigned char* payload = calloc(1, BINARY_PAD8(sampleslength + (2 + 2 * (uint64_t)count) * 10));
+    if (payload == NULL)
+        return -1;
+    unsigned char* p = payload;
+    for (unsigned channel = 0; channel < writer->channels; channel++)
+    {
+        memcpy(p, writer->data + (size_t)channel * writer->segmentframes, count * sizeof(uint16_t));
+        p += count * sizeof(uint16_t);
+    }
+
+    p = payload + sampleslength;
+    p = binary_putvarint(p, writer->firstsequence);
+    p = binary_putvarint(p, writer->sequencestep);
+    uint64_t difference = 0;
+    for (unsigned frame = 1; frame < count; frame++)
+    {
+        uint64_t next = writer->time[frame] - writer->time[frame - 1];
+        p = binary_putvarint(p, binary_zigzag(next - difference));
+        difference = next;
+    }
+    for (unsigned frame = 0; frame < count; frame++)
+        p = binary_putvarint(p, writer->aux[frame]);
+    segment.payloadlength = BINARY_PAD8(p - payload);
+
+    int result = binary_writesegment(writer, &segment, payload);
+    free(payload);
+    writer->count = 0;
+    return result;
+}
+
+//
+// Create a binary acquisition file, replacing any existing file at path.
+//
+// Parameters:
+// writer: The writer to initialize.
+// path: The path of the file to create.
+// header: The CSV header line, without its newline, kept so a CSV file can be recreated exactly.
+// channels: The number of channel columns, up to BINARY_MAX_CHANNELS.
+// flags: BINARY_FLAG_ values.
+// segmentframes: The frames in a full data segment, or 0 for BINARY_SEGMENT_FRAMES.
+//
+// Returns: 0 on success, -1 on failure.
+//
+int binary_create(binarywriter_t* writer, const char* path, const char* header, unsigned channels, unsigned flags, unsigned segmentframes)
+{
+    memset(writer, 0, sizeof(*writer));
+    if (channels > BINARY_MAX_CHANNELS)
+        return -1;
+    if (segmentframes == 0)
+        segmentframes = BINARY_SEGMENT_FRAMES;
+
+    writer->channels = channels;
+    writer->segmentframes = segmentframes;
+    writer->time = malloc(segmentframes * sizeof(uint64_t));
+    writer->aux = malloc(segmentframes * sizeof(uint64_t));
+    writer->data = malloc((size_t)segmentframes * (channels ? channels : 1) * sizeof(uint16_t));
+    writer->file = fopen(path, "wb");
+    if (writer->time == NULL || writer->aux == NULL || writer->data == NULL || writer->file == NULL)
+        goto bad;
+
+    binaryheader_t fileheader = {};
+    fileheader.magic = BINARY_MAGIC;
+    fileheader.version = BINARY_VERSION;
+    fileheader.headersize = sizeof(fileheader);
+    fileheader.channels = channels;
+    fileheader.flags = flags;
+    fileheader.segmentframes = segmentframes;
+    fileheader.textlength = strlen(header);
+
+    static const char padding[8] = {};
+    uint64_t textpadding = BINARY_PAD8(fileheader.textlength) - fileheader.textlength;
+    if (fwrite(&fileheader, sizeof(fileheader), 1, writer->file) != 1 ||
+        fwrite(header, 1, fileheader.textlength, writer->file) != fileheader.textlength ||
+        fwrite(padding, 1, textpadding, writer->file) != textpadding)
+        goto bad;
+    return 0;
+
+bad:
+    if (writer->file != NULL)
+        fclose(writer->file);
+    free(writer->time);
+    free(writer->aux);
+    free(writer->data);
+    memset(writer, 0, sizeof(*writer));
+    return -1;
+}
+
+//
+// Append one frame.  values holds one sample for each channel.  Sequence numbers are
+// expected to go up by the same step from frame to frame; any other sequence number
+// ends the segment, so the gap is at a segment boundary.
+//
+// Returns: 0 on success, -1 on failure.
+//
+int binary_appendframe(binarywriter_t* writer, uint64_t sequence, uint64_t time, uint64_t aux, const uint16_t* values)
+{
+    if (writer->count == 1 && sequence > writer->firstsequence)
+        writer->sequencestep = sequence - writer->firstsequence;
+    else if (writer->count != 0 && sequence != writer->firstsequence + writer->count * writer->sequencestep &&
+             binary_flushdata(writer) != 0)
+        return -1;
+    if (writer->count == 0)
+    {
+        writer->firstsequence = sequence;
+        writer->sequencestep = 1;
+    }
+
+    unsigned index = writer->count;
+    writer->time[index] = time;
+    writer->aux[index] = aux;
+    for (unsigned channel = 0; channel < writer->channels; channel++)
+        writer->data[(size_t)channel * writer->segmentframes + index] = values[channel];
+
+    writer->count++;
+    if (writer->count == writer->segmentframes)
+        return binary_flushdata(writer);
+    return 0;
+}
+
+//
+// Internal method to write text as a segment of the given type, after the frames appended so far.
+//
+static int binary_appendtext(binarywriter_t* writer, unsigned type, const char* text, uint32_t length)
+{
+    if (binary_flushdata(writer) != 0)
+        return -1;
+
+    binarysegment_t segment = {};
+    segment.type = type;
+    segment.count = length;
+    segment.payloadlength = BINARY_PAD8(length);
+
+    char* payload = calloc(1, segment.payloadlength ? segment.payloadlength : 1);
+    if (payload == NULL)
+        return -1;
+    memcpy(payload, text, length);
+    int result = binary_writesegment(writer, &segment, payload);
+    free(payload);
+    return result;
+}
+
+//
+// Append comment text, normally one or more whole "#" lines with their newlines,
+// after the frames appended so far.
+//
+// Returns: 0 on success, -1 on failure.
+//
+int binary_appendcomment(binarywriter_t* writer, const char* text, uint32_t length)
+{
+    return binary_appendtext(writer, SEGMENT_COMMENT, text, length);
+}
+
+//
+// Append the bytes after the last newline of a CSV file, which are not a whole line.
+// Nothing should be appended after the trailer.
+//
+// Returns: 0 on success, -1 on failure.
+//
+int binary_appendtrailer(binarywriter_t* writer, const char* text, uint32_t length)
+{
+    return binary_appendtext(writer, SEGMENT_TRAILER, text, length);
+}
+
+//
+// Decode the sequence numbers, time and aux columns of a data segment, whose payload
+// must be in memory after its header.
+//
+// Parameters:
+// segment: The segment header, followed by its payload.
+// version: The version of the file, from its binaryheader_t.
+// channels: The number of channels in the file.
+// firstsequence, sequencestep: Receive the sequence number of the first frame and the
+//       step between frames, or NULL.  Version 1 files have no sequence numbers, and
+//       give 0 for both.
+// times, aux: Arrays of at least segment->count values to receive the columns, or NULL.
+//
+// Returns: 0 on success, -1 if the payload is damaged.
+//
+int binary_decodeframes(const binarysegment_t* segment, unsigned version, unsigned channels,
+                        uint64_t* firstsequence, uint64_t* sequencestep, uint64_t* times, uint64_t* aux)
+{
+    unsigned count = segment->count;
+    if (segment->payloadlength < binary_datalength(count, channels, version))
+        return -1;
+    if (version == BINARY_VERSION_COLUMNS)
+    {
+        const uint64_t* columns = (const uint64_t*)(segment + 1);
+        if (firstsequence != NULL)
+            *firstsequence = 0;
+        if (sequencestep != NULL)
+            *sequencestep = 0;
+        if (times != NULL)
+            memcpy(times, columns, count * sizeof(uint64_t));
+        if (aux != NULL)
+            memcpy(aux, columns + count, count * sizeof(uint64_t));
+        return 0;
+    }
+
+    const unsigned char* p = (const unsigned char*)(segment + 1) + binary_sampleslength(count, channels);
+    const unsigned char* end = (const unsigned char*)(segment + 1) + segment->payloadlength;
+    uint64_t sequence, step;
+    if ((p = binary_getvarint(p, end, &sequence)) == NULL || (p = binary_getvarint(p, end, &step)) == NULL)
+        return -1;
+    if (firstsequence != NULL)
+        *firstsequence = sequence;
+    if (sequencestep != NULL)
+        *sequencestep = step;
+    if (times == NULL && aux == NULL)
+        return 0;
+
+    uint64_t time = segment->firsttime;
+    uint64_t difference = 0;
+    if (times != NULL && count > 0)
+        times[0] = time;
+    for (unsigned frame = 1; frame < count; frame++)
+    {
+        uint64_t value;
+        if ((p = binary_getvarint(p, end, &value)) == NULL)
+            return -1;
+        difference += binary_unzigzag(value);
+        time += difference;
+        if (times != NULL)
+            times[frame] = time;
+    }
+    for (unsigned frame = 0; frame < count && aux != NULL; frame++)
+        if ((p = binary_getvarint(p, end, &aux[frame])) == NULL)
+            return -1;
+    return 0;
+}
+
+//
+// Parse a sequence record, SEQUENCE_RECORD "number=N,step=S,missed=M" and a newline,
+// as the driver writes into CSV files.
+//
+// Returns: 0 if text is a sequence record, with number and step set, -1 otherwise.
+//
+int binary_parsesequence(const char* text, size_t length, uint64_t* number, uint64_t* step)
+{
+    size_t prefix = sizeof(SEQUENCE_RECORD) - 1;
+    if (length < prefix || memcmp(text, SEQUENCE_RECORD, prefix) != 0)
+        return -1;
+
+    int found = 0;
+    uint64_t recordnumber = 0;
+    uint64_t recordstep = 1;
+    const char* end = text + length;
+    for (const char* p = text + prefix; p < end; )
+    {
+        const char* field = p;
+        while (p < end && *p != '=' && *p != ',' && *p != '\n')
+            p++;
+        size_t namelength = p - field;
+        uint64_t value = 0;
+        if (p < end && *p == '=')
+            for (p++; p < end && (unsigned)(*p - '0') < 10; p++)
+                value = value * 10 + (*p - '0');
+        if (namelength == 6 && memcmp(field, "number", 6) == 0)
+        {
+            recordnumber = value;
+            found = 1;
+        }
+        else if (namelength == 4 && memcmp(field, "step", 4) == 0 && value > 0)
+            recordstep = value;
+        while (p < end && *p != ',')
+            p++;
+        p++;
+    }
+    if (!found)
+        return -1;
+    *number = recordnumber;
+    *step = recordstep;
+    return 0;
+}
+
+//
+// Write any frames still collected, and close the file.
+//
+// Returns: 0 on success, -1 if anything failed to be written.
+//
+int binary_close(binarywriter_t* writer)
+{
+    if (writer->file == NULL)
+        return -1;
+
+    int result = binary_flushdata(writer);
+    if (fclose(writer->file) != 0)
+        result = -1;
+    free(writer->time);
+    free(writer->aux);
+    free(writer->data);
+    memset(writer, 0, sizeof(*writer));
+    return result;
+}
@@ -0,0 +1,55 @@
+//
+// Decoding of a conversion readout from sampled GPIO levels.  See trake_capture.h.
+//
+// This file is compiled into ad7616_driver.so, but uses nothing from pigpio, so it can
+// also be built on its own to decode recorded level dumps.
+//
+#include <string.h>
+
+#include "trake_capture.h"
+
+//
+// Recover the bits clocked out during the first CS-framed transfer in a run of level
+// samples.  The chip drives each bit on MISO after SCLK falls, so a bit is taken from
+// the last sample of each SCLK low phase, the one most settled, when SCLK rises again.
+// Samples may be periodic, or only those where a level changed; either way, each SCLK
+// phase must span at least one sample.
+//
+// Parameters:
+// samples: The level samples, in time order.
+// count: The number of samples.
+// pins: The masks of the CS, SCLK and MISO pins in the levels.
+// words: Receives the bits, most significant first, 32 to each word.  Bits after the
+//        last one decoded, up to the end of its word, are 0.
+// maxbits: The most bits words can hold.
+//
+// Returns: The number of bits decoded, 0 if CS never went low.  Decoding stops when CS
+//          goes high, the samples end, or maxbits is reached.
+//
+unsigned capture_decode(const capture_sample_t* samples, unsigned count, capture_pins_t pins, uint32_t* words, unsigned maxbits)
+{
+    memset(words, 0, ((maxbits + 31) / 32) * sizeof(*words));
+
+    unsigned i = 0;
+    while (i < count && (samples[i].level & pins.cs) != 0)
+        i++;
+    if (i == count)
+        return 0;
+
+    unsigned bits = 0;
+    uint32_t previous = samples[i].level;
+    for (i++; i < count && bits < maxbits; i++)
+    {
+        uint32_t level = samples[i].level;
+        if ((level & pins.cs) != 0)
+            break;
+        if ((previous & pins.sclk) == 0 && (level & pins.sclk) != 0)
+        {
+            if ((previous & pins.miso) != 0)
+                words[bits / 32] |= 0x80000000u >> (bits % 32);
+            bits++;
+        }
+        previous = level;
+    }
+    return bits;
+}
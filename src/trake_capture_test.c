@@ -0,0 +1,142 @@
+//
+// Test of capture_decode(), the decoder of the capture transport, with level dumps.
+// Each dump is the GPIO levels of a readout on SPI bus 1, CS on pin 18, SCLK on 21,
+// MOSI on 20 and SDOA on 19, as pigpio's sampler records them, with the words sent.
+//
+// To build on a Raspberry Pi, or any Linux machine, use this command in a terminal
+// prompt after changing to the directory with this file in it:
+//
+//gcc -Wall -I../include -o trake_capture_test trake_capture_test.c trake_capture.c
+//
+// Usage:
+// trake_capture_test
+//   Prints each failed check, and exits with 1 if any failed, 0 otherwise.
+//
+#include <stdio.h>
+#include <stdint.h>
+
+#include "trake_capture.h"
+
+static const capture_pins_t Pins = { 1u << 18, 1u << 21, 1u << 19 };
+
+//
+// A result pair, 0xa5c31234, and its CRC word, 0x5af0, sampled every 5 us as the
+// driver samples them, with each SCLK phase spanning two samples.
+//
+static const capture_sample_t PeriodicDump[] = {
+    { 3954120, 0x00340000 }, { 3954125, 0x00340000 }, { 3954130, 0x00340000 }, { 3954135, 0x00300000 },
+    { 3954140, 0x00300000 }, { 3954145, 0x00180000 }, { 3954150, 0x00180000 }, { 3954155, 0x00380000 },
+    { 3954160, 0x00380000 }, { 3954165, 0x00100000 }, { 3954170, 0x00100000 }, { 3954175, 0x00300000 },
+    { 3954180, 0x00300000 }, { 3954185, 0x00180000 }, { 3954190, 0x00180000 }, { 3954195, 0x00380000 },
+    { 3954200, 0x00380000 }, { 3954205, 0x00100000 }, { 3954210, 0x00100000 }, { 3954215, 0x00300000 },
+    { 3954220, 0x00300000 }, { 3954225, 0x00100000 }, { 3954230, 0x00100000 }, { 3954235, 0x00300000 },
+    { 3954240, 0x00300000 }, { 3954245, 0x00180000 }, { 3954250, 0x00180000 }, { 3954255, 0x00380000 },
+    { 3954260, 0x00380000 }, { 3954265, 0x00100000 }, { 3954270, 0x00100000 }, { 3954275, 0x00300000 },
+    { 3954280, 0x00300000 }, { 3954285, 0x00180000 }, { 3954290, 0x00180000 }, { 3954295, 0x00380000 },
+    { 3954300, 0x00380000 }, { 3954305, 0x00180000 }, { 3954310, 0x00180000 }, { 3954315, 0x00380000 },
+    { 3954320, 0x00380000 }, { 3954325, 0x00180000 }, { 3954330, 0x00180000 }, { 3954335, 0x00380000 },
+    { 3954340, 0x00380000 }, { 3954345, 0x00100000 }, { 3954350, 0x00100000 }, { 3954355, 0x00300000 },
+    { 3954360, 0x00300000 }, { 3954365, 0x00100000 }, { 3954370, 0x00100000 }, { 3954375, 0x00300000 },
+    { 3954380, 0x00300000 }, { 3954385, 0x00100000 }, { 3954390, 0x00100000 }, { 3954395, 0x00300000 },
+    { 3954400, 0x00300000 }, { 3954405, 0x00100000 }, { 3954410, 0x00100000 }, { 3954415, 0x00300000 },
+    { 3954420, 0x00300000 }, { 3954425, 0x00180000 }, { 3954430, 0x00180000 }, { 3954435, 0x00380000 },
+    { 3954440, 0x00380000 }, { 3954445, 0x00180000 }, { 3954450, 0x00180000 }, { 3954455, 0x00380000 },
+    { 3954460, 0x00380000 }, { 3954465, 0x00100000 }, { 3954470, 0x00100000 }, { 3954475, 0x00300000 },
+    { 3954480, 0x00300000 }, { 3954485, 0x00100000 }, { 3954490, 0x00100000 }, { 3954495, 0x00300000 },
+    { 3954500, 0x00300000 }, { 3954505, 0x00100000 }, { 3954510, 0x00100000 }, { 3954515, 0x00300000 },
+    { 3954520, 0x00300000 }, { 3954525, 0x00180000 }, { 3954530, 0x00180000 }, { 3954535, 0x00380000 },
+    { 3954540, 0x00380000 }, { 3954545, 0x00100000 }, { 3954550, 0x00100000 }, { 3954555, 0x00300000 },
+    { 3954560, 0x00300000 }, { 3954565, 0x00100000 }, { 3954570, 0x00100000 }, { 3954575, 0x00300000 },
+    { 3954580, 0x00300000 }, { 3954585, 0x00180000 }, { 3954590, 0x00180000 }, { 3954595, 0x00380000 },
+    { 3954600, 0x00380000 }, { 3954605, 0x00100000 }, { 3954610, 0x00100000 }, { 3954615, 0x00300000 },
+    { 3954620, 0x00300000 }, { 3954625, 0x00100000 }, { 3954630, 0x00100000 }, { 3954635, 0x00300000 },
+    { 3954640, 0x00300000 }, { 3954645, 0x00100000 }, { 3954650, 0x00100000 }, { 3954655, 0x00300000 },
+    { 3954660, 0x00300000 }, { 3954665, 0x00180000 }, { 3954670, 0x00180000 }, { 3954675, 0x00380000 },
+    { 3954680, 0x00380000 }, { 3954685, 0x00180000 }, { 3954690, 0x00180000 }, { 3954695, 0x00380000 },
+    { 3954700, 0x00380000 }, { 3954705, 0x00100000 }, { 3954710, 0x00100000 }, { 3954715, 0x00300000 },
+    { 3954720, 0x00300000 }, { 3954725, 0x00180000 }, { 3954730, 0x00180000 }, { 3954735, 0x00380000 },
+    { 3954740, 0x00380000 }, { 3954745, 0x00100000 }, { 3954750, 0x00100000 }, { 3954755, 0x00300000 },
+    { 3954760, 0x00300000 }, { 3954765, 0x00100000 }, { 3954770, 0x00100000 }, { 3954775, 0x00300000 },
+    { 3954780, 0x00300000 }, { 3954785, 0x00100000 }, { 3954790, 0x00100000 }, { 3954795, 0x00300000 },
+    { 3954800, 0x00300000 }, { 3954805, 0x00180000 }, { 3954810, 0x00180000 }, { 3954815, 0x00380000 },
+    { 3954820, 0x00380000 }, { 3954825, 0x00100000 }, { 3954830, 0x00100000 }, { 3954835, 0x00300000 },
+    { 3954840, 0x00300000 }, { 3954845, 0x00180000 }, { 3954850, 0x00180000 }, { 3954855, 0x00380000 },
+    { 3954860, 0x00380000 }, { 3954865, 0x00180000 }, { 3954870, 0x00180000 }, { 3954875, 0x00380000 },
+    { 3954880, 0x00380000 }, { 3954885, 0x00100000 }, { 3954890, 0x00100000 }, { 3954895, 0x00300000 },
+    { 3954900, 0x00300000 }, { 3954905, 0x00180000 }, { 3954910, 0x00180000 }, { 3954915, 0x00380000 },
+    { 3954920, 0x00380000 }, { 3954925, 0x00100000 }, { 3954930, 0x00100000 }, { 3954935, 0x00300000 },
+    { 3954940, 0x00300000 }, { 3954945, 0x00180000 }, { 3954950, 0x00180000 }, { 3954955, 0x00380000 },
+    { 3954960, 0x00380000 }, { 3954965, 0x00180000 }, { 3954970, 0x00180000 }, { 3954975, 0x00380000 },
+    { 3954980, 0x00380000 }, { 3954985, 0x00180000 }, { 3954990, 0x00180000 }, { 3954995, 0x00380000 },
+    { 3955000, 0x00380000 }, { 3955005, 0x00180000 }, { 3955010, 0x00180000 }, { 3955015, 0x00380000 },
+    { 3955020, 0x00380000 }, { 3955025, 0x00100000 }, { 3955030, 0x00100000 }, { 3955035, 0x00300000 },
+    { 3955040, 0x00300000 }, { 3955045, 0x00100000 }, { 3955050, 0x00100000 }, { 3955055, 0x00300000 },
+    { 3955060, 0x00300000 }, { 3955065, 0x00100000 }, { 3955070, 0x00100000 }, { 3955075, 0x00300000 },
+    { 3955080, 0x00300000 }, { 3955085, 0x00100000 }, { 3955090, 0x00100000 }, { 3955095, 0x00300000 },
+    { 3955100, 0x00300000 }, { 3955105, 0x00340000 }, { 3955110, 0x00340000 }, { 3955115, 0x00340000 },
+};
+
+//
+// A CRC word, 0xc3a5, with only the samples where a level changed, as a dump recorded
+// with a level change callback.  CS went high after 12 bits, ending the transfer early.
+//
+static const capture_sample_t ChangesDump[] = {
+    { 817200, 0x00340000 }, { 817203, 0x00300000 }, { 817206, 0x00180000 }, { 817209, 0x00380000 },
+    { 817212, 0x00180000 }, { 817215, 0x00380000 }, { 817218, 0x00100000 }, { 817221, 0x00300000 },
+    { 817224, 0x00100000 }, { 817227, 0x00300000 }, { 817230, 0x00100000 }, { 817233, 0x00300000 },
+    { 817236, 0x00100000 }, { 817239, 0x00300000 }, { 817242, 0x00180000 }, { 817245, 0x00380000 },
+    { 817248, 0x00180000 }, { 817251, 0x00380000 }, { 817254, 0x00180000 }, { 817257, 0x00380000 },
+    { 817260, 0x00100000 }, { 817263, 0x00300000 }, { 817266, 0x00180000 }, { 817269, 0x00380000 },
+    { 817272, 0x00100000 }, { 817275, 0x00300000 }, { 817278, 0x00340000 },
+};
+
+static int Failures = 0;
+
+//
+// Decode a dump, and check the number of bits and the words against those expected.
+//
+static void Check(const char* name, const capture_sample_t* samples, unsigned count, unsigned maxbits,
+                  unsigned expectedbits, const uint32_t* expected)
+{
+    uint32_t words[4];
+    unsigned bits = capture_decode(samples, count, Pins, words, maxbits);
+    if (bits != expectedbits)
+    {
+        printf("%s: decoded %u bits, expected %u\n", name, bits, expectedbits);
+        Failures++;
+        return;
+    }
+    for (unsigned i = 0; i < (maxbits + 31) / 32; i++)
+    {
+        if (words[i] != expected[i])
+        {
+            printf("%s: word %u is %08x, expected %08x\n", name, i, words[i], expected[i]);
+            Failures++;
+        }
+    }
+}
+
+int main()
+{
+    const unsigned periodicCount = sizeof(PeriodicDump) / sizeof(PeriodicDump[0]);
+    const unsigned changesCount = sizeof(ChangesDump) / sizeof(ChangesDump[0]);
+
+    static const uint32_t periodic[] = { 0xa5c31234, 0x5af00000 };
+    Check("periodic", PeriodicDump, periodicCount, 48, 48, periodic);
+
+    // Decoding stops at maxbits, and clears the rest of the last word.
+    static const uint32_t truncated[] = { 0xa5c31234 };
+    Check("periodic to 32 bits", PeriodicDump, periodicCount, 32, 32, truncated);
+
+    // CS went high after 12 bits, so only those are decoded.
+    static const uint32_t changes[] = { 0xc3a00000 };
+    Check("changes with CS high early", ChangesDump, changesCount, 16, 12, changes);
+
+    // Without the samples where CS is low, there is no transfer.
+    static const uint32_t none[] = { 0 };
+    Check("CS high", PeriodicDump, 3, 32, 0, none);
+
+    if (Failures == 0)
+        printf("capture_decode passed\n");
+    return Failures ? 1 : 0;
+}
@@ -0,0 +1,62 @@
+import os
+import json
+import time
+
+""" A thin client for the native acquisition daemon, trake_daemon.
+
+    The daemon is controlled the same way as deploy.py: a run file naming a
+    configuration in /trake/configuration starts acquisition, and deleting it stops
+    acquisition.  This client writes and removes the run file, and reads the state
+    the daemon publishes in /trake/status.json, so Python tools keep working
+    whichever of the two is deployed.
+"""
+
+configurationpath = '/trake/configuration'
+statuspath = '/trake/status.json'
+runfilepath = configurationpath + '/' + '__runfile__.deploy'
+
+
+class TrakeClient:
+  """ Controls and observes a running trake_daemon.
+  """
+
+  def Deploy(self, configurationName):
+    """ Start acquisition with the named configuration, which must exist as
+        /trake/configuration/<configurationName>.json
+        The run file is written under a temporary name and renamed into place, so the
+        daemon never reads it half written.
+    """
+    temporarypath = configurationpath + '/__runfile__.tmp'
+    with open(temporarypath, 'w') as runfile:
+      json.dump({'configurationName': configurationName}, runfile)
+    os.rename(temporarypath, runfilepath)
+
+  def Undeploy(self):
+    """ Stop acquisition, if it is running.
+    """
+    if os.path.exists(runfilepath):
+      os.remove(runfilepath)
+
+  def Status(self):
+    """ Return the state published by the daemon as a dictionary with the keys
+        'state' ('idle', 'running', 'stopped', 'failed' or 'powerlow'), 'pid',
+        'configurationName', 'datafile' and 'voltageLow', or None if the daemon
+        has not published any state.
+    """
+    try:
+      with open(statuspath, 'r') as statusfile:
+        return json.load(statusfile)
+    except (OSError, ValueError):
+      return None
+
+  def WaitForState(self, state, timeout_s=10):
+    """ Wait up to timeout_s seconds for the daemon to reach the given state.
+        Returns True if it did.
+    """
+    deadline = time.monotonic() + timeout_s
+    while time.monotonic() < deadline:
+      status = self.Status()
+      if status is not None and status.get('state') == state:
+        return True
+      time.sleep(0.1)
+    return False
@@ -0,0 +1,806 @@
+//
+// Convert acquisition files between the CSV format written by the driver and the
+// binary format of trake_binary.h, in either direction, exactly.
+//
+// CSV files are converted a window at a time.  Each window is split at newline
+// boundaries into one chunk per thread, the chunks are parsed in parallel, and the
+// frames and comments are then written to the binary file in their original order.
+// Binary files are converted back by formatting their segments in parallel.
+//
+// The conversion is exact: converting the binary file back gives the CSV file byte for
+// byte, including the header line, "#" records, and a partial last line left by a loss
+// of power.  A CSV file with any line that would not come back the same, for example
+// with leading zeros or carriage returns, is not converted.  Unless -n is given, every
+// CSV file is converted back in memory after it is written and compared with the original.
+//
+// The sequence records of a CSV file are kept as comments, and also number the frames
+// of the binary file, which has the same gaps at segment boundaries.
+//
+// A binary file made from a CSV file also gets an overview, <file>.trk.ovr, as the driver
+// writes during acquisition, so plotting tools can show archived files at any zoom.
+//
+// To build on a Raspberry Pi or a workstation, use this command in a terminal prompt
+// after changing to the directory with this file in it:
+//
+//gcc -O2 -Wall -pthread -I../include -o trake_convert trake_convert.c trake_binary.c trake_journal.c trake_overview.c
+//
+// Usage:
+// trake_convert [-f] [-n] [-j threads] [-o output] file...
+//   file:    A CSV file (yyyy-mm-dd_hh.mm.ss.csv) to convert to binary, or a binary
+//            file (yyyy-mm-dd_hh.mm.ss.trk) to convert to CSV.
+//   -o:      The output file, when one file is converted.  Defaults to the input path
+//            with its extension changed to .trk or .csv.
+//   -j:      The number of threads.  Defaults to one per online CPU.
+//   -n:      Do not verify CSV conversions by converting back.
+//   -f:      Replace output files that already exist.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trake_binary.h"
+#include "trake_overview.h"
+
+#define FilePathLength 1000
+#define MaxThreads 64
+#define WindowSize (16 * 1024 * 1024)       // Bytes of CSV text parsed in parallel at a time.
+#define BatchSegments 8                     // Binary segments formatted by each thread at a time.
+#define MaxDigits 20                        // Digits in the largest 64-bit value.
+
+static unsigned Threads = 0;
+
+//
+// A "#" line found while parsing a chunk, and the number of frames in the chunk before it.
+//
+typedef struct {
+    uint64_t frame;
+    const char* text;
+    uint32_t length;
+} comment_t;
+
+//
+// A chunk of whole CSV lines, and what parsing it found.
+//
+typedef struct {
+    const char* start;
+    const char* end;
+    unsigned channels;
+    int noaux;
+    uint64_t frames;
+    uint64_t capacity;
+    uint64_t* time;
+    uint64_t* aux;
+    uint16_t* values;                       // channels values for each frame, frame by frame.
+    comment_t* comments;
+    unsigned commentcount;
+    unsigned commentcapacity;
+    const char* error;                      // The first line that could not be converted exactly, or NULL.
+} chunk_t;
+
+//
+// Where formatted CSV text goes: to a file, or compared with the original CSV text.
+//
+typedef struct {
+    FILE* file;
+    const char* expected;
+    size_t expectedlength;
+    size_t position;
+    int failed;
+} sink_t;
+
+static void usage()
+{
+    fprintf(stderr, "Usage: trake_convert [-f] [-n] [-j threads] [-o output] file...\n");
+}
+
+//
+// Map a whole file read-only.
+//
+// Returns: The mapping, or NULL on failure.
+//
+static const char* MapFile(const char* path, size_t* size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat status;
+    void* map = NULL;
+    if (fstat(fd, &status) == 0 && status.st_size > 0)
+    {
+        *size = status.st_size;
+        map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+        else
+            madvise(map, *size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return map;
+}
+
+//
+// Parse an unsigned decimal number written the way printf("%llu") writes it, so that
+// formatting it again gives the same text: no sign, and no leading zeros.
+//
+// Returns: A pointer to the first character after the number, or NULL if it is not in that form.
+//
+static inline const char* ParseCanonical(const char* p, const char* end, uint64_t* value)
+{
+    if (p >= end || (unsigned)(*p - '0') > 9)
+        return NULL;
+    if (*p == '0')
+    {
+        *value = 0;
+        p++;
+        return (p < end && (unsigned)(*p - '0') <= 9) ? NULL : p;
+    }
+
+    const char* start = p;
+    uint64_t number = 0;
+    while (p < end && (unsigned)(*p - '0') <= 9)
+        number = number * 10 + (*p++ - '0');
+    if (p - start >= MaxDigits)
+        return NULL;
+    *value = number;
+    return p;
+}
+
+//
+// Format an unsigned decimal number.
+//
+// Returns: A pointer to the first character after the number.
+//
+static inline char* FormatNumber(char* p, uint64_t value)
+{
+    char digits[MaxDigits];
+    unsigned count = 0;
+    do
+    {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    while (count > 0)
+        *p++ = digits[--count];
+    return p;
+}
+
+static int GrowChunk(chunk_t* chunk)
+{
+    uint64_t capacity = chunk->capacity ? chunk->capacity * 2 : 65536;
+    uint64_t* time = realloc(chunk->time, capacity * sizeof(uint64_t));
+    if (time != NULL)
+        chunk->time = time;
+    uint64_t* aux = realloc(chunk->aux, capacity * sizeof(uint64_t));
+    if (aux != NULL)
+        chunk->aux = aux;
+    uint16_t* values = realloc(chunk->values, capacity * (chunk->channels ? chunk->channels : 1) * sizeof(uint16_t));
+    if (values != NULL)
+        chunk->values = values;
+    if (time == NULL || aux == NULL || values == NULL)
+        return -1;
+    chunk->capacity = capacity;
+    return 0;
+}
+
+//
+// Thread to parse the lines of one chunk.
+//
+static void* ParseChunk(void* arg)
+{
+    chunk_t* chunk = arg;
+    chunk->frames = 0;
+    chunk->commentcount = 0;
+    chunk->error = NULL;
+
+    const char* line = chunk->start;
+    while (line < chunk->end)
+    {
+        const char* newline = memchr(line, '\n', chunk->end - line);
+        if (*line == '#')
+        {
+            if (chunk->commentcount == chunk->commentcapacity)
+            {
+                unsigned capacity = chunk->commentcapacity ? chunk->commentcapacity * 2 : 16;
+                comment_t* comments = realloc(chunk->comments, capacity * sizeof(comment_t));
+                if (comments == NULL)
+                    goto bad;
+                chunk->comments = comments;
+                chunk->commentcapacity = capacity;
+            }
+            comment_t* comment = &chunk->comments[chunk->commentcount++];
+            comment->frame = chunk->frames;
+            comment->text = line;
+            comment->length = newline + 1 - line;
+            line = newline + 1;
+            continue;
+        }
+
+        if (chunk->frames == chunk->capacity && GrowChunk(chunk) != 0)
+            goto bad;
+        uint64_t frame = chunk->frames;
+        const char* p = ParseCanonical(line, newline, &chunk->time[frame]);
+        if (p == NULL)
+            goto bad;
+        chunk->aux[frame] = 0;
+        if (!chunk->noaux)
+        {
+            if (*p != '(' || (p = ParseCanonical(p + 1, newline, &chunk->aux[frame])) == NULL || *p != ')')
+                goto bad;
+            p++;
+        }
+        uint16_t* values = chunk->values + frame * chunk->channels;
+        for (unsigned channel = 0; channel < chunk->channels; channel++)
+        {
+            uint64_t value;
+            if (*p != ',' || (p = ParseCanonical(p + 1, newline, &value)) == NULL || value > 0xffff)
+                goto bad;
+            values[channel] = value;
+        }
+        if (p != newline)
+            goto bad;
+        chunk->frames++;
+        line = newline + 1;
+    }
+    return NULL;
+
+bad:
+    chunk->error = line;
+    return NULL;
+}
+
+//
+// Write the formatted text to the sink.
+//
+static void SinkWrite(sink_t* sink, const char* text, size_t length)
+{
+    if (sink->failed)
+        return;
+    if (sink->file != NULL)
+    {
+        if (fwrite(text, 1, length, sink->file) != length)
+            sink->failed = 1;
+    }
+    else if (sink->position + length > sink->expectedlength || memcmp(sink->expected + sink->position, text, length) != 0)
+        sink->failed = 1;
+    sink->position += length;
+}
+
+//
+// The binary segments being formatted as CSV text, shared by the formatting threads.
+//
+typedef struct {
+    const binarysegment_t** segments;
+    unsigned count;
+    unsigned version;
+    unsigned channels;
+    int noaux;
+    unsigned next;                          // Taken atomically by each thread in turn.
+    char** buffers;                         // The text of each data segment.
+    size_t* lengths;
+    size_t* capacities;
+    int failed;
+} batch_t;
+
+//
+// Internal method to format one data segment as CSV lines.
+//
+static int FormatSegment(batch_t* batch, unsigned index)
+{
+    const binarysegment_t* segment = batch->segments[index];
+    if (binary_segmentcrc(segment, segment + 1) != segment->crc)
+        return -1;
+
+    unsigned channels = batch->channels;
+    size_t needed = (size_t)segment->count * (2 * MaxDigits + 4 + channels * 6);
+    if (batch->capacities[index] < needed)
+    {
+        free(batch->buffers[index]);
+        batch->buffers[index] = malloc(needed);
+        if (batch->buffers[index] == NULL)
+        {
+            batch->capacities[index] = 0;
+            return -1;
+        }
+        batch->capacities[index] = needed;
+    }
+
+    uint64_t* time = malloc(2 * (size_t)segment->count * sizeof(uint64_t));
+    const uint64_t* aux = time + segment->count;
+    const uint16_t* data = binary_samples(segment, batch->version);
+    if (time == NULL || binary_decodeframes(segment, batch->version, channels, NULL, NULL, time, time + segment->count) != 0)
+    {
+        free(time);
+        return -1;
+    }
+    char* p = batch->buffers[index];
+    for (uint32_t frame = 0; frame < segment->count; frame++)
+    {
+        p = FormatNumber(p, time[frame]);
+        if (!batch->noaux)
+        {
+            *p++ = '(';
+            p = FormatNumber(p, aux[frame]);
+            *p++ = ')';
+        }
+        for (unsigned channel = 0; channel < channels; channel++)
+        {
+            *p++ = ',';
+            p = FormatNumber(p, data[(size_t)channel * segment->count + frame]);
+        }
+        *p++ = '\n';
+    }
+    batch->lengths[index] = p - batch->buffers[index];
+    free(time);
+    return 0;
+}
+
+static void* FormatThread(void* arg)
+{
+    batch_t* batch = arg;
+    unsigned index;
+    while ((index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count)
+        if (batch->segments[index]->type == SEGMENT_DATA && FormatSegment(batch, index) != 0)
+            __atomic_store_n(&batch->failed, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+//
+// Run a thread function on threads threads, including the calling thread.
+//
+static void RunThreads(void* (*function)(void*), void** args, unsigned threads)
+{
+    pthread_t thread_ids[MaxThreads];
+    int started[MaxThreads] = {};
+    for (unsigned i = 1; i < threads; i++)
+        started[i] = pthread_create(&thread_ids[i], NULL, function, args[i]) == 0;
+    function(args[0]);
+    for (unsigned i = 1; i < threads; i++)
+    {
+        if (started[i])
+            pthread_join(thread_ids[i], NULL);
+        else
+            function(args[i]);
+    }
+}
+
+//
+// Format a mapped binary file as CSV text into the sink.
+//
+// Returns: 0 on success, -1 if the file is not a binary acquisition file, is damaged, or the sink failed.
+//
+static int BinaryToCsv(const char* map, size_t size, sink_t* sink, const char* path)
+{
+    const binaryheader_t* header = (const binaryheader_t*)map;
+    if (size < sizeof(*header) || header->magic != BINARY_MAGIC ||
+        (header->version != BINARY_VERSION && header->version != BINARY_VERSION_COLUMNS) ||
+        header->headersize < sizeof(*header) || header->channels > BINARY_MAX_CHANNELS ||
+        header->headersize + (uint64_t)header->textlength > size)
+    {
+        fprintf(stderr, "%s is not a binary acquisition file\n", path);
+        return -1;
+    }
+    SinkWrite(sink, map + header->headersize, header->textlength);
+    SinkWrite(sink, "\n", 1);
+
+    // Find all segments first, so they can be formatted in parallel.
+    unsigned count = 0;
+    unsigned capacity = 1024;
+    const binarysegment_t** segments = malloc(capacity * sizeof(*segments));
+    uint64_t position = BINARY_PAD8(header->headersize + (uint64_t)header->textlength);
+    while (segments != NULL && position + sizeof(binarysegment_t) <= size)
+    {
+        const binarysegment_t* segment = (const binarysegment_t*)(map + position);
+        uint64_t end = position + sizeof(*segment) + segment->payloadlength;
+        if (segment->magic != BINARY_SEGMENT_MAGIC || end > size ||
+            (segment->type == SEGMENT_DATA && segment->payloadlength < binary_datalength(segment->count, header->channels, header->version)) ||
+            (segment->type != SEGMENT_DATA && segment->count > segment->payloadlength))
+            break;
+        if (count == capacity)
+        {
+            capacity *= 2;
+            const binarysegment_t** grown = realloc(segments, capacity * sizeof(*segments));
+            if (grown == NULL)
+                free(segments);
+            segments = grown;
+            if (segments == NULL)
+                break;
+        }
+        segments[count++] = segment;
+        position = end;
+    }
+    if (segments == NULL)
+        return -1;
+    if (position != size)
+        fprintf(stderr, "%s is damaged after byte %llu, converting what comes before\n", path, (unsigned long long)position);
+
+    unsigned threads = Threads;
+    unsigned batchsize = threads * BatchSegments;
+    batch_t batch = {};
+    batch.version = header->version;
+    batch.channels = header->channels;
+    batch.noaux = header->flags & BINARY_FLAG_NOAUX;
+    batch.buffers = calloc(batchsize, sizeof(char*));
+    batch.lengths = calloc(batchsize, sizeof(size_t));
+    batch.capacities = calloc(batchsize, sizeof(size_t));
+    int result = (batch.buffers && batch.lengths && batch.capacities) ? 0 : -1;
+
+    void* args[MaxThreads];
+    for (unsigned i = 0; i < threads; i++)
+        args[i] = &batch;
+    for (unsigned first = 0; result == 0 && first < count; first += batchsize)
+    {
+        batch.segments = segments + first;
+        batch.count = count - first < batchsize ? count - first : batchsize;
+        batch.next = 0;
+        RunThreads(FormatThread, args, threads < batch.count ? threads : batch.count);
+        if (batch.failed)
+        {
+            fprintf(stderr, "%s has a segment that fails its CRC\n", path);
+            result = -1;
+            break;
+        }
+
+        for (unsigned i = 0; i < batch.count; i++)
+        {
+            const binarysegment_t* segment = batch.segments[i];
+            if (segment->type == SEGMENT_DATA)
+                SinkWrite(sink, batch.buffers[i], batch.lengths[i]);
+            else if (binary_segmentcrc(segment, segment + 1) == segment->crc)
+                SinkWrite(sink, (const char*)(segment + 1), segment->count);
+            else
+            {
+                fprintf(stderr, "%s has a segment that fails its CRC\n", path);
+                result = -1;
+                break;
+            }
+        }
+    }
+
+    if (batch.buffers != NULL)
+        for (unsigned i = 0; i < batchsize; i++)
+            free(batch.buffers[i]);
+    free(batch.buffers);
+    free(batch.lengths);
+    free(batch.capacities);
+    free(segments);
+    return sink->failed ? -1 : result;
+}
+
+//
+// Write the frames and comments of parsed chunks to the binary file, in their original
+// order, and add the frames to the overview.  sequence and step carry the numbering of
+// the frames, as set by the last sequence record, from one chunk to the next.
+//
+static int WriteChunk(binarywriter_t* writer, const chunk_t* chunk, overview_t* overview, FILE* overviewfile, uint64_t* sequence, uint64_t* step)
+{
+    char records[OVERVIEW_MAX_OUTPUT];
+    unsigned comment = 0;
+    for (uint64_t frame = 0; frame <= chunk->frames; frame++)
+    {
+        for (; comment < chunk->commentcount && chunk->comments[comment].frame == frame; comment++)
+        {
+            binary_parsesequence(chunk->comments[comment].text, chunk->comments[comment].length, sequence, step);
+            if (binary_appendcomment(writer, chunk->comments[comment].text, chunk->comments[comment].length) != 0)
+                return -1;
+        }
+        if (frame == chunk->frames)
+            break;
+
+        const uint16_t* values = chunk->values + frame * chunk->channels;
+        if (binary_appendframe(writer, *sequence, chunk->time[frame], chunk->aux[frame], values) != 0)
+            return -1;
+        *sequence += *step;
+        unsigned length = overview_add(overview, chunk->time[frame], values, records);
+        if (length > 0 && fwrite(records, 1, length, overviewfile) != length)
+            return -1;
+    }
+    return 0;
+}
+
+//
+// Convert a mapped CSV file to a binary file.
+//
+// Returns: 0 on success, -1 on failure.
+//
+static int CsvToBinary(const char* map, size_t size, const char* path, const char* outputpath, uint64_t* frames)
+{
+    const char* end = map + size;
+    const char* newline = memchr(map, '\n', size);
+    if (newline == NULL || (newline > map && newline[-1] == '\r'))
+    {
+        fprintf(stderr, "%s has no header line, or is not in the acquisition format\n", path);
+        return -1;
+    }
+
+    // The header line names the columns: the time, then one for each channel.
+    unsigned channels = 0;
+    for (const char* p = map; p < newline; p++)
+        if (*p == ',')
+            channels++;
+    if (channels > BINARY_MAX_CHANNELS)
+    {
+        fprintf(stderr, "%s has more than %d channels\n", path, BINARY_MAX_CHANNELS);
+        return -1;
+    }
+
+    // Anything after the last newline is not a whole line, and is kept as a trailer.
+    const char* datastart = newline + 1;
+    const char* dataend = datastart;
+    const char* lastnewline = memrchr(datastart, '\n', end - datastart);
+    if (lastnewline != NULL)
+        dataend = lastnewline + 1;
+
+    // The first data line shows whether the time column has a value in parentheses.
+    int noaux = 0;
+    for (const char* line = datastart; line < dataend; line = (const char*)memchr(line, '\n', dataend - line) + 1)
+    {
+        if (*line == '#')
+            continue;
+        uint64_t time;
+        const char* p = ParseCanonical(line, dataend, &time);
+        noaux = (p != NULL && *p != '(');
+        break;
+    }
+
+    char* header = strndup(map, newline - map);
+    binarywriter_t writer;
+    if (header == NULL || binary_create(&writer, outputpath, header, channels, noaux ? BINARY_FLAG_NOAUX : 0, 0) != 0)
+    {
+        fprintf(stderr, "Cannot create %s\n", outputpath);
+        free(header);
+        return -1;
+    }
+    free(header);
+
+    char overviewpath[FilePathLength + sizeof(OVERVIEW_EXTENSION)];
+    snprintf(overviewpath, sizeof(overviewpath), "%s%s", outputpath, OVERVIEW_EXTENSION);
+    overview_t overview;
+    char records[OVERVIEW_MAX_OUTPUT];
+    unsigned recordslength = overview_begin(&overview, channels, records);
+    FILE* overviewfile = fopen(overviewpath, "w");
+    if (overviewfile == NULL || fwrite(records, 1, recordslength, overviewfile) != recordslength)
+    {
+        fprintf(stderr, "Cannot create %s\n", overviewpath);
+        if (overviewfile != NULL)
+            fclose(overviewfile);
+        binary_close(&writer);
+        return -1;
+    }
+
+    unsigned threads = Threads;
+    chunk_t chunks[MaxThreads] = {};
+    void* args[MaxThreads];
+    for (unsigned i = 0; i < threads; i++)
+    {
+        chunks[i].channels = channels;
+        chunks[i].noaux = noaux;
+        args[i] = &chunks[i];
+    }
+
+    int result = 0;
+    *frames = 0;
+    uint64_t sequence = 0;
+    uint64_t step = 1;
+    const char* window = datastart;
+    while (result == 0 && window < dataend)
+    {
+        // Take a window of whole lines, and split it into a chunk of whole lines for each thread.
+        const char* windowend = dataend;
+        if (dataend - window > WindowSize)
+            windowend = (const char*)memchr(window + WindowSize - 1, '\n', dataend - (window + WindowSize - 1)) + 1;
+        size_t length = windowend - window;
+        const char* start = window;
+        for (unsigned i = 0; i < threads; i++)
+        {
+            const char* chunkend = windowend;
+            if (i + 1 < threads)
+            {
+                chunkend = window + length * (i + 1) / threads;
+                if (chunkend <= start)
+                    chunkend = start;
+                else
+                    chunkend = (const char*)memchr(chunkend - 1, '\n', windowend - (chunkend - 1)) + 1;
+            }
+            chunks[i].start = start;
+            chunks[i].end = chunkend;
+            start = chunkend;
+        }
+
+        RunThreads(ParseChunk, args, threads);
+
+        for (unsigned i = 0; i < threads && result == 0; i++)
+        {
+            if (chunks[i].error != NULL)
+            {
+                const char* line = chunks[i].error;
+                int linelength = (const char*)memchr(line, '\n', dataend - line) - line;
+                fprintf(stderr, "%s cannot be converted exactly, at byte %llu: %.*s\n", path,
+                        (unsigned long long)(line - map), linelength > 80 ? 80 : linelength, line);
+                result = -1;
+            }
+            else if (WriteChunk(&writer, &chunks[i], &overview, overviewfile, &sequence, &step) != 0)
+            {
+                fprintf(stderr, "Cannot write %s\n", outputpath);
+                result = -1;
+            }
+            else
+                *frames += chunks[i].frames;
+        }
+        window = windowend;
+    }
+
+    if (result == 0 && dataend < end && binary_appendtrailer(&writer, dataend, end - dataend) != 0)
+    {
+        fprintf(stderr, "Cannot write %s\n", outputpath);
+        result = -1;
+    }
+    if (binary_close(&writer) != 0 && result == 0)
+    {
+        fprintf(stderr, "Cannot write %s\n", outputpath);
+        result = -1;
+    }
+    recordslength = overview_finish(&overview, records);
+    if ((fwrite(records, 1, recordslength, overviewfile) != recordslength || fclose(overviewfile) != 0) && result == 0)
+    {
+        fprintf(stderr, "Cannot write %s\n", overviewpath);
+        result = -1;
+    }
+
+    for (unsigned i = 0; i < threads; i++)
+    {
+        free(chunks[i].time);
+        free(chunks[i].aux);
+        free(chunks[i].values);
+        free(chunks[i].comments);
+    }
+    return result;
+}
+
+//
+// Derive the output path by changing the extension of the input path.
+//
+static int OutputPath(const char* path, const char* extension, char* outputpath)
+{
+    const char* dot = strrchr(path, '.');
+    const char* slash = strrchr(path, '/');
+    size_t stem = (dot != NULL && (slash == NULL || dot > slash)) ? (size_t)(dot - path) : strlen(path);
+    if (stem + strlen(extension) >= FilePathLength)
+        return -1;
+    memcpy(outputpath, path, stem);
+    strcpy(outputpath + stem, extension);
+    return 0;
+}
+
+//
+// Convert one file, in whichever direction its contents call for.
+//
+// Returns: 0 on success, -1 on failure.
+//
+static int Convert(const char* path, const char* output, int force, int verify)
+{
+    size_t size = 0;
+    const char* map = MapFile(path, &size);
+    if (map == NULL)
+    {
+        fprintf(stderr, "Cannot read %s\n", path);
+        return -1;
+    }
+
+    uint32_t magic = 0;
+    if (size >= sizeof(magic))
+        memcpy(&magic, map, sizeof(magic));
+    int tocsv = magic == BINARY_MAGIC;
+
+    char outputpath[FilePathLength];
+    if (output != NULL)
+        snprintf(outputpath, sizeof(outputpath), "%s", output);
+    else if (OutputPath(path, tocsv ? ".csv" : BINARY_EXTENSION, outputpath) != 0)
+    {
+        fprintf(stderr, "Cannot derive an output name from %s, please give one\n", path);
+        munmap((void*)map, size);
+        return -1;
+    }
+    if (!force && access(outputpath, F_OK) == 0)
+    {
+        fprintf(stderr, "%s already exists, use -f to replace it\n", outputpath);
+        munmap((void*)map, size);
+        return -1;
+    }
+
+    int result;
+    if (tocsv)
+    {
+        sink_t sink = {};
+        sink.file = fopen(outputpath, "w");
+        result = sink.file != NULL ? BinaryToCsv(map, size, &sink, path) : -1;
+        if (sink.file == NULL || fclose(sink.file) != 0)
+            result = -1;
+        if (result == 0)
+            printf("Converted %s to %s, %llu bytes\n", path, outputpath, (unsigned long long)sink.position);
+    }
+    else
+    {
+        uint64_t frames = 0;
+        result = CsvToBinary(map, size, path, outputpath, &frames);
+        if (result == 0 && verify)
+        {
+            // Convert the new file back in memory, and compare it with the original.
+            size_t binarysize = 0;
+            const char* binary = MapFile(outputpath, &binarysize);
+            sink_t sink = {};
+            sink.expected = map;
+            sink.expectedlength = size;
+            if (binary == NULL || BinaryToCsv(binary, binarysize, &sink, outputpath) != 0 || sink.position != size)
+            {
+                fprintf(stderr, "%s does not convert back to %s exactly\n", outputpath, path);
+                result = -1;
+            }
+            if (binary != NULL)
+                munmap((void*)binary, binarysize);
+        }
+        if (result == 0)
+            printf("Converted %s to %s, %llu frames%s\n", path, outputpath, (unsigned long long)frames, verify ? ", verified" : "");
+    }
+
+    if (result != 0)
+    {
+        unlink(outputpath);
+        if (!tocsv)
+        {
+            strncat(outputpath, OVERVIEW_EXTENSION, sizeof(outputpath) - strlen(outputpath) - 1);
+            unlink(outputpath);
+        }
+    }
+    munmap((void*)map, size);
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    int force = 0;
+    int verify = 1;
+    const char* output = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "fnj:o:")) != -1)
+    {
+        if (opt == 'f')
+            force = 1;
+        else if (opt == 'n')
+            verify = 0;
+        else if (opt == 'j')
+            Threads = atoi(optarg);
+        else if (opt == 'o')
+            output = optarg;
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (optind >= argc || (output != NULL && optind + 1 != argc))
+    {
+        usage();
+        return 1;
+    }
+
+    if (Threads == 0)
+        Threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (Threads < 1)
+        Threads = 1;
+    if (Threads > MaxThreads)
+        Threads = MaxThreads;
+
+    int failed = 0;
+    for (int i = optind; i < argc; i++)
+        if (Convert(argv[i], output, force, verify) != 0)
+            failed++;
+
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,750 @@
+//
+// Native t-rake acquisition daemon.
+//
+// This program does the work of deploy.py, filewatcher.py and temperature_rake.py in
+// one small process built directly on the driver, without the Python interpreter, the
+// watchdog observer thread, or the polling loops competing with the acquisition thread
+// for the CPU.  It behaves the same way:
+// - The configuration folder is watched, with inotify, for the run file __runfile__.deploy.
+//   When it is written, the configuration it names is loaded and acquisition is started.
+//   When it is deleted, acquisition is stopped.
+// - Immediate commands, files named *__immediate__.execute, are not supported, as
+//   filewatcher.py defines no commands either.  Such a file is deleted unread, and
+//   logged with debug on, so it does not linger in the folder.
+// - When the supply voltage fails, acquisition stops and the daemon exits, so that
+//   start-trake.sh can power the system off.
+//
+// The state of the daemon is published in /trake/status.json for trake_client.py.
+//
+// For unattended deployments, the daemon can boot straight into acquisition with -b,
+// in place of start-trake-onboot.sh writing the run file after a delay.  After each run
+// is configured, the register image is verified against the chip and cached with a
+// checksum of the configuration file, so the next boot with the same configuration
+// restores it in one verified transaction.  The time from boot to the first sample is
+// logged on every run, and appended to /trake/boottimes.csv so it can be tracked.
+//
+// To build on a Raspberry Pi, use this command in a terminal prompt after changing
+// to the directory with this file in it:
+//
+//gcc -Wall -pthread -I../include -o trake_daemon trake_daemon.c trake_json.c ad7616_driver.c trake_journal.c trake_overview.c trake_telemetry.c trake_spidev.c trake_capture.c -lpigpio -lrt
+//
+// Usage: trake_daemon [-b configuration] [debug|driver]
+// -b deploys the named configuration at once, as start-trake-onboot.sh would.
+// Any other argument turns on console logging; "driver" also turns on driver
+// diagnostics, the same as deploy.py.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/inotify.h>
+
+#include "spi_ad7616.h"
+#include "trake_json.h"
+#include "trake_journal.h"
+
+#define CONFIGURATION_PATH "/trake/configuration"
+#define RUNFILE_NAME "__runfile__.deploy"
+#define IMMEDIATE_SUFFIX "__immediate__.execute"
+#define STATUS_PATH "/trake/status.json"
+#define REGISTER_CACHE_PATH "/trake/registers.cache"
+#define BOOT_TIMES_PATH "/trake/boottimes.csv"
+#define DATA_PATH "/trake/data"
+#define TELEMETRY_PATH "/trake/telemetry.sock"
+#define POLL_ms 100                 // How often the low-voltage state is checked while idle.
+#define NAME_LENGTH 256
+
+//
+// The state of the current run, the same as RunState in filewatcher.py.
+//
+typedef struct {
+    char configurationName[NAME_LENGTH];
+    json_t* configuration;
+    uint32_t configurationCrc;      // CRC-32 of the configuration file, to validate the register cache.
+    int running;
+    int voltageLow;
+} runstate_t;
+
+//
+// The register image cached in REGISTER_CACHE_PATH.  It is only used when the magic,
+// version and CRC-32 of the whole image are good, and the configuration name and the
+// CRC-32 of the configuration file both match the run being started.
+//
+#define REGISTER_CACHE_MAGIC 0x52524b54     // "TKRR" in little-endian byte order.
+#define REGISTER_CACHE_VERSION 1
+#define REGISTER_IMAGE_SIZE (6 + 32)        // Registers 2-7, plus up to 32 sequencer stack registers.
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    char configurationName[NAME_LENGTH];
+    uint32_t configurationCrc;
+    uint32_t count;
+    uint32_t addresses[REGISTER_IMAGE_SIZE];
+    uint32_t values[REGISTER_IMAGE_SIZE];
+    uint32_t crc;                           // CRC-32 of everything before this field.
+} registercache_t;
+
+static int debug = 0;
+static int debugdriver = 0;
+static volatile sig_atomic_t terminating = 0;   // Set by SIGINT or SIGTERM.
+static unsigned long long DaemonStart_ns = 0;   // CLOCK_BOOTTIME when main() was entered.
+static unsigned TransportInUse = TRANSPORT_BITBANG;
+static char SpidevDevice[NAME_LENGTH] = "";     // spidev device of the transport in use, empty unless spidev.
+static unsigned SpidevHz = 0;                   // SCLK rate of the spidev transport in use.
+
+static unsigned long long BootTime_ns()
+{
+    struct timespec tpBoot;
+    clock_gettime(CLOCK_BOOTTIME, &tpBoot);
+    return (unsigned long long)tpBoot.tv_sec * (unsigned long long)(1000*1000*1000) + (unsigned long long)tpBoot.tv_nsec;
+}
+
+//
+// Returns: The CRC-32 of a file's contents, or 0 if it cannot be read.
+//
+static uint32_t FileCrc(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+
+    uint32_t crc = 0;
+    char buffer[4096];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        crc = journal_crc32(crc, buffer, length);
+    fclose(file);
+    return crc;
+}
+
+static void OnTerminate(int signal)
+{
+    terminating = 1;
+}
+
+static void ResetRunState(runstate_t* runstate)
+{
+    json_free(runstate->configuration);
+    runstate->configuration = NULL;
+    runstate->configurationName[0] = '\0';
+    runstate->running = 0;
+}
+
+//
+// Publish the daemon state for trake_client.py.  The file is replaced atomically,
+// so a reader never sees it half written.
+//
+static void WriteStatus(const char* state, const runstate_t* runstate, const char* datafile)
+{
+    FILE* file = fopen(STATUS_PATH ".tmp", "w");
+    if (file == NULL)
+        return;
+
+    fprintf(file, "{\"state\": \"%s\", \"pid\": %d, \"configurationName\": \"%s\", \"datafile\": \"%s\", \"voltageLow\": %s}\n",
+            state, (int)getpid(), runstate->configurationName, datafile, runstate->voltageLow ? "true" : "false");
+    fclose(file);
+    rename(STATUS_PATH ".tmp", STATUS_PATH);
+}
+
+//
+// Read the run file and the configuration it names, the same as
+// DeployHandler.reevaluate() in filewatcher.py.
+//
+static void Reevaluate(runstate_t* runstate)
+{
+    ResetRunState(runstate);
+
+    json_t* runData = json_parsefile(CONFIGURATION_PATH "/" RUNFILE_NAME);
+    const char* configName = json_getstring(runData, "configurationName", NULL);
+    if (configName != NULL && strlen(configName) < NAME_LENGTH)
+    {
+        char fullpathname[NAME_LENGTH + sizeof(CONFIGURATION_PATH) + 8];
+        snprintf(fullpathname, sizeof(fullpathname), "%s/%s.json", CONFIGURATION_PATH, configName);
+
+        json_t* configuration = json_parsefile(fullpathname);
+        if (configuration != NULL && configuration->type == JSON_OBJECT)
+        {
+            if (debug)
+                printf("Using configuration file %s\n", fullpathname);
+            strcpy(runstate->configurationName, configName);
+            runstate->configuration = configuration;
+            runstate->configurationCrc = FileCrc(fullpathname);
+            runstate->running = 1;
+        }
+        else
+        {
+            if (debug)
+                printf("Configuration file %s does not exist or is not valid\n", fullpathname);
+            json_free(configuration);
+        }
+    }
+    json_free(runData);
+
+    if (debug)
+        printf("Run state: %s %s\n", runstate->configurationName, runstate->running ? "Running" : "NOT Running");
+}
+
+//
+// Read and act on all pending inotify events for the configuration folder.
+//
+static void HandleEvents(int inotifyfd, runstate_t* runstate)
+{
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+
+    while ((length = read(inotifyfd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char* p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len)
+        {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            if (event->len == 0)
+                continue;
+
+            size_t namelength = strlen(event->name);
+            if (strcmp(event->name, RUNFILE_NAME) == 0)
+            {
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                {
+                    if (debug)
+                        printf("Run file deleted\n");
+                    runstate->running = 0;
+                }
+                else
+                {
+                    if (debug)
+                        printf("Handling new runfile, reevaluating\n");
+                    Reevaluate(runstate);
+                }
+            }
+            else if (namelength >= strlen(IMMEDIATE_SUFFIX) &&
+                     strcmp(event->name + namelength - strlen(IMMEDIATE_SUFFIX), IMMEDIATE_SUFFIX) == 0 &&
+                     !(event->mask & (IN_DELETE | IN_MOVED_FROM)))
+            {
+                // Immediate commands are not supported, see the top of this file.
+                char path[NAME_LENGTH + sizeof(CONFIGURATION_PATH) + 2];
+                snprintf(path, sizeof(path), "%s/%s", CONFIGURATION_PATH, event->name);
+                if (debug)
+                    printf("Immediate commands are not supported, discarding %s\n", path);
+                unlink(path);
+            }
+        }
+    }
+}
+
+//
+// Wait up to timeout_ms for configuration folder events, and handle them.
+//
+static void WaitForEvents(int inotifyfd, runstate_t* runstate, int timeout_ms)
+{
+    struct pollfd pfd = { inotifyfd, POLLIN, 0 };
+    if (poll(&pfd, 1, timeout_ms) > 0)
+        HandleEvents(inotifyfd, runstate);
+}
+
+//
+// Restore the cached register image, if it is valid for this run and verifies
+// when written to the chip.
+//
+// Returns: 1 if the chip was configured from the cache, 0 if it must be configured step by step.
+//
+static int LoadRegisterCache(self_t chip, const runstate_t* runstate)
+{
+    registercache_t cache;
+    FILE* file = fopen(REGISTER_CACHE_PATH, "r");
+    if (file == NULL)
+        return 0;
+    size_t length = fread(&cache, 1, sizeof(cache), file);
+    fclose(file);
+
+    if (length != sizeof(cache) ||
+        cache.magic != REGISTER_CACHE_MAGIC ||
+        cache.version != REGISTER_CACHE_VERSION ||
+        cache.crc != journal_crc32(0, &cache, offsetof(registercache_t, crc)) ||
+        cache.count > REGISTER_IMAGE_SIZE ||
+        strncmp(cache.configurationName, runstate->configurationName, NAME_LENGTH) != 0 ||
+        cache.configurationCrc != runstate->configurationCrc)
+    {
+        if (debug)
+            printf("Register cache is missing, damaged or for another configuration\n");
+        return 0;
+    }
+
+    unsigned addresses[REGISTER_IMAGE_SIZE];
+    unsigned values[REGISTER_IMAGE_SIZE];
+    for (unsigned i = 0; i < cache.count; i++)
+    {
+        addresses[i] = cache.addresses[i];
+        values[i] = cache.values[i];
+    }
+    if (spi_loadregisters(chip, cache.count, addresses, values) != 0)
+    {
+        printf("Cached register image did not verify, configuring step by step\n");
+        return 0;
+    }
+    return 1;
+}
+
+//
+// Cache the register image the chip was configured with, taken from the driver's shadow
+// of the registers once it has been verified, for the next boot.  The cache is replaced
+// atomically, so a power loss leaves either the old or the new one.
+//
+static void SaveRegisterCache(self_t chip, const runstate_t* runstate, unsigned sequencecount)
+{
+    registercache_t cache;
+    memset(&cache, 0, sizeof(cache));
+    cache.magic = REGISTER_CACHE_MAGIC;
+    cache.version = REGISTER_CACHE_VERSION;
+    snprintf(cache.configurationName, sizeof(cache.configurationName), "%s", runstate->configurationName);
+    cache.configurationCrc = runstate->configurationCrc;
+
+    // The channel and range registers first, then the sequencer stack, and the
+    // configuration register last, since it enables the sequencer.
+    unsigned addresses[REGISTER_IMAGE_SIZE];
+    unsigned values[REGISTER_IMAGE_SIZE];
+    unsigned count = 0;
+    for (unsigned address = REGISTER_CHANNELSEL; address <= REGISTER_RANGEB_4_7; address++)
+        addresses[count++] = address;
+    for (unsigned i = 0; i < sequencecount; i++)
+        addresses[count++] = REGISTER_SEQUENCER + i;
+    addresses[count++] = REGISTER_CONFIGURATION;
+
+    if (spi_readregisters(chip, count, addresses, values) != 0)
+        return;
+
+    cache.count = count;
+    for (unsigned i = 0; i < count; i++)
+    {
+        cache.addresses[i] = addresses[i];
+        cache.values[i] = values[i] & 0x1ff;
+    }
+    cache.crc = journal_crc32(0, &cache, offsetof(registercache_t, crc));
+
+    int fd = open(REGISTER_CACHE_PATH ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return;
+    int written = (write(fd, &cache, sizeof(cache)) == sizeof(cache) && fsync(fd) == 0);
+    close(fd);
+    if (written)
+        rename(REGISTER_CACHE_PATH ".tmp", REGISTER_CACHE_PATH);
+}
+
+//
+// Define the conversion sequence from the channel map, or only the columns of it selected
+// by "channelmask", named by "channelnames".  The mask is a number, or a string such as
+// "0x4444", with bit i for column i of the whole map, A channels first, and the names are
+// an object from column number to name.  With names but no mask, the named columns are
+// selected.  "channelrepeat", an object from column number to count, converts those
+// columns several times per sample period, with no mask or names all the columns.  The
+// same as DefineConversionSequence() in temperature_rake.py.
+//
+// Returns: The number of channel pairs in the sequence.
+//
+static unsigned DefineChannels(self_t chip, const json_t* configuration)
+{
+    // A mapping that accounts for convenience trace routing on the board.
+    unsigned Achannels[16] = { 3, 2, 1, 0, 6, 7, 5, 4 };
+    unsigned Bchannels[16] = { 4, 5, 6, 7, 0, 1, 2, 3 };
+    unsigned count = 8;
+
+    const json_t* channelmap = json_get(configuration, "channelmap");
+    const json_t* Aconfigured = json_get(channelmap, "Achannels");
+    const json_t* Bconfigured = json_get(channelmap, "Bchannels");
+    unsigned Acount = Aconfigured ? json_length(Aconfigured) : count;
+    unsigned Bcount = Bconfigured ? json_length(Bconfigured) : count;
+    if (Acount != Bcount || Acount == 0 || Acount > 16)
+    {
+        printf("Channel map must give the same number (1-16) of A and B channels, using the default\n");
+        Aconfigured = Bconfigured = NULL;
+    }
+    else
+        count = Acount;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (Aconfigured)
+            Achannels[i] = (unsigned)json_item(Aconfigured, i)->number;
+        if (Bconfigured)
+            Bchannels[i] = (unsigned)json_item(Bconfigured, i)->number;
+    }
+
+    const json_t* names = json_get(configuration, "channelnames");
+    const json_t* repeatconfigured = json_get(configuration, "channelrepeat");
+    const json_t* maskconfigured = json_get(configuration, "channelmask");
+    unsigned mask = 0;
+    if (maskconfigured != NULL && maskconfigured->type == JSON_STRING)
+        mask = (unsigned)strtoul(maskconfigured->string, NULL, 0);
+    else if (maskconfigured != NULL)
+        mask = (unsigned)maskconfigured->number;
+    else if (names != NULL)
+    {
+        for (const json_t* name = names->child; name != NULL; name = name->next)
+        {
+            unsigned column = (unsigned)strtoul(name->key, NULL, 10);
+            if (column < 32)
+                mask |= 1u << column;
+        }
+    }
+    else if (repeatconfigured != NULL)
+        mask = (count < 16) ? (1u << (2 * count)) - 1 : 0xffffffff;
+
+    if (debug)
+        printf("Defining conversion sequence\n");
+    if (maskconfigured == NULL && names == NULL && repeatconfigured == NULL)
+    {
+        spi_definesequence(chip, count, Achannels, Bchannels);
+        return count;
+    }
+
+    // The names and repeats of the selected columns in order, ChannelN for those not named.
+    char namelist[1000] = "";
+    unsigned repeats[32];
+    unsigned selected = 0;
+    int length = 0;
+    for (unsigned column = 0; column < 2 * count && column < 32; column++)
+    {
+        if (!(mask & (1u << column)))
+            continue;
+        char key[12];
+        snprintf(key, sizeof(key), "%d", column);
+        const json_t* repeat = json_get(repeatconfigured, key);
+        repeats[selected++] = (repeat != NULL) ? (unsigned)repeat->number : 1;
+        const char* name = json_getstring(names, key, NULL);
+        if (name != NULL)
+            length += snprintf(namelist + length, sizeof(namelist) - length, "%s%s", length > 0 ? "," : "", name);
+        else
+            length += snprintf(namelist + length, sizeof(namelist) - length, "%sChannel%d", length > 0 ? "," : "", column);
+        if (length >= (int)sizeof(namelist))
+            length = sizeof(namelist) - 1;
+    }
+    if (spi_definechannels(chip, count, Achannels, Bchannels, mask, repeats, namelist) < 0)
+    {
+        printf("Channel mask %x or repeats do not fit the %d pair channel map, using all of it\n", mask, count);
+        spi_definesequence(chip, count, Achannels, Bchannels);
+    }
+    return spi_getsequencepairs();
+}
+
+//
+// Configure the input ranges, conversion sequence and oversampling step by step, verify
+// the whole register image against the chip in one transaction, then cache it for the
+// next boot.
+//
+static void ConfigureRegisters(self_t chip, const runstate_t* runstate)
+{
+    const json_t* configuration = runstate->configuration;
+
+    // Write an input range of +-2.5V to all channels.
+    unsigned range = RANGE_PLUS_MINUS_2_5V << 6 | RANGE_PLUS_MINUS_2_5V << 4 | RANGE_PLUS_MINUS_2_5V << 2 | RANGE_PLUS_MINUS_2_5V;
+    unsigned addresses[] = { REGISTER_RANGEA_0_3, REGISTER_RANGEA_4_7, REGISTER_RANGEB_0_3, REGISTER_RANGEB_4_7 };
+    unsigned values[] = { range, range, range, range };
+    spi_writeregisters(chip, 4, addresses, values, NULL);
+
+    unsigned count = DefineChannels(chip, configuration);
+
+    if (spi_setoversampling(chip, (unsigned)json_getnumber(configuration, "oversampling", 128)) != 0)
+        spi_setoversampling(chip, 128);
+
+    int failed = spi_verifyregisters(chip);
+    if (failed != 0)
+        printf("%d registers failed to verify, the register image is not cached\n", failed);
+    else
+        SaveRegisterCache(chip, runstate, count);
+}
+
+//
+// Log the time from boot to the first sample of this run, and append it to
+// BOOT_TIMES_PATH, so that every boot can be compared.
+//
+static void LogFirstSample(const runstate_t* runstate, unsigned long long runStart_ns, unsigned long long firstSample_ns, int cached)
+{
+    double boot_ms = firstSample_ns / 1e6;
+    double daemon_ms = (firstSample_ns - DaemonStart_ns) / 1e6;
+    double run_ms = (firstSample_ns - runStart_ns) / 1e6;
+    printf("First sample %.1f ms after boot, %.1f ms after daemon start, %.1f ms after run start (%s registers)\n",
+           boot_ms, daemon_ms, run_ms, cached ? "cached" : "configured");
+
+    int exists = (access(BOOT_TIMES_PATH, F_OK) == 0);
+    FILE* file = fopen(BOOT_TIMES_PATH, "a");
+    if (file == NULL)
+        return;
+    if (!exists)
+        fprintf(file, "time,configurationName,daemonstart_ms,firstsample_ms,run_ms,registers\n");
+
+    char now[32];
+    time_t t = time(NULL);
+    struct tm utcDateTime;
+    gmtime_r(&t, &utcDateTime);
+    strftime(now, sizeof(now), "%Y-%m-%dT%H:%M:%SZ", &utcDateTime);
+    fprintf(file, "%s,%s,%.1f,%.1f,%.1f,%s\n", now, runstate->configurationName,
+            DaemonStart_ns / 1e6, boot_ms, run_ms, cached ? "cached" : "configured");
+    fclose(file);
+}
+
+//
+// Select the transport named by the configuration: "spidev" for the device of the
+// hardware SPI transport, or "capture": true for the DMA-clocked readout, bit-banged
+// without either.  Selecting a transport resets the chip, so it is only done when the
+// transport changes from the previous run.
+//
+static void SelectTransport(self_t chip, const json_t* configuration)
+{
+    const char* device = json_getstring(configuration, "spidev", "");
+    unsigned hz = (unsigned)json_getnumber(configuration, "spidevhz", 0);
+    unsigned transport = TRANSPORT_BITBANG;
+    if (device[0] != '\0')
+        transport = TRANSPORT_SPIDEV;
+    else if (json_getbool(configuration, "capture", 0))
+        transport = TRANSPORT_CAPTURE;
+    if (transport == TransportInUse &&
+        (transport != TRANSPORT_SPIDEV || (strcmp(device, SpidevDevice) == 0 && hz == SpidevHz)))
+        return;
+
+    // If the transport cannot be set up, the driver stays bit-banged, and it is tried again next run.
+    TransportInUse = TRANSPORT_BITBANG;
+    SpidevDevice[0] = '\0';
+    SpidevHz = 0;
+    if (spi_settransport(chip, transport, device, hz) == 0)
+    {
+        TransportInUse = transport;
+        if (transport == TRANSPORT_SPIDEV)
+        {
+            strncpy(SpidevDevice, device, NAME_LENGTH - 1);
+            SpidevHz = hz;
+        }
+    }
+}
+
+//
+// Configure the chip from the configuration and acquire data until the run file is
+// deleted, the supply voltage fails, or the daemon is terminated.  The same as
+// TemperatureRake.Run() in temperature_rake.py.
+//
+static void RunAcquisition(self_t chip, int inotifyfd, runstate_t* runstate)
+{
+    const json_t* configuration = runstate->configuration;
+    unsigned long long runStart_ns = BootTime_ns();
+
+    SelectTransport(chip, configuration);
+    int cached = LoadRegisterCache(chip, runstate);
+    if (!cached)
+        ConfigureRegisters(chip, runstate);
+    else
+    {
+        // The cached image already holds the sequence, so this writes nothing, but selects
+        // the columns to store.
+        DefineChannels(chip, configuration);
+        if (debug)
+            printf("Configured from the cached register image\n");
+    }
+
+
+    // The SCLK timing is a settle count, or "scan" to find the fastest that reads the
+    // self-test pattern without errors.
+    const char* sclksettle = json_getstring(configuration, "sclksettle", NULL);
+    if (sclksettle != NULL && strcasecmp(sclksettle, "scan") == 0)
+        spi_scansclk(chip, 1000);
+    else
+        spi_setsclksettle(chip, (unsigned)json_getnumber(configuration, "sclksettle", 0));
+
+    const char* crc = json_getstring(configuration, "crc", "off");
+    if (strcasecmp(crc, "mark") == 0)
+        spi_setcrc(chip, CRC_MARK);
+    else if (strcasecmp(crc, "drop") == 0)
+        spi_setcrc(chip, CRC_DROP);
+    else if (strcasecmp(crc, "retry") == 0)
+        spi_setcrc(chip, CRC_RETRY);
+    else
+        spi_setcrc(chip, CRC_OFF);
+
+    const char* busywait = json_getstring(configuration, "busywait", NULL);
+    if (busywait != NULL)
+    {
+        unsigned mode = BUSYWAIT_SPIN;
+        if (strcasecmp(busywait, "delay") == 0)
+            mode = BUSYWAIT_DELAY;
+        else if (strcasecmp(busywait, "alert") == 0)
+            mode = BUSYWAIT_ALERT;
+        spi_setbusywait(chip, mode, (unsigned)json_getnumber(configuration, "busytimeoutus", 100000));
+    }
+
+    spi_setjournal(chip, json_getbool(configuration, "journal", 0), (unsigned)json_getnumber(configuration, "journalflushms", 1000));
+    spi_setoverview(chip, json_getbool(configuration, "overview", 1));
+    spi_setclockrecords(chip, (unsigned)json_getnumber(configuration, "clockrecordms", 10000), json_getbool(configuration, "rtc", 1));
+    spi_settelemetry(chip, json_getstring(configuration, "telemetry", TELEMETRY_PATH), (unsigned)json_getnumber(configuration, "telemetryms", 100));
+
+    const char* trigger = json_getstring(configuration, "trigger", "software");
+    spi_settrigger(chip, strcmp(trigger, "hardware") == 0 ? TRIGGER_HARDWARE : TRIGGER_SOFTWARE);
+
+    if (json_get(configuration, "shutdownbudgetms") != NULL)
+        spi_setshutdownbudget(chip, (unsigned)json_getnumber(configuration, "shutdownbudgetms", 500));
+
+    spi_setaffinity(chip, (int)json_getnumber(configuration, "samplercpu", -1), (int)json_getnumber(configuration, "writercpu", -1));
+
+    time_t now = time(NULL);
+    struct tm utcDateTime;
+    gmtime_r(&now, &utcDateTime);
+    char datafile[64];
+    strftime(datafile, sizeof(datafile), "%Y-%m-%d_%H.%M.%S.csv", &utcDateTime);
+
+    char datafolder[NAME_LENGTH];
+    snprintf(datafolder, sizeof(datafolder), "%s", json_getstring(configuration, "datafolder", DATA_PATH));
+
+    int status = spi_start(chip, (unsigned)json_getnumber(configuration, "sampleperiodms", 1),
+                           (unsigned)json_getnumber(configuration, "averagecount", 10), datafolder, datafile);
+    if (status < 0)
+    {
+        printf("Data acquisition failed to start (%d)\n", status);
+        WriteStatus("failed", runstate, datafile);
+        return;
+    }
+    if (status != START_OK)
+        printf("Data acquisition started degraded (%d), see the scheduling record in %s\n", status, datafile);
+    WriteStatus("running", runstate, datafile);
+
+    // The driver stops by itself, and saves its data, as soon as it sees low voltage,
+    // so there is nothing to do here but wait for that or for the run file to go away.
+    int firstSampleLogged = 0;
+    while (runstate->running && !terminating)
+    {
+        // Poll quickly until the first sample, so its time is logged promptly.
+        WaitForEvents(inotifyfd, runstate, firstSampleLogged ? POLL_ms : 1);
+
+        unsigned long long firstSample_ns = spi_getfirstsample();
+        if (!firstSampleLogged && firstSample_ns != 0)
+        {
+            LogFirstSample(runstate, runStart_ns, firstSample_ns, cached);
+            firstSampleLogged = 1;
+        }
+
+        if (spi_waitstop(chip, 0) == WAITSTOP_POWERLOW || read_powerlow())
+        {
+            if (debug)
+                printf("Data acquisition reports low voltage, stopping\n");
+            runstate->voltageLow = 1;
+            break;
+        }
+    }
+
+    if (debug)
+        printf("Data acquisition stopping: is_running=%d voltage_low=%d\n", runstate->running, runstate->voltageLow);
+    spi_stop(chip);
+
+    long long shutdownlatency = spi_getshutdownlatency();
+    if (shutdownlatency >= 0)
+        printf("Low-voltage shutdown saved data in %lld us\n", shutdownlatency);
+
+    unsigned busytimeouts = spi_getbusytimeouts();
+    if (busytimeouts != 0)
+        printf("Data acquisition had %u conversions time out waiting for BUSY\n", busytimeouts);
+
+    WriteStatus("stopped", runstate, datafile);
+}
+
+//
+// Deploy a configuration, as trake_client.py and start-trake-onboot.sh do, by writing
+// the run file under another name and renaming it into place.
+//
+static void WriteRunFile(const char* configurationName)
+{
+    FILE* file = fopen(CONFIGURATION_PATH "/__runfile__.tmp", "w");
+    if (file == NULL)
+        return;
+    fprintf(file, "{\"configurationName\": \"%s\"}", configurationName);
+    fclose(file);
+    rename(CONFIGURATION_PATH "/__runfile__.tmp", CONFIGURATION_PATH "/" RUNFILE_NAME);
+}
+
+int main(int argc, char* argv[])
+{
+    DaemonStart_ns = BootTime_ns();
+
+    const char* bootConfiguration = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            bootConfiguration = argv[++i];
+        else
+        {
+            debug = 1;
+            if (strcmp(argv[i], "driver") == 0)
+                debugdriver = 1;
+        }
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("Starting trake daemon %.1f ms after boot with debug = %d and debugdriver = %d\n", DaemonStart_ns / 1e6, debug, debugdriver);
+
+    // Deploy the boot configuration before watching, so the daemon does not see its own run file.
+    if (bootConfiguration != NULL)
+        WriteRunFile(bootConfiguration);
+
+    // Watch before looking for an existing run file, so a run file written in between is not missed.
+    int inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyfd < 0 || inotify_add_watch(inotifyfd, CONFIGURATION_PATH, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) < 0)
+    {
+        printf("Cannot watch %s: %s\n", CONFIGURATION_PATH, strerror(errno));
+        return 1;
+    }
+
+    // pigpio and the chip are brought up once, rather than for every run, so a run
+    // starts sampling as soon as its run file appears.
+    self_t chip = spi_initialize();
+    if ((int)chip.spi_errorcode < 0)
+        return 1;
+    if (debugdriver)
+        chip.spi_flags |= PRINT_DIAG_FLAG;
+    spi_open(chip, 1, 0);
+
+    // Replace the pigpio signal handlers, so a stop request still closes the data file.
+    struct sigaction action = {};
+    action.sa_handler = OnTerminate;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    runstate_t runstate = {};
+    if (access(CONFIGURATION_PATH "/" RUNFILE_NAME, F_OK) == 0)
+        Reevaluate(&runstate);
+    WriteStatus("idle", &runstate, "");
+
+    if (debug)
+        printf("Daemon running in %s/\n", CONFIGURATION_PATH);
+
+    while (!runstate.voltageLow && !terminating)
+    {
+        if (runstate.running)
+        {
+            if (debug)
+                printf("Runstate is running, starting acquisition\n");
+            RunAcquisition(chip, inotifyfd, &runstate);
+            ResetRunState(&runstate);
+            WriteStatus(runstate.voltageLow ? "powerlow" : "idle", &runstate, "");
+            continue;
+        }
+
+        WaitForEvents(inotifyfd, &runstate, POLL_ms);
+
+        // Capture the low-voltage state.
+        if (read_powerlow())
+        {
+            if (debug)
+                printf("GPIO detected low voltage\n");
+            runstate.voltageLow = 1;
+            WriteStatus("powerlow", &runstate, "");
+        }
+    }
+
+    ResetRunState(&runstate);
+    spi_terminate(chip);
+    close(inotifyfd);
+    if (debug)
+        printf("Daemon terminated\n");
+    return 0;
+}
@@ -0,0 +1,228 @@
+//
+// Crash-safe write-ahead journal for acquired data.  See trake_journal.h for the
+// rationale and the block layout.
+//
+// This file is compiled into ad7616_driver.so, which writes journals, and into the
+// trake_recover tool, which rebuilds acquisition files from them.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "trake_journal.h"
+
+//
+// Standard reflected CRC-32 (polynomial 0xedb88320), as used by zlib.
+//
+static uint32_t crctable[256];
+static int crctableready = 0;
+
+uint32_t journal_crc32(uint32_t crc, const void* data, uint32_t length)
+{
+    if (!crctableready)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (unsigned _ = 0; _ < 8; _++)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            crctable[i] = c;
+        }
+        crctableready = 1;
+    }
+
+    const unsigned char* bytes = data;
+    crc = ~crc;
+    for (uint32_t i = 0; i < length; i++)
+        crc = crctable[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+//
+// Internal method to compute the CRC of a block, with its crc field taken as zero.
+//
+static uint32_t journal_blockcrc(const unsigned char* block)
+{
+    journalblock_t header;
+    memcpy(&header, block, sizeof(header));
+    header.crc = 0;
+
+    uint32_t crc = journal_crc32(0, &header, sizeof(header));
+    return journal_crc32(crc, block + sizeof(header), header.payloadlength);
+}
+
+//
+// Create a new journal, replacing any existing file at path, and preallocate
+// space for the first blocks.
+//
+// Returns: 0 on success, or -1 with errno set.
+//
+int journal_open(journal_t* journal, const char* path)
+{
+    journal->sequence = 0;
+    journal->allocated = 0;
+    journal->length = 0;
+
+    journal->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (journal->fd < 0)
+        return -1;
+
+    // Preallocation is an optimization; the writes still work without it.
+    if (fallocate(journal->fd, 0, 0, JOURNAL_PREALLOCATE_BLOCKS * JOURNAL_BLOCK_SIZE) == 0)
+        journal->allocated = JOURNAL_PREALLOCATE_BLOCKS * JOURNAL_BLOCK_SIZE;
+
+    return 0;
+}
+
+//
+// Internal method that seals the block being filled with its header and CRC,
+// writes it to its place in the file, and starts the next block.  A partly
+// filled block is written as it is, and the rest of its space is left unused.
+//
+static int journal_writeblock(journal_t* journal)
+{
+    off_t offset = (off_t)journal->sequence * JOURNAL_BLOCK_SIZE;
+    if (offset + JOURNAL_BLOCK_SIZE > journal->allocated)
+    {
+        if (fallocate(journal->fd, 0, journal->allocated, JOURNAL_PREALLOCATE_BLOCKS * JOURNAL_BLOCK_SIZE) == 0)
+            journal->allocated += JOURNAL_PREALLOCATE_BLOCKS * JOURNAL_BLOCK_SIZE;
+    }
+
+    journalblock_t header = {};
+    header.magic = JOURNAL_MAGIC;
+    header.version = JOURNAL_VERSION;
+    header.headersize = sizeof(header);
+    header.sequence = journal->sequence;
+    header.payloadlength = journal->length;
+    memcpy(journal->block, &header, sizeof(header));
+    header.crc = journal_blockcrc(journal->block);
+    memcpy(journal->block, &header, sizeof(header));
+
+    // Zero the unused tail, so stale payload from an earlier block never reaches the disk.
+    memset(journal->block + sizeof(header) + journal->length, 0, JOURNAL_PAYLOAD_SIZE - journal->length);
+
+    if (pwrite(journal->fd, journal->block, JOURNAL_BLOCK_SIZE, offset) != JOURNAL_BLOCK_SIZE)
+        return -1;
+
+    journal->sequence++;
+    journal->length = 0;
+    return 0;
+}
+
+//
+// Append bytes to the journal.  Full blocks are written as they fill, but
+// nothing is forced to the disk.
+//
+// Returns: 0 on success, or -1 if a block could not be written.
+//
+int journal_append(journal_t* journal, const void* data, uint32_t length)
+{
+    const unsigned char* bytes = data;
+    while (length > 0)
+    {
+        uint32_t space = JOURNAL_PAYLOAD_SIZE - journal->length;
+        uint32_t chunk = (length < space) ? length : space;
+        memcpy(journal->block + sizeof(journalblock_t) + journal->length, bytes, chunk);
+        journal->length += chunk;
+        bytes += chunk;
+        length -= chunk;
+
+        if (journal->length == JOURNAL_PAYLOAD_SIZE && journal_writeblock(journal) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+//
+// Write any partly filled block, and optionally force everything written so far to the disk.
+//
+// Returns: 0 on success, or -1 if the block could not be written or synced.
+//
+int journal_flush(journal_t* journal, int sync)
+{
+    if (journal->length > 0 && journal_writeblock(journal) != 0)
+        return -1;
+    if (sync && fdatasync(journal->fd) != 0)
+        return -1;
+    return 0;
+}
+
+//
+// Flush and sync the journal, release the unused preallocated space, and close it.
+//
+// Returns: 0 on success, or -1 if anything failed.
+//
+int journal_close(journal_t* journal)
+{
+    if (journal->fd < 0)
+        return 0;
+
+    int result = journal_flush(journal, 1);
+    if (ftruncate(journal->fd, (off_t)journal->sequence * JOURNAL_BLOCK_SIZE) != 0)
+        result = -1;
+    if (close(journal->fd) != 0)
+        result = -1;
+    journal->fd = -1;
+
+    return result;
+}
+
+//
+// Rebuild an acquisition file from a journal, using every good block from the start
+// of the journal up to the first block that is missing, out of sequence, or fails
+// its CRC.  After a power loss, that is everything but the block being written.
+//
+// Parameters:
+// journalpath: The journal to read.
+// outputpath: The acquisition file to create, replacing any existing file.
+// blocks: If not NULL, returns the number of good blocks recovered.
+//
+// Returns: The number of bytes written to the output file, or -1 on error.
+//
+long long journal_recover(const char* journalpath, const char* outputpath, uint64_t* blocks)
+{
+    FILE* journalFile = fopen(journalpath, "rb");
+    if (journalFile == NULL)
+        return -1;
+
+    FILE* outputFile = fopen(outputpath, "wb");
+    if (outputFile == NULL)
+    {
+        fclose(journalFile);
+        return -1;
+    }
+
+    unsigned char block[JOURNAL_BLOCK_SIZE];
+    long long written = 0;
+    uint64_t sequence = 0;
+    while (fread(block, JOURNAL_BLOCK_SIZE, 1, journalFile) == 1)
+    {
+        journalblock_t header;
+        memcpy(&header, block, sizeof(header));
+        if (header.magic != JOURNAL_MAGIC || header.sequence != sequence ||
+            header.headersize != sizeof(header) || header.payloadlength > JOURNAL_PAYLOAD_SIZE ||
+            header.crc != journal_blockcrc(block))
+            break;
+
+        if (fwrite(block + sizeof(header), 1, header.payloadlength, outputFile) != header.payloadlength)
+        {
+            written = -1;
+            break;
+        }
+        written += header.payloadlength;
+        sequence++;
+    }
+
+    fclose(journalFile);
+    if (fclose(outputFile) != 0)
+        written = -1;
+
+    if (blocks != NULL)
+        *blocks = sequence;
+    return written;
+}
@@ -0,0 +1,462 @@
+//
+// A small JSON parser for the t-rake configuration and run files.  See trake_json.h
+// for the rationale.
+//
+// This file is compiled into the trake_daemon program.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "trake_json.h"
+
+#define JSON_MAX_DEPTH 32           // Deeper nesting is rejected rather than risk the stack.
+#define JSON_MAX_FILE_SIZE 65536    // Configuration files are far smaller than this.
+
+//
+// Parser state, the text still to be parsed.
+//
+typedef struct {
+    const char* p;
+} jsonparser_t;
+
+static json_t* json_parsevalue(jsonparser_t* parser, unsigned depth);
+
+static void json_skipspace(jsonparser_t* parser)
+{
+    while (*parser->p == ' ' || *parser->p == '\t' || *parser->p == '\n' || *parser->p == '\r')
+        parser->p++;
+}
+
+static json_t* json_newnode(jsontype_t type)
+{
+    json_t* node = calloc(1, sizeof(json_t));
+    if (node != NULL)
+        node->type = type;
+    return node;
+}
+
+//
+// Internal method to append UTF-8 for a code point to a string being decoded.
+//
+static char* json_pututf8(char* out, unsigned codepoint)
+{
+    if (codepoint < 0x80)
+        *out++ = codepoint;
+    else if (codepoint < 0x800)
+    {
+        *out++ = 0xc0 | (codepoint >> 6);
+        *out++ = 0x80 | (codepoint & 0x3f);
+    }
+    else if (codepoint < 0x10000)
+    {
+        *out++ = 0xe0 | (codepoint >> 12);
+        *out++ = 0x80 | ((codepoint >> 6) & 0x3f);
+        *out++ = 0x80 | (codepoint & 0x3f);
+    }
+    else
+    {
+        *out++ = 0xf0 | (codepoint >> 18);
+        *out++ = 0x80 | ((codepoint >> 12) & 0x3f);
+        *out++ = 0x80 | ((codepoint >> 6) & 0x3f);
+        *out++ = 0x80 | (codepoint & 0x3f);
+    }
+    return out;
+}
+
+static int json_parsehex4(const char* p, unsigned* value)
+{
+    *value = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        char c = p[i];
+        *value <<= 4;
+        if (c >= '0' && c <= '9')
+            *value |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            *value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            *value |= c - 'A' + 10;
+        else
+            return -1;
+    }
+    return 0;
+}
+
+//
+// Internal method to parse a string starting at its opening quote.
+//
+// Returns: A newly allocated, decoded, NUL-terminated string, or NULL if the string is malformed.
+//
+static char* json_parsestring(jsonparser_t* parser)
+{
+    if (*parser->p != '"')
+        return NULL;
+    parser->p++;
+
+    // Escapes never decode to more bytes than they occupy, so the raw length is enough.
+    const char* end = parser->p;
+    while (*end != '"')
+    {
+        if (*end == '\0')
+            return NULL;
+        if (*end == '\\' && end[1] != '\0')
+            end++;
+        end++;
+    }
+
+    char* string = malloc(end - parser->p + 1);
+    if (string == NULL)
+        return NULL;
+
+    char* out = string;
+    while (parser->p < end)
+    {
+        char c = *parser->p++;
+        if ((unsigned char)c < 0x20)
+            goto bad;
+        if (c != '\\')
+        {
+            *out++ = c;
+            continue;
+        }
+
+        c = *parser->p++;
+        switch (c)
+        {
+            case '"':  *out++ = '"';  break;
+            case '\\': *out++ = '\\'; break;
+            case '/':  *out++ = '/';  break;
+            case 'b':  *out++ = '\b'; break;
+            case 'f':  *out++ = '\f'; break;
+            case 'n':  *out++ = '\n'; break;
+            case 'r':  *out++ = '\r'; break;
+            case 't':  *out++ = '\t'; break;
+            case 'u':
+            {
+                unsigned codepoint;
+                if (end - parser->p < 4 || json_parsehex4(parser->p, &codepoint) != 0)
+                    goto bad;
+                parser->p += 4;
+
+                // Combine a UTF-16 surrogate pair into one code point.
+                unsigned low;
+                if (codepoint >= 0xd800 && codepoint < 0xdc00 &&
+                    end - parser->p >= 6 && parser->p[0] == '\\' && parser->p[1] == 'u' &&
+                    json_parsehex4(parser->p + 2, &low) == 0 && low >= 0xdc00 && low < 0xe000)
+                {
+                    codepoint = 0x10000 + ((codepoint - 0xd800) << 10) + (low - 0xdc00);
+                    parser->p += 6;
+                }
+                out = json_pututf8(out, codepoint);
+                break;
+            }
+            default:
+                goto bad;
+        }
+    }
+    *out = '\0';
+    parser->p = end + 1;
+    return string;
+
+bad:
+    free(string);
+    return NULL;
+}
+
+static json_t* json_parsenumber(jsonparser_t* parser)
+{
+    // Check the JSON number grammar, since strtod() accepts more (hex, inf, nan...).
+    const char* p = parser->p;
+    if (*p == '-')
+        p++;
+    if (*p == '0')
+        p++;
+    else if (*p >= '1' && *p <= '9')
+        while (*p >= '0' && *p <= '9')
+            p++;
+    else
+        return NULL;
+    if (*p == '.')
+    {
+        p++;
+        if (!(*p >= '0' && *p <= '9'))
+            return NULL;
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+    if (*p == 'e' || *p == 'E')
+    {
+        p++;
+        if (*p == '+' || *p == '-')
+            p++;
+        if (!(*p >= '0' && *p <= '9'))
+            return NULL;
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+
+    json_t* node = json_newnode(JSON_NUMBER);
+    if (node != NULL)
+        node->number = strtod(parser->p, NULL);
+    parser->p = p;
+    return node;
+}
+
+//
+// Internal method to parse the members of an object or the items of an array,
+// starting at the opening bracket.
+//
+static json_t* json_parsecontainer(jsonparser_t* parser, unsigned depth, jsontype_t type)
+{
+    char close = (type == JSON_OBJECT) ? '}' : ']';
+    json_t* container = json_newnode(type);
+    if (container == NULL)
+        return NULL;
+    parser->p++;
+
+    json_t** tail = &container->child;
+    json_skipspace(parser);
+    if (*parser->p == close)
+    {
+        parser->p++;
+        return container;
+    }
+
+    for (;;)
+    {
+        char* key = NULL;
+        if (type == JSON_OBJECT)
+        {
+            json_skipspace(parser);
+            key = json_parsestring(parser);
+            if (key == NULL)
+                goto bad;
+            json_skipspace(parser);
+            if (*parser->p != ':')
+            {
+                free(key);
+                goto bad;
+            }
+            parser->p++;
+        }
+
+        json_t* item = json_parsevalue(parser, depth + 1);
+        if (item == NULL)
+        {
+            free(key);
+            goto bad;
+        }
+        item->key = key;
+        *tail = item;
+        tail = &item->next;
+
+        json_skipspace(parser);
+        if (*parser->p == ',')
+        {
+            parser->p++;
+            continue;
+        }
+        if (*parser->p == close)
+        {
+            parser->p++;
+            return container;
+        }
+        goto bad;
+    }
+
+bad:
+    json_free(container);
+    return NULL;
+}
+
+static json_t* json_parsevalue(jsonparser_t* parser, unsigned depth)
+{
+    if (depth > JSON_MAX_DEPTH)
+        return NULL;
+
+    json_skipspace(parser);
+    switch (*parser->p)
+    {
+        case '{':
+            return json_parsecontainer(parser, depth, JSON_OBJECT);
+        case '[':
+            return json_parsecontainer(parser, depth, JSON_ARRAY);
+        case '"':
+        {
+            char* string = json_parsestring(parser);
+            if (string == NULL)
+                return NULL;
+            json_t* node = json_newnode(JSON_STRING);
+            if (node == NULL)
+            {
+                free(string);
+                return NULL;
+            }
+            node->string = string;
+            return node;
+        }
+        case 't':
+            if (strncmp(parser->p, "true", 4) != 0)
+                return NULL;
+            parser->p += 4;
+            return json_newnode(JSON_TRUE);
+        case 'f':
+            if (strncmp(parser->p, "false", 5) != 0)
+                return NULL;
+            parser->p += 5;
+            return json_newnode(JSON_FALSE);
+        case 'n':
+            if (strncmp(parser->p, "null", 4) != 0)
+                return NULL;
+            parser->p += 4;
+            return json_newnode(JSON_NULL);
+        default:
+            return json_parsenumber(parser);
+    }
+}
+
+//
+// Parse a complete JSON document.
+//
+// Parameters:
+// text: The NUL-terminated document.
+//
+// Returns: The root node, to be released with json_free(), or NULL if the document is not valid JSON.
+//
+json_t* json_parse(const char* text)
+{
+    jsonparser_t parser = { text };
+    json_t* root = json_parsevalue(&parser, 0);
+    if (root == NULL)
+        return NULL;
+
+    // Nothing but white space may follow the document.
+    json_skipspace(&parser);
+    if (*parser.p != '\0')
+    {
+        json_free(root);
+        return NULL;
+    }
+    return root;
+}
+
+//
+// Read and parse a JSON file.
+//
+// Parameters:
+// path: The path to the file.
+//
+// Returns: The root node, to be released with json_free(), or NULL if the file cannot be
+//          read or is not valid JSON.
+//
+json_t* json_parsefile(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return NULL;
+
+    char* text = malloc(JSON_MAX_FILE_SIZE + 1);
+    size_t length = 0;
+    if (text != NULL)
+        length = fread(text, 1, JSON_MAX_FILE_SIZE + 1, file);
+    fclose(file);
+
+    json_t* root = NULL;
+    if (text != NULL && length <= JSON_MAX_FILE_SIZE)
+    {
+        text[length] = '\0';
+        root = json_parse(text);
+    }
+    free(text);
+    return root;
+}
+
+//
+// Release a node and everything below it.  Passing NULL is allowed.
+//
+void json_free(json_t* node)
+{
+    while (node != NULL)
+    {
+        json_t* next = node->next;
+        json_free(node->child);
+        free(node->key);
+        free(node->string);
+        free(node);
+        node = next;
+    }
+}
+
+//
+// Returns: The member of object named key, or NULL if object is not an object or has no such member.
+//
+json_t* json_get(const json_t* object, const char* key)
+{
+    if (object == NULL || object->type != JSON_OBJECT)
+        return NULL;
+
+    for (json_t* member = object->child; member != NULL; member = member->next)
+        if (strcmp(member->key, key) == 0)
+            return member;
+    return NULL;
+}
+
+//
+// Returns: The number of items in array, or 0 if it is not an array.
+//
+unsigned json_length(const json_t* array)
+{
+    unsigned length = 0;
+    if (array != NULL && array->type == JSON_ARRAY)
+        for (json_t* item = array->child; item != NULL; item = item->next)
+            length++;
+    return length;
+}
+
+//
+// Returns: The item of array at index, or NULL if it is not an array or is too short.
+//
+json_t* json_item(const json_t* array, unsigned index)
+{
+    if (array == NULL || array->type != JSON_ARRAY)
+        return NULL;
+
+    json_t* item = array->child;
+    while (item != NULL && index-- > 0)
+        item = item->next;
+    return item;
+}
+
+//
+// Convenience lookups of a member of an object, returning fallback if the member is
+// missing or of the wrong type.  Like Python, json_getbool() treats nonzero numbers as true.
+//
+double json_getnumber(const json_t* object, const char* key, double fallback)
+{
+    json_t* member = json_get(object, key);
+    return (member != NULL && member->type == JSON_NUMBER) ? member->number : fallback;
+}
+
+const char* json_getstring(const json_t* object, const char* key, const char* fallback)
+{
+    json_t* member = json_get(object, key);
+    return (member != NULL && member->type == JSON_STRING) ? member->string : fallback;
+}
+
+int json_getbool(const json_t* object, const char* key, int fallback)
+{
+    json_t* member = json_get(object, key);
+    if (member == NULL)
+        return fallback;
+
+    switch (member->type)
+    {
+        case JSON_TRUE:   return 1;
+        case JSON_FALSE:
+        case JSON_NULL:   return 0;
+        case JSON_NUMBER: return member->number != 0;
+        default:          return fallback;
+    }
+}
@@ -0,0 +1,161 @@
+import sys
+import time
+import socket
+import struct
+import argparse
+
+""" Live monitor for a running acquisition.
+
+    The driver publishes telemetry on a local Unix domain socket while acquiring, when
+    it is given a socket path with SetTelemetry(), or by the "telemetry" configuration
+    value of trake_daemon and temperature_rake.py.  This tool connects to it and shows
+    the last sample and the minimum, maximum and mean of each channel, with the health
+    counters of the driver, without reading the data file.  It waits for acquisition to
+    start, and for the next run when one stops.  See include/trake_telemetry.h for the
+    protocol.
+
+    Usage: python3 trake_monitor.py [-s socket] [-r]
+    -r prints each message as a line of text, rather than redrawing the screen.
+"""
+
+telemetrypath = '/trake/telemetry.sock'
+
+TELEMETRY_MAGIC = 0x544b5254
+TELEMETRY_HELLO = 1
+TELEMETRY_FRAME = 2
+TELEMETRY_HEALTH = 3
+TELEMETRY_VOLTAGE_LOW = 0x1
+TELEMETRY_JOURNAL = 0x2
+
+HEADER = struct.Struct('<HH')
+HELLO = struct.Struct('<HHIHHIIII')
+FRAME = struct.Struct('<HHIQQ')
+VALUE = struct.Struct('<HHHHf')
+HEALTH = struct.Struct('<HHIQQQQQIIQII')
+
+
+class TelemetryClient:
+  """ Receives the telemetry of a running acquisition.
+  """
+
+  def __init__(self, path=telemetrypath):
+    self.path = path
+    self.socket = None
+    self.channels = 0
+
+  def Connect(self):
+    """ Connect to the telemetry socket.  Returns False if acquisition is not running.
+    """
+    self.Close()
+    try:
+      self.socket = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+      self.socket.connect(self.path)
+      return True
+    except OSError:
+      self.Close()
+      return False
+
+  def Close(self):
+    if self.socket is not None:
+      self.socket.close()
+    self.socket = None
+
+  def Receive(self, timeout_s=None):
+    """ Wait up to timeout_s seconds, or forever, for the next message, and return it as
+        a dictionary with a 'type' of 'hello', 'frame' or 'health'.  Returns None on a
+        timeout, and raises EOFError when acquisition stops.
+    """
+    while True:
+      self.socket.settimeout(timeout_s)
+      try:
+        message = self.socket.recv(65536)
+      except socket.timeout:
+        return None
+      if len(message) == 0:
+        raise EOFError('acquisition stopped')
+      if len(message) < HEADER.size:
+        continue
+
+      kind, length = HEADER.unpack_from(message)
+      if kind == TELEMETRY_HELLO and len(message) >= HELLO.size:
+        fields = HELLO.unpack_from(message)
+        if fields[2] != TELEMETRY_MAGIC:
+          raise EOFError('not a telemetry socket')
+        self.channels = fields[4]
+        return {'type': 'hello', 'version': fields[3], 'channels': fields[4], 'period_us': fields[5],
+                'averagecount': fields[6], 'interval_us': fields[7], 'start': fields[8],
+                'datafile': message[HELLO.size:].decode('utf-8', 'replace')}
+      if kind == TELEMETRY_FRAME and len(message) >= FRAME.size + self.channels * VALUE.size:
+        fields = FRAME.unpack_from(message)
+        values = [VALUE.unpack_from(message, FRAME.size + channel * VALUE.size) for channel in range(self.channels)]
+        return {'type': 'frame', 'count': fields[2], 'sequence': fields[3], 'time': fields[4],
+                'last': [value[0] for value in values], 'min': [value[1] for value in values],
+                'max': [value[2] for value in values], 'mean': [value[4] for value in values]}
+      if kind == TELEMETRY_HEALTH and len(message) >= HEALTH.size:
+        fields = HEALTH.unpack_from(message)
+        return {'type': 'health', 'voltageLow': bool(fields[2] & TELEMETRY_VOLTAGE_LOW),
+                'journal': bool(fields[2] & TELEMETRY_JOURNAL), 'uptime_ns': fields[3], 'lines': fields[4],
+                'dropped': fields[5], 'missed': fields[6], 'busytimeouts': fields[7], 'ringused': fields[8],
+                'ringpeak': fields[9], 'telemetrydropped': fields[10], 'clients': fields[11], 'crcerrors': fields[12]}
+
+
+def Render(hello, frame, health):
+  """ Redraw the terminal with the latest state.
+  """
+  lines = ['\x1b[H\x1b[2J' + hello['datafile'],
+           'Period %d us, average %d, start status %d' % (hello['period_us'], hello['averagecount'], hello['start'])]
+  if health is not None:
+    lines.append('Up %.1f s  lines %d  dropped %d  missed %d  BUSY timeouts %d  CRC errors %d  ring %d/%d bytes  telemetry dropped %d  clients %d%s%s'
+                 % (health['uptime_ns'] / 1e9, health['lines'], health['dropped'], health['missed'], health['busytimeouts'], health['crcerrors'],
+                    health['ringused'], health['ringpeak'], health['telemetrydropped'], health['clients'],
+                    '  JOURNAL' if health['journal'] else '', '  VOLTAGE LOW' if health['voltageLow'] else ''))
+  if frame is not None:
+    lines.append('Time %d us, sequence %d, %d lines' % (frame['time'], frame['sequence'], frame['count']))
+    lines.append('%8s %8s %8s %8s %10s' % ('Channel', 'Last', 'Min', 'Max', 'Mean'))
+    for channel in range(len(frame['last'])):
+      lines.append('%8d %8d %8d %8d %10.1f' % (channel, frame['last'][channel], frame['min'][channel],
+                                               frame['max'][channel], frame['mean'][channel]))
+  sys.stdout.write('\n'.join(lines) + '\n')
+  sys.stdout.flush()
+
+
+def Monitor(path, raw):
+  client = TelemetryClient(path)
+  while True:
+    while not client.Connect():
+      time.sleep(1)
+
+    hello = frame = health = None
+    drawn = 0
+    try:
+      while True:
+        message = client.Receive()
+        if raw:
+          print(message)
+          continue
+        if message['type'] == 'hello':
+          hello = message
+        elif message['type'] == 'frame':
+          frame = message
+        else:
+          health = message
+        # Redraw at most five times a second, however fast the frames come.
+        if hello is not None and time.monotonic() - drawn >= 0.2:
+          Render(hello, frame, health)
+          drawn = time.monotonic()
+    except EOFError:
+      print('Acquisition stopped, waiting for the next run')
+    except OSError:
+      pass
+    client.Close()
+
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser(description='Show the live telemetry of a running acquisition.')
+  parser.add_argument('-s', '--socket', default=telemetrypath, help='telemetry socket path')
+  parser.add_argument('-r', '--raw', action='store_true', help='print each message rather than redrawing')
+  arguments = parser.parse_args()
+  try:
+    Monitor(arguments.socket, arguments.raw)
+  except KeyboardInterrupt:
+    pass
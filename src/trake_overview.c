@@ -0,0 +1,132 @@
+//
+// Multi-resolution overview of an acquisition file.  See trake_overview.h for the
+// rationale and the file layout.
+//
+// This file is compiled into ad7616_driver.so, which writes overviews while acquiring,
+// into trake_convert, which writes them for converted files, and into trake_reader.so.
+//
+#include <string.h>
+
+#include "trake_overview.h"
+
+static const uint64_t OverviewWidths[OVERVIEW_LEVELS] = OVERVIEW_WIDTHS;
+
+//
+// Start an overview.
+//
+// Parameters:
+// overview: The overview to initialize.
+// channels: The number of channels in each frame, up to OVERVIEW_MAX_CHANNELS.
+// output: Receives the file header, which starts the sidecar file.
+//
+// Returns: The number of bytes placed in output.
+//
+unsigned overview_begin(overview_t* overview, unsigned channels, void* output)
+{
+    memset(overview, 0, sizeof(*overview));
+    overview->channels = channels < OVERVIEW_MAX_CHANNELS ? channels : OVERVIEW_MAX_CHANNELS;
+
+    overviewheader_t header = {};
+    header.magic = OVERVIEW_MAGIC;
+    header.version = OVERVIEW_VERSION;
+    header.headersize = sizeof(header);
+    header.channels = overview->channels;
+    header.levels = OVERVIEW_LEVELS;
+    for (unsigned level = 0; level < OVERVIEW_LEVELS; level++)
+        header.width[level] = OverviewWidths[level];
+    memcpy(output, &header, sizeof(header));
+    return sizeof(header);
+}
+
+//
+// Internal method to write the record of a finished bucket, and empty the bucket.
+//
+static unsigned overview_emit(overview_t* overview, unsigned level, unsigned char* output)
+{
+    overviewbucket_t* bucket = &overview->level[level];
+    if (bucket->count == 0)
+        return 0;
+
+    overviewrecord_t record = {};
+    record.level = level;
+    record.channels = overview->channels;
+    record.count = bucket->count;
+    record.start = bucket->bucket * OverviewWidths[level];
+    memcpy(output, &record, sizeof(record));
+
+    overviewvalue_t* values = (overviewvalue_t*)(output + sizeof(record));
+    for (unsigned channel = 0; channel < overview->channels; channel++)
+    {
+        overviewvalue_t value;
+        value.min = bucket->min[channel];
+        value.max = bucket->max[channel];
+        value.mean = (float)bucket->sum[channel] / bucket->count;
+        memcpy(&values[channel], &value, sizeof(value));
+    }
+
+    bucket->count = 0;
+    return OVERVIEW_RECORD_SIZE(overview->channels);
+}
+
+//
+// Add a frame to the overview.  If its time is past the end of the bucket being
+// summarized at any level, the record of that bucket is placed in output.
+//
+// Parameters:
+// overview: The overview.
+// time: The time column of the frame.  Times are expected to increase.
+// values: The sample of each channel.
+// output: Receives the records of finished buckets, up to OVERVIEW_MAX_OUTPUT bytes.
+//
+// Returns: The number of bytes placed in output, normally 0.
+//
+unsigned overview_add(overview_t* overview, uint64_t time, const uint16_t* values, void* output)
+{
+    unsigned length = 0;
+    for (unsigned level = 0; level < OVERVIEW_LEVELS; level++)
+    {
+        overviewbucket_t* bucket = &overview->level[level];
+        uint64_t number = time / OverviewWidths[level];
+        if (bucket->count != 0 && number != bucket->bucket)
+            length += overview_emit(overview, level, (unsigned char*)output + length);
+
+        if (bucket->count == 0)
+        {
+            bucket->bucket = number;
+            for (unsigned channel = 0; channel < overview->channels; channel++)
+            {
+                bucket->min[channel] = values[channel];
+                bucket->max[channel] = values[channel];
+                bucket->sum[channel] = values[channel];
+            }
+        }
+        else
+        {
+            for (unsigned channel = 0; channel < overview->channels; channel++)
+            {
+                uint16_t value = values[channel];
+                if (value < bucket->min[channel])
+                    bucket->min[channel] = value;
+                if (value > bucket->max[channel])
+                    bucket->max[channel] = value;
+                bucket->sum[channel] += value;
+            }
+        }
+        bucket->count++;
+    }
+    return length;
+}
+
+//
+// Finish the overview at the end of the acquisition file, placing the records of the
+// partly filled buckets of every level in output.
+//
+// Returns: The number of bytes placed in output.
+//
+unsigned overview_finish(overview_t* overview, void* output)
+{
+    unsigned length = 0;
+    for (unsigned level = 0; level < OVERVIEW_LEVELS; level++)
+        length += overview_emit(overview, level, (unsigned char*)output + length);
+    return length;
+}
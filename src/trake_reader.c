@@ -0,0 +1,1085 @@
+//
+// Memory-mapped random-access reader for acquisition files.  See trake_reader.h for
+// an overview, and trake_binary.h for the binary format.
+//
+// To build on a Raspberry Pi or a workstation, use this command in a terminal prompt
+// after changing to the directory with this file in it:
+//
+//gcc -O2 -Wall -pthread -fpic -shared -I../include -o trake_reader.so trake_reader.c trake_binary.c trake_journal.c trake_overview.c
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trake_binary.h"
+#include "trake_overview.h"
+#include "trake_reader.h"
+
+#define MAX_READER_THREADS 64
+
+//
+// A sequence record of a CSV file: frame and the frames after it are numbered from number, by step.
+//
+typedef struct {
+    uint64_t frame;
+    uint64_t number;
+    uint64_t step;
+} readersequence_t;
+
+struct reader_s {
+    int format;                             // READER_FORMAT_ value.
+    unsigned openflags;                     // READER_ flags given to reader_open().
+    unsigned fileflags;                     // BINARY_FLAG_ values, also found for CSV files.
+    unsigned version;                       // Binary file version.
+    unsigned channels;
+    int fd;
+    const unsigned char* map;
+    size_t size;
+    char* header;                           // The CSV header line, without its newline.
+    readersegment_t* segments;
+    unsigned segmentcount;
+    readercomment_t* comments;
+    unsigned commentcount;
+    uint64_t frames;
+    uint64_t** decoded;                     // Time and aux columns of each binary segment, decoded when first sliced.
+    readersequence_t* sequences;            // The sequence records of a CSV file.
+    unsigned sequencecount;
+    unsigned char* overview;                // The overview sidecar, or NULL if there is none.
+    unsigned overviewlevels;
+    uint64_t overviewwidth[OVERVIEW_LEVELS];
+    const overviewrecord_t** overviewrecords[OVERVIEW_LEVELS];  // The records of each level, in time order.
+    uint64_t overviewcount[OVERVIEW_LEVELS];
+};
+
+//
+// The header of a CSV index file, followed by the segments and then the comments.
+//
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headersize;
+    uint32_t channels;
+    uint32_t fileflags;
+    uint64_t filesize;                      // Size of the CSV file when it was indexed.
+    int64_t filemtime_ns;                   // Modification time of the CSV file when it was indexed.
+    uint64_t frames;
+    uint32_t segmentcount;
+    uint32_t commentcount;
+} readerindex_t;
+
+//
+// Internal method to add an entry to a growing array.
+//
+static void* reader_grow(void* array, unsigned count, unsigned* capacity, size_t size)
+{
+    if (count < *capacity)
+        return array;
+    unsigned newcapacity = *capacity ? *capacity * 2 : 64;
+    void* grown = realloc(array, (size_t)newcapacity * size);
+    if (grown != NULL)
+        *capacity = newcapacity;
+    return grown;
+}
+
+static int reader_addsegment(reader_t* reader, unsigned* capacity, const readersegment_t* segment)
+{
+    readersegment_t* segments = reader_grow(reader->segments, reader->segmentcount, capacity, sizeof(*segment));
+    if (segments == NULL)
+        return -1;
+    reader->segments = segments;
+    reader->segments[reader->segmentcount++] = *segment;
+    return 0;
+}
+
+static int reader_addcomment(reader_t* reader, unsigned* capacity, const readercomment_t* comment)
+{
+    readercomment_t* comments = reader_grow(reader->comments, reader->commentcount, capacity, sizeof(*comment));
+    if (comments == NULL)
+        return -1;
+    reader->comments = comments;
+    reader->comments[reader->commentcount++] = *comment;
+    return 0;
+}
+
+//
+// Internal method to walk the segment headers of a binary file.  A segment cut short
+// by the end of the file, or with a bad magic number, ends the file.
+//
+static int reader_indexbinary(reader_t* reader)
+{
+    const binaryheader_t* header = (const binaryheader_t*)reader->map;
+    if (reader->size < sizeof(*header) || (header->version != BINARY_VERSION && header->version != BINARY_VERSION_COLUMNS) ||
+        header->headersize < sizeof(*header) || header->channels > BINARY_MAX_CHANNELS ||
+        header->headersize + (uint64_t)header->textlength > reader->size)
+        return -1;
+
+    reader->channels = header->channels;
+    reader->fileflags = header->flags;
+    reader->version = header->version;
+    reader->header = strndup((const char*)reader->map + header->headersize, header->textlength);
+    if (reader->header == NULL)
+        return -1;
+
+    unsigned segmentcapacity = 0;
+    unsigned commentcapacity = 0;
+    uint64_t position = BINARY_PAD8(header->headersize + (uint64_t)header->textlength);
+    while (position + sizeof(binarysegment_t) <= reader->size)
+    {
+        const binarysegment_t* segment = (const binarysegment_t*)(reader->map + position);
+        uint64_t payload = position + sizeof(*segment);
+        if (segment->magic != BINARY_SEGMENT_MAGIC || payload + segment->payloadlength > reader->size)
+            break;
+
+        if (segment->type == SEGMENT_DATA)
+        {
+            readersegment_t entry = {};
+            if (binary_decodeframes(segment, reader->version, reader->channels, &entry.firstsequence, &entry.sequencestep, NULL, NULL) != 0)
+                break;
+            if (reader->version == BINARY_VERSION_COLUMNS)
+            {
+                entry.firstsequence = reader->frames;
+                entry.sequencestep = 1;
+            }
+            entry.firstframe = reader->frames;
+            entry.firsttime = segment->firsttime;
+            entry.lasttime = segment->lasttime;
+            entry.offset = payload;
+            entry.length = segment->payloadlength;
+            entry.frames = segment->count;
+            if (reader_addsegment(reader, &segmentcapacity, &entry) != 0)
+                return -1;
+            reader->frames += segment->count;
+        }
+        else if (segment->type == SEGMENT_COMMENT)
+        {
+            readercomment_t entry = { reader->frames, payload, segment->count };
+            if (reader_addcomment(reader, &commentcapacity, &entry) != 0)
+                return -1;
+        }
+        // Other segments, such as the trailer of a converted CSV file, hold no frames.
+        position = payload + segment->payloadlength;
+    }
+
+    // Room for the time and aux columns of version 2 segments, decoded when they are sliced.
+    if (reader->version != BINARY_VERSION_COLUMNS)
+    {
+        reader->decoded = calloc(reader->segmentcount ? reader->segmentcount : 1, sizeof(uint64_t*));
+        if (reader->decoded == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+//
+// Internal method to parse an unsigned decimal number.
+//
+// Returns: A pointer to the first character after the number, or NULL if there are no digits.
+//
+static inline const char* reader_parsenumber(const char* p, const char* end, uint64_t* value)
+{
+    const char* start = p;
+    uint64_t number = 0;
+    while (p < end && (unsigned)(*p - '0') < 10)
+        number = number * 10 + (*p++ - '0');
+    *value = number;
+    return p == start ? NULL : p;
+}
+
+//
+// Internal method to parse one CSV data line, from p up to the newline at end.
+//
+// Returns: 0 on success, -1 if the line does not have the expected columns.
+//
+static int reader_parseline(const reader_t* reader, const char* p, const char* end, uint64_t* time, uint64_t* aux, uint16_t* values, size_t stride)
+{
+    if (end > p && end[-1] == '\r')
+        end--;
+
+    p = reader_parsenumber(p, end, time);
+    if (p == NULL)
+        return -1;
+    *aux = 0;
+    if (p < end && *p == '(')
+    {
+        p = reader_parsenumber(p + 1, end, aux);
+        if (p == NULL || p >= end || *p != ')')
+            return -1;
+        p++;
+    }
+
+    for (unsigned channel = 0; channel < reader->channels; channel++)
+    {
+        uint64_t value;
+        if (p >= end || *p != ',' || (p = reader_parsenumber(p + 1, end, &value)) == NULL || value > 0xffff)
+            return -1;
+        if (values != NULL)
+            values[channel * stride] = value;
+    }
+    return p == end ? 0 : -1;
+}
+
+//
+// Internal method to read a CSV index file written by reader_saveindex().
+//
+// Returns: 0 if the index was loaded and matches the file, -1 otherwise.
+//
+static int reader_loadindex(reader_t* reader, const char* indexpath, const struct stat* status)
+{
+    FILE* file = fopen(indexpath, "rb");
+    if (file == NULL)
+        return -1;
+
+    readerindex_t index;
+    int result = -1;
+    if (fread(&index, sizeof(index), 1, file) == 1 && index.magic == READER_INDEX_MAGIC &&
+        index.version == READER_INDEX_VERSION && index.headersize == sizeof(index) &&
+        index.filesize == (uint64_t)status->st_size &&
+        index.filemtime_ns == status->st_mtim.tv_sec * 1000000000LL + status->st_mtim.tv_nsec &&
+        index.channels == reader->channels)
+    {
+        reader->segments = malloc((index.segmentcount ? index.segmentcount : 1) * sizeof(readersegment_t));
+        reader->comments = malloc((index.commentcount ? index.commentcount : 1) * sizeof(readercomment_t));
+        if (reader->segments != NULL && reader->comments != NULL &&
+            fread(reader->segments, sizeof(readersegment_t), index.segmentcount, file) == index.segmentcount &&
+            fread(reader->comments, sizeof(readercomment_t), index.commentcount, file) == index.commentcount)
+        {
+            reader->segmentcount = index.segmentcount;
+            reader->commentcount = index.commentcount;
+            reader->frames = index.frames;
+            reader->fileflags = index.fileflags;
+            result = 0;
+        }
+        else
+        {
+            free(reader->segments);
+            free(reader->comments);
+            reader->segments = NULL;
+            reader->comments = NULL;
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+//
+// Internal method to save the index of a CSV file next to it.  The index is written
+// under a temporary name and renamed into place, so a reader never loads half of one.
+// Failure, for example in a read-only folder, only means the next open indexes again.
+//
+static void reader_saveindex(const reader_t* reader, const char* indexpath, const struct stat* status)
+{
+    char temporarypath[4096];
+    if (snprintf(temporarypath, sizeof(temporarypath), "%s.tmp", indexpath) >= (int)sizeof(temporarypath))
+        return;
+    FILE* file = fopen(temporarypath, "wb");
+    if (file == NULL)
+        return;
+
+    readerindex_t index = {};
+    index.magic = READER_INDEX_MAGIC;
+    index.version = READER_INDEX_VERSION;
+    index.headersize = sizeof(index);
+    index.channels = reader->channels;
+    index.fileflags = reader->fileflags;
+    index.filesize = status->st_size;
+    index.filemtime_ns = status->st_mtim.tv_sec * 1000000000LL + status->st_mtim.tv_nsec;
+    index.frames = reader->frames;
+    index.segmentcount = reader->segmentcount;
+    index.commentcount = reader->commentcount;
+
+    int ok = fwrite(&index, sizeof(index), 1, file) == 1 &&
+        fwrite(reader->segments, sizeof(readersegment_t), reader->segmentcount, file) == reader->segmentcount &&
+        fwrite(reader->comments, sizeof(readercomment_t), reader->commentcount, file) == reader->commentcount;
+    if (fclose(file) != 0 || !ok || rename(temporarypath, indexpath) != 0)
+        unlink(temporarypath);
+}
+
+//
+// Internal method to index a CSV file: find the channel count from the header, then
+// the line boundaries of every READER_CSV_SEGMENT_FRAMES data lines, and the comments.
+//
+static int reader_indexcsv(reader_t* reader, const char* path, const struct stat* status)
+{
+    const char* text = (const char*)reader->map;
+    const char* end = text + reader->size;
+    const char* newline = memchr(text, '\n', reader->size);
+    if (newline == NULL)
+        return -1;
+
+    size_t headerlength = newline - text;
+    if (headerlength > 0 && text[headerlength - 1] == '\r')
+        headerlength--;
+    reader->header = strndup(text, headerlength);
+    if (reader->header == NULL)
+        return -1;
+    for (size_t i = 0; i < headerlength; i++)
+        if (text[i] == ',')
+            reader->channels++;
+    if (reader->channels > BINARY_MAX_CHANNELS)
+        return -1;
+
+    char indexpath[4096];
+    int useindex = !(reader->openflags & READER_NOINDEXFILE) &&
+        snprintf(indexpath, sizeof(indexpath), "%s%s", path, READER_INDEX_EXTENSION) < (int)sizeof(indexpath);
+    if (useindex && reader_loadindex(reader, indexpath, status) == 0)
+        return 0;
+
+    unsigned segmentcapacity = 0;
+    unsigned commentcapacity = 0;
+    readersegment_t segment = {};
+    uint64_t sequence = 0;
+    uint64_t step = 1;
+    int firstline = 1;
+    const char* line = newline + 1;
+    while (line < end && (newline = memchr(line, '\n', end - line)) != NULL)
+    {
+        if (*line == '#')
+        {
+            readercomment_t comment = { reader->frames, line - text, newline + 1 - line };
+            if (reader_addcomment(reader, &commentcapacity, &comment) != 0)
+                return -1;
+            binary_parsesequence(line, newline + 1 - line, &sequence, &step);
+        }
+        else if (newline > line && *line != '\r')
+        {
+            uint64_t time;
+            const char* p = reader_parsenumber(line, newline, &time);
+            if (p == NULL)
+                return -1;
+            if (firstline)
+            {
+                // Early files have no value in parentheses after the time.
+                if (*p != '(')
+                    reader->fileflags |= BINARY_FLAG_NOAUX;
+                firstline = 0;
+            }
+            if (segment.frames == 0)
+            {
+                segment.firstframe = reader->frames;
+                segment.firsttime = time;
+                segment.offset = line - text;
+                segment.firstsequence = sequence;
+                segment.sequencestep = step;
+            }
+            sequence += step;
+            segment.lasttime = time;
+            segment.frames++;
+            reader->frames++;
+            if (segment.frames == READER_CSV_SEGMENT_FRAMES)
+            {
+                segment.length = newline + 1 - text - segment.offset;
+                if (reader_addsegment(reader, &segmentcapacity, &segment) != 0)
+                    return -1;
+                segment.frames = 0;
+            }
+        }
+        line = newline + 1;
+    }
+    if (segment.frames != 0)
+    {
+        segment.length = line - text - segment.offset;
+        if (reader_addsegment(reader, &segmentcapacity, &segment) != 0)
+            return -1;
+    }
+
+    if (useindex)
+        reader_saveindex(reader, indexpath, status);
+    return 0;
+}
+
+//
+// Internal method to collect the sequence records of a CSV file from its comments.
+//
+static int reader_findsequences(reader_t* reader)
+{
+    unsigned capacity = 0;
+    for (unsigned index = 0; index < reader->commentcount; index++)
+    {
+        const readercomment_t* comment = &reader->comments[index];
+        readersequence_t record = { comment->frame };
+        if (binary_parsesequence((const char*)reader->map + comment->offset, comment->length, &record.number, &record.step) != 0)
+            continue;
+        readersequence_t* sequences = reader_grow(reader->sequences, reader->sequencecount, &capacity, sizeof(record));
+        if (sequences == NULL)
+            return -1;
+        reader->sequences = sequences;
+        reader->sequences[reader->sequencecount++] = record;
+    }
+    return 0;
+}
+
+//
+// Internal method to load the overview sidecar of a file, if it has one, and sort its
+// records by level.  A record cut short by the end of the file, as when acquisition is
+// still running or power was lost, ends the overview.
+//
+static void reader_loadoverview(reader_t* reader, const char* path)
+{
+    char overviewpath[4096];
+    if (snprintf(overviewpath, sizeof(overviewpath), "%s%s", path, OVERVIEW_EXTENSION) >= (int)sizeof(overviewpath))
+        return;
+    FILE* file = fopen(overviewpath, "rb");
+    if (file == NULL)
+        return;
+
+    struct stat status;
+    overviewheader_t header;
+    if (fstat(fileno(file), &status) != 0 || status.st_size < (off_t)sizeof(header) ||
+        fread(&header, sizeof(header), 1, file) != 1 || header.magic != OVERVIEW_MAGIC ||
+        header.version != OVERVIEW_VERSION || header.headersize < sizeof(header) ||
+        header.levels == 0 || header.levels > OVERVIEW_LEVELS || header.channels != reader->channels ||
+        (reader->overview = malloc(status.st_size)) == NULL ||
+        fseek(file, 0, SEEK_SET) != 0 || fread(reader->overview, 1, status.st_size, file) != (size_t)status.st_size)
+    {
+        free(reader->overview);
+        reader->overview = NULL;
+        fclose(file);
+        return;
+    }
+    fclose(file);
+
+    // Count the records of each level, then list them.
+    size_t recordsize = OVERVIEW_RECORD_SIZE(header.channels);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint64_t filled[OVERVIEW_LEVELS] = {};
+        for (size_t position = header.headersize; position + recordsize <= (size_t)status.st_size; position += recordsize)
+        {
+            const overviewrecord_t* record = (const overviewrecord_t*)(reader->overview + position);
+            if (record->level >= header.levels || record->channels != header.channels || record->count == 0)
+                break;
+            if (pass == 1)
+                reader->overviewrecords[record->level][filled[record->level]] = record;
+            filled[record->level]++;
+        }
+        for (unsigned level = 0; level < header.levels && pass == 0; level++)
+        {
+            reader->overviewcount[level] = filled[level];
+            reader->overviewrecords[level] = malloc((filled[level] ? filled[level] : 1) * sizeof(overviewrecord_t*));
+            if (reader->overviewrecords[level] == NULL)
+                return;
+        }
+    }
+    reader->overviewlevels = header.levels;
+    for (unsigned level = 0; level < header.levels; level++)
+        reader->overviewwidth[level] = header.width[level];
+}
+
+//
+// Open an acquisition file for reading.  The format is found from the file's contents.
+//
+// Parameters:
+// path: A binary (.trk) or CSV acquisition file.
+// flags: READER_VERIFY and READER_NOINDEXFILE, or 0.
+//
+// Returns: The reader, or NULL if the file could not be opened or is not an acquisition file.
+//
+reader_t* reader_open(const char* path, unsigned flags)
+{
+    reader_t* reader = calloc(1, sizeof(*reader));
+    if (reader == NULL)
+        return NULL;
+    reader->openflags = flags;
+    reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (reader->fd < 0)
+        goto bad;
+
+    struct stat status;
+    if (fstat(reader->fd, &status) != 0 || status.st_size < (off_t)sizeof(uint32_t))
+        goto bad;
+    reader->size = status.st_size;
+    reader->map = mmap(NULL, reader->size, PROT_READ, MAP_SHARED, reader->fd, 0);
+    if (reader->map == MAP_FAILED)
+    {
+        reader->map = NULL;
+        goto bad;
+    }
+
+    uint32_t magic;
+    memcpy(&magic, reader->map, sizeof(magic));
+    if (magic == BINARY_MAGIC)
+    {
+        reader->format = READER_FORMAT_BINARY;
+        if (reader_indexbinary(reader) != 0)
+            goto bad;
+    }
+    else
+    {
+        reader->format = READER_FORMAT_CSV;
+        if (reader_indexcsv(reader, path, &status) != 0 || reader_findsequences(reader) != 0)
+            goto bad;
+    }
+    reader_loadoverview(reader, path);
+    return reader;
+
+bad:
+    reader_close(reader);
+    return NULL;
+}
+
+//
+// Unmap and close a file opened by reader_open().  Slices returned for it are no longer valid.
+//
+void reader_close(reader_t* reader)
+{
+    if (reader == NULL)
+        return;
+    if (reader->map != NULL)
+        munmap((void*)reader->map, reader->size);
+    if (reader->fd >= 0)
+        close(reader->fd);
+    free(reader->header);
+    free(reader->segments);
+    free(reader->comments);
+    free(reader->sequences);
+    if (reader->decoded != NULL)
+        for (unsigned segment = 0; segment < reader->segmentcount; segment++)
+            free(reader->decoded[segment]);
+    free(reader->decoded);
+    free(reader->overview);
+    for (unsigned level = 0; level < OVERVIEW_LEVELS; level++)
+        free(reader->overviewrecords[level]);
+    free(reader);
+}
+
+int reader_format(const reader_t* reader)
+{
+    return reader->format;
+}
+
+unsigned reader_channels(const reader_t* reader)
+{
+    return reader->channels;
+}
+
+//
+// Returns: BINARY_FLAG_ values describing the file, for example BINARY_FLAG_NOAUX for an early CSV file.
+//
+unsigned reader_flags(const reader_t* reader)
+{
+    return reader->fileflags;
+}
+
+uint64_t reader_frames(const reader_t* reader)
+{
+    return reader->frames;
+}
+
+//
+// Returns: The CSV header line, without its newline.
+//
+const char* reader_header(const reader_t* reader)
+{
+    return reader->header;
+}
+
+unsigned reader_segments(const reader_t* reader)
+{
+    return reader->segmentcount;
+}
+
+//
+// Copy the index entry of a segment to info.
+//
+// Returns: 0 on success, -1 if there is no such segment.
+//
+int reader_segmentinfo(const reader_t* reader, unsigned segment, readersegment_t* info)
+{
+    if (segment >= reader->segmentcount)
+        return -1;
+    *info = reader->segments[segment];
+    return 0;
+}
+
+unsigned reader_comments(const reader_t* reader)
+{
+    return reader->commentcount;
+}
+
+//
+// Returns: A pointer into the file at the text of a comment, which is not NUL-terminated,
+// or NULL if there is no such comment.  length is set to its length in bytes, and frame
+// to the number of frames before it.
+//
+const char* reader_comment(const reader_t* reader, unsigned comment, uint64_t* length, uint64_t* frame)
+{
+    if (comment >= reader->commentcount)
+        return NULL;
+    if (length != NULL)
+        *length = reader->comments[comment].length;
+    if (frame != NULL)
+        *frame = reader->comments[comment].frame;
+    return (const char*)reader->map + reader->comments[comment].offset;
+}
+
+static inline const binarysegment_t* reader_segmentheader(const reader_t* reader, unsigned segment)
+{
+    return (const binarysegment_t*)(reader->map + reader->segments[segment].offset - sizeof(binarysegment_t));
+}
+
+//
+// Access to the columns of a binary data segment, each holding the segment's frames
+// values.  Samples are used in place in the mapped file, without any copy.  The time
+// and aux columns of version 1 files are too; in later files they are varints, which
+// are decoded the first time the segment is sliced, and kept until the file is closed.
+//
+// Returns: The column, or NULL for a CSV file, if there is no such segment or channel,
+// or if the segment is damaged.
+//
+const uint64_t* reader_timeslice(const reader_t* reader, unsigned segment)
+{
+    if (reader->format != READER_FORMAT_BINARY || segment >= reader->segmentcount)
+        return NULL;
+    if (reader->version == BINARY_VERSION_COLUMNS)
+        return (const uint64_t*)(reader->map + reader->segments[segment].offset);
+
+    uint64_t* columns = __atomic_load_n(&reader->decoded[segment], __ATOMIC_ACQUIRE);
+    if (columns != NULL)
+        return columns;
+    unsigned frames = reader->segments[segment].frames;
+    columns = malloc(2 * (size_t)(frames ? frames : 1) * sizeof(uint64_t));
+    if (columns == NULL ||
+        binary_decodeframes(reader_segmentheader(reader, segment), reader->version, reader->channels, NULL, NULL, columns, columns + frames) != 0)
+    {
+        free(columns);
+        return NULL;
+    }
+
+    // Another thread may have decoded the segment at the same time; keep the first.
+    uint64_t* expected = NULL;
+    if (!__atomic_compare_exchange_n(&reader->decoded[segment], &expected, columns, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        free(columns);
+        columns = expected;
+    }
+    return columns;
+}
+
+const uint64_t* reader_auxslice(const reader_t* reader, unsigned segment)
+{
+    const uint64_t* time = reader_timeslice(reader, segment);
+    return time == NULL ? NULL : time + reader->segments[segment].frames;
+}
+
+const uint16_t* reader_channelslice(const reader_t* reader, unsigned segment, unsigned channel)
+{
+    if (reader->format != READER_FORMAT_BINARY || segment >= reader->segmentcount || channel >= reader->channels)
+        return NULL;
+    return binary_samples(reader_segmentheader(reader, segment), reader->version) + (size_t)channel * reader->segments[segment].frames;
+}
+
+//
+// Find the first frame whose time is at or after the given time.  Times are expected
+// to increase through the file, as they do in every acquisition file.
+//
+// Returns: The frame number, or the number of frames if every frame is earlier.
+//
+uint64_t reader_findtime(const reader_t* reader, uint64_t time)
+{
+    // Binary search of the sparse index for the first segment that ends at or after the time.
+    unsigned low = 0;
+    unsigned high = reader->segmentcount;
+    while (low < high)
+    {
+        unsigned middle = low + (high - low) / 2;
+        if (reader->segments[middle].lasttime < time)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (low == reader->segmentcount)
+        return reader->frames;
+
+    const readersegment_t* segment = &reader->segments[low];
+    if (segment->firsttime >= time)
+        return segment->firstframe;
+
+    if (reader->format == READER_FORMAT_BINARY)
+    {
+        const uint64_t* times = reader_timeslice(reader, low);
+        if (times == NULL)
+            return segment->firstframe;
+        uint32_t first = 0;
+        uint32_t last = segment->frames;
+        while (first < last)
+        {
+            uint32_t middle = first + (last - first) / 2;
+            if (times[middle] < time)
+                first = middle + 1;
+            else
+                last = middle;
+        }
+        return segment->firstframe + first;
+    }
+
+    const char* line = (const char*)reader->map + segment->offset;
+    const char* end = line + segment->length;
+    uint64_t frame = segment->firstframe;
+    while (line < end)
+    {
+        const char* newline = memchr(line, '\n', end - line);
+        if (*line != '#' && *line != '\n' && *line != '\r')
+        {
+            uint64_t linetime;
+            if (reader_parsenumber(line, newline, &linetime) != NULL && linetime >= time)
+                return frame;
+            frame++;
+        }
+        line = newline + 1;
+    }
+    return segment->firstframe + segment->frames;
+}
+
+//
+// The work shared by the threads of one reader_read() call.
+//
+typedef struct {
+    const reader_t* reader;
+    uint64_t first;
+    uint64_t count;
+    uint64_t* times;
+    uint64_t* aux;
+    uint16_t* data;
+    unsigned firstsegment;
+    unsigned lastsegment;
+    unsigned nextsegment;                   // Taken atomically by each thread in turn.
+    int failed;
+} readerwork_t;
+
+//
+// Internal method to decode the part of one segment that falls in the range being read.
+//
+static int reader_decodesegment(readerwork_t* work, unsigned index)
+{
+    const reader_t* reader = work->reader;
+    const readersegment_t* segment = &reader->segments[index];
+    uint64_t start = segment->firstframe > work->first ? segment->firstframe : work->first;
+    uint64_t stop = segment->firstframe + segment->frames;
+    if (stop > work->first + work->count)
+        stop = work->first + work->count;
+    uint32_t skip = start - segment->firstframe;
+    uint32_t frames = stop - start;
+    uint64_t output = start - work->first;
+    unsigned channels = reader->channels;
+
+    if (reader->format == READER_FORMAT_BINARY)
+    {
+        const binarysegment_t* header = reader_segmentheader(reader, index);
+        if ((reader->openflags & READER_VERIFY) && binary_segmentcrc(header, header + 1) != header->crc)
+            return -1;
+        if (work->times != NULL || work->aux != NULL)
+        {
+            // Decode into a buffer of this call's own, rather than keeping every segment read.
+            const uint64_t* columns = NULL;
+            uint64_t* decoded = NULL;
+            if (reader->version == BINARY_VERSION_COLUMNS)
+                columns = (const uint64_t*)(header + 1);
+            else if ((columns = __atomic_load_n(&reader->decoded[index], __ATOMIC_ACQUIRE)) == NULL)
+            {
+                decoded = malloc(2 * (size_t)segment->frames * sizeof(uint64_t));
+                if (decoded == NULL ||
+                    binary_decodeframes(header, reader->version, channels, NULL, NULL, decoded, decoded + segment->frames) != 0)
+                {
+                    free(decoded);
+                    return -1;
+                }
+                columns = decoded;
+            }
+            if (work->times != NULL)
+                memcpy(work->times + output, columns + skip, frames * sizeof(uint64_t));
+            if (work->aux != NULL)
+                memcpy(work->aux + output, columns + segment->frames + skip, frames * sizeof(uint64_t));
+            free(decoded);
+        }
+        if (work->data != NULL)
+            for (unsigned channel = 0; channel < channels; channel++)
+                memcpy(work->data + channel * work->count + output, reader_channelslice(reader, index, channel) + skip, frames * sizeof(uint16_t));
+        return 0;
+    }
+
+    const char* line = (const char*)reader->map + segment->offset;
+    const char* end = line + segment->length;
+    uint32_t frame = 0;
+    while (line < end && frame < skip + frames)
+    {
+        const char* newline = memchr(line, '\n', end - line);
+        if (*line != '#' && *line != '\n' && *line != '\r')
+        {
+            if (frame >= skip)
+            {
+                uint64_t i = output + frame - skip;
+                uint64_t time, aux;
+                if (reader_parseline(reader, line, newline, &time, &aux, work->data ? work->data + i : NULL, work->count) != 0)
+                    return -1;
+                if (work->times != NULL)
+                    work->times[i] = time;
+                if (work->aux != NULL)
+                    work->aux[i] = aux;
+            }
+            frame++;
+        }
+        line = newline + 1;
+    }
+    return frame == skip + frames ? 0 : -1;
+}
+
+static void* reader_thread(void* arg)
+{
+    readerwork_t* work = arg;
+    unsigned index;
+    while ((index = __atomic_fetch_add(&work->nextsegment, 1, __ATOMIC_RELAXED)) <= work->lastsegment)
+    {
+        if (__atomic_load_n(&work->failed, __ATOMIC_RELAXED))
+            break;
+        if (reader_decodesegment(work, index) != 0)
+            __atomic_store_n(&work->failed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+//
+// Read a range of frames, decoding the segments it covers in parallel.
+//
+// Parameters:
+// reader: The open file.
+// first: The first frame to read.
+// count: The number of frames to read.  Fewer are read if the file ends first.
+// times: Array of at least count values to receive the time column, or NULL.
+// aux: Array of at least count values to receive the value in parentheses after the time, or NULL.
+// data: Array of at least channels * count values to receive the samples, or NULL.  The
+//       samples of each channel are together: channel c of frame i is at data[c * count + i].
+// threads: The number of decoding threads, or 0 for one per online CPU.
+//
+// Returns: The number of frames read, or -1 if a segment fails its CRC or a CSV line
+// cannot be parsed.
+//
+long long reader_read(const reader_t* reader, uint64_t first, uint64_t count, uint64_t* times, uint64_t* aux, uint16_t* data, unsigned threads)
+{
+    if (first >= reader->frames || count == 0)
+        return 0;
+
+    readerwork_t work = {};
+    work.reader = reader;
+    work.first = first;
+    work.count = count;
+    work.times = times;
+    work.aux = aux;
+    work.data = data;
+
+    // Binary search of the index for the segments holding the first and last frames.
+    uint64_t last = first + count - 1;
+    if (last >= reader->frames)
+        last = reader->frames - 1;
+    unsigned low = 0;
+    unsigned high = reader->segmentcount - 1;
+    while (low < high)
+    {
+        unsigned middle = low + (high - low + 1) / 2;
+        if (reader->segments[middle].firstframe <= first)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    work.firstsegment = low;
+    work.nextsegment = low;
+    for (work.lastsegment = low; work.lastsegment + 1 < reader->segmentcount && reader->segments[work.lastsegment + 1].firstframe <= last; )
+        work.lastsegment++;
+
+    unsigned segments = work.lastsegment - work.firstsegment + 1;
+    if (threads == 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > segments)
+        threads = segments;
+    if (threads > MAX_READER_THREADS)
+        threads = MAX_READER_THREADS;
+
+    pthread_t thread_ids[MAX_READER_THREADS];
+    unsigned started = 0;
+    for (unsigned i = 1; i < threads; i++)
+        if (pthread_create(&thread_ids[started], NULL, reader_thread, &work) == 0)
+            started++;
+    reader_thread(&work);
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(thread_ids[i], NULL);
+
+    if (work.failed)
+        return -1;
+    return last - first + 1;
+}
+
+//
+// Internal method to find the segment holding a frame.
+//
+static unsigned reader_findsegment(const reader_t* reader, uint64_t frame)
+{
+    unsigned low = 0;
+    unsigned high = reader->segmentcount - 1;
+    while (low < high)
+    {
+        unsigned middle = low + (high - low + 1) / 2;
+        if (reader->segments[middle].firstframe <= frame)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return low;
+}
+
+//
+// Read the sequence numbers of a range of frames.  A frame whose sequence number is
+// more than a step after the one before it follows a gap, where frames were dropped.
+// Sequence numbers come from the index, so no frames are decoded.
+//
+// Parameters:
+// reader: The open file.
+// first: The first frame to read.
+// count: The number of frames to read.  Fewer are read if the file ends first.
+// sequences: Array of at least count values to receive the sequence numbers.
+//
+// Returns: The number of frames read.
+//
+long long reader_readsequences(const reader_t* reader, uint64_t first, uint64_t count, uint64_t* sequences)
+{
+    if (first >= reader->frames || count == 0)
+        return 0;
+    if (count > reader->frames - first)
+        count = reader->frames - first;
+
+    if (reader->format == READER_FORMAT_BINARY)
+    {
+        for (unsigned index = reader_findsegment(reader, first); index < reader->segmentcount; index++)
+        {
+            const readersegment_t* segment = &reader->segments[index];
+            for (uint64_t frame = first > segment->firstframe ? first : segment->firstframe;
+                 frame < segment->firstframe + segment->frames && frame < first + count; frame++)
+                sequences[frame - first] = segment->firstsequence + (frame - segment->firstframe) * segment->sequencestep;
+            if (segment->firstframe + segment->frames >= first + count)
+                break;
+        }
+        return count;
+    }
+
+    // Each sequence record numbers the frames from its own up to the next record.
+    unsigned record = 0;
+    while (record < reader->sequencecount && reader->sequences[record].frame <= first)
+        record++;
+    for (uint64_t frame = first; frame < first + count; frame++)
+    {
+        while (record < reader->sequencecount && reader->sequences[record].frame <= frame)
+            record++;
+        if (record == 0)
+            sequences[frame - first] = frame;
+        else
+        {
+            const readersequence_t* last = &reader->sequences[record - 1];
+            sequences[frame - first] = last->number + (frame - last->frame) * last->step;
+        }
+    }
+    return count;
+}
+
+//
+// Returns: The number of overview levels, 0 if the file has no overview.
+//
+unsigned reader_overviewlevels(const reader_t* reader)
+{
+    return reader->overviewlevels;
+}
+
+//
+// Returns: The bucket width of an overview level, in time column units, or 0 if there is no such level.
+//
+uint64_t reader_overviewwidth(const reader_t* reader, unsigned level)
+{
+    return level < reader->overviewlevels ? reader->overviewwidth[level] : 0;
+}
+
+//
+// Internal method to find the first record of a level whose bucket ends after the given time.
+//
+static uint64_t reader_findbucket(const reader_t* reader, unsigned level, uint64_t time)
+{
+    const overviewrecord_t** records = reader->overviewrecords[level];
+    uint64_t width = reader->overviewwidth[level];
+    uint64_t low = 0;
+    uint64_t high = reader->overviewcount[level];
+    while (low < high)
+    {
+        uint64_t middle = low + (high - low) / 2;
+        if (records[middle]->start + width <= time)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+//
+// Pick the finest resolution that shows a time range in at most maxpoints points: the
+// frames themselves if there are few enough, otherwise the finest overview level that
+// has few enough buckets in the range, or the coarsest level.
+//
+// Returns: The overview level, or -1 to read the frames themselves.  Without an
+// overview, this is always -1.
+//
+int reader_overviewlevel(const reader_t* reader, uint64_t start, uint64_t end, uint64_t maxpoints)
+{
+    if (reader->overviewlevels == 0 || reader_findtime(reader, end) - reader_findtime(reader, start) <= maxpoints)
+        return -1;
+    for (unsigned level = 0; level < reader->overviewlevels; level++)
+        if (reader_findbucket(reader, level, end) - reader_findbucket(reader, level, start) <= maxpoints)
+            return level;
+    return reader->overviewlevels - 1;
+}
+
+//
+// Read the overview records of a level for the buckets overlapping a time range.
+//
+// Parameters:
+// reader: The open file.
+// level: The overview level.
+// start: The start of the time range.
+// end: The end of the time range, which is not included.
+// maxcount: The most buckets to read.
+// times: Array of at least maxcount values to receive the start time of each bucket, or NULL.
+// counts: Array of at least maxcount values to receive the frames in each bucket, or NULL.
+// min, max, mean: Arrays of at least channels * maxcount values to receive the summaries
+//       of the buckets, or NULL.  Channel c of bucket i is at [c * maxcount + i].
+//
+// Returns: The number of buckets read, or -1 if there is no such level.
+//
+long long reader_overview(const reader_t* reader, unsigned level, uint64_t start, uint64_t end, uint64_t maxcount,
+                          uint64_t* times, uint32_t* counts, uint16_t* min, uint16_t* max, float* mean)
+{
+    if (level >= reader->overviewlevels)
+        return -1;
+
+    const overviewrecord_t** records = reader->overviewrecords[level];
+    uint64_t count = 0;
+    for (uint64_t index = reader_findbucket(reader, level, start);
+         index < reader->overviewcount[level] && records[index]->start < end && count < maxcount; index++, count++)
+    {
+        const overviewrecord_t* record = records[index];
+        const overviewvalue_t* values = (const overviewvalue_t*)(record + 1);
+        if (times != NULL)
+            times[count] = record->start;
+        if (counts != NULL)
+            counts[count] = record->count;
+        for (unsigned channel = 0; channel < reader->channels; channel++)
+        {
+            if (min != NULL)
+                min[channel * maxcount + count] = values[channel].min;
+            if (max != NULL)
+                max[channel * maxcount + count] = values[channel].max;
+            if (mean != NULL)
+                mean[channel * maxcount + count] = values[channel].mean;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,365 @@
+import calendar
+import pathlib
+import time
+import numpy
+from ctypes import *
+
+""" This shim gives Python programs fast random access to acquisition files through
+    the C reader library trake_reader.so, which maps the file into memory instead of
+    parsing all of it.  Both the binary format (.trk) and CSV data files can be read.
+
+    NOTE: This shim assumes that the trake_reader.so shared library is in the
+          same directory as the shim Python file itself.  See instructions to generate
+          trake_reader.so in the comments of the trake_reader.c file.
+
+    Example,
+
+    from trake_reader_api import TrakeFile
+
+    with TrakeFile('/trake/data/2024-01-01_00.00.00.trk') as data:
+      first = data.FindTime(60000)
+      times, aux, samples = data.Read(first, 1000)
+      print(samples[3].mean())
+"""
+
+READER_VERIFY = 0x1
+READER_NOINDEXFILE = 0x2
+READER_FORMAT_BINARY = 1
+READER_FORMAT_CSV = 2
+BINARY_FLAG_NOAUX = 0x1
+
+
+class READERSEGMENT(Structure):
+    """ One entry of the sparse index, readersegment_t in trake_reader.h.
+    """
+    _fields_ = [("firstframe", c_uint64),
+                ("firsttime", c_uint64),
+                ("lasttime", c_uint64),
+                ("offset", c_uint64),
+                ("length", c_uint64),
+                ("frames", c_uint32),
+                ("reserved", c_uint32),
+                ("firstsequence", c_uint64),
+                ("sequencestep", c_uint64)]
+
+
+def _loadreader():
+  """ Load trake_reader.so, and declare the argument and result types of its methods once.
+  """
+  reader = CDLL(str(pathlib.Path(__file__).parent.absolute() / "trake_reader.so"))
+  reader.reader_open.restype = c_void_p
+  reader.reader_open.argtypes = [c_char_p, c_uint]
+  reader.reader_close.argtypes = [c_void_p]
+  reader.reader_format.argtypes = [c_void_p]
+  reader.reader_channels.restype = c_uint
+  reader.reader_channels.argtypes = [c_void_p]
+  reader.reader_flags.restype = c_uint
+  reader.reader_flags.argtypes = [c_void_p]
+  reader.reader_frames.restype = c_uint64
+  reader.reader_frames.argtypes = [c_void_p]
+  reader.reader_header.restype = c_char_p
+  reader.reader_header.argtypes = [c_void_p]
+  reader.reader_segments.restype = c_uint
+  reader.reader_segments.argtypes = [c_void_p]
+  reader.reader_segmentinfo.argtypes = [c_void_p, c_uint, POINTER(READERSEGMENT)]
+  reader.reader_comments.restype = c_uint
+  reader.reader_comments.argtypes = [c_void_p]
+  reader.reader_comment.restype = c_void_p
+  reader.reader_comment.argtypes = [c_void_p, c_uint, POINTER(c_uint64), POINTER(c_uint64)]
+  reader.reader_timeslice.restype = POINTER(c_uint64)
+  reader.reader_timeslice.argtypes = [c_void_p, c_uint]
+  reader.reader_auxslice.restype = POINTER(c_uint64)
+  reader.reader_auxslice.argtypes = [c_void_p, c_uint]
+  reader.reader_channelslice.restype = POINTER(c_uint16)
+  reader.reader_channelslice.argtypes = [c_void_p, c_uint, c_uint]
+  reader.reader_findtime.restype = c_uint64
+  reader.reader_findtime.argtypes = [c_void_p, c_uint64]
+  reader.reader_read.restype = c_longlong
+  reader.reader_read.argtypes = [c_void_p, c_uint64, c_uint64, c_void_p, c_void_p, c_void_p, c_uint]
+  reader.reader_readsequences.restype = c_longlong
+  reader.reader_readsequences.argtypes = [c_void_p, c_uint64, c_uint64, c_void_p]
+  reader.reader_overviewlevels.restype = c_uint
+  reader.reader_overviewlevels.argtypes = [c_void_p]
+  reader.reader_overviewwidth.restype = c_uint64
+  reader.reader_overviewwidth.argtypes = [c_void_p, c_uint]
+  reader.reader_overviewlevel.argtypes = [c_void_p, c_uint64, c_uint64, c_uint64]
+  reader.reader_overview.restype = c_longlong
+  reader.reader_overview.argtypes = [c_void_p, c_uint, c_uint64, c_uint64, c_uint64,
+                                     c_void_p, c_void_p, c_void_p, c_void_p, c_void_p]
+  return reader
+
+
+class TrakeFile:
+  """ An acquisition file opened for reading.  Use the 'with' idiom, so that the file
+      is unmapped when it is no longer needed:
+
+      with TrakeFile(path) as data:
+        # Use the data object as needed.
+  """
+  library = None
+
+  def __init__(self, path, verify=False, indexfile=True):
+    """ Constructor for a TrakeFile object.
+        verify: Check the CRC of every binary segment that is read.
+        indexfile: Read and write the index of a CSV file in <path>.idx, so that
+                   only the first open of a CSV file has to scan all of it.
+    """
+    self.path = str(path)
+    self.flags = (READER_VERIFY if verify else 0) | (0 if indexfile else READER_NOINDEXFILE)
+    self.handle = None
+
+  def __enter__(self):
+    """ Context manager.  Opens and maps the file, and loads or builds its index.
+    """
+    if TrakeFile.library is None:
+      TrakeFile.library = _loadreader()
+    self.handle = TrakeFile.library.reader_open(self.path.encode(), self.flags)
+    if not self.handle:
+      raise OSError('Cannot open acquisition file ' + self.path)
+    return self
+
+  def __exit__(self, exception_type, exception_value, exception_traceback):
+    """ Context manager.  Unmaps the file.  Arrays returned by SegmentTimes(),
+        SegmentAux() and SegmentChannel() must not be used after this.
+    """
+    self.Close()
+
+  def Close(self):
+    if self.handle:
+      TrakeFile.library.reader_close(self.handle)
+      self.handle = None
+
+  def IsBinary(self):
+    """ True for a binary (.trk) file, False for a CSV file.
+    """
+    return TrakeFile.library.reader_format(self.handle) == READER_FORMAT_BINARY
+
+  def HasAux(self):
+    """ False for early files whose time column has no value in parentheses.
+    """
+    return not (TrakeFile.library.reader_flags(self.handle) & BINARY_FLAG_NOAUX)
+
+  def Channels(self):
+    return TrakeFile.library.reader_channels(self.handle)
+
+  def Frames(self):
+    return TrakeFile.library.reader_frames(self.handle)
+
+  def Header(self):
+    """ The CSV header line, which names the file and the channels.
+    """
+    return TrakeFile.library.reader_header(self.handle).decode()
+
+  def Segments(self):
+    """ A list of the segments of the sparse index, as dictionaries with the keys
+        'firstframe', 'frames', 'firsttime', 'lasttime', 'firstsequence' and 'sequencestep'.
+    """
+    segments = []
+    info = READERSEGMENT()
+    for index in range(TrakeFile.library.reader_segments(self.handle)):
+      TrakeFile.library.reader_segmentinfo(self.handle, index, byref(info))
+      segments.append({'firstframe': info.firstframe, 'frames': info.frames,
+                       'firsttime': info.firsttime, 'lasttime': info.lasttime,
+                       'firstsequence': info.firstsequence, 'sequencestep': info.sequencestep})
+    return segments
+
+  def Comments(self):
+    """ A list of (frame, text) pairs, one for each '#' record in the file, for example
+        the scheduling and shutdown records.  frame is the number of frames before the record.
+    """
+    comments = []
+    length = c_uint64()
+    frame = c_uint64()
+    for index in range(TrakeFile.library.reader_comments(self.handle)):
+      text = TrakeFile.library.reader_comment(self.handle, index, byref(length), byref(frame))
+      comments.append((frame.value, string_at(text, length.value).decode(errors='replace')))
+    return comments
+
+  def ClockRecords(self):
+    """ The clock correlation records of the file, as a pair of lists (clocks, rtcs), with a
+        dictionary of the fields of each '# clock' and '# rtc' record.  All fields but 'utc'
+        are integers.
+    """
+    records = {'clock': [], 'rtc': []}
+    for frame, text in self.Comments():
+      fields = text[1:].strip().split(',')
+      if fields[0] in records:
+        record = dict(field.split('=', 1) for field in fields[1:] if '=' in field)
+        records[fields[0]].append({key: value if key == 'utc' else int(value) for key, value in record.items()})
+    return records['clock'], records['rtc']
+
+  def UtcTimes(self, times, rtc=True):
+    """ Convert times from the time column to UTC, in seconds since 1970, by fitting a
+        straight line through the clock records, or, if rtc is True and the file has RTC
+        records, through the RTC's edges.  Files of several rakes whose RTCs were set
+        from the same source can then be aligned to well under a millisecond.
+        Returns None if the file has no clock records.
+    """
+    clocks, rtcs = self.ClockRecords()
+    if not clocks:
+      return None
+    clocktimes = numpy.array([clock['time_ns'] for clock in clocks], dtype=numpy.int64)
+    if rtc and rtcs:
+      # Place each edge on the time column through the clock records around it.
+      monotonic = numpy.array([clock['monotonic_raw_ns'] for clock in clocks], dtype=numpy.int64)
+      edges = numpy.array([record['monotonic_raw_ns'] for record in rtcs], dtype=numpy.int64)
+      x = edges - numpy.interp(edges, monotonic, monotonic - clocktimes)
+      y = numpy.array([calendar.timegm(time.strptime(record['utc'], '%Y-%m-%dT%H:%M:%SZ')) * 10**9
+                       for record in rtcs], dtype=numpy.int64)
+    else:
+      x = clocktimes
+      y = numpy.array([clock['realtime_ns'] for clock in clocks], dtype=numpy.int64)
+
+    # Fit relative to the first point, since nanoseconds since 1970 do not fit in a double.
+    dx = (x - x[0]).astype(numpy.float64)
+    dy = (y - y[0]).astype(numpy.float64)
+    if len(dx) > 1 and numpy.ptp(dx) > 0:
+      slope, intercept = numpy.polyfit(dx, dy, 1)
+    else:
+      slope, intercept = 1.0, float(numpy.mean(dy - dx))
+    offset_ns = (numpy.asarray(times, dtype=numpy.float64) * 1000 - x[0]) * slope + intercept
+    return y[0] / 1e9 + offset_ns / 1e9
+
+  def SegmentTimes(self, segment):
+    """ The time column of a segment of a binary file, as a read-only numpy array.
+        The times are decoded the first time they are asked for, and kept until the
+        file is closed.
+    """
+    return self._slice(TrakeFile.library.reader_timeslice(self.handle, segment), segment)
+
+  def SegmentAux(self, segment):
+    """ The values in parentheses after the times of a segment of a binary file, as a
+        read-only numpy array, decoded and kept like the times.
+    """
+    return self._slice(TrakeFile.library.reader_auxslice(self.handle, segment), segment)
+
+  def SegmentChannel(self, segment, channel):
+    """ The samples of one channel in a segment of a binary file, as a read-only numpy
+        view of the mapped file.
+    """
+    return self._slice(TrakeFile.library.reader_channelslice(self.handle, segment, channel), segment)
+
+  def _slice(self, pointer, segment):
+    if not pointer:
+      raise ValueError('Zero-copy slices need a binary file and a valid segment and channel')
+    info = READERSEGMENT()
+    TrakeFile.library.reader_segmentinfo(self.handle, segment, byref(info))
+    view = numpy.ctypeslib.as_array(pointer, shape=(info.frames,))
+    view.flags.writeable = False
+    return view
+
+  def FindTime(self, time):
+    """ The first frame at or after the given time, or Frames() if there is none.
+    """
+    return TrakeFile.library.reader_findtime(self.handle, time)
+
+  def Read(self, first=0, count=None, threads=0):
+    """ Read count frames starting at frame first, or all frames to the end of the file.
+        Segments are decoded in parallel with the given number of threads, or one per CPU.
+        Returns (times, aux, samples), where samples has one row per channel.
+    """
+    available = max(self.Frames() - first, 0)
+    count = available if count is None else min(count, available)
+    times = numpy.empty(count, dtype=numpy.uint64)
+    aux = numpy.empty(count, dtype=numpy.uint64)
+    samples = numpy.empty((self.Channels(), count), dtype=numpy.uint16)
+    if count > 0:
+      read = TrakeFile.library.reader_read(self.handle, first, count, times.ctypes.data,
+                                           aux.ctypes.data, samples.ctypes.data, threads)
+      if read < 0:
+        raise IOError('Corrupt segment in acquisition file ' + self.path)
+    return times, aux, samples
+
+  def Sequences(self, first=0, count=None):
+    """ The sequence numbers of count frames starting at frame first, or of all frames to
+        the end of the file.  They count sample periods since acquisition started, so where
+        numpy.diff() of them is more than the step of the averaged lines, frames were
+        dropped, and a time step that is merely long is jitter.
+    """
+    available = max(self.Frames() - first, 0)
+    count = available if count is None else min(count, available)
+    sequences = numpy.empty(count, dtype=numpy.uint64)
+    if count > 0:
+      TrakeFile.library.reader_readsequences(self.handle, first, count, sequences.ctypes.data)
+    return sequences
+
+  def Streams(self, first=0, count=None, threads=0):
+    """ Read count frames starting at frame first, or all frames to the end of the file,
+        as one stream per channel.  A channel converted several times per sample period
+        is written in several columns, name.0 onwards, and the '# columns' record gives
+        the stream of each column and when it was converted after the time of the line.
+        Returns a list of (name, times, samples), one per channel in column order, with
+        the samples of its columns merged in time order, and the times, as float64 in
+        time column units, of each conversion.  Without the record, each column is a
+        stream whose times are those of the lines.
+    """
+    times, aux, samples = self.Read(first, count, threads)
+    names = self.Header().strip().split(',')[1:]
+    streams = list(range(self.Channels()))
+    offsets = [0] * self.Channels()
+    for frame, text in self.Comments():
+      fields = text[1:].strip().split(',')
+      if fields[0] == 'columns':
+        record = dict(field.split('=', 1) for field in fields[1:] if '=' in field)
+        streams = [int(stream) for stream in record['stream'].split('/')]
+        offsets = [int(offset) for offset in record['offset_ns'].split('/')]
+    result = []
+    for stream in sorted(set(streams), key=streams.index):
+      columns = [column for column in range(len(streams)) if streams[column] == stream]
+      name = names[columns[0]] if columns[0] < len(names) else 'Channel%d' % columns[0]
+      if len(columns) > 1:
+        name = name.rsplit('.', 1)[0]
+      columns.sort(key=lambda column: offsets[column])
+      # Interleave the columns, each one's times shifted by its offset.
+      streamtimes = numpy.empty((len(times), len(columns)), dtype=numpy.float64)
+      streamsamples = numpy.empty((len(times), len(columns)), dtype=samples.dtype)
+      for index, column in enumerate(columns):
+        streamtimes[:, index] = times + offsets[column] / 1000
+        streamsamples[:, index] = samples[column]
+      result.append((name, streamtimes.reshape(-1), streamsamples.reshape(-1)))
+    return result
+
+  def ReadTimeRange(self, start, end, threads=0):
+    """ Read the frames with times from start up to, but not including, end.
+        Returns (times, aux, samples) as Read() does.
+    """
+    first = self.FindTime(start)
+    return self.Read(first, max(self.FindTime(end) - first, 0), threads)
+
+  def OverviewWidths(self):
+    """ The bucket width of each level of the file's overview, in time column units,
+        finest first, or an empty list if the file has no overview.
+    """
+    return [TrakeFile.library.reader_overviewwidth(self.handle, level)
+            for level in range(TrakeFile.library.reader_overviewlevels(self.handle))]
+
+  def Overview(self, start, end, maxpoints=2000, threads=0):
+    """ Summarize the frames with times from start up to end in at most about maxpoints
+        points per channel, for plotting.  The frames themselves are used if there are
+        few enough, otherwise the finest overview level that has few enough buckets.
+        Returns a dictionary with the keys
+          'level': The overview level used, or None for the frames themselves.
+          'times': The start time of each point.
+          'counts': The number of frames summarized by each point.
+          'min', 'max', 'mean': Arrays with one row per channel.
+        Without an overview, the frames themselves are always used.
+    """
+    level = TrakeFile.library.reader_overviewlevel(self.handle, start, end, maxpoints)
+    if level < 0:
+      times, aux, samples = self.ReadTimeRange(start, end, threads)
+      return {'level': None, 'times': times, 'counts': numpy.ones(len(times), dtype=numpy.uint32),
+              'min': samples, 'max': samples, 'mean': samples.astype(numpy.float32)}
+
+    # Count the buckets first, without reading them.
+    maxcount = TrakeFile.library.reader_overview(self.handle, level, start, end, 2**64 - 1,
+                                                 None, None, None, None, None)
+    times = numpy.empty(maxcount, dtype=numpy.uint64)
+    counts = numpy.empty(maxcount, dtype=numpy.uint32)
+    minimum = numpy.empty((self.Channels(), maxcount), dtype=numpy.uint16)
+    maximum = numpy.empty((self.Channels(), maxcount), dtype=numpy.uint16)
+    mean = numpy.empty((self.Channels(), maxcount), dtype=numpy.float32)
+    count = TrakeFile.library.reader_overview(self.handle, level, start, end, maxcount,
+                                              times.ctypes.data, counts.ctypes.data, minimum.ctypes.data,
+                                              maximum.ctypes.data, mean.ctypes.data)
+    return {'level': level, 'times': times[:count], 'counts': counts[:count],
+            'min': minimum[:, :count], 'max': maximum[:, :count], 'mean': mean[:, :count]}
@@ -0,0 +1,83 @@
+//
+// Rebuild acquisition files from the write-ahead journals left behind when a
+// deployment ends without a clean Stop(), normally by a loss of power.
+//
+// To build on a Raspberry Pi, use this command in a terminal prompt after changing
+// to the directory with this file in it:
+//
+//gcc -Wall -I../include -o trake_recover trake_recover.c trake_journal.c
+//
+// Usage:
+// trake_recover [-k] journal [output]
+//   journal: A journal file, typically /trake/data/yyyy-mm-dd_hh.mm.ss.csv.journal
+//   output:  The file to rebuild.  Defaults to the journal path without ".journal".
+//   -k:      Keep the journal after a successful recovery.  By default it is removed.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trake_journal.h"
+
+#define FilePathLength 1000
+
+static void usage()
+{
+    fprintf(stderr, "Usage: trake_recover [-k] journal [output]\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int keep = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "k")) != -1)
+    {
+        if (opt == 'k')
+            keep = 1;
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        usage();
+        return 1;
+    }
+
+    const char* journalpath = argv[optind];
+    char outputpath[FilePathLength];
+    if (optind + 1 < argc)
+        strncpy(outputpath, argv[optind + 1], FilePathLength - 1);
+    else
+    {
+        size_t length = strlen(journalpath);
+        size_t extension = strlen(JOURNAL_EXTENSION);
+        if (length <= extension || strcmp(journalpath + length - extension, JOURNAL_EXTENSION) != 0 || length - extension >= FilePathLength)
+        {
+            fprintf(stderr, "Cannot derive an output name from %s, please give one\n", journalpath);
+            return 1;
+        }
+        memcpy(outputpath, journalpath, length - extension);
+        outputpath[length - extension] = '\0';
+    }
+    outputpath[FilePathLength - 1] = '\0';
+
+    uint64_t blocks = 0;
+    long long written = journal_recover(journalpath, outputpath, &blocks);
+    if (written < 0)
+    {
+        fprintf(stderr, "Recovery of %s failed\n", journalpath);
+        return 2;
+    }
+
+    printf("Recovered %llu bytes in %llu blocks from %s to %s\n", written, (unsigned long long)blocks, journalpath, outputpath);
+
+    if (!keep && unlink(journalpath) != 0)
+        fprintf(stderr, "Could not remove %s\n", journalpath);
+
+    return 0;
+}
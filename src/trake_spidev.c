@@ -0,0 +1,243 @@
+//
+// Hardware SPI transport to the AD7616 through spidev.  See trake_spidev.h for the
+// rationale, and for the simulated device.
+//
+// This file is compiled into ad7616_driver.so, which selects it in place of the
+// bit-banged transport with spi_settransport().
+//
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#include "trake_spidev.h"
+
+#define SIM_SELFTEST_CHANNEL 0xb
+#define SIM_CRC16_POLYNOMIAL 0x8005
+
+//
+// Open the spidev device and configure it for the AD7616: SPI mode 2, where SCLK
+// idles high and data is sampled on its falling edge, 8-bit words.
+//
+// Parameters:
+// spidev: The transport to initialize.
+// device: The spidev device, such as "/dev/spidev1.0", or SPIDEV_SIMULATED.
+// speed_hz: The SCLK rate, or 0 for SPIDEV_DEFAULT_HZ.
+//
+// Returns: 0 on success, or -1 with errno set, when the transport is left closed.
+//
+int spidev_open(spidev_t* spidev, const char* device, uint32_t speed_hz)
+{
+    memset(spidev, 0, sizeof(*spidev));
+    spidev->fd = -1;
+    spidev->speed_hz = speed_hz > 0 ? speed_hz : SPIDEV_DEFAULT_HZ;
+
+    if (strcmp(device, SPIDEV_SIMULATED) == 0)
+    {
+        // The register values after reset: input ranges of +-10V on every channel.
+        for (unsigned address = 4; address <= 7; address++)
+            spidev->registers[address] = 0x0ff;
+        spidev->simulated = 1;
+        return 0;
+    }
+
+    int fd = open(device, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    uint8_t mode = SPI_MODE_2;
+    uint8_t bits = 8;
+    uint32_t speed = spidev->speed_hz;
+    if (ioctl(fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+        ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+        ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    spidev->fd = fd;
+    return 0;
+}
+
+//
+// Internal method that answers one 16-bit command frame as the simulated chip.
+//
+static uint16_t SimulateFrame(spidev_t* spidev, uint16_t command)
+{
+    uint16_t response = spidev->response;
+    unsigned address = (command >> 9) & 0x3f;
+    if (command & 0x8000)
+    {
+        spidev->registers[address] = command & 0x1ff;
+        spidev->response = 0;
+    }
+    else
+        spidev->response = (address << 9) | spidev->registers[address];
+    return response;
+}
+
+//
+// Send count 16-bit command frames in one CS-framed transfer, and receive the frame
+// clocked in during each.
+//
+// Parameters:
+// spidev: The open transport.
+// send: The frames to send.
+// receive: Receives the frames clocked in, or NULL.
+// count: The number of frames, up to SPIDEV_MAX_TRANSFER / 2.
+//
+// Returns: 0 on success, or -1 with errno set.
+//
+int spidev_transfer(spidev_t* spidev, const uint16_t* send, uint16_t* receive, unsigned count)
+{
+    if (count * 2 > SPIDEV_MAX_TRANSFER)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (spidev->simulated)
+    {
+        for (unsigned i = 0; i < count; i++)
+        {
+            uint16_t response = SimulateFrame(spidev, send[i]);
+            if (receive != NULL)
+                receive[i] = response;
+        }
+        return 0;
+    }
+
+    uint8_t tx[SPIDEV_MAX_TRANSFER];
+    uint8_t rx[SPIDEV_MAX_TRANSFER];
+    for (unsigned i = 0; i < count; i++)
+    {
+        tx[2 * i] = send[i] >> 8;
+        tx[2 * i + 1] = send[i] & 0xff;
+    }
+
+    struct spi_ioc_transfer transfer = {
+        .tx_buf = (unsigned long)tx,
+        .rx_buf = (unsigned long)rx,
+        .len = count * 2,
+        .speed_hz = spidev->speed_hz,
+        .bits_per_word = 8,
+    };
+    if (ioctl(spidev->fd, SPI_IOC_MESSAGE(1), &transfer) < 0)
+        return -1;
+
+    if (receive != NULL)
+        for (unsigned i = 0; i < count; i++)
+            receive[i] = (uint16_t)(rx[2 * i] << 8 | rx[2 * i + 1]);
+    return 0;
+}
+
+//
+// Internal method that adds one 16-bit result to a CRC, as the simulated chip computes it.
+//
+static unsigned SimulateCrc(unsigned crc, unsigned word)
+{
+    crc ^= word & 0xffff;
+    for (unsigned bit = 0; bit < 16; bit++)
+        crc = (crc & 0x8000) ? (crc << 1) ^ SIM_CRC16_POLYNOMIAL : crc << 1;
+    return crc & 0xffff;
+}
+
+//
+// Internal method that converts the simulated chip's sequence.
+//
+static void SimulateSequence(spidev_t* spidev, unsigned count, unsigned* conversions, unsigned* crc)
+{
+    // With SEQEN, the channel pairs come from the sequencer stack, up to the one with SSREN.
+    unsigned pairs = 1;
+    const uint16_t* channels = &spidev->registers[3];
+    if (spidev->registers[2] & 0x20)
+    {
+        channels = &spidev->registers[0x20];
+        while (pairs < 32 && !(channels[pairs - 1] & 0x100))
+            pairs++;
+    }
+
+    unsigned expected = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        unsigned Achannel = channels[i % pairs] & 0xf;
+        unsigned Bchannel = (channels[i % pairs] >> 4) & 0xf;
+        unsigned Aconversion = (Achannel == SIM_SELFTEST_CHANNEL) ? 0xaaaa : (Achannel << 12) | (spidev->conversions & 0xfff);
+        unsigned Bconversion = (Bchannel == SIM_SELFTEST_CHANNEL) ? 0x5555 : (Bchannel << 12) | (spidev->conversions & 0xfff);
+        conversions[i] = Aconversion << 16 | Bconversion;
+        expected = SimulateCrc(SimulateCrc(expected, Aconversion), Bconversion);
+    }
+    if (crc != NULL)
+        *crc = expected;
+    spidev->conversions++;
+}
+
+//
+// Read the results of one converted sequence, and optionally the CRC word that follows
+// them, in one SPI_IOC_MESSAGE, so CS stays asserted from the first bit to the last.
+//
+// Parameters:
+// spidev: The open transport.
+// count: The number of A and B result pairs, 32 bits each.
+// conversions: Receives the pairs, with the A side in the high word.
+// crc: Receives the CRC word, or NULL not to read it.
+//
+// Returns: 0 on success, or -1 with errno set.
+//
+int spidev_readsequence(spidev_t* spidev, unsigned count, unsigned* conversions, unsigned* crc)
+{
+    if (count * 4 > SPIDEV_MAX_TRANSFER)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (spidev->simulated)
+    {
+        SimulateSequence(spidev, count, conversions, crc);
+        return 0;
+    }
+
+    static const uint8_t zeros[SPIDEV_MAX_TRANSFER];
+    uint8_t rx[SPIDEV_MAX_TRANSFER];
+    uint8_t crcrx[2];
+    struct spi_ioc_transfer transfers[2] = {
+        {
+            .tx_buf = (unsigned long)zeros,
+            .rx_buf = (unsigned long)rx,
+            .len = count * 4,
+            .speed_hz = spidev->speed_hz,
+            .bits_per_word = 8,
+        },
+        {
+            .tx_buf = (unsigned long)zeros,
+            .rx_buf = (unsigned long)crcrx,
+            .len = 2,
+            .speed_hz = spidev->speed_hz,
+            .bits_per_word = 8,
+        },
+    };
+    if (ioctl(spidev->fd, crc != NULL ? SPI_IOC_MESSAGE(2) : SPI_IOC_MESSAGE(1), transfers) < 0)
+        return -1;
+
+    for (unsigned i = 0; i < count; i++)
+        conversions[i] = (unsigned)rx[4 * i] << 24 | (unsigned)rx[4 * i + 1] << 16 | (unsigned)rx[4 * i + 2] << 8 | rx[4 * i + 3];
+    if (crc != NULL)
+        *crc = (unsigned)crcrx[0] << 8 | crcrx[1];
+    return 0;
+}
+
+//
+// Close the device.
+//
+void spidev_close(spidev_t* spidev)
+{
+    if (spidev->fd >= 0)
+        close(spidev->fd);
+    spidev->fd = -1;
+    spidev->simulated = 0;
+}
@@ -0,0 +1,226 @@
+//
+// Live telemetry of a running acquisition.  See trake_telemetry.h for the rationale
+// and the protocol.
+//
+// This file is compiled into ad7616_driver.so.  The acquisition thread summarizes
+// frames with telemetry_add(), and the writer thread sends the summaries and the
+// health messages to the clients with the telemetry_open() to telemetry_close() methods.
+//
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "trake_telemetry.h"
+
+//
+// Start summarizing frames.
+//
+// Parameters:
+// telemetry: The summary to initialize.
+// channels: The number of channels in each frame, up to TELEMETRY_MAX_CHANNELS.
+// interval: The time between frame messages, in time column units, at least 1.
+//
+void telemetry_begin(telemetry_t* telemetry, unsigned channels, uint64_t interval)
+{
+    memset(telemetry, 0, sizeof(*telemetry));
+    telemetry->channels = channels < TELEMETRY_MAX_CHANNELS ? channels : TELEMETRY_MAX_CHANNELS;
+    telemetry->interval = interval > 0 ? interval : 1;
+}
+
+//
+// Add a sample line to the summary.  If its time is past the end of the interval being
+// summarized, the frame message of that interval is placed in output.
+//
+// Parameters:
+// telemetry: The summary.
+// sequence: The sequence number of the line.
+// time: The time column of the line.  Times are expected to increase.
+// values: The sample of each channel.
+// output: Receives the frame message, up to TELEMETRY_MAX_FRAME bytes.
+//
+// Returns: The number of bytes placed in output, normally 0.
+//
+unsigned telemetry_add(telemetry_t* telemetry, uint64_t sequence, uint64_t time, const uint16_t* values, void* output)
+{
+    unsigned length = 0;
+    uint64_t bucket = time / telemetry->interval;
+    if (telemetry->count != 0 && bucket != telemetry->bucket)
+    {
+        telemetryframe_t frame = {};
+        length = TELEMETRY_FRAME_SIZE(telemetry->channels);
+        frame.header.type = TELEMETRY_FRAME;
+        frame.header.length = length;
+        frame.count = telemetry->count;
+        frame.sequence = telemetry->sequence;
+        frame.time = telemetry->time;
+        memcpy(output, &frame, sizeof(frame));
+
+        telemetryvalue_t* summaries = (telemetryvalue_t*)((unsigned char*)output + sizeof(frame));
+        for (unsigned channel = 0; channel < telemetry->channels; channel++)
+        {
+            telemetryvalue_t value = {};
+            value.last = telemetry->last[channel];
+            value.min = telemetry->min[channel];
+            value.max = telemetry->max[channel];
+            value.mean = (float)telemetry->sum[channel] / telemetry->count;
+            memcpy(&summaries[channel], &value, sizeof(value));
+        }
+        telemetry->count = 0;
+    }
+
+    if (telemetry->count == 0)
+    {
+        telemetry->bucket = bucket;
+        for (unsigned channel = 0; channel < telemetry->channels; channel++)
+        {
+            telemetry->min[channel] = values[channel];
+            telemetry->max[channel] = values[channel];
+            telemetry->sum[channel] = 0;
+        }
+    }
+    for (unsigned channel = 0; channel < telemetry->channels; channel++)
+    {
+        uint16_t value = values[channel];
+        if (value < telemetry->min[channel])
+            telemetry->min[channel] = value;
+        if (value > telemetry->max[channel])
+            telemetry->max[channel] = value;
+        telemetry->sum[channel] += value;
+        telemetry->last[channel] = value;
+    }
+    telemetry->sequence = sequence;
+    telemetry->time = time;
+    telemetry->count++;
+    return length;
+}
+
+//
+// Create the listening socket.  Any socket left at path by an earlier run is replaced.
+//
+// Parameters:
+// server: The server to initialize.
+// path: The path of the socket.
+// hello: The hello message sent to each client as it connects.  The type and length
+//        are filled in.
+// datafile: The acquisition file path, sent after the hello.
+//
+// Returns: 0 on success, or -1 with errno set, when the server is left closed.
+//
+int telemetry_open(telemetryserver_t* server, const char* path, const telemetryhello_t* hello, const char* datafile)
+{
+    server->fd = -1;
+    for (unsigned i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
+        server->clients[i] = -1;
+    server->dropped = 0;
+
+    unsigned datafileLength = strlen(datafile);
+    if (datafileLength > sizeof(server->hello) - sizeof(*hello))
+        datafileLength = sizeof(server->hello) - sizeof(*hello);
+    telemetryhello_t message = *hello;
+    message.header.type = TELEMETRY_HELLO;
+    message.header.length = sizeof(message) + datafileLength;
+    memcpy(server->hello, &message, sizeof(message));
+    memcpy(server->hello + sizeof(message), datafile, datafileLength);
+    server->hellolength = message.header.length;
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, TELEMETRY_MAX_CLIENTS) != 0)
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    server->fd = fd;
+    return 0;
+}
+
+//
+// Accept the clients waiting to connect, and send each the hello message.  Clients
+// beyond TELEMETRY_MAX_CLIENTS are turned away.
+//
+void telemetry_accept(telemetryserver_t* server)
+{
+    if (server->fd < 0)
+        return;
+
+    int client;
+    while ((client = accept4(server->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        unsigned i = 0;
+        while (i < TELEMETRY_MAX_CLIENTS && server->clients[i] >= 0)
+            i++;
+        if (i == TELEMETRY_MAX_CLIENTS || send(client, server->hello, server->hellolength, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+            close(client);
+        else
+            server->clients[i] = client;
+    }
+}
+
+//
+// Send a message to every client.  A client whose socket buffer is full misses the
+// message, which is counted; a client that has gone away is closed.
+//
+void telemetry_publish(telemetryserver_t* server, const void* message, unsigned length)
+{
+    for (unsigned i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
+    {
+        if (server->clients[i] < 0)
+            continue;
+        if (send(server->clients[i], message, length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+                server->dropped++;
+            else
+            {
+                close(server->clients[i]);
+                server->clients[i] = -1;
+            }
+        }
+    }
+}
+
+//
+// Returns: The number of clients connected.
+//
+unsigned telemetry_clients(const telemetryserver_t* server)
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
+        if (server->clients[i] >= 0)
+            count++;
+    return count;
+}
+
+//
+// Disconnect the clients, close the listening socket and remove it from path.
+//
+void telemetry_close(telemetryserver_t* server, const char* path)
+{
+    for (unsigned i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
+    {
+        if (server->clients[i] >= 0)
+            close(server->clients[i]);
+        server->clients[i] = -1;
+    }
+    if (server->fd >= 0)
+    {
+        close(server->fd);
+        unlink(path);
+    }
+    server->fd = -1;
+}
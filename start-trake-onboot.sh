@@ -1,6 +1,10 @@
 #!/bin/bash
 
 cd /home/trake/github/t-rake/src
+if [ -x ./trake_daemon ]; then
+  # start-trake.sh boots the daemon straight into the default configuration.
+  exit 0
+fi
 echo "Starting t-rake operation on power up" >> /home/trake/trake.log
 python3 deployautostart.py
 echo "t-rake power up autostart complete" >> /home/trake/trake.log
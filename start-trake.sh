@@ -2,8 +2,18 @@
 
 cd /home/trake/github/t-rake/src
 python3 ./set_time_from_rtc.py >> /home/trake/trake.log
+# Journals are rebuilt in the background, so they do not delay the first sample.
+for journal in /trake/data/*.journal; do
+  [ -e "$journal" ] && ./trake_recover "$journal" >> /home/trake/trake.log
+done &
 echo "Deploying Temperature Rake data acquisition" >> /home/trake/trake.log
-python3 deploy.py
+if [ -x ./trake_daemon ]; then
+  # Boot straight into the default configuration, in place of start-trake-onboot.sh.
+  ./trake_daemon -b defaultconfig >> /home/trake/trake.log
+else
+  python3 deploy.py
+fi
+wait
 echo "Temperature Rake data acquisition complete" >> /home/trake/trake.log
 echo "Stopping system" >> /home/trake/trake.log
 /usr/sbin/poweroff
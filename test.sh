@@ -1,5 +1,8 @@
 #!/bin/bash
 
+# Check the capture transport's decoder against its level dumps before switching.
+(cd src && gcc -Wall -I../include -o trake_capture_test trake_capture_test.c trake_capture.c && ./trake_capture_test) || exit 1
+
 sudo cp test-trake.sh /usr/local/bin/start-trake.sh
 sudo echo "Changed startup script to test-trake.sh" >> /home/trake/trake.log
 echo "Reboot to invoke test-mode trake acquisition"